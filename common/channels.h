@@ -0,0 +1,96 @@
+#pragma once
+#include <stdint.h>
+
+// Channel schema, shared by the sensor and the gateway. Every piece of state a
+// mailbox reports is one row of CHANNELS: its bit in the status byte of a
+// status frame (frame_codec.h), the Home Assistant binary sensor it becomes on
+// the gateway and its key on the packed state topic. Adding a channel is one
+// row here, plus the pin in the sensor's input table (inputs.h) if it is an
+// input; packing, decoding, discovery and state publishing loop over the table.
+//
+// A channel set is a bitmask in table order, bit 1 << Channel. The gateway's
+// outbound queue stores channel indices, so rows are only ever appended.
+// C++11 constexpr so both firmwares can check the table at compile time.
+
+enum Channel : uint8_t
+{
+  CHANNEL_NEW_MAIL,
+  CHANNEL_DOOR,
+  CHANNEL_MOTION,
+  CHANNEL_VIBRATION,
+  CHANNEL_COUNT,
+};
+
+struct ChannelSpec
+{
+  // Home Assistant object id suffix and name suffix
+  const char *id;
+  const char *name;
+  // discovery attributes, nullptr if not set
+  const char *deviceClass;
+  const char *icon;
+  // key on the packed state topic
+  const char *key;
+  uint8_t statusBit;
+  // read from a pin on the sensor, otherwise worked out by its firmware
+  bool input;
+};
+
+constexpr ChannelSpec CHANNELS[CHANNEL_COUNT] = {
+    {"new_mail", "New Mail", nullptr, "mdi:mail", "nm", 3, false},
+    {"door", "Door", "door", nullptr, "d", 0, true},
+    {"motion", "Motion", "motion", nullptr, "m", 1, true},
+    {"vibration", "Vibration", "vibration", nullptr, "v", 2, true},
+};
+
+constexpr uint8_t channelBit(uint8_t channel)
+{
+  return (uint8_t)(1 << channel);
+}
+
+constexpr uint8_t CHANNEL_ALL = (uint8_t)((1 << CHANNEL_COUNT) - 1);
+
+// status bits of the channels from `channel` on
+constexpr uint8_t packStatusFrom(uint8_t channels, uint8_t channel)
+{
+  return channel == CHANNEL_COUNT ? 0
+                                  : (uint8_t)(((channels >> channel) & 1) << CHANNELS[channel].statusBit |
+                                              packStatusFrom(channels, channel + 1));
+}
+
+constexpr uint8_t unpackStatusFrom(uint8_t status, uint8_t channel)
+{
+  return channel == CHANNEL_COUNT ? 0
+                                  : (uint8_t)(((status >> CHANNELS[channel].statusBit) & 1) << channel |
+                                              unpackStatusFrom(status, channel + 1));
+}
+
+// channel set -> status byte of a status frame
+constexpr uint8_t packStatus(uint8_t channels)
+{
+  return packStatusFrom(channels, 0);
+}
+
+// status byte -> channel set, bits no channel uses are dropped
+constexpr uint8_t unpackStatus(uint8_t status)
+{
+  return unpackStatusFrom(status, 0);
+}
+
+constexpr uint8_t inputChannelsFrom(uint8_t channel)
+{
+  return channel == CHANNEL_COUNT ? 0 : (uint8_t)((CHANNELS[channel].input ? channelBit(channel) : 0) | inputChannelsFrom(channel + 1));
+}
+
+constexpr uint8_t CHANNEL_INPUTS = inputChannelsFrom(0);
+
+// every channel decodes back to just itself, so no two share a status bit
+constexpr bool statusBitsDistinctFrom(uint8_t channel)
+{
+  return channel == CHANNEL_COUNT ||
+         (unpackStatus(packStatus(channelBit(channel))) == channelBit(channel) && statusBitsDistinctFrom(channel + 1));
+}
+
+static_assert(CHANNEL_COUNT <= 8, "a channel set is a uint8_t");
+static_assert(statusBitsDistinctFrom(0), "channels share a status bit");
+static_assert(packStatus(channelBit(CHANNEL_DOOR)) == 0x01, "the door is bit 0 since the first firmware");
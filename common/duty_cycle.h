@@ -0,0 +1,112 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include "lora_airtime.h"
+
+// EU868 duty cycle. Sensor and gateway send on 868.0 MHz, sub-band g1 of ETSI
+// EN 300 220, where a device may be on air 1 % of any hour: 36 s. The budget
+// below keeps the time on air of every transmission and tells the firmware how
+// much of the hour is left, the sensor's main.cpp decides what goes out, the
+// gateway books the firmware fragments it sends (fuota.h) against one.
+
+// Airtime of the last hour in slots of WINDOW_US / (SLOT_COUNT - 1). The
+// current slot and all older ones in the ring are counted, which covers
+// between one hour and one hour plus a slot: the budget errs on the safe side.
+// The sensor keeps it in RTC memory, the clock it runs on keeps counting in
+// deep sleep.
+struct DutyCycleBudget
+{
+  static constexpr uint64_t WINDOW_US = 3600ULL * 1000000;
+  static constexpr uint8_t SLOT_COUNT = 13;
+  static constexpr uint64_t SLOT_US = WINDOW_US / (SLOT_COUNT - 1);
+
+  // airtime per slot, slot % SLOT_COUNT
+  uint32_t slotUs[SLOT_COUNT];
+  // the newest slot that has airtime in it
+  uint32_t slot;
+  uint32_t limitUs;
+
+  // power on, permille of the window the device may transmit
+  void reset(uint16_t permille)
+  {
+    *this = DutyCycleBudget();
+    limitUs = (uint32_t)(WINDOW_US * permille / 1000);
+  }
+
+  // airtime in the window up to nowUs
+  uint32_t usedUs(uint64_t nowUs)
+  {
+    expire(nowUs);
+    uint32_t used = 0;
+    for (uint8_t i = 0; i < SLOT_COUNT; i++)
+    {
+      used += slotUs[i];
+    }
+    return used;
+  }
+
+  uint32_t availableUs(uint64_t nowUs)
+  {
+    const uint32_t used = usedUs(nowUs);
+    return used < limitUs ? limitUs - used : 0;
+  }
+
+  bool fits(uint64_t nowUs, uint32_t airtimeUs)
+  {
+    return airtimeUs <= availableUs(nowUs);
+  }
+
+  void spend(uint64_t nowUs, uint32_t airtimeUs)
+  {
+    expire(nowUs);
+    slotUs[slot % SLOT_COUNT] += airtimeUs;
+  }
+
+  // how long until airtimeUs fits, UINT32_MAX if it never does
+  uint32_t waitMs(uint64_t nowUs, uint32_t airtimeUs)
+  {
+    const uint32_t used = usedUs(nowUs);
+    if (airtimeUs > limitUs)
+    {
+      return UINT32_MAX;
+    }
+    if (used + airtimeUs <= limitUs)
+    {
+      return 0;
+    }
+    // the oldest slots drop out first, each when the ring comes round to it
+    uint32_t freed = 0;
+    for (uint32_t oldest = slot >= SLOT_COUNT - 1 ? slot - (SLOT_COUNT - 1) : 0; oldest <= slot; oldest++)
+    {
+      freed += slotUs[oldest % SLOT_COUNT];
+      if (used - freed + airtimeUs <= limitUs)
+      {
+        return (uint32_t)(((uint64_t)(oldest + SLOT_COUNT) * SLOT_US - nowUs + 999) / 1000);
+      }
+    }
+    return UINT32_MAX;
+  }
+
+private:
+  // clears the slots that left the window since the last call
+  void expire(uint64_t nowUs)
+  {
+    const uint32_t now = (uint32_t)(nowUs / SLOT_US);
+    if (now < slot)
+    {
+      // the clock started over, nothing we know about is recent
+      for (uint8_t i = 0; i < SLOT_COUNT; i++)
+      {
+        slotUs[i] = 0;
+      }
+    }
+    else
+    {
+      for (uint32_t next = slot + 1; next <= now && next <= slot + SLOT_COUNT; next++)
+      {
+        slotUs[next % SLOT_COUNT] = 0;
+      }
+    }
+    slot = now;
+  }
+};
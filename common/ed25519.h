@@ -0,0 +1,662 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// Ed25519 signatures (RFC 8032) for firmware updates (firmware_delta.h): the
+// node checks a delta against the public key built into it, the host signs it
+// with `program delta`. After TweetNaCl: small and constant time rather than
+// fast, a check takes a few hundred ms on the ESP32-S3 and 2 KB of stack,
+// once per update. Signing is only done on the host.
+
+// SHA-512 (FIPS 180-4), streaming
+class Sha512
+{
+public:
+  static constexpr size_t HASH_LENGTH = 64;
+
+  Sha512()
+  {
+    reset();
+  }
+
+  void reset()
+  {
+    static const uint64_t initial[8] = {
+      0x6a09e667f3bcc908ULL, 0xbb67ae8584caa73bULL, 0x3c6ef372fe94f82bULL, 0xa54ff53a5f1d36f1ULL,
+      0x510e527fade682d1ULL, 0x9b05688c2b3e6c1fULL, 0x1f83d9abfb41bd6bULL, 0x5be0cd19137e2179ULL
+    };
+    memcpy(m_state, initial, sizeof(m_state));
+    m_bufferLength = 0;
+    m_length = 0;
+  }
+
+  void update(const uint8_t *data, size_t length)
+  {
+    m_length += length;
+    while (length > 0)
+    {
+      const size_t part = length < BLOCK_LENGTH - m_bufferLength ? length : BLOCK_LENGTH - m_bufferLength;
+      memcpy(&m_buffer[m_bufferLength], data, part);
+      m_bufferLength += part;
+      data += part;
+      length -= part;
+      if (m_bufferLength == BLOCK_LENGTH)
+      {
+        block(m_buffer);
+        m_bufferLength = 0;
+      }
+    }
+  }
+
+  void finish(uint8_t *hash)
+  {
+    const uint64_t bits = m_length * 8;
+    const uint8_t pad = 0x80;
+    update(&pad, 1);
+    const uint8_t zero = 0;
+    while (m_bufferLength != BLOCK_LENGTH - 16)
+    {
+      update(&zero, 1);
+    }
+    uint8_t length[16] = {};
+    for (int i = 0; i < 8; i++)
+    {
+      length[15 - i] = (uint8_t)(bits >> (8 * i));
+    }
+    update(length, sizeof(length));
+    for (int i = 0; i < 8; i++)
+    {
+      for (int j = 0; j < 8; j++)
+      {
+        hash[8 * i + j] = (uint8_t)(m_state[i] >> (56 - 8 * j));
+      }
+    }
+  }
+
+private:
+  static constexpr size_t BLOCK_LENGTH = 128;
+
+  static uint64_t rotate(uint64_t x, int n)
+  {
+    return x >> n | x << (64 - n);
+  }
+
+  void block(const uint8_t *data)
+  {
+    static const uint64_t k[80] = {
+      0x428a2f98d728ae22ULL, 0x7137449123ef65cdULL, 0xb5c0fbcfec4d3b2fULL, 0xe9b5dba58189dbbcULL,
+      0x3956c25bf348b538ULL, 0x59f111f1b605d019ULL, 0x923f82a4af194f9bULL, 0xab1c5ed5da6d8118ULL,
+      0xd807aa98a3030242ULL, 0x12835b0145706fbeULL, 0x243185be4ee4b28cULL, 0x550c7dc3d5ffb4e2ULL,
+      0x72be5d74f27b896fULL, 0x80deb1fe3b1696b1ULL, 0x9bdc06a725c71235ULL, 0xc19bf174cf692694ULL,
+      0xe49b69c19ef14ad2ULL, 0xefbe4786384f25e3ULL, 0x0fc19dc68b8cd5b5ULL, 0x240ca1cc77ac9c65ULL,
+      0x2de92c6f592b0275ULL, 0x4a7484aa6ea6e483ULL, 0x5cb0a9dcbd41fbd4ULL, 0x76f988da831153b5ULL,
+      0x983e5152ee66dfabULL, 0xa831c66d2db43210ULL, 0xb00327c898fb213fULL, 0xbf597fc7beef0ee4ULL,
+      0xc6e00bf33da88fc2ULL, 0xd5a79147930aa725ULL, 0x06ca6351e003826fULL, 0x142929670a0e6e70ULL,
+      0x27b70a8546d22ffcULL, 0x2e1b21385c26c926ULL, 0x4d2c6dfc5ac42aedULL, 0x53380d139d95b3dfULL,
+      0x650a73548baf63deULL, 0x766a0abb3c77b2a8ULL, 0x81c2c92e47edaee6ULL, 0x92722c851482353bULL,
+      0xa2bfe8a14cf10364ULL, 0xa81a664bbc423001ULL, 0xc24b8b70d0f89791ULL, 0xc76c51a30654be30ULL,
+      0xd192e819d6ef5218ULL, 0xd69906245565a910ULL, 0xf40e35855771202aULL, 0x106aa07032bbd1b8ULL,
+      0x19a4c116b8d2d0c8ULL, 0x1e376c085141ab53ULL, 0x2748774cdf8eeb99ULL, 0x34b0bcb5e19b48a8ULL,
+      0x391c0cb3c5c95a63ULL, 0x4ed8aa4ae3418acbULL, 0x5b9cca4f7763e373ULL, 0x682e6ff3d6b2b8a3ULL,
+      0x748f82ee5defb2fcULL, 0x78a5636f43172f60ULL, 0x84c87814a1f0ab72ULL, 0x8cc702081a6439ecULL,
+      0x90befffa23631e28ULL, 0xa4506cebde82bde9ULL, 0xbef9a3f7b2c67915ULL, 0xc67178f2e372532bULL,
+      0xca273eceea26619cULL, 0xd186b8c721c0c207ULL, 0xeada7dd6cde0eb1eULL, 0xf57d4f7fee6ed178ULL,
+      0x06f067aa72176fbaULL, 0x0a637dc5a2c898a6ULL, 0x113f9804bef90daeULL, 0x1b710b35131c471bULL,
+      0x28db77f523047d84ULL, 0x32caab7b40c72493ULL, 0x3c9ebe0a15c9bebcULL, 0x431d67c49c100d4cULL,
+      0x4cc5d4becb3e42b6ULL, 0x597f299cfc657e2aULL, 0x5fcb6fab3ad6faecULL, 0x6c44198c4a475817ULL
+    };
+    uint64_t w[16];
+    for (int i = 0; i < 16; i++)
+    {
+      w[i] = 0;
+      for (int j = 0; j < 8; j++)
+      {
+        w[i] = w[i] << 8 | data[8 * i + j];
+      }
+    }
+    uint64_t v[8];
+    memcpy(v, m_state, sizeof(v));
+    for (int i = 0; i < 80; i++)
+    {
+      // the message schedule in place, 16 words at a time
+      if (i >= 16)
+      {
+        const uint64_t w15 = w[(i + 1) & 15];
+        const uint64_t w2 = w[(i + 14) & 15];
+        w[i & 15] += (rotate(w15, 1) ^ rotate(w15, 8) ^ w15 >> 7) + w[(i + 9) & 15] +
+                     (rotate(w2, 19) ^ rotate(w2, 61) ^ w2 >> 6);
+      }
+      const uint64_t t1 = v[7] + (rotate(v[4], 14) ^ rotate(v[4], 18) ^ rotate(v[4], 41)) +
+                          ((v[4] & v[5]) ^ (~v[4] & v[6])) + k[i] + w[i & 15];
+      const uint64_t t2 = (rotate(v[0], 28) ^ rotate(v[0], 34) ^ rotate(v[0], 39)) +
+                          ((v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]));
+      memmove(&v[1], &v[0], 7 * sizeof(v[0]));
+      v[4] += t1;
+      v[0] = t1 + t2;
+    }
+    for (int i = 0; i < 8; i++)
+    {
+      m_state[i] += v[i];
+    }
+  }
+
+  uint64_t m_state[8];
+  uint8_t m_buffer[BLOCK_LENGTH];
+  size_t m_bufferLength;
+  uint64_t m_length;
+};
+
+class Ed25519
+{
+public:
+  static constexpr size_t KEY_LENGTH = 32;
+  static constexpr size_t SIGNATURE_LENGTH = 64;
+
+  // Checks a signature over a message handed over in pieces:
+  //   begin(), update() for each piece, finish()
+  class Verifier
+  {
+  public:
+    // false if the key is no point of the curve or the signature is malformed
+    bool begin(const uint8_t *publicKey, const uint8_t *signature)
+    {
+      memcpy(m_publicKey, publicKey, KEY_LENGTH);
+      memcpy(m_signature, signature, SIGNATURE_LENGTH);
+      Point a;
+      m_valid = unpackNegative(a, publicKey) && scalarBelowOrder(&signature[32]);
+      m_hash.reset();
+      m_hash.update(signature, 32);
+      m_hash.update(publicKey, KEY_LENGTH);
+      return m_valid;
+    }
+
+    void update(const uint8_t *data, size_t length)
+    {
+      m_hash.update(data, length);
+    }
+
+    bool finish()
+    {
+      Point a;
+      if (!m_valid || !unpackNegative(a, m_publicKey))
+      {
+        return false;
+      }
+      uint8_t h[Sha512::HASH_LENGTH];
+      m_hash.finish(h);
+      reduce(h);
+      // [s]B - [h]A has to be R
+      Point p;
+      Point q;
+      scalarMultiply(p, a, h);
+      scalarBase(q, &m_signature[32]);
+      add(p, q);
+      uint8_t r[32];
+      pack(r, p);
+      uint8_t difference = 0;
+      for (int i = 0; i < 32; i++)
+      {
+        difference |= r[i] ^ m_signature[i];
+      }
+      return difference == 0;
+    }
+
+  private:
+    Sha512 m_hash;
+    uint8_t m_publicKey[KEY_LENGTH];
+    uint8_t m_signature[SIGNATURE_LENGTH];
+    bool m_valid = false;
+  };
+
+  static void publicKey(const uint8_t *seed, uint8_t *key)
+  {
+    uint8_t d[Sha512::HASH_LENGTH];
+    expandSeed(seed, d);
+    Point p;
+    scalarBase(p, d);
+    pack(key, p);
+  }
+
+  static void sign(const uint8_t *seed, const uint8_t *message, size_t length, uint8_t *signature)
+  {
+    uint8_t d[Sha512::HASH_LENGTH];
+    expandSeed(seed, d);
+    uint8_t key[KEY_LENGTH];
+    publicKey(seed, key);
+
+    uint8_t r[Sha512::HASH_LENGTH];
+    Sha512 hash;
+    hash.update(&d[32], 32);
+    hash.update(message, length);
+    hash.finish(r);
+    reduce(r);
+    Point p;
+    scalarBase(p, r);
+    pack(signature, p);
+
+    uint8_t h[Sha512::HASH_LENGTH];
+    hash.reset();
+    hash.update(signature, 32);
+    hash.update(key, KEY_LENGTH);
+    hash.update(message, length);
+    hash.finish(h);
+    reduce(h);
+    // s = r + h * a mod L
+    int64_t x[64] = {};
+    for (int i = 0; i < 32; i++)
+    {
+      x[i] = r[i];
+    }
+    for (int i = 0; i < 32; i++)
+    {
+      for (int j = 0; j < 32; j++)
+      {
+        x[i + j] += h[i] * (int64_t)d[j];
+      }
+    }
+    modL(&signature[32], x);
+  }
+
+private:
+  // GF(2^255 - 19) in 16 limbs of 16 bits, with room for carries
+  typedef int64_t Field[16];
+  // extended coordinates X, Y, Z, T
+  struct Point
+  {
+    Field v[4];
+  };
+
+  static const int64_t *fieldD()
+  {
+    static const Field d = {0x78a3, 0x1359, 0x4dca, 0x75eb, 0xd8ab, 0x4141, 0x0a4d, 0x0070,
+                            0xe898, 0x7779, 0x4079, 0x8cc7, 0xfe73, 0x2b6f, 0x6cee, 0x5203};
+    return d;
+  }
+
+  static const int64_t *fieldD2()
+  {
+    static const Field d2 = {0xf159, 0x26b2, 0x9b94, 0xebd6, 0xb156, 0x8283, 0x149a, 0x00e0,
+                             0xd130, 0xeef3, 0x80f2, 0x198e, 0xfce7, 0x56df, 0xd9dc, 0x2406};
+    return d2;
+  }
+
+  // sqrt(-1)
+  static const int64_t *fieldI()
+  {
+    static const Field i = {0xa0b0, 0x4a0e, 0x1b27, 0xc4ee, 0xe478, 0xad2f, 0x1806, 0x2f43,
+                            0xd7a7, 0x3dfb, 0x0099, 0x2b4d, 0xdf0b, 0x4fc1, 0x2480, 0x2b83};
+    return i;
+  }
+
+  // the base point
+  static const int64_t *baseX()
+  {
+    static const Field x = {0xd51a, 0x8f25, 0x2d60, 0xc956, 0xa7b2, 0x9525, 0xc760, 0x692c,
+                            0xdc5c, 0xfdd6, 0xe231, 0xc0a4, 0x53fe, 0xcd6e, 0x36d3, 0x2169};
+    return x;
+  }
+
+  static const int64_t *baseY()
+  {
+    static const Field y = {0x6658, 0x6666, 0x6666, 0x6666, 0x6666, 0x6666, 0x6666, 0x6666,
+                            0x6666, 0x6666, 0x6666, 0x6666, 0x6666, 0x6666, 0x6666, 0x6666};
+    return y;
+  }
+
+  // the group order L, little endian
+  static const uint8_t *order()
+  {
+    static const uint8_t l[32] = {0xed, 0xd3, 0xf5, 0x5c, 0x1a, 0x63, 0x12, 0x58, 0xd6, 0x9c, 0xf7,
+                                  0xa2, 0xde, 0xf9, 0xde, 0x14, 0,    0,    0,    0,    0,    0,
+                                  0,    0,    0,    0,    0,    0,    0,    0,    0,    0x10};
+    return l;
+  }
+
+  static void set(Field o, const int64_t *a)
+  {
+    memcpy(o, a, sizeof(Field));
+  }
+
+  static void setSmall(Field o, int64_t value)
+  {
+    memset(o, 0, sizeof(Field));
+    o[0] = value;
+  }
+
+  static void carry(Field o)
+  {
+    for (int i = 0; i < 16; i++)
+    {
+      o[i] += (int64_t)1 << 16;
+      const int64_t c = o[i] >> 16;
+      // 2^256 is 38 mod p
+      o[(i + 1) * (i < 15)] += c - 1 + 37 * (c - 1) * (i == 15);
+      o[i] -= c * ((int64_t)1 << 16);
+    }
+  }
+
+  // swaps p and q if b is 1, without a branch on it
+  static void select(Field p, Field q, int b)
+  {
+    const int64_t mask = ~((int64_t)b - 1);
+    for (int i = 0; i < 16; i++)
+    {
+      const int64_t t = mask & (p[i] ^ q[i]);
+      p[i] ^= t;
+      q[i] ^= t;
+    }
+  }
+
+  static void packField(uint8_t *o, const Field n)
+  {
+    Field m;
+    Field t;
+    set(t, n);
+    carry(t);
+    carry(t);
+    carry(t);
+    for (int j = 0; j < 2; j++)
+    {
+      m[0] = t[0] - 0xffed;
+      for (int i = 1; i < 15; i++)
+      {
+        m[i] = t[i] - 0xffff - ((m[i - 1] >> 16) & 1);
+        m[i - 1] &= 0xffff;
+      }
+      m[15] = t[15] - 0x7fff - ((m[14] >> 16) & 1);
+      const int b = (int)((m[15] >> 16) & 1);
+      m[14] &= 0xffff;
+      select(t, m, 1 - b);
+    }
+    for (int i = 0; i < 16; i++)
+    {
+      o[2 * i] = (uint8_t)(t[i] & 0xff);
+      o[2 * i + 1] = (uint8_t)(t[i] >> 8);
+    }
+  }
+
+  static bool equal(const Field a, const Field b)
+  {
+    uint8_t c[32];
+    uint8_t d[32];
+    packField(c, a);
+    packField(d, b);
+    return memcmp(c, d, sizeof(c)) == 0;
+  }
+
+  static uint8_t parity(const Field a)
+  {
+    uint8_t d[32];
+    packField(d, a);
+    return d[0] & 1;
+  }
+
+  static void unpackField(Field o, const uint8_t *n)
+  {
+    for (int i = 0; i < 16; i++)
+    {
+      o[i] = n[2 * i] + ((int64_t)n[2 * i + 1] << 8);
+    }
+    o[15] &= 0x7fff;
+  }
+
+  static void fieldAdd(Field o, const Field a, const Field b)
+  {
+    for (int i = 0; i < 16; i++)
+    {
+      o[i] = a[i] + b[i];
+    }
+  }
+
+  static void fieldSubtract(Field o, const Field a, const Field b)
+  {
+    for (int i = 0; i < 16; i++)
+    {
+      o[i] = a[i] - b[i];
+    }
+  }
+
+  static void fieldMultiply(Field o, const Field a, const Field b)
+  {
+    int64_t t[31] = {};
+    for (int i = 0; i < 16; i++)
+    {
+      for (int j = 0; j < 16; j++)
+      {
+        t[i + j] += a[i] * b[j];
+      }
+    }
+    for (int i = 0; i < 15; i++)
+    {
+      t[i] += 38 * t[i + 16];
+    }
+    for (int i = 0; i < 16; i++)
+    {
+      o[i] = t[i];
+    }
+    carry(o);
+    carry(o);
+  }
+
+  static void fieldSquare(Field o, const Field a)
+  {
+    fieldMultiply(o, a, a);
+  }
+
+  // a^(p - 2)
+  static void invert(Field o, const Field a)
+  {
+    Field c;
+    set(c, a);
+    for (int i = 253; i >= 0; i--)
+    {
+      fieldSquare(c, c);
+      if (i != 2 && i != 4)
+      {
+        fieldMultiply(c, c, a);
+      }
+    }
+    set(o, c);
+  }
+
+  // a^((p - 5) / 8)
+  static void power2523(Field o, const Field a)
+  {
+    Field c;
+    set(c, a);
+    for (int i = 250; i >= 0; i--)
+    {
+      fieldSquare(c, c);
+      if (i != 1)
+      {
+        fieldMultiply(c, c, a);
+      }
+    }
+    set(o, c);
+  }
+
+  static void add(Point &p, const Point &q)
+  {
+    Field a, b, c, d, t, e, f, g, h;
+    fieldSubtract(a, p.v[1], p.v[0]);
+    fieldSubtract(t, q.v[1], q.v[0]);
+    fieldMultiply(a, a, t);
+    fieldAdd(b, p.v[0], p.v[1]);
+    fieldAdd(t, q.v[0], q.v[1]);
+    fieldMultiply(b, b, t);
+    fieldMultiply(c, p.v[3], q.v[3]);
+    fieldMultiply(c, c, fieldD2());
+    fieldMultiply(d, p.v[2], q.v[2]);
+    fieldAdd(d, d, d);
+    fieldSubtract(e, b, a);
+    fieldSubtract(f, d, c);
+    fieldAdd(g, d, c);
+    fieldAdd(h, b, a);
+    fieldMultiply(p.v[0], e, f);
+    fieldMultiply(p.v[1], h, g);
+    fieldMultiply(p.v[2], g, f);
+    fieldMultiply(p.v[3], e, h);
+  }
+
+  static void swap(Point &p, Point &q, int b)
+  {
+    for (int i = 0; i < 4; i++)
+    {
+      select(p.v[i], q.v[i], b);
+    }
+  }
+
+  static void pack(uint8_t *r, const Point &p)
+  {
+    Field tx, ty, zi;
+    invert(zi, p.v[2]);
+    fieldMultiply(tx, p.v[0], zi);
+    fieldMultiply(ty, p.v[1], zi);
+    packField(r, ty);
+    r[31] ^= parity(tx) << 7;
+  }
+
+  // p = [s]q, q is used up
+  static void scalarMultiply(Point &p, Point &q, const uint8_t *s)
+  {
+    setSmall(p.v[0], 0);
+    setSmall(p.v[1], 1);
+    setSmall(p.v[2], 1);
+    setSmall(p.v[3], 0);
+    for (int i = 255; i >= 0; i--)
+    {
+      const int b = (s[i / 8] >> (i & 7)) & 1;
+      swap(p, q, b);
+      add(q, p);
+      add(p, p);
+      swap(p, q, b);
+    }
+  }
+
+  static void scalarBase(Point &p, const uint8_t *s)
+  {
+    Point q;
+    set(q.v[0], baseX());
+    set(q.v[1], baseY());
+    setSmall(q.v[2], 1);
+    fieldMultiply(q.v[3], baseX(), baseY());
+    scalarMultiply(p, q, s);
+  }
+
+  // the negated point of a packed one, false if there is none
+  static bool unpackNegative(Point &r, const uint8_t *packed)
+  {
+    Field t, check, num, den, den2, den4, den6;
+    setSmall(r.v[2], 1);
+    unpackField(r.v[1], packed);
+    fieldSquare(num, r.v[1]);
+    fieldMultiply(den, num, fieldD());
+    fieldSubtract(num, num, r.v[2]);
+    fieldAdd(den, r.v[2], den);
+
+    fieldSquare(den2, den);
+    fieldSquare(den4, den2);
+    fieldMultiply(den6, den4, den2);
+    fieldMultiply(t, den6, num);
+    fieldMultiply(t, t, den);
+
+    power2523(t, t);
+    fieldMultiply(t, t, num);
+    fieldMultiply(t, t, den);
+    fieldMultiply(t, t, den);
+    fieldMultiply(r.v[0], t, den);
+
+    fieldSquare(check, r.v[0]);
+    fieldMultiply(check, check, den);
+    if (!equal(check, num))
+    {
+      fieldMultiply(r.v[0], r.v[0], fieldI());
+    }
+    fieldSquare(check, r.v[0]);
+    fieldMultiply(check, check, den);
+    if (!equal(check, num))
+    {
+      return false;
+    }
+    if (parity(r.v[0]) == (packed[31] >> 7))
+    {
+      Field zero;
+      setSmall(zero, 0);
+      fieldSubtract(r.v[0], zero, r.v[0]);
+    }
+    fieldMultiply(r.v[3], r.v[0], r.v[1]);
+    return true;
+  }
+
+  // s < L, RFC 8032 refuses the others
+  static bool scalarBelowOrder(const uint8_t *s)
+  {
+    for (int i = 31; i >= 0; i--)
+    {
+      if (s[i] != order()[i])
+      {
+        return s[i] < order()[i];
+      }
+    }
+    return false;
+  }
+
+  // r = x mod L, x is 64 limbs of 8 bits with room for carries
+  static void modL(uint8_t *r, int64_t *x)
+  {
+    const uint8_t *l = order();
+    for (int i = 63; i >= 32; i--)
+    {
+      int64_t c = 0;
+      int j;
+      for (j = i - 32; j < i - 12; j++)
+      {
+        x[j] += c - 16 * x[i] * l[j - (i - 32)];
+        c = (x[j] + 128) >> 8;
+        x[j] -= c * 256;
+      }
+      x[j] += c;
+      x[i] = 0;
+    }
+    int64_t c = 0;
+    for (int j = 0; j < 32; j++)
+    {
+      x[j] += c - (x[31] >> 4) * l[j];
+      c = x[j] >> 8;
+      x[j] &= 255;
+    }
+    for (int j = 0; j < 32; j++)
+    {
+      x[j] -= c * l[j];
+    }
+    for (int i = 0; i < 32; i++)
+    {
+      x[i + 1] += x[i] >> 8;
+      r[i] = (uint8_t)(x[i] & 255);
+    }
+  }
+
+  // a 64 byte hash mod L, into its first 32 bytes
+  static void reduce(uint8_t *r)
+  {
+    int64_t x[64];
+    for (int i = 0; i < 64; i++)
+    {
+      x[i] = r[i];
+    }
+    memset(r, 0, 64);
+    modL(r, x);
+  }
+
+  // the secret scalar and the nonce prefix of a seed
+  static void expandSeed(const uint8_t *seed, uint8_t *d)
+  {
+    Sha512 hash;
+    hash.update(seed, KEY_LENGTH);
+    hash.finish(d);
+    d[0] &= 248;
+    d[31] &= 127;
+    d[31] |= 64;
+  }
+};
@@ -0,0 +1,420 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include "frame_codec.h"
+#include "ed25519.h"
+
+// Binary delta of a firmware image against the build the node runs, the
+// payload of a firmware update over LoRa (fuota.h). Made on the host with
+// `program delta` (letterman/src/sim/delta_encoder.h), applied on the node
+// while streaming: the delta, the running image and the new one are all read
+// and written through the caller, the decoder itself holds 1.1 KB.
+//
+//   header     "LMD2", base build, target build, target length and target
+//              CRC-32, uint32 little endian each
+//   ops        a token, kind << 6 | length, length 0 if a varint follows:
+//                DELTA_LITERAL  length bytes of the target follow
+//                DELTA_COPY     length bytes of the base image, from where the
+//                               previous copy ended plus a zigzag varint
+//                DELTA_REPEAT   length bytes of the target written so far,
+//                               from a varint distance back of at most
+//                               DELTA_WINDOW
+//   signature  Ed25519 (ed25519.h) over header and ops, by the update key
+//
+// Anyone with a radio can send a node an offer and fragments, the signature is
+// what tells it the delta comes from the owner of the update key. It covers
+// the header with the target's CRC and every op, and the base is the node's
+// own running build, so a valid one vouches for the image that comes out.
+// The decoder checks it before it writes anything.
+//
+// A build is known by the first 4 bytes of the ELF SHA-256 in its app
+// description, the node reads it from its own and `program delta` from the
+// .bin, see firmwareImageBuildId().
+
+#define DELTA_MAGIC 0x32444d4cUL
+#define DELTA_HEADER_LENGTH 20
+#define DELTA_SIGNATURE_LENGTH 64
+// back reference range of DELTA_REPEAT, the decoder keeps that much output
+#define DELTA_WINDOW 1024
+// esp_image_header_t and the first segment header, then esp_app_desc_t with
+// app_elf_sha256 at 144
+#define FIRMWARE_BUILD_ID_OFFSET (24 + 8 + 144)
+
+enum DeltaOp : uint8_t
+{
+  DELTA_LITERAL = 0,
+  DELTA_COPY = 1,
+  DELTA_REPEAT = 2,
+};
+
+enum DeltaError : uint8_t
+{
+  DELTA_OK,
+  DELTA_BAD_HEADER,
+  // made against another build than the one running
+  DELTA_WRONG_BASE,
+  // an op runs past the end of the delta
+  DELTA_TRUNCATED,
+  DELTA_BAD_OP,
+  DELTA_READ_FAILED,
+  DELTA_WRITE_FAILED,
+  // the output is not the length or CRC the header promises
+  DELTA_BAD_LENGTH,
+  DELTA_BAD_CRC,
+  // not signed with the update key
+  DELTA_BAD_SIGNATURE,
+};
+
+inline const char *deltaErrorName(DeltaError error)
+{
+  static const char *const names[] = {"ok", "bad header", "wrong base", "truncated", "bad op",
+                                      "read failed", "write failed", "bad length", "bad crc", "bad signature"};
+  return error <= DELTA_BAD_SIGNATURE ? names[error] : "unknown";
+}
+
+struct DeltaHeader
+{
+  uint32_t baseBuild;
+  uint32_t targetBuild;
+  uint32_t targetLength;
+  uint32_t targetCrc;
+};
+
+// CRC-32/ISO-HDLC (reflected polynomial 0xEDB88320, zlib's), a nibble at a
+// time like frameCrc8(). Continue with the previous result, start with 0.
+inline uint32_t deltaCrc32(uint32_t crc, const uint8_t *data, size_t length)
+{
+  static const uint32_t table[16] = {0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac, 0x76dc4190, 0x6b6b51f4,
+                                     0x4db26158, 0x5005713c, 0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c,
+                                     0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c};
+  crc = ~crc;
+  for (size_t i = 0; i < length; i++)
+  {
+    crc ^= data[i];
+    crc = (crc >> 4) ^ table[crc & 0x0f];
+    crc = (crc >> 4) ^ table[crc & 0x0f];
+  }
+  return ~crc;
+}
+
+// build id of a firmware .bin, 0 if it is too short to have one
+inline uint32_t firmwareImageBuildId(const uint8_t *image, size_t length)
+{
+  return length >= FIRMWARE_BUILD_ID_OFFSET + 4 ? frameGetLe32(&image[FIRMWARE_BUILD_ID_OFFSET]) : 0;
+}
+
+inline void writeDeltaHeader(const DeltaHeader &header, uint8_t *data)
+{
+  framePutLe32(&data[0], DELTA_MAGIC);
+  framePutLe32(&data[4], header.baseBuild);
+  framePutLe32(&data[8], header.targetBuild);
+  framePutLe32(&data[12], header.targetLength);
+  framePutLe32(&data[16], header.targetCrc);
+}
+
+inline bool readDeltaHeader(const uint8_t *data, size_t length, DeltaHeader &header)
+{
+  if (length < DELTA_HEADER_LENGTH || frameGetLe32(&data[0]) != DELTA_MAGIC)
+  {
+    return false;
+  }
+  header.baseBuild = frameGetLe32(&data[4]);
+  header.targetBuild = frameGetLe32(&data[8]);
+  header.targetLength = frameGetLe32(&data[12]);
+  header.targetCrc = frameGetLe32(&data[16]);
+  return true;
+}
+
+// Applies a delta signed with the key whose public half is `publicKey`. Io is
+// anything with
+//   bool readDelta(uint32_t offset, uint8_t *data, size_t length)
+//   bool readBase(uint32_t offset, uint8_t *data, size_t length)
+//   bool write(const uint8_t *data, size_t length)
+// the delta is read twice, for the signature and to decode it, the target is
+// written in order, in chunks of up to WRITE_CHUNK bytes. Safe on any delta:
+// every length and offset is checked before it is used, a broken one ends in
+// an error, never in a write past the header's target length.
+class DeltaDecoder
+{
+public:
+  static constexpr size_t WRITE_CHUNK = 256;
+
+  template <typename Io>
+  DeltaError apply(Io &io, uint32_t deltaLength, uint32_t baseBuild, const uint8_t *publicKey)
+  {
+    m_deltaLength = deltaLength;
+    m_deltaOffset = 0;
+    m_bufferOffset = 0;
+    m_bufferLength = 0;
+    m_written = 0;
+    m_flushed = 0;
+    m_crc = 0;
+    m_readFailed = false;
+    uint8_t headerData[DELTA_HEADER_LENGTH];
+    DeltaHeader header;
+    if (!readDelta(io, headerData, sizeof(headerData)) || !readDeltaHeader(headerData, sizeof(headerData), header))
+    {
+      return m_readFailed ? DELTA_READ_FAILED : DELTA_BAD_HEADER;
+    }
+    if (header.baseBuild != baseBuild)
+    {
+      return DELTA_WRONG_BASE;
+    }
+    if (deltaLength < DELTA_HEADER_LENGTH + DELTA_SIGNATURE_LENGTH)
+    {
+      return DELTA_TRUNCATED;
+    }
+    if (!signatureValid(io, deltaLength - DELTA_SIGNATURE_LENGTH, publicKey))
+    {
+      return m_readFailed ? DELTA_READ_FAILED : DELTA_BAD_SIGNATURE;
+    }
+    m_deltaLength = deltaLength - DELTA_SIGNATURE_LENGTH;
+    m_bufferLength = 0;
+    m_targetLength = header.targetLength;
+    uint32_t baseOffset = 0;
+    while (m_deltaOffset < m_deltaLength)
+    {
+      uint8_t token;
+      uint32_t length;
+      if (!readDelta(io, &token, 1) || !readLength(io, token, length))
+      {
+        return m_readFailed ? DELTA_READ_FAILED : DELTA_TRUNCATED;
+      }
+      if (length > m_targetLength - m_written)
+      {
+        return DELTA_BAD_LENGTH;
+      }
+      DeltaError error = DELTA_OK;
+      switch (token >> 6)
+      {
+      case DELTA_LITERAL:
+        error = literal(io, length);
+        break;
+      case DELTA_COPY:
+        error = copy(io, length, baseOffset);
+        break;
+      case DELTA_REPEAT:
+        error = repeat(io, length);
+        break;
+      default:
+        error = DELTA_BAD_OP;
+        break;
+      }
+      if (error != DELTA_OK)
+      {
+        return error;
+      }
+    }
+    if (m_written != m_targetLength)
+    {
+      return DELTA_BAD_LENGTH;
+    }
+    if (!flush(io))
+    {
+      return DELTA_WRITE_FAILED;
+    }
+    return m_crc == header.targetCrc ? DELTA_OK : DELTA_BAD_CRC;
+  }
+
+  // bytes of the target written so far
+  uint32_t written() const
+  {
+    return m_written;
+  }
+
+private:
+  // the delta is read in chunks of this size
+  static constexpr size_t READ_CHUNK = 64;
+
+  template <typename Io>
+  bool signatureValid(Io &io, uint32_t signedLength, const uint8_t *publicKey)
+  {
+    uint8_t signature[DELTA_SIGNATURE_LENGTH];
+    if (!io.readDelta(signedLength, signature, sizeof(signature)))
+    {
+      m_readFailed = true;
+      return false;
+    }
+    Ed25519::Verifier verifier;
+    if (!verifier.begin(publicKey, signature))
+    {
+      return false;
+    }
+    for (uint32_t offset = 0; offset < signedLength; offset += READ_CHUNK)
+    {
+      const size_t part = signedLength - offset < READ_CHUNK ? signedLength - offset : READ_CHUNK;
+      if (!io.readDelta(offset, m_buffer, part))
+      {
+        m_readFailed = true;
+        return false;
+      }
+      verifier.update(m_buffer, part);
+    }
+    return verifier.finish();
+  }
+
+  template <typename Io>
+  bool readDelta(Io &io, uint8_t *data, size_t length)
+  {
+    for (size_t i = 0; i < length; i++)
+    {
+      if (m_deltaOffset >= m_deltaLength)
+      {
+        return false;
+      }
+      if (m_deltaOffset >= m_bufferOffset + m_bufferLength)
+      {
+        m_bufferOffset = m_deltaOffset;
+        m_bufferLength = m_deltaLength - m_deltaOffset < READ_CHUNK ? m_deltaLength - m_deltaOffset : READ_CHUNK;
+        if (!io.readDelta(m_bufferOffset, m_buffer, m_bufferLength))
+        {
+          m_readFailed = true;
+          return false;
+        }
+      }
+      data[i] = m_buffer[m_deltaOffset++ - m_bufferOffset];
+    }
+    return true;
+  }
+
+  template <typename Io>
+  bool readVarint(Io &io, uint32_t &value)
+  {
+    value = 0;
+    for (uint8_t shift = 0; shift < 35; shift += 7)
+    {
+      uint8_t byte;
+      if (!readDelta(io, &byte, 1))
+      {
+        return false;
+      }
+      value |= (uint32_t)(byte & 0x7f) << shift;
+      if ((byte & 0x80) == 0)
+      {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  template <typename Io>
+  bool readLength(Io &io, uint8_t token, uint32_t &length)
+  {
+    length = token & 0x3f;
+    return length != 0 || readVarint(io, length);
+  }
+
+  template <typename Io>
+  bool put(Io &io, uint8_t byte)
+  {
+    m_window[m_written % DELTA_WINDOW] = byte;
+    m_written++;
+    return m_written % WRITE_CHUNK != 0 || flush(io);
+  }
+
+  // writes what the window holds since the last chunk
+  template <typename Io>
+  bool flush(Io &io)
+  {
+    const size_t pending = m_written % WRITE_CHUNK != 0 ? m_written % WRITE_CHUNK : (m_written != 0 ? WRITE_CHUNK : 0);
+    if (pending == 0 || m_written == m_flushed)
+    {
+      return true;
+    }
+    const uint8_t *chunk = &m_window[(m_written - pending) % DELTA_WINDOW];
+    m_crc = deltaCrc32(m_crc, chunk, pending);
+    m_flushed = m_written;
+    return io.write(chunk, pending);
+  }
+
+  template <typename Io>
+  DeltaError literal(Io &io, uint32_t length)
+  {
+    for (uint32_t i = 0; i < length; i++)
+    {
+      uint8_t byte;
+      if (!readDelta(io, &byte, 1))
+      {
+        return m_readFailed ? DELTA_READ_FAILED : DELTA_TRUNCATED;
+      }
+      if (!put(io, byte))
+      {
+        return DELTA_WRITE_FAILED;
+      }
+    }
+    return DELTA_OK;
+  }
+
+  template <typename Io>
+  DeltaError copy(Io &io, uint32_t length, uint32_t &baseOffset)
+  {
+    uint32_t zigzag;
+    if (!readVarint(io, zigzag))
+    {
+      return m_readFailed ? DELTA_READ_FAILED : DELTA_TRUNCATED;
+    }
+    // the base image reader checks the end, wrapping around 0 is a bad op
+    const int32_t step = (int32_t)(zigzag >> 1) ^ -(int32_t)(zigzag & 1);
+    if (step < 0 && (uint32_t)-step > baseOffset)
+    {
+      return DELTA_BAD_OP;
+    }
+    baseOffset += step;
+    uint8_t chunk[READ_CHUNK];
+    while (length != 0)
+    {
+      const size_t part = length < sizeof(chunk) ? length : sizeof(chunk);
+      if (!io.readBase(baseOffset, chunk, part))
+      {
+        return DELTA_READ_FAILED;
+      }
+      for (size_t i = 0; i < part; i++)
+      {
+        if (!put(io, chunk[i]))
+        {
+          return DELTA_WRITE_FAILED;
+        }
+      }
+      baseOffset += part;
+      length -= part;
+    }
+    return DELTA_OK;
+  }
+
+  template <typename Io>
+  DeltaError repeat(Io &io, uint32_t length)
+  {
+    uint32_t distance;
+    if (!readVarint(io, distance))
+    {
+      return m_readFailed ? DELTA_READ_FAILED : DELTA_TRUNCATED;
+    }
+    if (distance == 0 || distance > DELTA_WINDOW || distance > m_written)
+    {
+      return DELTA_BAD_OP;
+    }
+    // byte by byte, a distance shorter than the length repeats a pattern
+    for (uint32_t i = 0; i < length; i++)
+    {
+      if (!put(io, m_window[(m_written - distance) % DELTA_WINDOW]))
+      {
+        return DELTA_WRITE_FAILED;
+      }
+    }
+    return DELTA_OK;
+  }
+
+  uint32_t m_deltaLength = 0;
+  uint32_t m_deltaOffset = 0;
+  uint32_t m_bufferOffset = 0;
+  uint32_t m_bufferLength = 0;
+  uint32_t m_targetLength = 0;
+  uint32_t m_written = 0;
+  uint32_t m_flushed = 0;
+  uint32_t m_crc = 0;
+  bool m_readFailed = false;
+  uint8_t m_buffer[READ_CHUNK];
+  uint8_t m_window[DELTA_WINDOW];
+};
+
+static_assert(DELTA_WINDOW % DeltaDecoder::WRITE_CHUNK == 0, "a chunk never wraps around the window");
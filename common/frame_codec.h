@@ -0,0 +1,352 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// Letterman wire format, shared by the sensor and the gateway. Header only and
+// allocation free: frames are written into and decoded from caller buffers.
+//
+//   header      FRAME_VERSION << 4 | FrameType
+//   node id     uint32 little endian
+//   counter     uint16 little endian, an ACK carries the acknowledged one
+//   body        FRAME_STATUS: the status bits, FRAME_FRAGMENT: the rest of
+//               the frame, empty for the other types
+//   extensions  each a tag (FrameExtension << 4 | length) and up to 15 bytes
+//               of value, kinds a decoder does not know are skipped
+//   check       CRC-8 over everything before it
+//
+// Sized for airtime: a status frame with pulse counts is 12 bytes, at SF9 as
+// many symbols as a bare one. Frames of the original sensor firmware start
+// with 'l' (version 6) and are told apart by that.
+
+#define FRAME_VERSION 1
+// header, node id, counter
+#define FRAME_HEADER_LENGTH 7
+#define FRAME_CHECK_LENGTH 1
+#define FRAME_EXTENSION_MAX_LENGTH 15
+// largest frame the encoder writes and the decoder accepts
+#define FRAME_MAX_LENGTH 64
+
+enum FrameType : uint8_t
+{
+  FRAME_STATUS = 1,
+  FRAME_ACK = 2,
+  // daily summary of the sensor's energy ledger, not acknowledged
+  FRAME_ENERGY = 3,
+  // a piece of a firmware update for the node (fuota.h), gateway to node, the
+  // counter is the fragment number
+  FRAME_FRAGMENT = 4,
+};
+
+enum FrameExtension : uint8_t
+{
+  // vibration and motion pulses the input filter counted, uint8 each, saturated
+  EXT_PULSE_COUNTS = 1,
+  // packed SF and TX power: in a status frame the ones it was sent with, in an
+  // ACK the ones to use from now on, see frameLinkSettings()
+  EXT_LINK_SETTINGS = 2,
+  // battery voltage in mV, uint16
+  EXT_BATTERY = 3,
+  // wakes uint16, seconds uint32 and charge in uAh uint32 since power on
+  EXT_ENERGY_TOTALS = 4,
+  // share of the charge per energy phase in percent, uint8 each
+  EXT_ENERGY_PHASES = 5,
+  // inputs that went high since the previous message: their channel set, then
+  // for each of its channels in table order the number of times (uint8,
+  // saturated) and when it first did in FRAME_EVENT_TICK_MS after the first
+  // edge of the burst (uint8, saturated)
+  EXT_EVENTS = 6,
+  // input bursts the sensor took for noise and did not send since the last
+  // summary, uint16, and the flap and PIR pulses in them, uint16 each
+  EXT_NOISE = 7,
+  // build the node runs, uint32, see firmware_delta.h
+  EXT_FIRMWARE = 8,
+  // a firmware update for the node, FuotaOffer in fuota.h
+  EXT_UPDATE_OFFER = 9,
+  // in a status frame the update fragments the node is missing, in an ACK the
+  // ones the gateway sends after it, FuotaRequest in fuota.h
+  EXT_UPDATE_REQUEST = 10,
+  // random id of the node's boot, uint32, in every status frame from power on
+  // or reset until one is acknowledged: its counter started over
+  EXT_RESTART = 11,
+  // what the sensor made of the burst the message reports, FrameMail, uint8
+  EXT_MAIL = 12,
+};
+
+// EXT_MAIL values
+enum FrameMail : uint8_t
+{
+  FRAME_MAIL_DELIVERED = 1,
+  FRAME_MAIL_EMPTIED = 2,
+};
+
+#define FRAME_EVENT_TICK_MS 100
+
+enum FrameError : uint8_t
+{
+  FRAME_OK,
+  FRAME_TOO_SHORT,
+  FRAME_TOO_LONG,
+  FRAME_BAD_VERSION,
+  FRAME_BAD_TYPE,
+  FRAME_BAD_CHECK,
+  // an extension runs past the end of the frame
+  FRAME_BAD_EXTENSION,
+};
+
+inline const char *frameErrorName(FrameError error)
+{
+  static const char *const names[] = {"ok", "too short", "too long", "bad version", "bad type", "bad check", "bad extension"};
+  return error <= FRAME_BAD_EXTENSION ? names[error] : "unknown";
+}
+
+// CRC-8/SMBUS (polynomial 0x07), a nibble at a time from a 16 entry table
+inline uint8_t frameCrc8(const uint8_t *data, size_t length)
+{
+  static const uint8_t table[16] = {0x00, 0x07, 0x0e, 0x09, 0x1c, 0x1b, 0x12, 0x15,
+                                    0x38, 0x3f, 0x36, 0x31, 0x24, 0x23, 0x2a, 0x2d};
+  uint8_t crc = 0;
+  for (size_t i = 0; i < length; i++)
+  {
+    crc ^= data[i];
+    crc = (uint8_t)(crc << 4) ^ table[crc >> 4];
+    crc = (uint8_t)(crc << 4) ^ table[crc >> 4];
+  }
+  return crc;
+}
+
+// SF and TX power in one byte: SF - 5 in the upper 3 bits, TX power + 9 dBm in
+// the lower 5, which covers SF5-12 and the SX1262's -9 to 22 dBm
+inline uint8_t frameLinkSettings(uint8_t sf, int8_t powerDbm)
+{
+  return (uint8_t)((sf - 5) << 5 | (powerDbm + 9));
+}
+
+inline uint8_t frameLinkSf(uint8_t settings)
+{
+  return (settings >> 5) + 5;
+}
+
+inline int8_t frameLinkPower(uint8_t settings)
+{
+  return (int8_t)(settings & 0x1f) - 9;
+}
+
+inline uint16_t frameGetLe16(const uint8_t *data)
+{
+  return (uint16_t)data[0] | (uint16_t)data[1] << 8;
+}
+
+inline uint32_t frameGetLe32(const uint8_t *data)
+{
+  return (uint32_t)data[0] | (uint32_t)data[1] << 8 | (uint32_t)data[2] << 16 | (uint32_t)data[3] << 24;
+}
+
+inline void framePutLe16(uint8_t *data, uint16_t value)
+{
+  data[0] = (uint8_t)(value >> 0);
+  data[1] = (uint8_t)(value >> 8);
+}
+
+inline void framePutLe32(uint8_t *data, uint32_t value)
+{
+  for (uint8_t i = 0; i < 4; i++)
+  {
+    data[i] = (uint8_t)(value >> (8 * i));
+  }
+}
+
+// one extension, value points into the frame
+struct FrameExtensionView
+{
+  uint8_t kind;
+  uint8_t length;
+  const uint8_t *value;
+};
+
+// A decoded frame. Nothing is copied, the extensions still live in the
+// buffer that was decoded, so the view is only valid as long as it is.
+struct FrameView
+{
+  FrameType type;
+  uint32_t nodeId;
+  uint16_t counter;
+  // FRAME_STATUS only
+  uint8_t status;
+  // FRAME_FRAGMENT only, the body
+  const uint8_t *payload;
+  uint8_t payloadLength;
+  const uint8_t *extensions;
+  uint8_t extensionsLength;
+
+  // first extension of the kind with at least minLength bytes of value
+  bool find(uint8_t kind, uint8_t minLength, FrameExtensionView &extension) const
+  {
+    size_t offset = 0;
+    while (offset < extensionsLength)
+    {
+      const uint8_t tag = extensions[offset];
+      const uint8_t length = tag & 0x0f;
+      if ((tag >> 4) == kind && length >= minLength)
+      {
+        extension.kind = kind;
+        extension.length = length;
+        extension.value = &extensions[offset + 1];
+        return true;
+      }
+      offset += 1 + length;
+    }
+    return false;
+  }
+};
+
+// Checks the frame and fills in the view, the view is undefined unless FRAME_OK
+// is returned. Safe on any input: every read is bounds checked first.
+inline FrameError decodeFrame(const uint8_t *data, size_t length, FrameView &frame)
+{
+  if (length < FRAME_HEADER_LENGTH + FRAME_CHECK_LENGTH)
+  {
+    return FRAME_TOO_SHORT;
+  }
+  if (length > FRAME_MAX_LENGTH)
+  {
+    return FRAME_TOO_LONG;
+  }
+  if ((data[0] >> 4) != FRAME_VERSION)
+  {
+    return FRAME_BAD_VERSION;
+  }
+  if (frameCrc8(data, length - FRAME_CHECK_LENGTH) != data[length - 1])
+  {
+    return FRAME_BAD_CHECK;
+  }
+  frame.type = (FrameType)(data[0] & 0x0f);
+  frame.nodeId = frameGetLe32(&data[1]);
+  frame.counter = frameGetLe16(&data[5]);
+  frame.status = 0;
+  frame.payload = nullptr;
+  frame.payloadLength = 0;
+  size_t offset = FRAME_HEADER_LENGTH;
+  const size_t end = length - FRAME_CHECK_LENGTH;
+  switch (frame.type)
+  {
+  case FRAME_STATUS:
+    if (offset >= end)
+    {
+      return FRAME_TOO_SHORT;
+    }
+    frame.status = data[offset++];
+    break;
+  case FRAME_FRAGMENT:
+    frame.payload = &data[offset];
+    frame.payloadLength = (uint8_t)(end - offset);
+    offset = end;
+    break;
+  case FRAME_ACK:
+  case FRAME_ENERGY:
+    break;
+  default:
+    return FRAME_BAD_TYPE;
+  }
+  frame.extensions = &data[offset];
+  frame.extensionsLength = (uint8_t)(end - offset);
+  // the extensions have to tile the rest exactly, so find() can trust the tags
+  while (offset < end)
+  {
+    offset += 1 + (data[offset] & 0x0f);
+  }
+  return offset == end ? FRAME_OK : FRAME_BAD_EXTENSION;
+}
+
+// Builds a frame in a caller buffer. Writes past the end are dropped and make
+// finish() return 0, so the calls need no checks in between.
+class FrameWriter
+{
+public:
+  FrameWriter(uint8_t *buffer, size_t size)
+      : m_buffer(buffer), m_size(size > FRAME_MAX_LENGTH ? FRAME_MAX_LENGTH : size), m_length(0), m_overflow(false)
+  {
+  }
+
+  FrameWriter &begin(FrameType type, uint32_t nodeId, uint16_t counter)
+  {
+    m_length = 0;
+    m_overflow = false;
+    if (reserve(FRAME_HEADER_LENGTH))
+    {
+      m_buffer[0] = (uint8_t)(FRAME_VERSION << 4 | type);
+      framePutLe32(&m_buffer[1], nodeId);
+      framePutLe16(&m_buffer[5], counter);
+      m_length = FRAME_HEADER_LENGTH;
+    }
+    return *this;
+  }
+
+  // the status bits of a FRAME_STATUS, right after begin()
+  FrameWriter &status(uint8_t bits)
+  {
+    if (reserve(1))
+    {
+      m_buffer[m_length++] = bits;
+    }
+    return *this;
+  }
+
+  // body bytes of a FRAME_FRAGMENT, right after begin()
+  FrameWriter &payload(const uint8_t *data, size_t length)
+  {
+    if (reserve(length))
+    {
+      memcpy(&m_buffer[m_length], data, length);
+      m_length += length;
+    }
+    return *this;
+  }
+
+  FrameWriter &extension(FrameExtension kind, const uint8_t *value, uint8_t length)
+  {
+    if (length > FRAME_EXTENSION_MAX_LENGTH)
+    {
+      m_overflow = true;
+    }
+    else if (reserve(1 + length))
+    {
+      m_buffer[m_length] = (uint8_t)(kind << 4 | length);
+      memcpy(&m_buffer[m_length + 1], value, length);
+      m_length += 1 + length;
+    }
+    return *this;
+  }
+
+  FrameWriter &extension(FrameExtension kind, uint8_t value)
+  {
+    return extension(kind, &value, 1);
+  }
+
+  // appends the check, returns the frame length or 0 if it did not fit
+  size_t finish()
+  {
+    if (!reserve(FRAME_CHECK_LENGTH))
+    {
+      return 0;
+    }
+    m_buffer[m_length] = frameCrc8(m_buffer, m_length);
+    return m_length + FRAME_CHECK_LENGTH;
+  }
+
+private:
+  bool reserve(size_t length)
+  {
+    if (m_overflow || m_length + length > m_size)
+    {
+      m_overflow = true;
+      return false;
+    }
+    return true;
+  }
+
+  uint8_t *m_buffer;
+  size_t m_size;
+  size_t m_length;
+  bool m_overflow;
+};
@@ -0,0 +1,174 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include "frame_codec.h"
+
+// Firmware update over LoRa: the gateway holds a delta (firmware_delta.h)
+// against the build a node runs and hands it out in fragments, the node pulls
+// them in the receive window after its own uplinks, so it never listens
+// longer than its messages already make it.
+//
+//   status frame  EXT_FIRMWARE, the build the node runs, with the link settings
+//   ACK           EXT_UPDATE_OFFER, the delta for a node on its base build
+//   status frame  EXT_UPDATE_REQUEST, the fragments of a window still missing
+//   ACK           EXT_UPDATE_REQUEST, the ones of them the gateway sends now
+//   fragments     FRAME_FRAGMENT right after the ACK, FUOTA_FRAGMENT_GAP_MS apart
+//
+// The delta is cut into FUOTA_FRAGMENT_SIZE byte fragments, every block of
+// FUOTA_BLOCK_FRAGMENTS of them has a parity fragment, their XOR: a block that
+// lost one fragment on air is recovered without asking again. A node pulls
+// FUOTA_WINDOW_FRAGMENTS at a time and moves on once it has all of them.
+
+#define FUOTA_FRAGMENT_SIZE 48
+#define FUOTA_BLOCK_FRAGMENTS 8
+#define FUOTA_WINDOW_FRAGMENTS 16
+#define FUOTA_WINDOW_BLOCKS (FUOTA_WINDOW_FRAGMENTS / FUOTA_BLOCK_FRAGMENTS)
+// the counter of a parity fragment is its block with this bit set
+#define FUOTA_PARITY_FLAG 0x8000
+// time the node has between the ACK and the first fragment, and the gateway
+// between fragments
+#define FUOTA_FRAGMENT_GAP_MS 50
+// target build, then the fragment
+#define FUOTA_FRAGMENT_FRAME_LENGTH (FRAME_HEADER_LENGTH + 4 + FUOTA_FRAGMENT_SIZE + FRAME_CHECK_LENGTH)
+#define FUOTA_OFFER_LENGTH 15
+#define FUOTA_REQUEST_LENGTH 8
+#define FUOTA_GRANT_LENGTH 4
+
+static_assert(FUOTA_WINDOW_FRAGMENTS <= 16, "a window is a 16 bit mask");
+static_assert(FUOTA_WINDOW_FRAGMENTS % FUOTA_BLOCK_FRAGMENTS == 0, "a window is whole blocks");
+static_assert(FUOTA_FRAGMENT_FRAME_LENGTH <= FRAME_MAX_LENGTH, "a fragment is one frame");
+
+// EXT_UPDATE_OFFER: base and target build uint32, delta length uint24 and its
+// CRC-32 (firmware_delta.h) uint32
+struct FuotaOffer
+{
+  uint32_t baseBuild;
+  uint32_t targetBuild;
+  uint32_t length;
+  uint32_t crc;
+
+  void write(uint8_t *value) const
+  {
+    framePutLe32(&value[0], baseBuild);
+    framePutLe32(&value[4], targetBuild);
+    value[8] = (uint8_t)length;
+    framePutLe16(&value[9], (uint16_t)(length >> 8));
+    framePutLe32(&value[11], crc);
+  }
+
+  void read(const uint8_t *value)
+  {
+    baseBuild = frameGetLe32(&value[0]);
+    targetBuild = frameGetLe32(&value[4]);
+    length = value[8] | (uint32_t)frameGetLe16(&value[9]) << 8;
+    crc = frameGetLe32(&value[11]);
+  }
+};
+
+// EXT_UPDATE_REQUEST in a status frame: target build uint32, the first
+// fragment of the window uint16 and the ones of it still missing, bit i for
+// first + i, uint16. No missing ones declines the offer of the target.
+// In an ACK only the first fragment and the mask of the ones that follow.
+struct FuotaRequest
+{
+  uint32_t targetBuild;
+  uint16_t first;
+  uint16_t missing;
+
+  void write(uint8_t *value) const
+  {
+    framePutLe32(&value[0], targetBuild);
+    framePutLe16(&value[4], first);
+    framePutLe16(&value[6], missing);
+  }
+
+  void read(const uint8_t *value)
+  {
+    targetBuild = frameGetLe32(&value[0]);
+    first = frameGetLe16(&value[4]);
+    missing = frameGetLe16(&value[6]);
+  }
+};
+
+inline uint16_t fuotaFragmentCount(uint32_t deltaLength)
+{
+  return (uint16_t)((deltaLength + FUOTA_FRAGMENT_SIZE - 1) / FUOTA_FRAGMENT_SIZE);
+}
+
+// the last fragment is shorter
+inline uint8_t fuotaFragmentLength(uint32_t deltaLength, uint16_t fragment)
+{
+  const uint32_t offset = (uint32_t)fragment * FUOTA_FRAGMENT_SIZE;
+  if (offset >= deltaLength)
+  {
+    return 0;
+  }
+  return deltaLength - offset < FUOTA_FRAGMENT_SIZE ? (uint8_t)(deltaLength - offset) : FUOTA_FRAGMENT_SIZE;
+}
+
+// fragments of a window that exist, bit i for first + i
+inline uint16_t fuotaWindowMask(uint32_t deltaLength, uint16_t first)
+{
+  const uint16_t count = fuotaFragmentCount(deltaLength);
+  if (first >= count)
+  {
+    return 0;
+  }
+  const uint16_t inWindow = count - first < FUOTA_WINDOW_FRAGMENTS ? count - first : FUOTA_WINDOW_FRAGMENTS;
+  return (uint16_t)((1UL << inWindow) - 1);
+}
+
+// frames that follow an ACK granting `mask` of a window: the data fragments
+// and the parity of every block one of them is in
+inline uint8_t fuotaGrantFrames(uint16_t mask)
+{
+  uint8_t frames = 0;
+  for (uint8_t i = 0; i < FUOTA_WINDOW_FRAGMENTS; i++)
+  {
+    frames += (mask >> i) & 1;
+  }
+  for (uint8_t block = 0; block < FUOTA_WINDOW_BLOCKS; block++)
+  {
+    const uint16_t blockMask = (uint16_t)(((1UL << FUOTA_BLOCK_FRAGMENTS) - 1) << (block * FUOTA_BLOCK_FRAGMENTS));
+    frames += (mask & blockMask) != 0;
+  }
+  return frames;
+}
+
+// XOR of the fragments of a block, each zero padded to FUOTA_FRAGMENT_SIZE.
+// Read is bool(uint16_t fragment, uint8_t *data, uint8_t length).
+template <typename Read>
+bool fuotaParity(Read read, uint32_t deltaLength, uint16_t block, uint8_t *parity)
+{
+  memset(parity, 0, FUOTA_FRAGMENT_SIZE);
+  uint8_t data[FUOTA_FRAGMENT_SIZE];
+  for (uint16_t fragment = block * FUOTA_BLOCK_FRAGMENTS; fragment < (block + 1) * FUOTA_BLOCK_FRAGMENTS; fragment++)
+  {
+    const uint8_t length = fuotaFragmentLength(deltaLength, fragment);
+    if (length == 0)
+    {
+      break;
+    }
+    if (!read(fragment, data, length))
+    {
+      return false;
+    }
+    for (uint8_t i = 0; i < length; i++)
+    {
+      parity[i] ^= data[i];
+    }
+  }
+  return true;
+}
+
+// a FRAME_FRAGMENT for node, number is the fragment or FUOTA_PARITY_FLAG | block
+inline size_t fuotaFragmentFrame(uint8_t *buffer, size_t size, uint32_t nodeId, uint32_t targetBuild, uint16_t number,
+                                 const uint8_t *data, uint8_t length)
+{
+  uint8_t target[4];
+  framePutLe32(target, targetBuild);
+  FrameWriter writer(buffer, size);
+  writer.begin(FRAME_FRAGMENT, nodeId, number).payload(target, sizeof(target)).payload(data, length);
+  return writer.finish();
+}
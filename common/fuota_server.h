@@ -0,0 +1,223 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include "fuota.h"
+#include "firmware_delta.h"
+#include "duty_cycle.h"
+#include "lora_airtime.h"
+
+// The gateway's side of a firmware update (fuota.h): one delta, offered to
+// every node on its base build and handed out in the fragments the nodes ask
+// for. Shared by the gateway and the ACK model of the sensor simulation.
+// Store is anything with
+//   bool read(uint32_t offset, uint8_t *data, size_t length)
+// over the delta, the server keeps nothing of it in RAM.
+//
+// Fragments take air time from the gateway's duty cycle: a grant is cut to
+// what FUOTA_DUTY_CYCLE_PERMILLE of the hour has left, the node asks again
+// with its next message. The node listens for the whole grant and the
+// gateway sends one grant at a time, so one is also cut to
+// FUOTA_GRANT_MAX_FRAMES.
+
+// half of the 1 % the gateway has, the ACKs need the rest
+#define FUOTA_DUTY_CYCLE_PERMILLE 5
+// parity included, about 2.5 s at SF9
+#define FUOTA_GRANT_MAX_FRAMES 6
+
+// what the gateway knows about a node's update
+struct FuotaNode
+{
+  // reported with EXT_FIRMWARE, 0 until it did
+  uint32_t build;
+  // target the node declined, it is not offered again
+  uint32_t declined;
+};
+
+template <typename Store>
+class FuotaServer
+{
+public:
+  // LoRa settings the fragments go out with
+  FuotaServer(uint8_t sf, uint32_t bwHz, uint8_t cr, uint16_t preambleLength)
+      : m_fragmentAirtimeUs(loraAirtimeUs(sf, bwHz, cr, preambleLength, FUOTA_FRAGMENT_FRAME_LENGTH))
+  {
+    m_budget.reset(FUOTA_DUTY_CYCLE_PERMILLE);
+  }
+
+  // reads the delta's header and CRC, false if it is not a delta. The
+  // signature is the node's to check, the gateway has no key.
+  bool begin(Store *store, uint32_t length)
+  {
+    m_store = nullptr;
+    uint8_t data[DELTA_HEADER_LENGTH];
+    DeltaHeader header;
+    if (store == nullptr || length >= 1UL << 24 || length <= DELTA_HEADER_LENGTH + DELTA_SIGNATURE_LENGTH ||
+        !store->read(0, data, sizeof(data)) ||
+        !readDeltaHeader(data, sizeof(data), header))
+    {
+      return false;
+    }
+    uint32_t crc = 0;
+    for (uint32_t offset = 0; offset < length; offset += FUOTA_FRAGMENT_SIZE)
+    {
+      uint8_t chunk[FUOTA_FRAGMENT_SIZE];
+      const uint8_t part = fuotaFragmentLength(length, (uint16_t)(offset / FUOTA_FRAGMENT_SIZE));
+      if (!store->read(offset, chunk, part))
+      {
+        return false;
+      }
+      crc = deltaCrc32(crc, chunk, part);
+    }
+    m_offer = {header.baseBuild, header.targetBuild, length, crc};
+    m_store = store;
+    return true;
+  }
+
+  bool active() const
+  {
+    return m_store != nullptr;
+  }
+
+  const FuotaOffer &offer() const
+  {
+    return m_offer;
+  }
+
+  // Looks at the update extensions of a node's status frame and adds the
+  // offer or the grant of at most maxFrames to its ACK, 0 while another grant
+  // still goes out. The fragments of a grant follow the ACK, grantFrame()
+  // builds them from what `grant` was set to, its mask is 0 if there are none.
+  void answer(const FrameView &frame, FuotaNode &node, uint64_t nowUs, uint8_t maxFrames, FrameWriter &ack,
+              FuotaRequest &grant)
+  {
+    grant = {m_offer.targetBuild, 0, 0};
+    FrameExtensionView extension;
+    if (frame.find(EXT_FIRMWARE, 4, extension))
+    {
+      node.build = frameGetLe32(extension.value);
+    }
+    if (!active())
+    {
+      return;
+    }
+    FuotaRequest request;
+    const bool requested = frame.find(EXT_UPDATE_REQUEST, FUOTA_REQUEST_LENGTH, extension);
+    if (requested)
+    {
+      request.read(extension.value);
+    }
+    if (!requested || request.targetBuild != m_offer.targetBuild)
+    {
+      // a node that reported no build yet checks the base itself
+      if ((node.build == 0 || node.build == m_offer.baseBuild) && node.declined != m_offer.targetBuild)
+      {
+        uint8_t value[FUOTA_OFFER_LENGTH];
+        m_offer.write(value);
+        ack.extension(EXT_UPDATE_OFFER, value, sizeof(value));
+      }
+      return;
+    }
+    if (request.missing == 0)
+    {
+      node.declined = request.targetBuild;
+      return;
+    }
+    grant.first = request.first;
+    // the parity blocks are numbered from the start of a window, a request for
+    // anything else or past the end of the delta gets nothing
+    grant.missing = request.first % FUOTA_WINDOW_FRAGMENTS == 0
+                        ? request.missing & fuotaWindowMask(m_offer.length, request.first)
+                        : 0;
+    if (maxFrames > FUOTA_GRANT_MAX_FRAMES)
+    {
+      maxFrames = FUOTA_GRANT_MAX_FRAMES;
+    }
+    // cut to the burst and the budget, from the end of the window
+    while (grant.missing != 0 && (fuotaGrantFrames(grant.missing) > maxFrames ||
+                                  !m_budget.fits(nowUs, fuotaGrantFrames(grant.missing) * m_fragmentAirtimeUs)))
+    {
+      grant.missing &= (uint16_t)~(0x8000U >> countLeadingZeros(grant.missing));
+    }
+    uint8_t value[FUOTA_GRANT_LENGTH];
+    framePutLe16(&value[0], grant.first);
+    framePutLe16(&value[2], grant.missing);
+    ack.extension(EXT_UPDATE_REQUEST, value, sizeof(value));
+    m_budget.spend(nowUs, fuotaGrantFrames(grant.missing) * m_fragmentAirtimeUs);
+    m_fragmentsGranted += fuotaGrantFrames(grant.missing);
+  }
+
+  // Builds frame `index` of a grant into `frame`: the data fragments in
+  // order, then the parity of the blocks they are in. Returns its length, 0
+  // past the last one of the grant or if the store cannot be read. Each goes
+  // out FUOTA_FRAGMENT_GAP_MS after the frame before it.
+  size_t grantFrame(uint32_t nodeId, const FuotaRequest &grant, uint8_t index, uint8_t *frame, size_t size)
+  {
+    uint8_t data[FUOTA_FRAGMENT_SIZE];
+    uint8_t blocks = 0;
+    for (uint8_t i = 0; i < FUOTA_WINDOW_FRAGMENTS; i++)
+    {
+      if (((grant.missing >> i) & 1) == 0)
+      {
+        continue;
+      }
+      blocks |= 1 << (i / FUOTA_BLOCK_FRAGMENTS);
+      if (index-- != 0)
+      {
+        continue;
+      }
+      const uint16_t fragment = grant.first + i;
+      const uint8_t length = fuotaFragmentLength(m_offer.length, fragment);
+      if (!m_store->read((uint32_t)fragment * FUOTA_FRAGMENT_SIZE, data, length))
+      {
+        return 0;
+      }
+      return fuotaFragmentFrame(frame, size, nodeId, m_offer.targetBuild, fragment, data, length);
+    }
+    Store *store = m_store;
+    auto read = [store](uint16_t fragment, uint8_t *fragmentData, uint8_t length)
+    { return store->read((uint32_t)fragment * FUOTA_FRAGMENT_SIZE, fragmentData, length); };
+    for (uint8_t block = 0; block < FUOTA_WINDOW_BLOCKS; block++)
+    {
+      if ((blocks & (1 << block)) == 0 || index-- != 0)
+      {
+        continue;
+      }
+      const uint16_t number = grant.first / FUOTA_BLOCK_FRAGMENTS + block;
+      if (!fuotaParity(read, m_offer.length, number, data))
+      {
+        return 0;
+      }
+      return fuotaFragmentFrame(frame, size, nodeId, m_offer.targetBuild, FUOTA_PARITY_FLAG | number, data,
+                                FUOTA_FRAGMENT_SIZE);
+    }
+    return 0;
+  }
+
+  // fragments granted since begin(), parity included
+  uint32_t fragmentsGranted() const
+  {
+    return m_fragmentsGranted;
+  }
+
+  uint32_t fragmentAirtimeUs() const
+  {
+    return m_fragmentAirtimeUs;
+  }
+
+private:
+  static uint8_t countLeadingZeros(uint16_t value)
+  {
+    uint8_t zeros = 0;
+    for (uint16_t bit = 0x8000; bit != 0 && (value & bit) == 0; bit >>= 1)
+    {
+      zeros++;
+    }
+    return zeros;
+  }
+
+  Store *m_store = nullptr;
+  FuotaOffer m_offer = {};
+  uint32_t m_fragmentAirtimeUs;
+  uint32_t m_fragmentsGranted = 0;
+  DutyCycleBudget m_budget;
+};
@@ -0,0 +1,116 @@
+#pragma once
+#include <stdint.h>
+#include <math.h>
+
+// Link margin estimator of one node and the SF / TX power derived from it,
+// after the ADR of a LoRaWAN network server: the best SNR of the last HISTORY
+// frames has to clear the demodulation floor of the SF by MARGIN_DB. Nodes
+// report the SF and power they send with whenever those change and every few
+// messages, so every sample is normalised to 0 dBm and stays valid when the
+// node changes its power. A node that reports more robust settings than it was
+// assigned fell back after lost ACKs, the link got worse and the history is
+// started over.
+struct LinkAdr
+{
+  static const uint8_t HISTORY = 8;
+  // reserve for fading: rain, a van parked in front of the mailbox
+  static const int8_t MARGIN_DB = 10;
+  // SX1262 range that is still worth it, and the EU868 limit of 25 mW ERP
+  static const int8_t MIN_POWER_DBM = 2;
+  static const int8_t MAX_POWER_DBM = 14;
+
+  // SNR minus TX power in 0.25 dB, ring of the last HISTORY frames
+  int16_t gain[HISTORY];
+  uint8_t count;
+  uint8_t next;
+  // settings the node sends with as far as we know, sf 0 until it reported them
+  uint8_t sf;
+  int8_t power;
+  // last assignment, sf 0 before the first one
+  uint8_t assignedSf;
+  int8_t assignedPower;
+
+  // lowest SNR the SX127x/SX126x demodulate at a spreading factor
+  static float requiredSnr(uint8_t sf)
+  {
+    return -5.0f - 2.5f * (sf - 6);
+  }
+
+  // link budget of a setting relative to the others, higher is more robust
+  static float budget(uint8_t sf, int8_t powerDbm)
+  {
+    return powerDbm - requiredSnr(sf);
+  }
+
+  // settings from a frame's link settings extension
+  void report(uint8_t reportedSf, int8_t reportedPower)
+  {
+    if (assignedSf != 0 && budget(reportedSf, reportedPower) > budget(assignedSf, assignedPower))
+    {
+      count = 0;
+      next = 0;
+    }
+    sf = reportedSf;
+    power = reportedPower;
+  }
+
+  // false if the sample was dropped because the node's settings are unknown
+  bool addFrame(float snr)
+  {
+    if (sf == 0)
+    {
+      return false;
+    }
+    gain[next] = (int16_t)lroundf((snr - power) * 4);
+    next = (next + 1) % HISTORY;
+    if (count < HISTORY)
+    {
+      count++;
+    }
+    return true;
+  }
+
+  // Lowest SF in [minSf, maxSf], then the lowest power, that keeps the margin.
+  // Until the history is full the settings only ever get more robust than the
+  // node's current ones, a single good frame is no reason to go down. Returns
+  // true if the node should switch to newSf / newPower.
+  bool assign(uint8_t minSf, uint8_t maxSf, uint8_t &newSf, int8_t &newPower)
+  {
+    if (count == 0)
+    {
+      return false;
+    }
+    int16_t best = gain[0];
+    for (uint8_t i = 1; i < count; i++)
+    {
+      if (gain[i] > best)
+      {
+        best = gain[i];
+      }
+    }
+
+    uint8_t wantSf = maxSf;
+    int8_t wantPower = MAX_POWER_DBM;
+    for (uint8_t candidate = minSf; candidate <= maxSf; candidate++)
+    {
+      const int needed = (int)ceilf(requiredSnr(candidate) + MARGIN_DB - best / 4.0f);
+      if (needed <= MAX_POWER_DBM)
+      {
+        wantSf = candidate;
+        wantPower = needed < MIN_POWER_DBM ? MIN_POWER_DBM : (int8_t)needed;
+        break;
+      }
+    }
+
+    newSf = sf;
+    newPower = power;
+    if (count >= HISTORY || budget(wantSf, wantPower) > budget(sf, power))
+    {
+      newSf = wantSf;
+      newPower = wantPower;
+    }
+    assignedSf = newSf;
+    assignedPower = newPower;
+    return newSf != sf || newPower != power;
+  }
+};
@@ -0,0 +1,27 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+// Time on air in us of a LoRa frame with explicit header and CRC, SX1261/2
+// datasheet section 6.1.4, the same for the gateway's SX1276. Integer math,
+// exact for the bandwidths RadioLib offers: a symbol is 2^sf / bw.
+inline uint32_t loraAirtimeUs(uint8_t sf, uint32_t bwHz, uint8_t cr, uint16_t preambleLength, size_t payloadLength)
+{
+  // low data rate optimisation is mandatory for symbols of 16 ms and more,
+  // RadioLib switches it on at the same point
+  const bool ldro = ((uint64_t)1000000 << sf) >= (uint64_t)16000 * bwHz;
+  // in quarter symbols, the preamble is followed by 4.25 symbols of sync word
+  uint32_t quarterSymbols = 4 * (uint32_t)preambleLength + 17;
+  int32_t bits = 8 * (int32_t)payloadLength - 4 * sf + 28 + 16;
+  int32_t bitsPerBlock = 4 * (sf - (ldro ? 2 : 0));
+  if (sf <= 6)
+  {
+    // SF5/SF6 carry two extra preamble symbols and drop the 8 bit header offset
+    quarterSymbols += 8;
+    bits -= 8;
+    bitsPerBlock = 4 * sf;
+  }
+  const uint32_t blocks = bits > 0 ? (uint32_t)((bits + bitsPerBlock - 1) / bitsPerBlock) : 0;
+  quarterSymbols += 4 * (8 + blocks * cr);
+  return (uint32_t)((((uint64_t)quarterSymbols << sf) * 1000000 + 2 * bwHz) / (4 * (uint64_t)bwHz));
+}
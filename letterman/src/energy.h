@@ -0,0 +1,177 @@
+#pragma once
+#include <stdint.h>
+
+// Per-wake energy accounting. The firmware switches the ledger to the phase it
+// is about to spend time in, the ledger adds up the time per phase and turns
+// it into charge with the board current model below.
+
+enum EnergyPhase : uint8_t
+{
+  PHASE_DEEP_SLEEP,
+  // ROM and bootloader, before any of our code runs
+  PHASE_BOOT,
+  PHASE_RADIO_INIT,
+  PHASE_TX,
+  // listening for the ACK or for channel activity before a transmission
+  PHASE_RX,
+  // retry and listen before talk backoff, radio in standby
+  PHASE_WAIT,
+  // waiting for the UART to drain before sleeping
+  PHASE_LOG,
+  PHASE_LIGHT_SLEEP,
+  // everything else with the CPU running
+  PHASE_ACTIVE,
+  PHASE_COUNT,
+};
+
+enum EnergyWakeCause : uint8_t
+{
+  WAKE_POWER_ON,
+  WAKE_DOOR,
+  WAKE_VIBRATION,
+  WAKE_MOTION,
+  WAKE_TIMER,
+};
+
+// Supply current per phase in uA. Both supported boards pair an ESP32-S3 with
+// an SX1262; the values are the same datasheet typicals as the simulator's
+// SimPowerModel, TX at the RadioLib default of 10 dBm.
+static const uint32_t ENERGY_PHASE_UA[PHASE_COUNT] = {
+    // deep sleep, radio in warm sleep, ULP input filter
+    28,
+    // boot
+    40000,
+    // radio init, radio in standby
+    40600,
+    // TX at 10 dBm, energyPhaseUa() has the other power levels
+    66000,
+    // RX
+    44600,
+    // wait
+    40600,
+    // log
+    40000,
+    // light sleep, radio in warm sleep
+    241,
+    // active, radio mostly in standby
+    40600,
+};
+
+// SX1262 TX current by output power with RadioLib's PA settings, the CPU
+// waiting on it comes on top. Linear in between.
+static const int8_t ENERGY_TX_DBM[] = {2, 10, 14, 17, 20, 22};
+static const uint32_t ENERGY_TX_RADIO_UA[] = {18000, 26000, 45000, 58000, 84000, 118000};
+#define ENERGY_TX_CPU_UA 40000
+
+inline uint32_t energyPhaseUa(uint8_t phase, int8_t txPowerDbm)
+{
+  if (phase != PHASE_TX)
+  {
+    return ENERGY_PHASE_UA[phase];
+  }
+  const uint8_t points = sizeof(ENERGY_TX_DBM) / sizeof(ENERGY_TX_DBM[0]);
+  if (txPowerDbm <= ENERGY_TX_DBM[0])
+  {
+    return ENERGY_TX_CPU_UA + ENERGY_TX_RADIO_UA[0];
+  }
+  for (uint8_t i = 1; i < points; i++)
+  {
+    if (txPowerDbm <= ENERGY_TX_DBM[i])
+    {
+      const int32_t span = ENERGY_TX_RADIO_UA[i] - ENERGY_TX_RADIO_UA[i - 1];
+      return ENERGY_TX_CPU_UA + ENERGY_TX_RADIO_UA[i - 1] +
+             span * (txPowerDbm - ENERGY_TX_DBM[i - 1]) / (ENERGY_TX_DBM[i] - ENERGY_TX_DBM[i - 1]);
+    }
+  }
+  return ENERGY_TX_CPU_UA + ENERGY_TX_RADIO_UA[points - 1];
+}
+
+// ROM and bootloader after a deep sleep wakeup, the firmware cannot measure it
+#define ENERGY_BOOT_US 150000
+
+inline const char *energyPhaseName(uint8_t phase)
+{
+  static const char *const names[PHASE_COUNT] = {"deep-sleep", "boot", "radio-init", "tx", "rx", "wait", "log", "light-sleep", "active"};
+  return phase < PHASE_COUNT ? names[phase] : "unknown";
+}
+
+inline const char *energyWakeCauseName(uint8_t cause)
+{
+  static const char *const names[] = {"power-on", "door", "vibration", "motion", "timer"};
+  return cause <= WAKE_TIMER ? names[cause] : "unknown";
+}
+
+// charge of the given time per phase in nAh: uA * us = pC, 1 nAh = 3.6e6 pC
+inline uint64_t energyChargeNah(const uint64_t phaseUs[PHASE_COUNT], int8_t txPowerDbm)
+{
+  uint64_t pc = 0;
+  for (uint8_t phase = 0; phase < PHASE_COUNT; phase++)
+  {
+    pc += phaseUs[phase] * energyPhaseUa(phase, txPowerDbm);
+  }
+  return pc / 3600000;
+}
+
+// Kept in RTC memory. A wake record runs from one boot to the next, so it
+// covers the awake phases plus the deep sleep that followed them.
+struct EnergyLedger
+{
+  // time per phase of the current wake record
+  uint64_t phaseUs[PHASE_COUNT];
+  // time per phase since power on, completed records only
+  uint64_t totalUs[PHASE_COUNT];
+  uint64_t phaseSinceUs;
+  // total time at the last summary uplink
+  uint64_t reportedAtUs;
+  uint32_t wakes;
+  // TX power of the last transmission, the gateway rarely changes it
+  int8_t txPower;
+  uint8_t phase;
+  uint8_t cause;
+  bool valid;
+
+  // power on, nowUs is the time the app started
+  void reset(uint64_t nowUs)
+  {
+    *this = EnergyLedger();
+    phase = PHASE_BOOT;
+    phaseSinceUs = nowUs > ENERGY_BOOT_US ? nowUs - ENERGY_BOOT_US : 0;
+    cause = WAKE_POWER_ON;
+    valid = true;
+  }
+
+  void enter(EnergyPhase next, uint64_t nowUs)
+  {
+    phaseUs[phase] += nowUs - phaseSinceUs;
+    phaseSinceUs = nowUs;
+    phase = next;
+  }
+
+  // deep sleep wakeup, nowUs is the time the app started. The deep sleep ended
+  // when the ROM started booting, which completes the running record.
+  void endSleep(uint64_t nowUs)
+  {
+    enter(PHASE_BOOT, nowUs - ENERGY_BOOT_US);
+  }
+
+  // moves the completed record into the totals, the boot starts the next one
+  void startRecord()
+  {
+    for (uint8_t i = 0; i < PHASE_COUNT; i++)
+    {
+      totalUs[i] += phaseUs[i];
+      phaseUs[i] = 0;
+    }
+    wakes++;
+  }
+
+  uint64_t totalTimeUs() const
+  {
+    uint64_t us = 0;
+    for (uint8_t i = 0; i < PHASE_COUNT; i++)
+    {
+      us += totalUs[i];
+    }
+    return us;
+  }
+};
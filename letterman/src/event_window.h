@@ -0,0 +1,149 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include "channels.h"
+#include "frame_codec.h"
+
+// Burst aggregation. A mail delivery fires the flap's vibration sensor and
+// the PIR a few times within seconds; instead of a message per change the
+// first edge opens a window, every further edge and every input still high
+// keeps it open for another quietMs, up to maxMs after the first one, and a
+// single message goes out when it closes. Until that message is sent the
+// window keeps count of which inputs went high, how often and when first, the
+// EXT_EVENTS summary (frame_codec.h). In RAM: a window never spans a deep sleep.
+// a burst is over once no input changed for EVENT_WINDOW_QUIET_MS, and at the
+// latest EVENT_WINDOW_MAX_MS after its first edge
+#define EVENT_WINDOW_QUIET_MS 2000
+#define EVENT_WINDOW_MAX_MS 8000
+
+class EventWindow
+{
+public:
+  // channel set plus a count and an offset per channel
+  static constexpr size_t MAX_LENGTH = 1 + 2 * CHANNEL_COUNT;
+
+  EventWindow(uint32_t quietMs, uint32_t maxMs) : m_quietMs(quietMs), m_maxMs(maxMs)
+  {
+    clear();
+  }
+
+  // the summary went out with a message
+  void clear()
+  {
+    m_open = false;
+    m_started = false;
+    m_channels = 0;
+    for (uint8_t channel = 0; channel < CHANNEL_COUNT; channel++)
+    {
+      m_counts[channel] = 0;
+      m_firstTicks[channel] = 0;
+    }
+  }
+
+  // inputs changed level at nowMs, `rising` are the ones that went high
+  void edge(uint32_t nowMs, uint8_t rising)
+  {
+    if (!m_started)
+    {
+      m_started = true;
+      m_startedAt = nowMs;
+    }
+    m_open = true;
+    m_lastEdgeAt = nowMs;
+    const uint32_t ticks = (nowMs - m_startedAt) / FRAME_EVENT_TICK_MS;
+    for (uint8_t channel = 0; channel < CHANNEL_COUNT; channel++)
+    {
+      if ((rising & channelBit(channel)) == 0)
+      {
+        continue;
+      }
+      if ((m_channels & channelBit(channel)) == 0)
+      {
+        m_channels |= channelBit(channel);
+        m_firstTicks[channel] = (uint8_t)(ticks < 255 ? ticks : 255);
+      }
+      if (m_counts[channel] < 255)
+      {
+        m_counts[channel]++;
+      }
+    }
+  }
+
+  // an input is still high, the burst is not over yet
+  void hold(uint32_t nowMs)
+  {
+    if (m_open)
+    {
+      m_lastEdgeAt = nowMs;
+    }
+  }
+
+  // ends the burst early, the message goes out now
+  void close()
+  {
+    m_open = false;
+  }
+
+  // time until the window closes, 0 if it is not open
+  uint32_t closesInMs(uint32_t nowMs)
+  {
+    if (!m_open)
+    {
+      return 0;
+    }
+    if (nowMs - m_lastEdgeAt >= m_quietMs || nowMs - m_startedAt >= m_maxMs)
+    {
+      m_open = false;
+      return 0;
+    }
+    const uint32_t quietLeft = m_quietMs - (nowMs - m_lastEdgeAt);
+    const uint32_t maxLeft = m_maxMs - (nowMs - m_startedAt);
+    return quietLeft < maxLeft ? quietLeft : maxLeft;
+  }
+
+  // times an input went high since the last clear()
+  uint8_t count(uint8_t channel) const
+  {
+    return m_counts[channel];
+  }
+
+  // channel set of the inputs that went high since the last clear()
+  uint8_t channels() const
+  {
+    return m_channels;
+  }
+
+  // EXT_EVENTS value, 0 if no input went high
+  size_t write(uint8_t *value) const
+  {
+    if (m_channels == 0)
+    {
+      return 0;
+    }
+    size_t length = 0;
+    value[length++] = m_channels;
+    for (uint8_t channel = 0; channel < CHANNEL_COUNT; channel++)
+    {
+      if (m_channels & channelBit(channel))
+      {
+        value[length++] = m_counts[channel];
+        value[length++] = m_firstTicks[channel];
+      }
+    }
+    return length;
+  }
+
+private:
+  uint32_t m_quietMs;
+  uint32_t m_maxMs;
+  bool m_open;
+  // the first edge since the last clear(), the offsets count from it
+  bool m_started;
+  uint32_t m_startedAt;
+  uint32_t m_lastEdgeAt;
+  uint8_t m_channels;
+  uint8_t m_counts[CHANNEL_COUNT];
+  uint8_t m_firstTicks[CHANNEL_COUNT];
+};
+
+static_assert(EventWindow::MAX_LENGTH <= FRAME_EXTENSION_MAX_LENGTH, "the summary is one extension");
@@ -0,0 +1,214 @@
+#pragma once
+#include <stdint.h>
+#include "fuota.h"
+#include "firmware_delta.h"
+
+// Download of a firmware update (fuota.h) on the node. The fragments go into
+// the update storage partition as they arrive, this keeps track of the window
+// being pulled and lives in RTC memory, so a download goes on across deep
+// sleeps; a power on starts over.
+enum UpdateState : uint8_t
+{
+  UPDATE_IDLE,
+  UPDATE_RECEIVING,
+  // all fragments are in storage, the delta is applied next
+  UPDATE_COMPLETE,
+};
+
+// requests in a row the gateway acknowledged without sending anything, then
+// the download is given up: the gateway lost the update or has another one
+#define UPDATE_MAX_UNANSWERED 24
+
+struct FirmwareUpdate
+{
+  UpdateState state;
+  FuotaOffer offer;
+  // first fragment of the window being pulled and its data fragments that
+  // are in storage, bit i for windowStart + i
+  uint16_t windowStart;
+  uint16_t windowReceived;
+  uint8_t unanswered;
+  // rtc us of the last message with a request
+  uint64_t pulledAtUs;
+  // an offer to decline with the next message, 0 if none
+  uint32_t declineTarget;
+  // rolled back from or failed to apply, offers of it are declined
+  uint32_t rejectedTarget;
+  // for the log: windows pulled, fragments received and recovered from parity
+  uint16_t windows;
+  uint16_t fragments;
+  uint16_t recovered;
+
+  // power on, no download
+  void reset()
+  {
+    *this = FirmwareUpdate();
+  }
+
+  // An offer from an ACK. True if it starts a download, the storage has to be
+  // erased for it; an offer the node cannot take is declined, every offer if
+  // it has no update key to check the delta with.
+  bool start(const FuotaOffer &update, uint32_t runningBuild, uint32_t storageLength, bool keyed)
+  {
+    if (state != UPDATE_IDLE && update.targetBuild == offer.targetBuild)
+    {
+      return false;
+    }
+    if (!keyed || update.baseBuild != runningBuild || update.targetBuild == rejectedTarget ||
+        update.length <= DELTA_HEADER_LENGTH + DELTA_SIGNATURE_LENGTH || update.length > storageLength)
+    {
+      declineTarget = update.targetBuild;
+      return false;
+    }
+    state = UPDATE_RECEIVING;
+    offer = update;
+    windowStart = 0;
+    windowReceived = 0;
+    unanswered = 0;
+    windows = 0;
+    fragments = 0;
+    recovered = 0;
+    return true;
+  }
+
+  // the next message carries EXT_UPDATE_REQUEST
+  bool requesting() const
+  {
+    return state == UPDATE_RECEIVING || declineTarget != 0;
+  }
+
+  FuotaRequest request() const
+  {
+    if (state != UPDATE_RECEIVING)
+    {
+      return {declineTarget, 0, 0};
+    }
+    return {offer.targetBuild, windowStart, missing()};
+  }
+
+  // a download that has not pulled for pullIntervalUs sends a message for it
+  bool pullDue(uint64_t nowUs, uint64_t pullIntervalUs) const
+  {
+    return state == UPDATE_RECEIVING && nowUs - pulledAtUs >= pullIntervalUs;
+  }
+
+  // the gateway acknowledged the request, granting the fragments in the mask
+  void requestAcknowledged(uint16_t granted)
+  {
+    declineTarget = 0;
+    if (state != UPDATE_RECEIVING)
+    {
+      return;
+    }
+    unanswered = granted != 0 ? 0 : unanswered + 1;
+    if (unanswered >= UPDATE_MAX_UNANSWERED)
+    {
+      state = UPDATE_IDLE;
+    }
+  }
+
+  // data fragments of the window not in storage yet
+  uint16_t missing() const
+  {
+    return fuotaWindowMask(offer.length, windowStart) & ~windowReceived;
+  }
+
+  bool needs(uint16_t fragment) const
+  {
+    return state == UPDATE_RECEIVING && fragment >= windowStart && fragment < windowStart + FUOTA_WINDOW_FRAGMENTS &&
+           ((missing() >> (fragment - windowStart)) & 1) != 0;
+  }
+
+  void take(uint16_t fragment)
+  {
+    windowReceived |= (uint16_t)(1U << (fragment - windowStart));
+    fragments++;
+  }
+
+  // after a receive window, moves on if the window is complete
+  void advance()
+  {
+    if (state != UPDATE_RECEIVING || missing() != 0)
+    {
+      return;
+    }
+    windows++;
+    windowStart += FUOTA_WINDOW_FRAGMENTS;
+    windowReceived = 0;
+    if (windowStart >= fuotaFragmentCount(offer.length))
+    {
+      state = UPDATE_COMPLETE;
+    }
+  }
+
+  // the update failed, it is not taken again
+  void reject()
+  {
+    rejectedTarget = offer.targetBuild;
+    state = UPDATE_IDLE;
+  }
+};
+
+// the update key's public half from 64 hex digits
+inline bool updateKeyFromHex(const char *hex, uint8_t *key)
+{
+  for (size_t i = 0; i < 2 * Ed25519::KEY_LENGTH; i++)
+  {
+    const char c = hex[i];
+    const int digit = c >= '0' && c <= '9'   ? c - '0'
+                      : c >= 'a' && c <= 'f' ? c - 'a' + 10
+                      : c >= 'A' && c <= 'F' ? c - 'A' + 10
+                                             : -1;
+    if (digit < 0)
+    {
+      return false;
+    }
+    key[i / 2] = (uint8_t)(i % 2 == 0 ? digit << 4 : key[i / 2] | digit);
+  }
+  return hex[2 * Ed25519::KEY_LENGTH] == '\0';
+}
+
+// First sector of the update storage, the delta follows it. Written right
+// before the node restarts into a new build, so the next boot can tell it is
+// on probation: the new build counts its boots in `boots` and marks itself
+// `confirmed` once the gateway acknowledged one of its messages; after
+// UPDATE_MAX_BOOTS boots without that, or UPDATE_PROBATION_WAKES wakes in a
+// row whose messages got no ACK, it switches back to the base build. Flash
+// bits only ever go from 1 to 0 here, the record is updated without erasing
+// the sector.
+#define UPDATE_RECORD_MAGIC 0x3152554cUL
+#define UPDATE_STORAGE_DELTA_OFFSET 4096
+#define UPDATE_MAX_BOOTS 3
+#define UPDATE_PROBATION_WAKES 4
+
+struct UpdateRecord
+{
+  uint32_t magic;
+  uint32_t baseBuild;
+  uint32_t targetBuild;
+  // one bit cleared per boot of the target
+  uint32_t boots;
+  // 0 once confirmed
+  uint32_t confirmed;
+
+  bool valid() const
+  {
+    return magic == UPDATE_RECORD_MAGIC;
+  }
+
+  uint8_t bootCount() const
+  {
+    uint8_t count = 0;
+    for (uint32_t bits = ~boots; bits != 0; bits &= bits - 1)
+    {
+      count++;
+    }
+    return count;
+  }
+
+  // boots with the lowest bit that is still set cleared
+  uint32_t nextBoots() const
+  {
+    return boots & (boots - 1);
+  }
+};
@@ -0,0 +1,11 @@
+#pragma once
+// Compile-time hardware layer for the sensor firmware.
+// main.cpp only talks to the board through Hal::, which resolves to the real
+// ESP32 backend on target and to the virtual-clock simulation on the native env.
+#ifdef LETTERMAN_NATIVE
+#include "sim/sim_hal.h"
+using Hal = SimHal;
+#else
+#include "hal_esp32.h"
+using Hal = Esp32Hal;
+#endif
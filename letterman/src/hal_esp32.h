@@ -0,0 +1,271 @@
+#pragma once
+#include <Arduino.h>
+#include <SPI.h>
+#include <RadioLib.h>
+#include <sys/time.h>
+#include "esp_sleep.h"
+#include "esp_ota_ops.h"
+#include "esp_partition.h"
+#include "esp_idf_version.h"
+#include "driver/gpio.h"
+
+// automatically detect which board is being used
+#define RADIO_BOARD_AUTO
+
+// now include RadioBoards
+// this must be included AFTER RadioLib!
+#include <RadioBoards.h>
+
+#include "ulp_input_filter.h"
+#include "frame_codec.h"
+#include "firmware_update.h"
+
+// ESP32 backend of the hardware layer. Every call is a static inline forward,
+// so going through Hal:: costs nothing on target.
+struct Esp32Hal
+{
+  using Radio = ::Radio;
+
+  static Module *radioModule()
+  {
+    return new RadioModule();
+  }
+
+  // bytes 2..5 of the factory MAC, the vendor prefix would be the same on every board
+  static uint32_t nodeId()
+  {
+    return (uint32_t)(ESP.getEfuseMac() >> 16);
+  }
+
+  static long random(long min, long max)
+  {
+    return ::random(min, max);
+  }
+
+  static void pinMode(uint8_t pin, uint8_t mode)
+  {
+    ::pinMode(pin, mode);
+  }
+
+  static int digitalRead(uint8_t pin)
+  {
+    return ::digitalRead(pin);
+  }
+
+  static void digitalWrite(uint8_t pin, uint8_t value)
+  {
+    ::digitalWrite(pin, value);
+  }
+
+  static void delay(uint32_t ms)
+  {
+    ::delay(ms);
+  }
+
+  static uint32_t millis()
+  {
+    return ::millis();
+  }
+
+  static uint32_t micros()
+  {
+    return ::micros();
+  }
+
+  // keeps counting through deep sleep
+  static uint64_t rtcMicros()
+  {
+    struct timeval now;
+    gettimeofday(&now, nullptr);
+    return (uint64_t)now.tv_sec * 1000000 + now.tv_usec;
+  }
+
+  static esp_sleep_wakeup_cause_t wakeupCause()
+  {
+    return esp_sleep_get_wakeup_cause();
+  }
+
+  static uint64_t ext1WakeupStatus()
+  {
+    return esp_sleep_get_ext1_wakeup_status();
+  }
+
+  static esp_err_t enableExt1Wakeup(uint64_t mask, esp_sleep_ext1_wakeup_mode_t mode)
+  {
+    return esp_sleep_enable_ext1_wakeup(mask, mode);
+  }
+
+  static void disableWakeupSources()
+  {
+    esp_sleep_disable_wakeup_source(ESP_SLEEP_WAKEUP_ALL);
+  }
+
+  static esp_err_t enableTimerWakeup(uint64_t us)
+  {
+    return esp_sleep_enable_timer_wakeup(us);
+  }
+
+  // light sleep only, fires while the pin is at the given level
+  static esp_err_t enableGpioWakeup(uint8_t pin, bool level)
+  {
+    gpio_wakeup_enable((gpio_num_t)pin, level ? GPIO_INTR_HIGH_LEVEL : GPIO_INTR_LOW_LEVEL);
+    return esp_sleep_enable_gpio_wakeup();
+  }
+
+  static void disableGpioWakeup(uint8_t pin)
+  {
+    gpio_wakeup_disable((gpio_num_t)pin);
+  }
+
+  static esp_sleep_wakeup_cause_t lightSleepStart()
+  {
+    esp_light_sleep_start();
+    return esp_sleep_get_wakeup_cause();
+  }
+
+  static bool startInputFilter(const InputFilterConfig &config)
+  {
+    return UlpInputFilter::start(config);
+  }
+
+  static void stopInputFilter(const InputFilterConfig &config)
+  {
+    UlpInputFilter::stop(config);
+  }
+
+  static uint8_t inputFilterWakeReason()
+  {
+    return UlpInputFilter::wakeReason();
+  }
+
+  static void takeInputFilterCounts(uint16_t &vibrationPulses, uint16_t &motionPulses)
+  {
+    UlpInputFilter::takeCounts(vibrationPulses, motionPulses);
+  }
+
+  [[noreturn]] static void deepSleepStart()
+  {
+    esp_deep_sleep_start();
+  }
+
+  // --- firmware update (firmware_update.h), the delta is kept in the data
+  // partition the default partition tables have for SPIFFS ---
+
+  // first 4 bytes of the ELF SHA-256 of the running build, what
+  // firmwareImageBuildId() reads from its .bin
+  static uint32_t firmwareBuildId()
+  {
+#if ESP_IDF_VERSION_MAJOR >= 5
+    const esp_app_desc_t *app = esp_app_get_description();
+#else
+    const esp_app_desc_t *app = esp_ota_get_app_description();
+#endif
+    return frameGetLe32(app->app_elf_sha256);
+  }
+
+  // public half of the key updates are signed with, LETTERMAN_UPDATE_KEY in
+  // 64 hex digits from `program keygen`; a build without it takes no updates
+  static bool updateKey(uint8_t *key)
+  {
+#ifdef LETTERMAN_UPDATE_KEY
+    return updateKeyFromHex(LETTERMAN_UPDATE_KEY, key);
+#else
+    (void)key;
+    return false;
+#endif
+  }
+
+  static uint32_t updateStorageSize()
+  {
+    const esp_partition_t *partition = updateStorage();
+    return partition != nullptr ? partition->size : 0;
+  }
+
+  // whole sectors from offset on
+  static bool updateStorageErase(uint32_t offset, uint32_t length)
+  {
+    const esp_partition_t *partition = updateStorage();
+    length = (length + SPI_FLASH_SEC_SIZE - 1) / SPI_FLASH_SEC_SIZE * SPI_FLASH_SEC_SIZE;
+    return partition != nullptr && esp_partition_erase_range(partition, offset, length) == ESP_OK;
+  }
+
+  static bool updateStorageWrite(uint32_t offset, const void *data, size_t length)
+  {
+    const esp_partition_t *partition = updateStorage();
+    return partition != nullptr && esp_partition_write(partition, offset, data, length) == ESP_OK;
+  }
+
+  static bool updateStorageRead(uint32_t offset, void *data, size_t length)
+  {
+    const esp_partition_t *partition = updateStorage();
+    return partition != nullptr && esp_partition_read(partition, offset, data, length) == ESP_OK;
+  }
+
+  // the image of the running build, the base of a delta
+  static bool firmwareRead(uint32_t offset, uint8_t *data, size_t length)
+  {
+    const esp_partition_t *running = esp_ota_get_running_partition();
+    return offset + length <= running->size && esp_partition_read(running, offset, data, length) == ESP_OK;
+  }
+
+  // a new build goes to the OTA slot we are not running from
+  static bool firmwareBegin(uint32_t length)
+  {
+    const esp_partition_t *partition = esp_ota_get_next_update_partition(nullptr);
+    return partition != nullptr && esp_ota_begin(partition, length, &otaHandle()) == ESP_OK;
+  }
+
+  static bool firmwareWrite(const uint8_t *data, size_t length)
+  {
+    return esp_ota_write(otaHandle(), data, length) == ESP_OK;
+  }
+
+  // checks the image and boots it with the next restart
+  static bool firmwareFinish()
+  {
+    return esp_ota_end(otaHandle()) == ESP_OK &&
+           esp_ota_set_boot_partition(esp_ota_get_next_update_partition(nullptr)) == ESP_OK;
+  }
+
+  static void firmwareAbort()
+  {
+    esp_ota_abort(otaHandle());
+  }
+
+  // tells a bootloader with app rollback the build is good, a no-op for others
+  static void firmwareConfirm()
+  {
+    esp_ota_mark_app_valid_cancel_rollback();
+  }
+
+  // boots the other slot, the build we came from, with the next restart
+  static bool firmwareBootPrevious()
+  {
+    const esp_partition_t *previous = esp_ota_get_next_update_partition(nullptr);
+    return previous != nullptr && esp_ota_set_boot_partition(previous) == ESP_OK;
+  }
+
+  [[noreturn]] static void restart()
+  {
+    esp_restart();
+  }
+
+private:
+  static const esp_partition_t *updateStorage()
+  {
+    return esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_SPIFFS, nullptr);
+  }
+
+  static esp_ota_handle_t &otaHandle()
+  {
+    static esp_ota_handle_t handle = 0;
+    return handle;
+  }
+};
+
+// Arduino marks a new build good at boot unless this says the firmware does it
+// itself: firmwareConfirm() once the gateway acknowledged one of its messages.
+extern "C" bool verifyRollbackLater()
+{
+  return true;
+}
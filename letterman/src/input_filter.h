@@ -0,0 +1,95 @@
+#pragma once
+#include <stdint.h>
+
+// Deep sleep filter for the chattering vibration and motion inputs. On target
+// it runs as a ULP program (ulp_input_filter.h) that samples both pins every
+// samplePeriodUs and only wakes the CPU for a qualified event:
+//   vibration: at least vibrationMinPulses rising edges within one window of
+//              vibrationWindowSamples samples
+//   motion:    high for motionMinSamples samples in a row
+// Every pulse is counted either way, the counts go out with the next frame.
+
+#define INPUT_FILTER_VIBRATION 0x1
+#define INPUT_FILTER_MOTION 0x2
+
+struct InputFilterConfig
+{
+  uint8_t vibrationPin;
+  uint8_t motionPin;
+  // INPUT_FILTER_* bits of the inputs to sample, a stuck input is left out
+  uint8_t enabled;
+  uint32_t samplePeriodUs;
+  uint16_t vibrationMinPulses;
+  uint16_t vibrationWindowSamples;
+  uint16_t motionMinSamples;
+};
+
+// Reference model of the ULP program, step for step and with the same 16 bit
+// arithmetic. The simulation runs it, keep both in sync.
+struct InputFilter
+{
+  InputFilterConfig config;
+  uint16_t vibrationLevel;
+  uint16_t vibrationEdges;
+  uint16_t windowLeft;
+  uint16_t motionRun;
+  // pulses since the counts were last taken
+  uint16_t vibrationPulses;
+  uint16_t motionPulses;
+
+  // state the main CPU sets up before deep sleep, the counts are kept
+  void begin(const InputFilterConfig &filterConfig)
+  {
+    config = filterConfig;
+    // a vibration input that is high already is not a new pulse
+    vibrationLevel = 1;
+    vibrationEdges = 0;
+    windowLeft = config.vibrationWindowSamples;
+    motionRun = 0;
+  }
+
+  // one ULP run, returns the INPUT_FILTER_* bit of a qualified input or 0
+  uint8_t sample(bool vibration, bool motion)
+  {
+    if (config.enabled & INPUT_FILTER_VIBRATION)
+    {
+      const uint16_t previous = vibrationLevel;
+      vibrationLevel = vibration;
+      if (previous == 0 && vibration)
+      {
+        vibrationPulses++;
+        vibrationEdges++;
+        if (vibrationEdges >= config.vibrationMinPulses)
+        {
+          return INPUT_FILTER_VIBRATION;
+        }
+      }
+      windowLeft--;
+      if (windowLeft == 0)
+      {
+        vibrationEdges = 0;
+        windowLeft = config.vibrationWindowSamples;
+      }
+    }
+
+    if (config.enabled & INPUT_FILTER_MOTION)
+    {
+      if (motion)
+      {
+        motionRun++;
+        if (motionRun >= config.motionMinSamples)
+        {
+          motionPulses++;
+          return INPUT_FILTER_MOTION;
+        }
+      }
+      else if (motionRun != 0)
+      {
+        // pulse too short to wake for
+        motionPulses++;
+        motionRun = 0;
+      }
+    }
+    return 0;
+  }
+};
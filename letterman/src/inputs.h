@@ -0,0 +1,118 @@
+#pragma once
+#include <stdint.h>
+
+#include "platform.h"
+#include "channels.h"
+#include "energy.h"
+#include "input_filter.h"
+
+// The sensor's side of the channel schema (channels.h): the pin of every input
+// channel, the INPUT_FILTER_* bit of the inputs the ULP filter samples in deep
+// sleep instead of ext1, and the wake cause the energy ledger books a wake by
+// it under. Table order is the wake cause priority, the door comes first.
+//
+// The wake mask, the status bits and the reading of the pins are generated
+// from here, main.cpp keeps the inputs as a channel set.
+
+struct SensorInput
+{
+  uint8_t channel;
+  uint8_t pin;
+  uint8_t filter;
+  EnergyWakeCause wakeCause;
+};
+
+constexpr SensorInput SENSOR_INPUTS[] = {
+    {CHANNEL_DOOR, INPUT_DOOR, 0, WAKE_DOOR},
+    {CHANNEL_MOTION, INPUT_MOTION, INPUT_FILTER_MOTION, WAKE_MOTION},
+    {CHANNEL_VIBRATION, INPUT_VIBRATION, INPUT_FILTER_VIBRATION, WAKE_VIBRATION},
+};
+
+constexpr uint8_t SENSOR_INPUT_COUNT = sizeof(SENSOR_INPUTS) / sizeof(SENSOR_INPUTS[0]);
+
+// GPIO mask of the inputs from `index` on whose channel is in the set
+constexpr uint64_t inputPinMaskFrom(uint8_t channels, uint8_t index)
+{
+  return index == SENSOR_INPUT_COUNT ? 0
+                                     : ((channels >> SENSOR_INPUTS[index].channel) & 1ULL) << SENSOR_INPUTS[index].pin |
+                                           inputPinMaskFrom(channels, index + 1);
+}
+
+constexpr uint64_t inputPinMask(uint8_t channels)
+{
+  return inputPinMaskFrom(channels, 0);
+}
+
+constexpr uint8_t filteredChannelsFrom(uint8_t index)
+{
+  return index == SENSOR_INPUT_COUNT ? 0
+                                     : (uint8_t)((SENSOR_INPUTS[index].filter ? channelBit(SENSOR_INPUTS[index].channel) : 0) |
+                                                 filteredChannelsFrom(index + 1));
+}
+
+constexpr uint8_t inputChannelsOf(uint8_t index)
+{
+  return index == SENSOR_INPUT_COUNT ? 0 : (uint8_t)(channelBit(SENSOR_INPUTS[index].channel) | inputChannelsOf(index + 1));
+}
+
+// every input can wake the CPU from deep sleep, through ext1 or the filter
+constexpr uint64_t WAKEUP_BITMASK = inputPinMask(CHANNEL_ALL);
+// the inputs the ULP filter takes over from ext1
+constexpr uint8_t FILTERED_CHANNELS = filteredChannelsFrom(0);
+
+static_assert(inputChannelsOf(0) == CHANNEL_INPUTS, "every input channel needs exactly one pin");
+
+// the pin of an input channel
+inline uint8_t inputPin(uint8_t channel)
+{
+  for (const SensorInput &input : SENSOR_INPUTS)
+  {
+    if (input.channel == channel)
+    {
+      return input.pin;
+    }
+  }
+  return 0;
+}
+
+// channel set of the inputs whose pin is in a GPIO mask
+inline uint8_t inputChannels(uint64_t pinMask)
+{
+  uint8_t channels = 0;
+  for (const SensorInput &input : SENSOR_INPUTS)
+  {
+    if (pinMask & (1ULL << input.pin))
+    {
+      channels |= channelBit(input.channel);
+    }
+  }
+  return channels;
+}
+
+// channel set of the inputs behind INPUT_FILTER_* bits
+inline uint8_t filterChannels(uint8_t filterBits)
+{
+  uint8_t channels = 0;
+  for (const SensorInput &input : SENSOR_INPUTS)
+  {
+    if (filterBits & input.filter)
+    {
+      channels |= channelBit(input.channel);
+    }
+  }
+  return channels;
+}
+
+// INPUT_FILTER_* bits of the filtered inputs in a channel set
+inline uint8_t filterBits(uint8_t channels)
+{
+  uint8_t bits = 0;
+  for (const SensorInput &input : SENSOR_INPUTS)
+  {
+    if (channels & channelBit(input.channel))
+    {
+      bits |= input.filter;
+    }
+  }
+  return bits;
+}
@@ -5,46 +5,314 @@
   https://jgromes.github.io/RadioLib/
 */
 
+#ifndef LETTERMAN_NATIVE
 #include <Arduino.h>
 #include <SPI.h>
 #include <Wire.h>
 #include <RadioLib.h>
-#include <ArduinoJson.h>
 #include "esp_log.h"
+#endif
 
 #include "platform.h"
+#include "hal.h"
+#include "energy.h"
+#include "frame_codec.h"
+#include "inputs.h"
+#include "duty_cycle.h"
+#include "event_window.h"
+#include "mail_inference.h"
+#include "firmware_update.h"
 
-// automatically detect which board is being used
-#define RADIO_BOARD_AUTO
 
-// now include RadioBoards
-// this must be included AFTER RadioLib!
-#include <RadioBoards.h>
+// While an input is high the CPU light sleeps until one of them changes level
+// or the keep-alive is due, and only transitions are sent.
+#define KEEPALIVE_INTERVAL_MS (5 * 60 * 1000UL)
+// an input high this long without any change is stuck (door left ajar) and no
+// longer keeps the CPU out of deep sleep
+#define INPUT_STUCK_MS (5 * 60 * 1000UL)
 
-
-#define WAKEUP_BITMASK (1 << INPUT_VIBRATION | 1 << INPUT_MOTION | 1 << INPUT_DOOR)
+// In deep sleep the vibration and motion inputs go through the ULP input filter
+// (input_filter.h) instead of ext1: a single SW420 pulse from a passing truck
+// or a PIR glitch no longer boots the CPU. Only the door wakes it directly.
+#define FILTER_SAMPLE_PERIOD_MS 10
+#define VIBRATION_MIN_PULSES 2
+#define VIBRATION_WINDOW_MS 2000
+#define MOTION_MIN_HIGH_MS 300
 RTC_DATA_ATTR int bootCount = 0;
+// where the energy of each wake goes, see energy.h
+RTC_DATA_ATTR EnergyLedger g_energy;
+// a summary of the ledger goes out with the first message after this much time
+#define ENERGY_REPORT_INTERVAL_S (24 * 3600UL)
+// copy of the wake record completed by this boot, until it is printed
+EnergyLedger g_previousRecord;
+bool g_previousRecordValid = false;
+// message counter, kept across deep sleep so the gateway can tell repeats and
+// lost frames apart. Retries of a message carry the same value.
+RTC_DATA_ATTR uint32_t g_msgCounter = 0;
+// drawn at power on and sent until the gateway acknowledged a message, it
+// tells the gateway the counter started over
+RTC_DATA_ATTR uint32_t g_bootId = 0;
+RTC_DATA_ATTR bool g_restartReported = false;
+// inputs that were stuck high when we went to deep sleep, ext1 leaves them out
+RTC_DATA_ATTR uint8_t g_stuckInputs = 0;
+// pulses the input filter counted, sent with the next frame and cleared by its ACK
+RTC_DATA_ATTR uint16_t g_vibrationPulses = 0;
+RTC_DATA_ATTR uint16_t g_motionPulses = 0;
 
 //SX1262 g_radio = new Module(LORA_CS, LORA_IRQ, LORA_RST, LORA_BUSY);
-Radio g_radio = new RadioModule();
-uint16_t g_msgCounter = 0;
-bool g_doorOpen = false;
-bool g_motionDetected = false;
-bool g_vibrationDetected = false;
-bool g_newMail = true;
+Hal::Radio g_radio = Hal::radioModule();
+
+// spreading factor the gateway listens on
+#define LORA_SF 9
+
+// LoRa settings, RadioLib defaults apart from the frequency, the gateway has to
+// match. SF and TX power are assigned by the gateway later on.
+struct RadioConfig
+{
+  float freq;
+  float bw;
+  uint8_t sf;
+  uint8_t cr;
+  uint8_t syncWord;
+  int8_t power;
+  uint16_t preambleLength;
+};
+
+// Warm start: before deep sleep the SX1262 goes to sleep with configuration
+// retention and the settings it was configured with are kept here. A deep sleep
+// wake then only re-syncs RadioLib's RAM copy of the settings instead of
+// resetting and recalibrating the chip in begin(). Anything else (power on,
+// reset, a failed restore) takes the cold path.
+RTC_DATA_ATTR RadioConfig g_radioConfig = {LORA_FREQ, 125.0, LORA_SF, 7, 0x12, 10, 8};
+RTC_DATA_ATTR bool g_radioWarm = false;
 
-bool g_wakeup_door = false;
-bool g_wakeup_motion = false;
-bool g_wakeup_vibration = false;
+// Link adaptation: the gateway's ACK carries the SF and TX power it wants the
+// node to use, worked out from the SNR of the last frames. They go into
+// g_radioConfig and stay there across deep sleep. After LINK_FALLBACK_MESSAGES
+// unacknowledged messages in a row the node returns to LORA_SF at full power
+// so it gets heard again. The gateway learns the settings from the frames,
+// they are sent after a change and every LINK_REPORT_INTERVAL messages.
+#define LINK_MIN_SF 7
+#define LINK_MAX_SF 12
+#define LINK_MIN_POWER 2
+// EU868 limit of 25 mW ERP
+#define LINK_MAX_POWER 14
+#define LINK_FALLBACK_MESSAGES 2
+#define LINK_REPORT_INTERVAL 16
+RTC_DATA_ATTR uint8_t g_unackedMessages = 0;
+// the gateway acknowledged a frame with the current settings
+RTC_DATA_ATTR bool g_linkReported = false;
+// the frame in flight carries the settings
+bool g_linkSettingsSent = false;
+// channel sets (channels.h) of the inputs that are high and of the ones that woke us
+uint8_t g_inputs = 0;
+uint8_t g_wakeInputs = 0;
 
 bool g_ledState = false;
 
+// inputs of the last message sent, when it was sent and when they last changed
+bool g_reported = false;
+uint8_t g_reportedInputs = 0;
+uint32_t g_reportedAt = 0;
+uint32_t g_inputsChangedAt = 0;
+// inputs the previous loop() saw
+uint8_t g_previousInputs = 0;
+
+// Uplink acknowledgement: after each transmission the radio listens for the
+// gateway's ACK ('l', 'a', node id, counter) for up to ACK_TIMEOUT_MS, which
+// covers the gateway turnaround and the ACK's own time on air. A message is
+// retried with a random backoff only when the ACK is missing.
+#define ACK_TIMEOUT_MS 300
+#define MAX_TX_ATTEMPTS 3
+#define RETRY_BACKOFF_MIN_MS 50
+#define RETRY_BACKOFF_MAX_MS 400
+
+// EU868 duty cycle (duty_cycle.h), 1 % of any hour. With less than
+// DUTY_CYCLE_RESERVE_PERCENT of the budget left only urgent messages (a door
+// change, the first one after power on) get retries, keep-alives and the
+// energy report are dropped and the other changes are merged: one message at
+// most every DUTY_CYCLE_SPACING times its airtime, with the inputs as they are
+// by then. A message the budget has no room for at all waits until it has.
+#define DUTY_CYCLE_PERMILLE 10
+#define DUTY_CYCLE_RESERVE_PERCENT 25
+// half the rate the duty cycle allows
+#define DUTY_CYCLE_SPACING 200
+RTC_DATA_ATTR DutyCycleBudget g_dutyCycle;
+constexpr uint8_t URGENT_INPUTS = channelBit(CHANNEL_DOOR);
+// a message is due but held back by the budget until this time, the CPU
+// stays out of deep sleep meanwhile
+bool g_reportHeld = false;
+uint32_t g_reportHeldUntil = 0;
+
+// Listen before talk: a CAD before every transmission. While it finds a
+// preamble the node backs off for a random time from a window that doubles
+// per CAD, after LBT_MAX_CADS busy ones the attempt is given up.
+#define LBT_MAX_CADS 4
+#define LBT_BACKOFF_MIN_MS 20
+#define LBT_BACKOFF_WINDOW_MS 100
+
+// Burst aggregation (event_window.h): an input wake or an input change opens
+// a window and the message waits until no input changed for
+// EVENT_WINDOW_QUIET_MS, at most EVENT_WINDOW_MAX_MS. It carries the inputs as
+// they are then and which of them went high meanwhile, how often and when.
+// A door change is urgent and ends the window right away.
+EventWindow g_events(EVENT_WINDOW_QUIET_MS, EVENT_WINDOW_MAX_MS);
+
+// Mail inference (mail_inference.h): a burst that is over is a delivery, an
+// emptying or noise. Deliveries and emptyings go out right away, noise is
+// only counted. The counts go out with the next message, or on their own
+// once the oldest of them is NOISE_SUMMARY_INTERVAL_S old.
+#define NOISE_SUMMARY_INTERVAL_S 3600UL
+RTC_DATA_ATTR MailInference g_mail;
+// a delivery or emptying waiting to go out
+MailEvent g_mailPending = MAIL_NONE;
+// pulses the input filter counted before the wake, beyond the edge the window
+// counted for the input that woke us
+uint16_t g_wakeFlapPulses = 0;
+uint16_t g_wakeMotionPulses = 0;
+// the door opened, closed or stood open while the burst lasted
+bool g_burstDoor = false;
+// the keep-alive timer woke us from deep sleep, wakeupCause() also reports
+// the light sleeps since
+bool g_keepAliveWake = false;
+
+// Firmware update over LoRa (fuota.h): the gateway offers a delta against the
+// running build in an ACK, the node pulls it a window at a time with its
+// messages, at least one every UPDATE_PULL_INTERVAL_S while the download runs,
+// and listens for the fragments right after the ACK. A complete delta is
+// patched into the other OTA slot and booted, the new build is on probation
+// until the gateway acknowledged one of its messages (UpdateRecord).
+#define UPDATE_PULL_INTERVAL_S 600UL
+RTC_DATA_ATTR FirmwareUpdate g_update;
+// the frame in flight carries a request
+bool g_updateRequested = false;
+// the running build was just installed and not confirmed yet, kept across
+// deep sleeps with the wakes in a row whose message got no ACK
+RTC_DATA_ATTR bool g_updateProbation = false;
+RTC_DATA_ATTR uint8_t g_probationMisses = 0;
+// a message of this wake went unacknowledged
+bool g_messageUnacked = false;
+// off the stack, it keeps a window of the new image
+DeltaDecoder g_deltaDecoder;
+
+volatile bool g_radioIrq = false;
+
+// Boot phase timestamps in us since app start, logged once the first message
+// is through so the log output does not delay it.
+#define BOOT_PHASES_MAX 8
+struct BootPhase
+{
+  const char *name;
+  uint32_t atUs;
+};
+BootPhase g_bootPhases[BOOT_PHASES_MAX];
+uint8_t g_bootPhaseCount = 0;
+bool g_bootPhasesLogged = false;
+
+#ifdef LETTERMAN_NATIVE
+// RAM does not survive deep sleep on target, the simulation has to clear it
+// explicitly before every simulated boot. Keep in sync with the globals above.
+void resetVolatileState()
+{
+  g_inputs = 0;
+  g_wakeInputs = 0;
+  g_ledState = false;
+  g_reported = false;
+  g_reportedInputs = 0;
+  g_reportedAt = 0;
+  g_inputsChangedAt = 0;
+  g_previousInputs = 0;
+  g_reportHeld = false;
+  g_reportHeldUntil = 0;
+  g_radioIrq = false;
+  g_bootPhaseCount = 0;
+  g_bootPhasesLogged = false;
+  g_previousRecordValid = false;
+  g_linkSettingsSent = false;
+  g_events.clear();
+  g_mailPending = MAIL_NONE;
+  g_wakeFlapPulses = 0;
+  g_wakeMotionPulses = 0;
+  g_burstDoor = false;
+  g_keepAliveWake = false;
+  g_updateRequested = false;
+  g_messageUnacked = false;
+  // the RadioLib object lives in RAM as well, the chip itself keeps its state
+  g_radio = Hal::radioModule();
+}
+#endif
+
+void energyPhase(EnergyPhase phase)
+{
+  g_energy.enter(phase, Hal::rtcMicros());
+}
+
+// One line per completed wake record, the input of the host battery estimator
+// (sim/battery_estimate.cpp):
+//   energy,<wake>,<cause>,<us per phase in EnergyPhase order>,<charge nAh>,<tx dBm>
+// Printed right before deep sleep, the log drain wait covers it.
+void printEnergyRecord()
+{
+  if (!g_previousRecordValid)
+  {
+    return;
+  }
+  g_previousRecordValid = false;
+  const EnergyLedger &record = g_previousRecord;
+  Serial.printf("energy,%u,%s", record.wakes, energyWakeCauseName(record.cause));
+  for (uint8_t phase = 0; phase < PHASE_COUNT; phase++)
+  {
+    Serial.printf(",%llu", (unsigned long long)record.phaseUs[phase]);
+  }
+  Serial.printf(",%llu,%d\n", (unsigned long long)energyChargeNah(record.phaseUs, record.txPower), record.txPower);
+}
+
+void markBootPhase(const char *name)
+{
+  if (g_bootPhasesLogged || g_bootPhaseCount >= BOOT_PHASES_MAX)
+  {
+    return;
+  }
+  g_bootPhases[g_bootPhaseCount].name = name;
+  g_bootPhases[g_bootPhaseCount].atUs = Hal::micros();
+  g_bootPhaseCount++;
+}
+
+void logBootPhases()
+{
+  if (g_bootPhasesLogged)
+  {
+    return;
+  }
+  g_bootPhasesLogged = true;
+  for (uint8_t i = 0; i < g_bootPhaseCount; i++)
+  {
+    log_i("Boot phase %-10s at %7u us (+%u us)", g_bootPhases[i].name, g_bootPhases[i].atUs,
+          g_bootPhases[i].atUs - (i > 0 ? g_bootPhases[i - 1].atUs : 0));
+  }
+}
+
+// inputs that are high are left out, like for ext1
+InputFilterConfig inputFilterConfig(uint8_t active)
+{
+  InputFilterConfig config;
+  config.vibrationPin = inputPin(CHANNEL_VIBRATION);
+  config.motionPin = inputPin(CHANNEL_MOTION);
+  config.enabled = filterBits(FILTERED_CHANNELS & ~active);
+  config.samplePeriodUs = FILTER_SAMPLE_PERIOD_MS * 1000;
+  config.vibrationMinPulses = VIBRATION_MIN_PULSES;
+  config.vibrationWindowSamples = VIBRATION_WINDOW_MS / FILTER_SAMPLE_PERIOD_MS;
+  config.motionMinSamples = MOTION_MIN_HIGH_MS / FILTER_SAMPLE_PERIOD_MS;
+  return config;
+}
+
 void initRadio()
 {
   // initialize SX1262 with default settings
 
   log_i("[SX1262] Initializing ... ");
-  int state = g_radio.begin(LORA_FREQ);
+  const RadioConfig &config = g_radioConfig;
+  int state = g_radio.begin(config.freq, config.bw, config.sf, config.cr, config.syncWord, config.power, config.preambleLength);
   // set to max power.
   //g_radio.setOutputPower(22);
   if (state == RADIOLIB_ERR_NONE)
@@ -59,6 +327,36 @@ void initRadio()
   }
 }
 
+// Wakes the SX1262 from warm sleep. Its registers survived, but RadioLib keeps
+// the modem settings in RAM as well and needs them for the packet parameters,
+// so they are written again. That is a few SPI commands, no reset and no
+// calibration. Returns false if the chip did not come back as configured.
+bool restoreRadio()
+{
+  const RadioConfig &config = g_radioConfig;
+  // control pins and SPI only
+  g_radio.getMod()->init();
+  // NSS going low wakes the chip
+  if (g_radio.standby() != RADIOLIB_ERR_NONE)
+  {
+    return false;
+  }
+  // fails with a wrong modem error if the chip lost its configuration
+  return g_radio.setBandwidth(config.bw) == RADIOLIB_ERR_NONE &&
+         g_radio.setSpreadingFactor(config.sf) == RADIOLIB_ERR_NONE &&
+         g_radio.setCodingRate(config.cr) == RADIOLIB_ERR_NONE &&
+         g_radio.setPreambleLength(config.preambleLength) == RADIOLIB_ERR_NONE &&
+         g_radio.setCRC(2) == RADIOLIB_ERR_NONE &&
+         g_radio.explicitHeader() == RADIOLIB_ERR_NONE &&
+         g_radio.invertIQ(false) == RADIOLIB_ERR_NONE;
+}
+
+// puts the radio into warm sleep so the next wake can take the fast path
+void sleepRadio()
+{
+  g_radioWarm = g_radio.sleep(true) == RADIOLIB_ERR_NONE;
+}
+
 /*
 Method to print the reason by which ESP32
 has been awaken from sleep
@@ -67,7 +365,7 @@ void print_wakeup_reason()
 {
   esp_sleep_wakeup_cause_t wakeup_reason;
 
-  wakeup_reason = esp_sleep_get_wakeup_cause();
+  wakeup_reason = Hal::wakeupCause();
 
   switch (wakeup_reason)
   {
@@ -97,39 +395,205 @@ Method to print the GPIO that triggered the wakeup
 */
 void detect_gpio_wakeup()
 {
-  uint64_t GPIO_reason = esp_sleep_get_ext1_wakeup_status();
+  g_wakeInputs = inputChannels(Hal::ext1WakeupStatus());
+  if (Hal::wakeupCause() == ESP_SLEEP_WAKEUP_ULP)
+  {
+    // the input filter qualified an event
+    g_wakeInputs = filterChannels(Hal::inputFilterWakeReason());
+  }
+  uint64_t GPIO_reason = inputPinMask(g_wakeInputs);
   Serial.print("GPIO that triggered the wake up: GPIO ");
   Serial.println((log(GPIO_reason)) / log(2), 0);
 
-  if (GPIO_reason & (1 << INPUT_DOOR))
+  for (const SensorInput &input : SENSOR_INPUTS)
+  {
+    if (g_wakeInputs & channelBit(input.channel))
+    {
+      log_i("%s was triggered", CHANNELS[input.channel].name);
+    }
+  }
+}
+
+EnergyWakeCause energyWakeCause()
+{
+  switch (Hal::wakeupCause())
+  {
+  case ESP_SLEEP_WAKEUP_UNDEFINED:
+    return WAKE_POWER_ON;
+  case ESP_SLEEP_WAKEUP_TIMER:
+    return WAKE_TIMER;
+  default:
+    break;
+  }
+  for (const SensorInput &input : SENSOR_INPUTS)
+  {
+    if (g_wakeInputs & channelBit(input.channel))
+    {
+      return input.wakeCause;
+    }
+  }
+  // only the filter wakes without a pin, and it watches vibration first
+  return WAKE_VIBRATION;
+}
+
+// channel set of the inputs that are high right now
+uint8_t readInputs()
+{
+  uint8_t channels = 0;
+  for (const SensorInput &input : SENSOR_INPUTS)
+  {
+    if (Hal::digitalRead(input.pin))
+    {
+      channels |= channelBit(input.channel);
+    }
+  }
+  return channels;
+}
+
+// One line per input edge with the RTC time in ms and the pulses it counts
+// for the mail inference, 1 for a rising edge and 0 for a falling one, the
+// filter's count for the edge of a wake:
+//   edge,<ms>,<channel id>,<level>,<pulses>
+// A serial log of them, with label lines added, is a recorded trace for the
+// mail inference bench (sim/mail_bench.cpp).
+void printEdge(uint8_t channel, bool level, uint16_t pulses)
+{
+  Serial.printf("edge,%llu,%s,%d,%u\n", (unsigned long long)(Hal::rtcMicros() / 1000), CHANNELS[channel].id, level, pulses);
+}
+
+// filter pulses of an input beyond the edge the window counts if it woke us
+uint16_t wakePulses(uint8_t channel, uint16_t counted)
+{
+  if ((g_wakeInputs & channelBit(channel)) == 0)
   {
-    g_wakeup_door = true;
-    log_i("Door was opened");
+    return counted;
   }
+  return counted > 1 ? counted - 1 : 0;
+}
+
+uint16_t extraWakePulses(uint8_t channel)
+{
+  return channel == CHANNEL_VIBRATION ? g_wakeFlapPulses : channel == CHANNEL_MOTION ? g_wakeMotionPulses : 0;
+}
 
-  if (GPIO_reason & (1 << INPUT_MOTION))
+// back to the build the update started from, returns only if that failed
+void rollBackUpdate()
+{
+  g_updateProbation = false;
+  if (!Hal::firmwareBootPrevious())
   {
-    g_wakeup_motion = true;
-    log_i("Motion was triggered");
+    log_e("Rolling back failed, staying on build %08x", Hal::firmwareBuildId());
+    return;
   }
+  Serial.flush();
+  Hal::restart();
+}
 
-  if (GPIO_reason & (1 << INPUT_VIBRATION))
+// After a restart: a new build on probation counts its boot and rolls back
+// after UPDATE_MAX_BOOTS of them, the base build learns its update failed.
+void checkUpdateRecord()
+{
+  g_updateProbation = false;
+  g_probationMisses = 0;
+  UpdateRecord record;
+  if (!Hal::updateStorageRead(0, &record, sizeof(record)) || !record.valid() || record.confirmed == 0)
+  {
+    return;
+  }
+  const uint32_t build = Hal::firmwareBuildId();
+  if (build == record.baseBuild)
   {
-    g_wakeup_vibration = true;
-    log_i("Vibration was triggered");
+    log_w("Update to build %08x was rolled back", record.targetBuild);
+    g_update.rejectedTarget = record.targetBuild;
+    return;
   }
+  if (build != record.targetBuild)
+  {
+    return;
+  }
+  if (record.bootCount() >= UPDATE_MAX_BOOTS)
+  {
+    log_e("Build %08x booted %u times without an ACK, rolling back", build, record.bootCount());
+    rollBackUpdate();
+    return;
+  }
+  record.boots = record.nextBoots();
+  Hal::updateStorageWrite(offsetof(UpdateRecord, boots), &record.boots, sizeof(record.boots));
+  g_updateProbation = true;
+  log_i("Build %08x on probation, boot %u", build, record.bootCount());
+}
+
+// the gateway acknowledged a message of the new build
+void confirmUpdate()
+{
+  g_updateProbation = false;
+  g_probationMisses = 0;
+  const uint32_t confirmed = 0;
+  Hal::updateStorageWrite(offsetof(UpdateRecord, confirmed), &confirmed, sizeof(confirmed));
+  Hal::firmwareConfirm();
+  log_i("Build %08x confirmed", Hal::firmwareBuildId());
 }
 
 void setup()
 {
+  markBootPhase("setup");
+  const uint64_t appStartUs = Hal::rtcMicros();
+  // the pins belong to the ULP until it is stopped
+  Hal::stopInputFilter(inputFilterConfig(0));
   Serial.begin(9600);
-  pinMode(LED, OUTPUT);
-  pinMode(INPUT_DOOR, INPUT);
-  pinMode(INPUT_MOTION, INPUT);
-  pinMode(INPUT_VIBRATION, INPUT);
-  digitalWrite(LED, g_ledState);
+  Hal::pinMode(LED, OUTPUT);
+  for (const SensorInput &input : SENSOR_INPUTS)
+  {
+    Hal::pinMode(input.pin, INPUT);
+  }
+  Hal::digitalWrite(LED, g_ledState);
   log_i("Sketch running!");
-  initRadio();
+  markBootPhase("pins");
+
+  // the boot completes the record of the previous wake and its deep sleep
+  if (Hal::wakeupCause() != ESP_SLEEP_WAKEUP_UNDEFINED && g_energy.valid)
+  {
+    g_energy.endSleep(appStartUs);
+    g_previousRecord = g_energy;
+    g_previousRecordValid = true;
+    g_energy.startRecord();
+  }
+  else
+  {
+    g_energy.reset(appStartUs);
+  }
+  g_energy.enter(PHASE_ACTIVE, appStartUs);
+
+  // only a deep sleep wake finds the radio the way we left it
+  bool warm = g_radioWarm && Hal::wakeupCause() != ESP_SLEEP_WAKEUP_UNDEFINED;
+  g_radioWarm = false;
+  if (Hal::wakeupCause() == ESP_SLEEP_WAKEUP_UNDEFINED)
+  {
+    // the gateway may have restarted too, tell it the settings again
+    g_linkReported = false;
+    g_bootId = (uint32_t)Hal::random(1, 0x7fffffff);
+    g_restartReported = false;
+    // RTC memory starts over, so does the clock the budget runs on
+    g_dutyCycle.reset(DUTY_CYCLE_PERMILLE);
+    g_mail.reset();
+    g_update.reset();
+    checkUpdateRecord();
+  }
+  energyPhase(PHASE_RADIO_INIT);
+  if (warm && restoreRadio())
+  {
+    markBootPhase("radio-warm");
+  }
+  else
+  {
+    if (warm)
+    {
+      log_w("Radio warm start failed, falling back to a full init");
+    }
+    initRadio();
+    markBootPhase("radio-cold");
+  }
+  energyPhase(PHASE_ACTIVE);
   // Increment boot number and print it every reboot
   ++bootCount;
   log_i("Boot number: %d", bootCount);
@@ -139,6 +603,24 @@ void setup()
 
   // Print the GPIO used to wake up
   detect_gpio_wakeup();
+  g_energy.cause = energyWakeCause();
+  g_keepAliveWake = g_energy.cause == WAKE_TIMER;
+
+  // the filter's RTC memory is undefined after power on
+  uint16_t vibrationPulses;
+  uint16_t motionPulses;
+  Hal::takeInputFilterCounts(vibrationPulses, motionPulses);
+  if (Hal::wakeupCause() != ESP_SLEEP_WAKEUP_UNDEFINED)
+  {
+    g_vibrationPulses += vibrationPulses;
+    g_motionPulses += motionPulses;
+    log_i("Filtered pulses: vibration %u, motion %u", vibrationPulses, motionPulses);
+  }
+  else
+  {
+    vibrationPulses = 0;
+    motionPulses = 0;
+  }
 
   /*
   First we configure the wake up source
@@ -159,41 +641,176 @@ void setup()
   //   Serial.println("Failed to configure ext0 with the given parameters");
   // }
   //  If you were to use ext1, you would use it like
-  if (esp_sleep_enable_ext1_wakeup(WAKEUP_BITMASK, ESP_EXT1_WAKEUP_ANY_HIGH) != ESP_OK)
+  // ext1 is armed in goToDeepSleep(), the mask depends on the inputs at that time
+
+  g_inputs = g_wakeInputs | readInputs();
+  g_previousInputs = g_inputs;
+  g_inputsChangedAt = Hal::millis();
+  if (g_wakeInputs != 0)
   {
-    Serial.println("Failed to configure ext1 with the given parameters");
+    g_events.edge(g_inputsChangedAt, g_wakeInputs);
+  }
+  // The burst the wake opens also gets what the filter counted in deep sleep.
+  // It cannot tell when that was, a blip an hour ago counts the same.
+  g_wakeFlapPulses = wakePulses(CHANNEL_VIBRATION, vibrationPulses);
+  g_wakeMotionPulses = wakePulses(CHANNEL_MOTION, motionPulses);
+  for (const SensorInput &input : SENSOR_INPUTS)
+  {
+    if (g_wakeInputs & channelBit(input.channel))
+    {
+      printEdge(input.channel, true, 1 + extraWakePulses(input.channel));
+    }
+  }
+  for (const SensorInput &input : SENSOR_INPUTS)
+  {
+    if ((g_wakeInputs & channelBit(input.channel)) == 0 && extraWakePulses(input.channel) != 0)
+    {
+      printEdge(input.channel, false, extraWakePulses(input.channel));
+    }
   }
+  markBootPhase("inputs");
+}
 
-  g_doorOpen = g_wakeup_door | digitalRead(INPUT_DOOR);
-  g_motionDetected = g_wakeup_motion | digitalRead(INPUT_MOTION);
-  g_vibrationDetected = g_wakeup_vibration | digitalRead(INPUT_VIBRATION);
+// the channel set of the next message, the inputs plus what we made of them
+uint8_t messageChannels()
+{
+  return g_inputs | (g_mail.newMail ? channelBit(CHANNEL_NEW_MAIL) : 0);
 }
 
-void sendLoRaMsg(bool doorOpen, bool motionDetected, bool vibrationDetected, bool newMail)
+// classifies the burst that just ended, false if there is nothing to send for it
+bool classifyBurst(bool doorChanged)
 {
-  Serial.print(F("[SX1262] Transmitting packet ... "));
-  // Identifier:uint16, payloadsize:uint16t, payload
-  uint8_t buffer[4];
-  // LoRa.beginPacket();
-  // LoRa.write((uint8_t*)(&loraIdentifier),sizeof(loraIdentifier));
-  uint8_t status = 0;
-  status |= (doorOpen << 0);
-  status |= (motionDetected << 1);
-  status |= (vibrationDetected << 2);
-  status |= (newMail << 3);
-  buffer[0] = 'l';
-  buffer[1] = 'm';
-  buffer[2] = status;
-  buffer[3] = (uint8_t)g_msgCounter;
-  size_t length = sizeof(buffer);
-  // write number of bytes for payload
-  // LoRa.write((uint8_t*)(&length), sizeof(length));
+  MailBurst burst;
+  burst.door = g_burstDoor || (g_events.channels() & channelBit(CHANNEL_DOOR)) != 0;
+  burst.flapPulses = g_events.count(CHANNEL_VIBRATION) + g_wakeFlapPulses;
+  burst.motionPulses = g_events.count(CHANNEL_MOTION) + g_wakeMotionPulses;
+  g_wakeFlapPulses = 0;
+  g_wakeMotionPulses = 0;
+  g_burstDoor = false;
+  const bool hadMail = g_mail.newMail;
+  const MailEvent event = g_mail.add(burst, MAIL_INFERENCE_DEFAULTS, Hal::rtcMicros());
+  log_i("Burst of door %d, flap %u, motion %u: %s", burst.door, burst.flapPulses, burst.motionPulses, mailEventName(event));
+  // taking nothing out of an empty box is news only with the door message
+  if (event == MAIL_NOISE || (event == MAIL_EMPTIED && !hadMail && !doorChanged))
+  {
+    g_events.clear();
+    return false;
+  }
+  g_mailPending = event;
+  return true;
+}
+
+// status frame (frame_codec.h), with the pulses counted in deep sleep, the
+// event and noise summaries and the delivery or emptying they were taken for
+// if there were any, the SF, TX power and build if
+// the gateway needs them, the update request while a download runs and the
+// boot id until the gateway knows the counter started over
+#define STATUS_FRAME_LENGTH (FRAME_HEADER_LENGTH + 1 + 3 + 1 + EventWindow::MAX_LENGTH + 7 + 2 + 2 + 5 + 1 + FUOTA_REQUEST_LENGTH + 5 + FRAME_CHECK_LENGTH)
+
+size_t buildStatusFrame(uint8_t channels, uint8_t *buffer, size_t size)
+{
+  FrameWriter writer(buffer, size);
+  writer.begin(FRAME_STATUS, Hal::nodeId(), (uint16_t)g_msgCounter).status(packStatus(channels));
+  if (g_vibrationPulses != 0 || g_motionPulses != 0)
+  {
+    const uint8_t pulses[2] = {(uint8_t)(g_vibrationPulses > 255 ? 255 : g_vibrationPulses),
+                               (uint8_t)(g_motionPulses > 255 ? 255 : g_motionPulses)};
+    writer.extension(EXT_PULSE_COUNTS, pulses, sizeof(pulses));
+  }
+  uint8_t events[EventWindow::MAX_LENGTH];
+  const size_t eventsLength = g_events.write(events);
+  if (eventsLength != 0)
+  {
+    writer.extension(EXT_EVENTS, events, eventsLength);
+  }
+  if (g_mail.summaryPending())
+  {
+    uint8_t noise[6];
+    g_mail.writeSummary(noise);
+    writer.extension(EXT_NOISE, noise, sizeof(noise));
+  }
+  if (g_mailPending == MAIL_DELIVERED || g_mailPending == MAIL_EMPTIED)
+  {
+    writer.extension(EXT_MAIL, g_mailPending == MAIL_DELIVERED ? FRAME_MAIL_DELIVERED : FRAME_MAIL_EMPTIED);
+  }
+  g_linkSettingsSent = !g_linkReported || g_msgCounter % LINK_REPORT_INTERVAL == 0;
+  if (g_linkSettingsSent)
+  {
+    writer.extension(EXT_LINK_SETTINGS, frameLinkSettings(g_radioConfig.sf, g_radioConfig.power));
+    uint8_t build[4];
+    framePutLe32(build, Hal::firmwareBuildId());
+    writer.extension(EXT_FIRMWARE, build, sizeof(build));
+  }
+  if (!g_restartReported)
+  {
+    uint8_t bootId[4];
+    framePutLe32(bootId, g_bootId);
+    writer.extension(EXT_RESTART, bootId, sizeof(bootId));
+  }
+  g_updateRequested = g_update.requesting();
+  if (g_updateRequested)
+  {
+    uint8_t request[FUOTA_REQUEST_LENGTH];
+    g_update.request().write(request);
+    writer.extension(EXT_UPDATE_REQUEST, request, sizeof(request));
+  }
+  return writer.finish();
+}
+
+// time on air of a frame with the current settings
+uint32_t frameAirtimeUs(size_t length)
+{
+  const RadioConfig &config = g_radioConfig;
+  return loraAirtimeUs(config.sf, (uint32_t)(config.bw * 1000), config.cr, config.preambleLength, length);
+}
+
+bool dutyCycleLow()
+{
+  return g_dutyCycle.availableUs(Hal::rtcMicros()) < g_dutyCycle.limitUs / 100 * DUTY_CYCLE_RESERVE_PERCENT;
+}
+
+// listen before talk, false if the channel stayed busy
+bool channelClear()
+{
+  for (uint8_t cad = 0; cad < LBT_MAX_CADS; cad++)
+  {
+    energyPhase(PHASE_RX);
+    const int state = g_radio.scanChannel();
+    energyPhase(PHASE_ACTIVE);
+    // a failed CAD does not hold the frame back
+    if (state != RADIOLIB_LORA_DETECTED)
+    {
+      return true;
+    }
+    energyPhase(PHASE_WAIT);
+    Hal::delay(Hal::random(LBT_BACKOFF_MIN_MS, LBT_BACKOFF_MIN_MS + (LBT_BACKOFF_WINDOW_MS << cad)));
+    energyPhase(PHASE_ACTIVE);
+  }
+  log_w("Channel still busy after %u CADs", LBT_MAX_CADS);
+  return false;
+}
+
+// Sends a frame once the channel is clear and books its airtime, even if
+// transmit() failed: the frame may have been on air. RADIOLIB_LORA_DETECTED
+// if the channel stayed busy.
+int transmitFrame(const uint8_t *buffer, size_t length)
+{
+  if (!channelClear())
+  {
+    return RADIOLIB_LORA_DETECTED;
+  }
+  energyPhase(PHASE_TX);
   int state = g_radio.transmit(buffer, length);
-  g_msgCounter++;
-  // write buffer
-  // LoRa.write(buffer, length);
-  // send it out
-  // LoRa.endPacket();
+  energyPhase(PHASE_ACTIVE);
+  g_dutyCycle.spend(Hal::rtcMicros(), frameAirtimeUs(length));
+  return state;
+}
+
+int sendLoRaMsg(const uint8_t *buffer, size_t length)
+{
+  Serial.print(F("[SX1262] Transmitting packet ... "));
+  g_energy.txPower = g_radioConfig.power;
+  int state = transmitFrame(buffer, length);
 
   if (state == RADIOLIB_ERR_NONE)
   {
@@ -205,6 +822,11 @@ void sendLoRaMsg(bool doorOpen, bool motionDetected, bool vibrationDetected, boo
     Serial.print(g_radio.getDataRate());
     Serial.println(F(" bps"));
   }
+  else if (state == RADIOLIB_LORA_DETECTED)
+  {
+    // listen before talk kept finding someone else's frame
+    Serial.println(F("channel busy!"));
+  }
   else if (state == RADIOLIB_ERR_PACKET_TOO_LONG)
   {
     // the supplied packet was longer than 256 bytes
@@ -224,39 +846,687 @@ void sendLoRaMsg(bool doorOpen, bool motionDetected, bool vibrationDetected, boo
 
   Serial.printf("Sending %d bytes payload", length);
   Serial.println();
-  // TODO: fix, we cant say if we have really 0 byte at the end
-  // Serial.printf("Buffer: %s", buffer);
-  Serial.println();
+  return state;
+}
+
+void IRAM_ATTR onRadioIrq(void)
+{
+  g_radioIrq = true;
+}
+
+// switches to the SF and TX power the gateway assigned, the radio is in standby
+void applyLinkSettings(uint8_t sf, int8_t power)
+{
+  RadioConfig &config = g_radioConfig;
+  if (sf == config.sf && power == config.power)
+  {
+    return;
+  }
+  if (sf < LINK_MIN_SF || sf > LINK_MAX_SF || power < LINK_MIN_POWER || power > LINK_MAX_POWER)
+  {
+    log_w("Ignoring link settings SF%u %d dBm", sf, power);
+    return;
+  }
+  log_i("Link settings SF%u %d dBm -> SF%u %d dBm", config.sf, config.power, sf, power);
+  if (g_radio.setSpreadingFactor(sf) != RADIOLIB_ERR_NONE || g_radio.setOutputPower(power) != RADIOLIB_ERR_NONE)
+  {
+    // the next wake configures the radio from scratch with the old settings
+    log_e("Applying link settings failed");
+    g_radioWarm = false;
+    return;
+  }
+  config.sf = sf;
+  config.power = power;
+  g_linkReported = false;
+}
+
+// an update the gateway offered, the storage is erased for a download
+void startUpdate(const FuotaOffer &offer)
+{
+  const uint32_t storage = Hal::updateStorageSize();
+  const uint32_t room = storage > UPDATE_STORAGE_DELTA_OFFSET ? storage - UPDATE_STORAGE_DELTA_OFFSET : 0;
+  uint8_t key[Ed25519::KEY_LENGTH];
+  const bool keyed = Hal::updateKey(key);
+  if (!g_update.start(offer, Hal::firmwareBuildId(), room, keyed))
+  {
+    if (g_update.declineTarget == offer.targetBuild)
+    {
+      log_i("Declining update to build %08x%s", offer.targetBuild, keyed ? "" : ", no update key built in");
+    }
+    return;
+  }
+  log_i("Update %08x -> %08x offered, %u bytes in %u fragments", offer.baseBuild, offer.targetBuild, offer.length,
+        fuotaFragmentCount(offer.length));
+  if (!Hal::updateStorageErase(UPDATE_STORAGE_DELTA_OFFSET, offer.length))
+  {
+    log_e("Erasing the update storage failed");
+    g_update.reject();
+  }
+}
+
+uint32_t updateStorageOffset(uint16_t fragment)
+{
+  return UPDATE_STORAGE_DELTA_OFFSET + (uint32_t)fragment * FUOTA_FRAGMENT_SIZE;
+}
+
+// a fragment frame for the download, data fragments go to storage and the
+// parity of the window's blocks is kept for recoverFragments()
+void takeFragment(uint16_t number, const uint8_t *data, uint8_t length, uint8_t (*parity)[FUOTA_FRAGMENT_SIZE],
+                  uint8_t &parityReceived)
+{
+  if (number & FUOTA_PARITY_FLAG)
+  {
+    const uint16_t block = (uint16_t)(number & ~FUOTA_PARITY_FLAG) - g_update.windowStart / FUOTA_BLOCK_FRAGMENTS;
+    if (block < FUOTA_WINDOW_BLOCKS && length == FUOTA_FRAGMENT_SIZE)
+    {
+      memcpy(parity[block], data, length);
+      parityReceived |= 1 << block;
+    }
+    return;
+  }
+  if (g_update.needs(number) && length == fuotaFragmentLength(g_update.offer.length, number) &&
+      Hal::updateStorageWrite(updateStorageOffset(number), data, length))
+  {
+    g_update.take(number);
+  }
+}
+
+// A block that lost a single fragment gets it back from its parity: the XOR
+// of the parity and the other fragments, read back from storage.
+void recoverFragments(uint8_t (*parity)[FUOTA_FRAGMENT_SIZE], uint8_t parityReceived)
+{
+  for (uint8_t block = 0; block < FUOTA_WINDOW_BLOCKS; block++)
+  {
+    const uint8_t missing = (uint8_t)(g_update.missing() >> (block * FUOTA_BLOCK_FRAGMENTS));
+    if ((parityReceived & (1 << block)) == 0 || missing == 0 || (missing & (missing - 1)) != 0)
+    {
+      continue;
+    }
+    const uint16_t first = g_update.windowStart + block * FUOTA_BLOCK_FRAGMENTS;
+    uint16_t lost = first;
+    while (((missing >> (lost - first)) & 1) == 0)
+    {
+      lost++;
+    }
+    auto read = [lost](uint16_t fragment, uint8_t *data, uint8_t length)
+    {
+      if (fragment == lost)
+      {
+        memset(data, 0, length);
+        return true;
+      }
+      return Hal::updateStorageRead(updateStorageOffset(fragment), data, length);
+    };
+    uint8_t data[FUOTA_FRAGMENT_SIZE];
+    if (!fuotaParity(read, g_update.offer.length, first / FUOTA_BLOCK_FRAGMENTS, data))
+    {
+      continue;
+    }
+    for (uint8_t i = 0; i < FUOTA_FRAGMENT_SIZE; i++)
+    {
+      data[i] ^= parity[block][i];
+    }
+    if (Hal::updateStorageWrite(updateStorageOffset(lost), data, fuotaFragmentLength(g_update.offer.length, lost)))
+    {
+      g_update.take(lost);
+      g_update.recovered++;
+    }
+  }
+}
+
+// Listens for the update fragments the gateway sends right after its ACK,
+// until the ones it granted are in or their air time is over. Nothing is
+// logged on the way, the first one follows the ACK by FUOTA_FRAGMENT_GAP_MS.
+void receiveFragments(uint16_t granted)
+{
+  const uint32_t nodeId = Hal::nodeId();
+  const uint8_t expected = fuotaGrantFrames(granted);
+  const uint32_t timeoutMs = expected * (frameAirtimeUs(FUOTA_FRAGMENT_FRAME_LENGTH) / 1000 + FUOTA_FRAGMENT_GAP_MS) + ACK_TIMEOUT_MS;
+  uint8_t parity[FUOTA_WINDOW_BLOCKS][FUOTA_FRAGMENT_SIZE];
+  uint8_t parityReceived = 0;
+  uint8_t received = 0;
+  uint8_t buffer[FRAME_MAX_LENGTH];
+
+  g_radioIrq = false;
+  g_radio.startReceive();
+  const uint32_t start = Hal::millis();
+  while (received < expected && Hal::millis() - start < timeoutMs)
+  {
+    if (!g_radioIrq)
+    {
+      Hal::delay(1);
+      continue;
+    }
+    g_radioIrq = false;
+    const size_t length = g_radio.getPacketLength();
+    FrameView frame;
+    if (g_radio.readData(buffer, sizeof(buffer)) == RADIOLIB_ERR_NONE && decodeFrame(buffer, length, frame) == FRAME_OK &&
+        frame.type == FRAME_FRAGMENT && frame.nodeId == nodeId && frame.payloadLength > 4 &&
+        frameGetLe32(frame.payload) == g_update.offer.targetBuild)
+    {
+      received++;
+      takeFragment(frame.counter, &frame.payload[4], frame.payloadLength - 4, parity, parityReceived);
+    }
+    g_radio.startReceive();
+  }
+  recoverFragments(parity, parityReceived);
+}
+
+// listens for the gateway's ACK of the current message, returns as soon as it
+// arrived, or after the update fragments that follow it
+bool waitForAck()
+{
+  const uint32_t nodeId = Hal::nodeId();
+  const uint16_t counter = (uint16_t)g_msgCounter;
+  uint8_t buffer[FRAME_MAX_LENGTH];
+  FrameView ack;
+  bool acked = false;
+
+  g_radioIrq = false;
+  g_radio.setDio1Action(onRadioIrq);
+  energyPhase(PHASE_RX);
+  g_radio.startReceive();
+  uint32_t start = Hal::millis();
+  while (!acked && Hal::millis() - start < ACK_TIMEOUT_MS)
+  {
+    if (!g_radioIrq)
+    {
+      Hal::delay(1);
+      continue;
+    }
+    g_radioIrq = false;
+    size_t length = g_radio.getPacketLength();
+    int state = g_radio.readData(buffer, sizeof(buffer));
+    acked = state == RADIOLIB_ERR_NONE && decodeFrame(buffer, length, ack) == FRAME_OK &&
+            ack.type == FRAME_ACK && ack.nodeId == nodeId && ack.counter == counter;
+    if (!acked)
+    {
+      // someone else's frame, keep listening
+      g_radio.startReceive();
+    }
+  }
+  // the fragments the gateway grants of the window requested, they follow
+  FrameExtensionView update;
+  uint16_t granted = 0;
+  if (acked && g_updateRequested && ack.find(EXT_UPDATE_REQUEST, FUOTA_GRANT_LENGTH, update) &&
+      frameGetLe16(update.value) == g_update.windowStart)
+  {
+    granted = frameGetLe16(&update.value[2]);
+  }
+  if (granted != 0)
+  {
+    receiveFragments(granted);
+  }
+  g_radio.standby();
+  energyPhase(PHASE_ACTIVE);
+  g_radio.clearDio1Action();
+  if (acked)
+  {
+    // the gateway knows the settings now, unless its ACK changes them
+    g_linkReported |= g_linkSettingsSent;
+    g_restartReported = true;
+    FrameExtensionView settings;
+    if (ack.find(EXT_LINK_SETTINGS, 1, settings))
+    {
+      applyLinkSettings(frameLinkSf(settings.value[0]), frameLinkPower(settings.value[0]));
+    }
+    if (g_updateRequested)
+    {
+      g_update.requestAcknowledged(granted);
+      if (granted != 0)
+      {
+        log_i("Update window %u of %u %s, %u fragments so far, %u recovered",
+              g_update.windowStart / FUOTA_WINDOW_FRAGMENTS + 1,
+              (fuotaFragmentCount(g_update.offer.length) + FUOTA_WINDOW_FRAGMENTS - 1) / FUOTA_WINDOW_FRAGMENTS,
+              g_update.missing() == 0 ? "complete" : "incomplete", g_update.fragments, g_update.recovered);
+      }
+      g_update.advance();
+    }
+    if (ack.find(EXT_UPDATE_OFFER, FUOTA_OFFER_LENGTH, update))
+    {
+      FuotaOffer offer;
+      offer.read(update.value);
+      startUpdate(offer);
+    }
+  }
+  return acked;
+}
+
+// reads the delta from storage and the base from the running build, the
+// target goes to the other OTA slot
+// the OTA slot is only erased by the first write, after the decoder checked
+// the signature
+struct UpdateIo
+{
+  uint32_t targetLength;
+  bool begun;
+
+  bool readDelta(uint32_t offset, uint8_t *data, size_t length)
+  {
+    return Hal::updateStorageRead(UPDATE_STORAGE_DELTA_OFFSET + offset, data, length);
+  }
+
+  bool readBase(uint32_t offset, uint8_t *data, size_t length)
+  {
+    return Hal::firmwareRead(offset, data, length);
+  }
+
+  bool write(const uint8_t *data, size_t length)
+  {
+    if (!begun)
+    {
+      if (!Hal::firmwareBegin(targetLength))
+      {
+        log_e("No OTA slot for %u bytes", targetLength);
+        return false;
+      }
+      begun = true;
+    }
+    return Hal::firmwareWrite(data, length);
+  }
+};
+
+// Checks the downloaded delta and its signature, patches the running build
+// with it into the other OTA slot and restarts into the result with the UpdateRecord that puts
+// it on probation. An update that fails on the way is not taken again.
+void applyUpdate()
+{
+  const FuotaOffer &offer = g_update.offer;
+  log_i("Update to build %08x downloaded in %u windows, %u of %u fragments recovered", offer.targetBuild,
+        g_update.windows, g_update.recovered, g_update.fragments);
+  uint32_t crc = 0;
+  uint8_t chunk[64];
+  for (uint32_t offset = 0; offset < offer.length; offset += sizeof(chunk))
+  {
+    const size_t length = offer.length - offset < sizeof(chunk) ? offer.length - offset : sizeof(chunk);
+    if (!Hal::updateStorageRead(UPDATE_STORAGE_DELTA_OFFSET + offset, chunk, length))
+    {
+      break;
+    }
+    crc = deltaCrc32(crc, chunk, length);
+  }
+  DeltaHeader header;
+  if (crc != offer.crc || !Hal::updateStorageRead(UPDATE_STORAGE_DELTA_OFFSET, chunk, DELTA_HEADER_LENGTH) ||
+      !readDeltaHeader(chunk, DELTA_HEADER_LENGTH, header) || header.targetBuild != offer.targetBuild)
+  {
+    log_e("Update delta does not check out");
+    g_update.reject();
+    return;
+  }
+  uint8_t key[Ed25519::KEY_LENGTH];
+  if (!Hal::updateKey(key))
+  {
+    log_e("No update key built in");
+    g_update.reject();
+    return;
+  }
+  UpdateIo io = {header.targetLength, false};
+  const DeltaError error = g_deltaDecoder.apply(io, offer.length, Hal::firmwareBuildId(), key);
+  if (error != DELTA_OK)
+  {
+    log_e("Applying the update failed after %u bytes: %s", g_deltaDecoder.written(), deltaErrorName(error));
+    if (io.begun)
+    {
+      Hal::firmwareAbort();
+    }
+    g_update.reject();
+    return;
+  }
+  if (!Hal::firmwareFinish())
+  {
+    log_e("Build %08x does not check out", header.targetBuild);
+    g_update.reject();
+    return;
+  }
+  // without the record the new build could not roll back, it is not booted
+  const UpdateRecord record = {UPDATE_RECORD_MAGIC, header.baseBuild, header.targetBuild, 0xffffffff, 0xffffffff};
+  if (!Hal::updateStorageErase(0, sizeof(record)) || !Hal::updateStorageWrite(0, &record, sizeof(record)))
+  {
+    log_e("Writing the update record failed");
+    Hal::firmwareBootPrevious();
+    g_update.reject();
+    return;
+  }
+  log_i("Build %08x written, restarting", header.targetBuild);
+  sleepRadio();
+  Serial.flush();
+  Hal::restart();
+}
+
+// Once a day a summary of the ledger goes out as an energy frame, without ACK:
+// wakes, seconds and charge since power on, and the share of the charge per
+// EnergyPhase in percent
+void sendEnergyReport()
+{
+  // all TX time is charged at the current power
+  const uint64_t chargeNah = energyChargeNah(g_energy.totalUs, g_radioConfig.power);
+  const uint32_t seconds = (uint32_t)(g_energy.totalTimeUs() / 1000000);
+  const uint32_t chargeUah = (uint32_t)(chargeNah / 1000);
+  uint8_t totals[10];
+  framePutLe16(&totals[0], (uint16_t)g_energy.wakes);
+  framePutLe32(&totals[2], seconds);
+  framePutLe32(&totals[6], chargeUah);
+  uint8_t shares[PHASE_COUNT];
+  for (uint8_t phase = 0; phase < PHASE_COUNT; phase++)
+  {
+    const uint64_t phaseNah = g_energy.totalUs[phase] * energyPhaseUa(phase, g_radioConfig.power) / 3600000;
+    shares[phase] = chargeNah ? (uint8_t)(phaseNah * 100 / chargeNah) : 0;
+  }
+  uint8_t buffer[FRAME_HEADER_LENGTH + 1 + sizeof(totals) + 1 + sizeof(shares) + FRAME_CHECK_LENGTH];
+  FrameWriter writer(buffer, sizeof(buffer));
+  writer.begin(FRAME_ENERGY, Hal::nodeId(), (uint16_t)g_msgCounter)
+      .extension(EXT_ENERGY_TOTALS, totals, sizeof(totals))
+      .extension(EXT_ENERGY_PHASES, shares, sizeof(shares));
+  const size_t length = writer.finish();
+
+  if (!g_dutyCycle.fits(Hal::rtcMicros(), frameAirtimeUs(length)))
+  {
+    // stays due, the next one covers the same time
+    return;
+  }
+  log_i("Energy since power on: %u uAh in %u s over %u wakes", chargeUah, seconds, g_energy.wakes);
+  int state = transmitFrame(buffer, length);
+  if (state != RADIOLIB_ERR_NONE)
+  {
+    log_w("Sending the energy report failed, code %d", state);
+    return;
+  }
+  g_energy.reportedAtUs = g_energy.totalTimeUs();
+}
+
+// sends the current message until the gateway acknowledges it, as long as
+// the duty cycle budget has room for the attempts
+bool sendWithAck(uint8_t channels, bool urgent)
+{
+  uint8_t buffer[STATUS_FRAME_LENGTH];
+  const size_t length = buildStatusFrame(channels, buffer, sizeof(buffer));
+  const uint32_t airtimeUs = frameAirtimeUs(length);
+  // with the budget running low only urgent messages are worth a retry
+  const int attempts = urgent || !dutyCycleLow() ? MAX_TX_ATTEMPTS : 1;
+  bool onAir = false;
+  for (int attempt = 1; attempt <= attempts; attempt++)
+  {
+    if (!g_dutyCycle.fits(Hal::rtcMicros(), airtimeUs))
+    {
+      log_w("Duty cycle budget used up after %d attempt(s)", attempt - 1);
+      break;
+    }
+    const int state = sendLoRaMsg(buffer, length);
+    onAir |= state != RADIOLIB_LORA_DETECTED;
+    if (state == RADIOLIB_ERR_NONE && waitForAck())
+    {
+      log_i("Message %u acknowledged after %d attempt(s)", g_msgCounter, attempt);
+      g_unackedMessages = 0;
+      // the gateway has the counts now
+      g_vibrationPulses = 0;
+      g_motionPulses = 0;
+      g_mail.summarySent();
+      if (g_updateProbation)
+      {
+        confirmUpdate();
+      }
+      return true;
+    }
+    if (attempt < attempts)
+    {
+      energyPhase(PHASE_WAIT);
+      Hal::delay(Hal::random(RETRY_BACKOFF_MIN_MS, RETRY_BACKOFF_MAX_MS));
+      energyPhase(PHASE_ACTIVE);
+    }
+  }
+  log_w("Message %u not acknowledged", g_msgCounter);
+  g_messageUnacked = true;
+  // a busy channel says nothing about the link
+  if (onAir && ++g_unackedMessages >= LINK_FALLBACK_MESSAGES && (g_radioConfig.sf != LORA_SF || g_radioConfig.power != LINK_MAX_POWER))
+  {
+    log_w("No ACK for %u messages, falling back to SF%u %d dBm", g_unackedMessages, LORA_SF, LINK_MAX_POWER);
+    applyLinkSettings(LORA_SF, LINK_MAX_POWER);
+  }
+  return false;
+}
+
+// Duty cycle policy for a due message, see DUTY_CYCLE_*. True if it goes out
+// now, otherwise it was dropped or is held back with g_reportHeld set.
+bool dutyCycleAllows(bool changed, bool urgent)
+{
+  const uint32_t now = Hal::millis();
+  // the message is not built yet, plan with the longest one
+  const uint32_t airtimeUs = frameAirtimeUs(STATUS_FRAME_LENGTH);
+  uint32_t waitMs = g_dutyCycle.waitMs(Hal::rtcMicros(), airtimeUs);
+  if (waitMs == 0 && !urgent && dutyCycleLow())
+  {
+    if (!changed)
+    {
+      log_i("Keep-alive dropped, duty cycle budget low");
+      // the next one is due a keep-alive interval from now
+      g_reported = true;
+      g_reportedInputs = g_inputs;
+      g_reportedAt = now;
+      g_reportHeld = false;
+      return false;
+    }
+    const uint32_t spacingMs = (uint32_t)((uint64_t)airtimeUs * DUTY_CYCLE_SPACING / 1000);
+    if (g_reported && now - g_reportedAt < spacingMs)
+    {
+      waitMs = spacingMs - (now - g_reportedAt);
+    }
+  }
+  if (waitMs == 0)
+  {
+    g_reportHeld = false;
+    return true;
+  }
+  // looked at again at least every keep-alive interval
+  waitMs = waitMs < KEEPALIVE_INTERVAL_MS ? waitMs : KEEPALIVE_INTERVAL_MS;
+  if (!g_reportHeld)
+  {
+    log_i("Message held back %u ms by the duty cycle budget", waitMs);
+  }
+  g_reportHeld = true;
+  g_reportHeldUntil = now + waitMs;
+  return false;
+}
+
+// time until intervalUs after sinceUs, at least 1 us
+uint64_t dueInUs(uint64_t sinceUs, uint64_t intervalUs)
+{
+  const uint64_t ageUs = Hal::rtcMicros() - sinceUs;
+  return ageUs < intervalUs ? intervalUs - ageUs : 1;
+}
+
+// Deep sleep until the door opens or the input filter sees a qualified
+// vibration or motion event. ext1 is level triggered, so inputs that are still
+// high (stuck) must not be part of the mask or they would wake us right away;
+// a timer wake checks on them instead.
+[[noreturn]] void goToDeepSleep(uint8_t active)
+{
+  // TODO: check for other things that should be called to reach deep sleep
+  // one lost message is a busy channel or a gateway restart, not a bad build
+  if (g_updateProbation && g_messageUnacked && ++g_probationMisses >= UPDATE_PROBATION_WAKES)
+  {
+    log_e("Build %08x got no ACK in %u wakes, rolling back", Hal::firmwareBuildId(), g_probationMisses);
+    rollBackUpdate();
+  }
+  Serial.println("Going to sleep now");
+  sleepRadio();
+  Hal::disableWakeupSources();
+  uint64_t ext1Mask = WAKEUP_BITMASK & ~inputPinMask(active);
+  if (Hal::startInputFilter(inputFilterConfig(active)))
+  {
+    ext1Mask &= ~inputPinMask(FILTERED_CHANNELS);
+  }
+  if (ext1Mask != 0 && Hal::enableExt1Wakeup(ext1Mask, ESP_EXT1_WAKEUP_ANY_HIGH) != ESP_OK)
+  {
+    Serial.println("Failed to configure ext1 with the given parameters");
+  }
+  uint64_t timerUs = active != 0 ? KEEPALIVE_INTERVAL_MS * 1000ULL : 0;
+  // noise counts go out on their own once the oldest is due
+  if (g_mail.summaryPending())
+  {
+    const uint64_t noiseInUs = dueInUs(g_mail.noiseSinceUs, NOISE_SUMMARY_INTERVAL_S * 1000000ULL);
+    timerUs = timerUs != 0 && timerUs < noiseInUs ? timerUs : noiseInUs;
+  }
+  // and so does the next pull of a download
+  if (g_update.state == UPDATE_RECEIVING)
+  {
+    const uint64_t pullInUs = dueInUs(g_update.pulledAtUs, UPDATE_PULL_INTERVAL_S * 1000000ULL);
+    timerUs = timerUs != 0 && timerUs < pullInUs ? timerUs : pullInUs;
+  }
+  if (timerUs != 0)
+  {
+    Hal::enableTimerWakeup(timerUs);
+  }
+  energyPhase(PHASE_LOG);
+  printEnergyRecord();
+  Hal::delay(100);
+  energyPhase(PHASE_DEEP_SLEEP);
+  Hal::deepSleepStart();
+}
+
+// Light sleep until an input leaves its current level, the keep-alive is due
+// or the high inputs become stuck. GPIO wakeups are level triggered, so each
+// pin is armed for the opposite of its current level.
+void waitForInputChange(uint8_t active)
+{
+  const uint32_t now = Hal::millis();
+  uint32_t timeoutMs = KEEPALIVE_INTERVAL_MS - (now - g_reportedAt);
+  const uint32_t stuckInMs = INPUT_STUCK_MS - (now - g_inputsChangedAt);
+  if (stuckInMs < timeoutMs)
+  {
+    timeoutMs = stuckInMs;
+  }
+  const uint32_t windowMs = g_events.closesInMs(now);
+  if (windowMs != 0 && windowMs < timeoutMs)
+  {
+    timeoutMs = windowMs;
+  }
+  if (g_reportHeld)
+  {
+    const uint32_t heldMs = (int32_t)(g_reportHeldUntil - now) > 0 ? g_reportHeldUntil - now : 1;
+    timeoutMs = heldMs < timeoutMs ? heldMs : timeoutMs;
+  }
+
+  sleepRadio();
+  // the UART stops in light sleep, let the log out first
+  energyPhase(PHASE_LOG);
+  Serial.flush();
+  Hal::disableWakeupSources();
+  for (const SensorInput &input : SENSOR_INPUTS)
+  {
+    Hal::enableGpioWakeup(input.pin, (active & channelBit(input.channel)) == 0);
+  }
+  Hal::enableTimerWakeup(timeoutMs * 1000ULL);
+  energyPhase(PHASE_LIGHT_SLEEP);
+  Hal::lightSleepStart();
+  energyPhase(PHASE_ACTIVE);
+  for (const SensorInput &input : SENSOR_INPUTS)
+  {
+    Hal::disableGpioWakeup(input.pin);
+  }
 }
 
 void loop()
 {
-  digitalWrite(LED, g_ledState);
+  Hal::digitalWrite(LED, g_ledState);
   g_ledState = !g_ledState;
 
-  if (g_doorOpen)
+  const uint8_t active = g_inputs;
+  const uint32_t now = Hal::millis();
+  // what the gateway was told last, after deep sleep the inputs we went to sleep
+  // with: they were reported and are the ones left stuck
+  const bool known = g_reported || Hal::wakeupCause() != ESP_SLEEP_WAKEUP_UNDEFINED;
+  const uint8_t knownInputs = g_reported ? g_reportedInputs : g_stuckInputs;
+  // an input that went low is not stuck anymore
+  g_stuckInputs &= active;
+  if (active != g_previousInputs)
+  {
+    g_inputsChangedAt = now;
+    g_events.edge(now, active & ~g_previousInputs);
+    for (const SensorInput &input : SENSOR_INPUTS)
+    {
+      if ((active ^ g_previousInputs) & channelBit(input.channel))
+      {
+        const bool level = (active >> input.channel) & 1;
+        printEdge(input.channel, level, level);
+      }
+    }
+  }
+  else if ((active & ~URGENT_INPUTS & ~g_stuckInputs) != 0)
   {
-    g_newMail = false;
+    // PIR hold time, the flap still swinging
+    g_events.hold(now);
   }
+  g_previousInputs = active;
+  const bool doorChanged = !known || ((active ^ knownInputs) & URGENT_INPUTS) != 0;
+  if (doorChanged)
+  {
+    g_events.close();
+    g_burstDoor |= known;
+  }
+  // with the door open whatever goes on is the mail being taken out, unless
+  // it was left open
+  if (g_events.channels() != 0 && (active & ~g_stuckInputs & channelBit(CHANNEL_DOOR)) != 0)
+  {
+    g_burstDoor = true;
+  }
+  // nothing goes out while the burst lasts, noise not even afterwards
+  const bool collecting = g_events.closesInMs(now) != 0;
+  if (!collecting && g_events.channels() != 0 && g_mailPending == MAIL_NONE)
+  {
+    classifyBurst(doorChanged);
+  }
+  const bool changed = doorChanged || g_mailPending != MAIL_NONE;
+  const bool urgent = doorChanged || g_mailPending == MAIL_DELIVERED;
+  // the first message of a timer wake is the keep-alive of the stuck inputs
+  const bool keepAlive = g_reported ? now - g_reportedAt >= KEEPALIVE_INTERVAL_MS : g_keepAliveWake;
+  const bool due = !collecting &&
+                   (changed || keepAlive || g_mail.summaryDue(Hal::rtcMicros(), NOISE_SUMMARY_INTERVAL_S * 1000000ULL) ||
+                    g_update.pullDue(Hal::rtcMicros(), UPDATE_PULL_INTERVAL_S * 1000000ULL));
+  // a held message the inputs went back on is not due anymore
+  g_reportHeld &= due;
+  if (due && dutyCycleAllows(changed, urgent))
+  {
+    for (const SensorInput &input : SENSOR_INPUTS)
+    {
+      Serial.printf("%s %d\n", CHANNELS[input.channel].name, (active >> input.channel) & 1);
+    }
+    // one new message, repeated until acknowledged
+    g_msgCounter++;
+    markBootPhase("send");
+    sendWithAck(messageChannels(), urgent);
+    if (g_updateRequested)
+    {
+      g_update.pulledAtUs = Hal::rtcMicros();
+    }
+    // acknowledged or not, the next message starts a new summary
+    g_events.clear();
+    g_mailPending = MAIL_NONE;
+    g_burstDoor = false;
+    markBootPhase("sent");
+    logBootPhases();
+    g_reported = true;
+    g_reportedInputs = active;
+    g_reportedAt = Hal::millis();
 
-  Serial.printf("Door open %d\n", g_doorOpen);
-  Serial.printf("Motion %d\n", g_motionDetected);
-  Serial.printf("Vibration %d\n", g_vibrationDetected);
-  sendLoRaMsg(g_doorOpen, g_motionDetected, g_vibrationDetected, g_newMail);
-  delay(50);
-  sendLoRaMsg(g_doorOpen, g_motionDetected, g_vibrationDetected, g_newMail);
-  // wait for a second before transmitting again
-  // Go to sleep now
-  if (!g_doorOpen && !g_motionDetected && !g_vibrationDetected)
+    if (g_energy.totalTimeUs() - g_energy.reportedAtUs >= ENERGY_REPORT_INTERVAL_S * 1000000ULL && !dutyCycleLow())
+    {
+      sendEnergyReport();
+    }
+  }
+  if (g_update.state == UPDATE_COMPLETE)
   {
-    // TODO: check for other things that should be called to reach deep sleep
-    Serial.println("Going to sleep now");
-    delay(100);
-    esp_deep_sleep_start();
+    applyUpdate();
   }
-  // Serial.println("This will never be printed");
-  delay(1000);
-  g_doorOpen = digitalRead(INPUT_DOOR);
-  g_motionDetected = digitalRead(INPUT_MOTION);
-  g_vibrationDetected = digitalRead(INPUT_VIBRATION);
-}
\ No newline at end of file
+
+  if (Hal::millis() - g_inputsChangedAt >= INPUT_STUCK_MS)
+  {
+    g_stuckInputs |= active;
+  }
+  // Go to sleep now, unless a message is waiting for the budget or the burst
+  if ((active & ~g_stuckInputs) == 0 && !g_reportHeld && g_events.closesInMs(Hal::millis()) == 0)
+  {
+    goToDeepSleep(active);
+  }
+  waitForInputChange(active);
+  g_inputs = readInputs();
+}
@@ -34,4 +34,14 @@ static const uint8_t INPUT_DOOR = D4;
 static const uint8_t INPUT_MOTION = D5;
 
 static const uint8_t INPUT_VIBRATION = D3;
-#endif
\ No newline at end of file
+#endif
+
+#ifdef LETTERMAN_NATIVE
+// host simulation, pin numbers follow the Heltec V3 wiring
+#define LORA_FREQ 868.
+
+#define LED 35
+#define INPUT_DOOR 7
+#define INPUT_MOTION 6
+#define INPUT_VIBRATION 5
+#endif
@@ -0,0 +1,251 @@
+// Host battery life estimator. Reads the wake records the firmware prints
+// before every deep sleep (printEnergyRecord() in main.cpp), averages the
+// charge per wake cause and the deep sleep floor, and projects battery life
+// for an event rate profile.
+//
+//   program battery <trace> [profile]
+//
+// trace:   serial log of a sensor or the output of `program -v`, other lines
+//          are ignored, '-' reads stdin
+// profile: "<key> <value>" lines, '#' starts a comment
+//            capacity_mah 2500
+//            usable 0.8          share of the capacity usable before cut-off
+//            door 2              wakes per day for door, vibration, motion, timer
+//          Without a profile the wake rates of the trace itself are used.
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "../energy.h"
+
+namespace
+{
+
+struct CauseStats
+{
+  uint32_t records = 0;
+  uint64_t awakeUs = 0;
+  // charge of the awake phases, the deep sleep goes into the floor
+  uint64_t awakeNah = 0;
+  double wakesPerDay = -1;
+};
+
+struct Profile
+{
+  double capacityMah = 2500;
+  double usable = 0.8;
+};
+
+bool parseRecord(const char *line, uint8_t &cause, uint64_t phaseUs[PHASE_COUNT], int8_t &txPower)
+{
+  if (strncmp(line, "energy,", 7) != 0)
+  {
+    return false;
+  }
+  // wake number
+  const char *field = strchr(line + 7, ',');
+  if (field == nullptr)
+  {
+    return false;
+  }
+  field++;
+  const char *end = strchr(field, ',');
+  if (end == nullptr)
+  {
+    return false;
+  }
+  cause = 0xff;
+  for (uint8_t i = WAKE_POWER_ON; i <= WAKE_TIMER; i++)
+  {
+    const char *name = energyWakeCauseName(i);
+    if ((size_t)(end - field) == strlen(name) && strncmp(field, name, end - field) == 0)
+    {
+      cause = i;
+    }
+  }
+  if (cause == 0xff)
+  {
+    return false;
+  }
+  field = end;
+  for (uint8_t phase = 0; phase < PHASE_COUNT; phase++)
+  {
+    if (*field != ',')
+    {
+      return false;
+    }
+    char *next;
+    phaseUs[phase] = strtoull(field + 1, &next, 10);
+    if (next == field + 1)
+    {
+      return false;
+    }
+    field = next;
+  }
+  // charge, then the TX power, missing in traces of older firmware
+  txPower = 10;
+  const char *power = strchr(field + 1, ',');
+  if (*field == ',' && power != nullptr)
+  {
+    txPower = (int8_t)atoi(power + 1);
+  }
+  return true;
+}
+
+int causeByName(const char *name)
+{
+  for (uint8_t i = WAKE_DOOR; i <= WAKE_TIMER; i++)
+  {
+    if (strcmp(name, energyWakeCauseName(i)) == 0)
+    {
+      return i;
+    }
+  }
+  return -1;
+}
+
+bool readProfile(const char *path, Profile &profile, CauseStats causes[])
+{
+  FILE *file = fopen(path, "r");
+  if (file == nullptr)
+  {
+    fprintf(stderr, "cannot open profile %s\n", path);
+    return false;
+  }
+  char line[128];
+  while (fgets(line, sizeof(line), file))
+  {
+    char *comment = strchr(line, '#');
+    if (comment)
+    {
+      *comment = '\0';
+    }
+    char key[32];
+    double value;
+    if (sscanf(line, "%31s %lf", key, &value) != 2)
+    {
+      continue;
+    }
+    if (strcmp(key, "capacity_mah") == 0)
+    {
+      profile.capacityMah = value;
+    }
+    else if (strcmp(key, "usable") == 0)
+    {
+      profile.usable = value;
+    }
+    else if (causeByName(key) >= 0)
+    {
+      causes[causeByName(key)].wakesPerDay = value;
+    }
+    else
+    {
+      fprintf(stderr, "unknown profile key %s\n", key);
+    }
+  }
+  fclose(file);
+  return true;
+}
+
+} // namespace
+
+int batteryEstimate(int argc, char **argv)
+{
+  if (argc < 1)
+  {
+    fprintf(stderr, "usage: program battery <trace|-> [profile]\n");
+    return 2;
+  }
+  FILE *trace = strcmp(argv[0], "-") == 0 ? stdin : fopen(argv[0], "r");
+  if (trace == nullptr)
+  {
+    fprintf(stderr, "cannot open trace %s\n", argv[0]);
+    return 1;
+  }
+
+  CauseStats causes[WAKE_TIMER + 1];
+  uint64_t traceUs = 0;
+  uint64_t sleepUs = 0;
+  uint64_t sleepNah = 0;
+  uint32_t records = 0;
+  char line[512];
+  while (fgets(line, sizeof(line), trace))
+  {
+    uint8_t cause;
+    uint64_t phaseUs[PHASE_COUNT];
+    int8_t txPower;
+    if (!parseRecord(line, cause, phaseUs, txPower))
+    {
+      continue;
+    }
+    records++;
+    uint64_t sleep[PHASE_COUNT] = {};
+    sleep[PHASE_DEEP_SLEEP] = phaseUs[PHASE_DEEP_SLEEP];
+    sleepUs += phaseUs[PHASE_DEEP_SLEEP];
+    sleepNah += energyChargeNah(sleep, txPower);
+    for (uint8_t phase = 0; phase < PHASE_COUNT; phase++)
+    {
+      traceUs += phaseUs[phase];
+    }
+    phaseUs[PHASE_DEEP_SLEEP] = 0;
+    CauseStats &stats = causes[cause];
+    stats.records++;
+    stats.awakeNah += energyChargeNah(phaseUs, txPower);
+    for (uint8_t phase = 0; phase < PHASE_COUNT; phase++)
+    {
+      stats.awakeUs += phaseUs[phase];
+    }
+  }
+  if (trace != stdin)
+  {
+    fclose(trace);
+  }
+  if (records == 0)
+  {
+    fprintf(stderr, "no energy records in the trace\n");
+    return 1;
+  }
+
+  Profile profile;
+  if (argc > 1 && !readProfile(argv[1], profile, causes))
+  {
+    return 1;
+  }
+
+  // causes the trace has no record of are charged like an average wake
+  uint64_t awakeNah = 0;
+  uint32_t awakeRecords = 0;
+  for (uint8_t cause = WAKE_DOOR; cause <= WAKE_TIMER; cause++)
+  {
+    awakeNah += causes[cause].awakeNah;
+    awakeRecords += causes[cause].records;
+  }
+  const double averageNah = awakeRecords ? (double)awakeNah / awakeRecords : 0;
+  const double traceDays = traceUs / 86400e6;
+  // uA * h = uAh, 1 nAh over 1 us of deep sleep is 3.6e6 uA
+  const double floorUa = sleepUs ? sleepNah * 3.6e6 / sleepUs : 0;
+
+  printf("%u records over %.2f days\n\n", records, traceDays);
+  printf("%-10s %8s %12s %10s %10s %10s\n", "cause", "records", "awake ms/ev", "uAh/ev", "wakes/day", "uAh/day");
+  double dailyUah = floorUa * 24;
+  for (uint8_t cause = WAKE_DOOR; cause <= WAKE_TIMER; cause++)
+  {
+    CauseStats &stats = causes[cause];
+    if (stats.wakesPerDay < 0)
+    {
+      stats.wakesPerDay = traceDays > 0 ? stats.records / traceDays : 0;
+    }
+    const double nah = stats.records ? (double)stats.awakeNah / stats.records : averageNah;
+    const double awakeMs = stats.records ? stats.awakeUs / 1000.0 / stats.records : 0;
+    const double uah = stats.wakesPerDay * nah / 1000;
+    dailyUah += uah;
+    printf("%-10s %8u %12.1f %10.2f %10.2f %10.1f%s\n", energyWakeCauseName(cause), stats.records, awakeMs,
+           nah / 1000, stats.wakesPerDay, uah, stats.records ? "" : "  (no records, average wake)");
+  }
+  printf("%-10s %8s %12s %10s %10s %10.1f  (%.1f uA)\n", "sleep", "", "", "", "", floorUa * 24, floorUa);
+
+  const double days = profile.capacityMah * profile.usable * 1000 / dailyUah;
+  printf("\n%.1f uAh/day, %.0f days (%.1f years) on %.0f mAh with %.0f %% usable\n",
+         dailyUah, days, days / 365, profile.capacityMah, profile.usable * 100);
+  return 0;
+}
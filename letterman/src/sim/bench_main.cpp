@@ -0,0 +1,263 @@
+// Host benchmark for the sensor firmware: replays the scenarios from
+// scenarios.h against setup()/loop() on the virtual clock and reports
+// latency, awake time and charge per mailbox event.
+//
+//   pio run -e native && .pio/build/native/program [-v] [scenario]
+//   .pio/build/native/program battery <trace|-> [profile]   (battery_estimate.cpp)
+//   .pio/build/native/program codec [iterations]            (codec_check.cpp)
+//   .pio/build/native/program delta [base target [key out]] (delta_bench.cpp)
+//   .pio/build/native/program keygen <key>                  (delta_bench.cpp)
+//   .pio/build/native/program mail <trace|-> [sweep]        (mail_bench.cpp)
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+
+#include "sim_hal.h"
+#include "scenarios.h"
+#include "delta_encoder.h"
+
+// firmware entry points from main.cpp
+void setup();
+void loop();
+void resetVolatileState();
+
+int batteryEstimate(int argc, char **argv);
+int codecCheck(int argc, char **argv);
+int mailBench(int argc, char **argv);
+int deltaBench(int argc, char **argv);
+int keygen(int argc, char **argv);
+void simFirmwareImages(std::vector<uint8_t> &base, std::vector<uint8_t> &target);
+
+struct ScenarioResult
+{
+  uint32_t wakes = 0;
+  uint32_t txFrames = 0;
+  uint64_t airtimeUs = 0;
+  // most airtime in any hour, power-on boot included
+  uint64_t maxHourAirtimeUs = 0;
+  uint64_t awakeUs = 0;
+  double awakeChargeNc = 0;
+  double totalChargeNc = 0;
+  std::vector<uint64_t> latenciesUs;
+  // scenarios with a firmware update
+  size_t deltaLength = 0;
+  uint32_t fragmentsGranted = 0;
+  uint32_t targetBuild = 0;
+  uint32_t runningBuild = 0;
+  // when the node first ran the target, 0 if it did not
+  uint64_t updatedAtUs = 0;
+};
+
+// boot the firmware and run it until it enters deep sleep or the scenario
+// ends, a restart boots it again
+static void runAwake(esp_sleep_wakeup_cause_t cause, uint64_t endUs, ScenarioResult &result)
+{
+  while (true)
+  {
+    SimHal::wakeAt(SimHal::s_nowUs, cause);
+    resetVolatileState();
+    if (result.updatedAtUs == 0 && result.targetBuild != 0 && SimHal::firmwareBuildId() == result.targetBuild)
+    {
+      result.updatedAtUs = SimHal::s_nowUs;
+    }
+    try
+    {
+      setup();
+      while (SimHal::s_nowUs < endUs)
+      {
+        loop();
+      }
+      return;
+    }
+    catch (const SimDeepSleep &)
+    {
+      return;
+    }
+    catch (const SimScenarioEnd &)
+    {
+      return;
+    }
+    catch (const SimRestart &)
+    {
+      cause = ESP_SLEEP_WAKEUP_UNDEFINED;
+    }
+  }
+}
+
+// the duty cycle is judged over any hour, each window starting at a transmission
+static uint64_t maxHourAirtimeUs(const std::vector<uint64_t> &startsUs, const std::vector<uint32_t> &airtimesUs)
+{
+  const uint64_t hourUs = 3600ULL * 1000000;
+  uint64_t maxUs = 0;
+  uint64_t windowUs = 0;
+  size_t last = 0;
+  for (size_t first = 0; first < startsUs.size(); first++)
+  {
+    while (last < startsUs.size() && startsUs[last] < startsUs[first] + hourUs)
+    {
+      windowUs += airtimesUs[last++];
+    }
+    maxUs = std::max(maxUs, windowUs);
+    windowUs -= airtimesUs[first];
+  }
+  return maxUs;
+}
+
+static ScenarioResult runScenario(const SimScenario &scenario, const SimPowerModel &model)
+{
+  ScenarioResult result;
+  const uint64_t endUs = (uint64_t)scenario.durationMs * 1000;
+  SimHal::reset(&scenario.edges, model);
+  SimHal::s_lossPercent = scenario.lossPercent;
+  SimHal::s_channelBusyPercent = scenario.channelBusyPercent;
+  SimHal::s_linkGainDb = scenario.linkGainDb;
+  if (scenario.fadeAtMs != 0)
+  {
+    SimHal::s_linkFadeAtUs = (uint64_t)scenario.fadeAtMs * 1000;
+    SimHal::s_linkFadeDb = scenario.fadeDb;
+  }
+  SimHal::s_endUs = endUs;
+  if (scenario.firmwareUpdate)
+  {
+    // the node runs the base, the gateway has the delta to the target
+    std::vector<uint8_t> target;
+    simFirmwareImages(SimHal::s_firmwareSlots[0], target);
+    SimHal::s_fuotaStore.delta = DeltaEncoder::encode(SimHal::s_firmwareSlots[0], target, SIM_UPDATE_SEED);
+    SimHal::s_fuota.begin(&SimHal::s_fuotaStore, (uint32_t)SimHal::s_fuotaStore.delta.size());
+    result.deltaLength = SimHal::s_fuotaStore.delta.size();
+    result.targetBuild = firmwareImageBuildId(target.data(), target.size());
+  }
+
+  // power-on boot is not a mailbox event
+  runAwake(ESP_SLEEP_WAKEUP_UNDEFINED, endUs, result);
+  const size_t txPowerOn = SimHal::s_txStartsUs.size();
+  size_t txSeen = txPowerOn;
+  uint64_t airtimeSeen = SimHal::s_airtimeUs;
+
+  uint64_t wakeUs = 0;
+  esp_sleep_wakeup_cause_t cause;
+  while (SimHal::s_nowUs < endUs && SimHal::nextWakeup(endUs, wakeUs, cause))
+  {
+    SimHal::advance(wakeUs - SimHal::s_nowUs);
+    double chargeBefore = SimHal::s_chargeNc;
+
+    runAwake(cause, endUs, result);
+
+    result.wakes++;
+    result.awakeUs += SimHal::s_nowUs - wakeUs;
+    result.awakeChargeNc += SimHal::s_chargeNc - chargeBefore;
+    // keep-alive timer wakes are not mailbox events
+    if (cause != ESP_SLEEP_WAKEUP_TIMER && SimHal::s_txStartsUs.size() > txSeen)
+    {
+      result.latenciesUs.push_back(SimHal::s_txStartsUs[txSeen] - wakeUs);
+    }
+    txSeen = SimHal::s_txStartsUs.size();
+  }
+  result.txFrames = txSeen - txPowerOn;
+  result.airtimeUs = SimHal::s_airtimeUs - airtimeSeen;
+  result.maxHourAirtimeUs = maxHourAirtimeUs(SimHal::s_txStartsUs, SimHal::s_txAirtimesUs);
+
+  if (SimHal::s_nowUs < endUs)
+  {
+    SimHal::advance(endUs - SimHal::s_nowUs);
+  }
+  result.totalChargeNc = SimHal::s_chargeNc;
+  result.fragmentsGranted = SimHal::s_fuota.fragmentsGranted();
+  result.runningBuild = SimHal::firmwareBuildId();
+  return result;
+}
+
+static void printResult(const SimScenario &scenario, const ScenarioResult &result)
+{
+  const double events = scenario.events ? scenario.events : 1;
+  double latencyMean = 0;
+  uint64_t latencyMax = 0;
+  for (uint64_t latency : result.latenciesUs)
+  {
+    latencyMean += latency;
+    latencyMax = std::max(latencyMax, latency);
+  }
+  if (!result.latenciesUs.empty())
+  {
+    latencyMean /= result.latenciesUs.size();
+  }
+  // 1 uAh = 3.6 mC = 3.6e6 nC
+  const double avgCurrentUa = result.totalChargeNc / (scenario.durationMs * 1000.0) * 1000.0;
+
+  printf("%-16s %5u %5u %9.1f %9.1f %9.1f %10.1f %10.2f %9.1f %7.2f\n",
+         scenario.name,
+         result.wakes,
+         result.txFrames,
+         result.airtimeUs / 1000.0 / events,
+         latencyMean / 1000.0,
+         latencyMax / 1000.0,
+         result.awakeUs / 1000.0 / events,
+         result.awakeChargeNc / 3.6e6 / events,
+         avgCurrentUa,
+         result.maxHourAirtimeUs / 3.6e7);
+  if (scenario.firmwareUpdate)
+  {
+    printf("  update: delta %zu bytes, %u fragments sent (%.1f s on air), running %08x%s", result.deltaLength,
+           result.fragmentsGranted, result.fragmentsGranted * SimHal::s_fuota.fragmentAirtimeUs() / 1e6,
+           result.runningBuild, SimHal::s_firmwareConfirmed ? " confirmed" : "");
+    if (result.updatedAtUs != 0)
+    {
+      printf(result.runningBuild == result.targetBuild ? " since %.1f h" : ", target rolled back at %.1f h",
+             result.updatedAtUs / 3.6e9);
+    }
+    printf("\n");
+  }
+}
+
+int main(int argc, char **argv)
+{
+  if (argc > 1 && strcmp(argv[1], "battery") == 0)
+  {
+    return batteryEstimate(argc - 2, argv + 2);
+  }
+  if (argc > 1 && strcmp(argv[1], "codec") == 0)
+  {
+    return codecCheck(argc - 2, argv + 2);
+  }
+  if (argc > 1 && strcmp(argv[1], "mail") == 0)
+  {
+    return mailBench(argc - 2, argv + 2);
+  }
+  if (argc > 1 && strcmp(argv[1], "delta") == 0)
+  {
+    return deltaBench(argc - 2, argv + 2);
+  }
+  if (argc > 1 && strcmp(argv[1], "keygen") == 0)
+  {
+    return keygen(argc - 2, argv + 2);
+  }
+
+  const char *only = nullptr;
+  for (int i = 1; i < argc; i++)
+  {
+    if (strcmp(argv[i], "-v") == 0)
+    {
+      Serial.echo = true;
+    }
+    else
+    {
+      only = argv[i];
+    }
+  }
+
+  SimPowerModel model;
+  printf("%-16s %5s %5s %9s %9s %9s %10s %10s %9s %7s\n",
+         "scenario", "wakes", "tx", "air/ev", "lat avg", "lat max", "awake/ev", "uAh/ev", "avg uA", "dc max");
+  printf("%-16s %5s %5s %9s %9s %9s %10s %10s %9s %7s\n",
+         "", "", "", "ms", "ms", "ms", "ms", "", "", "%");
+  for (const SimScenario &scenario : simScenarios())
+  {
+    if (only && strcmp(only, scenario.name) != 0)
+    {
+      continue;
+    }
+    ScenarioResult result = runScenario(scenario, model);
+    printResult(scenario, result);
+  }
+  return 0;
+}
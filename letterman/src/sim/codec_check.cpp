@@ -0,0 +1,351 @@
+// Host checks for the frame codec in common/frame_codec.h: round trips of
+// random frames, rejection of truncated and corrupted ones, decoding of random
+// bytes, and encode/decode throughput.
+//
+//   program codec [iterations]
+//
+// The decoder also builds as a libFuzzer target, from letterman/src:
+//
+//   clang++ -std=gnu++17 -g -fsanitize=fuzzer,address,undefined -DLETTERMAN_FUZZ
+//     -I../../common sim/codec_check.cpp -o /tmp/codec_fuzz && /tmp/codec_fuzz
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "frame_codec.h"
+
+namespace
+{
+
+// xorshift32, the checks are reproducible without touching the sim's RNG
+struct Random
+{
+  uint32_t state = 0x4c6d;
+
+  uint32_t next()
+  {
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+  }
+
+  uint8_t byte()
+  {
+    return (uint8_t)next();
+  }
+};
+
+// what a frame was built from, to compare the decoded view against
+struct FrameSpec
+{
+  FrameType type;
+  uint32_t nodeId;
+  uint16_t counter;
+  uint8_t status;
+  // FRAME_FRAGMENT only
+  uint8_t payloadLength;
+  uint8_t payload[FRAME_MAX_LENGTH];
+  uint8_t extensionCount;
+  FrameExtension kinds[4];
+  uint8_t lengths[4];
+  uint8_t values[4][FRAME_EXTENSION_MAX_LENGTH];
+};
+
+void randomSpec(Random &random, FrameSpec &spec)
+{
+  static const FrameType types[] = {FRAME_STATUS, FRAME_ACK, FRAME_ENERGY, FRAME_FRAGMENT};
+  spec.type = types[random.next() % 4];
+  spec.nodeId = random.next();
+  spec.counter = (uint16_t)random.next();
+  spec.status = spec.type == FRAME_STATUS ? random.byte() : 0;
+  // the body of a fragment is the rest of the frame, no extensions after it
+  spec.payloadLength = 0;
+  if (spec.type == FRAME_FRAGMENT)
+  {
+    spec.payloadLength = random.next() % (FRAME_MAX_LENGTH - FRAME_HEADER_LENGTH - FRAME_CHECK_LENGTH + 1);
+    for (uint8_t i = 0; i < spec.payloadLength; i++)
+    {
+      spec.payload[i] = random.byte();
+    }
+  }
+  spec.extensionCount = spec.type == FRAME_FRAGMENT ? 0 : random.next() % 5;
+  for (uint8_t i = 0; i < spec.extensionCount; i++)
+  {
+    // distinct kinds, so find() has to return each of them
+    spec.kinds[i] = (FrameExtension)(i + 1);
+    spec.lengths[i] = random.next() % (FRAME_EXTENSION_MAX_LENGTH + 1);
+    for (uint8_t j = 0; j < spec.lengths[i]; j++)
+    {
+      spec.values[i][j] = random.byte();
+    }
+  }
+}
+
+size_t encodeSpec(const FrameSpec &spec, uint8_t *buffer, size_t size)
+{
+  FrameWriter writer(buffer, size);
+  writer.begin(spec.type, spec.nodeId, spec.counter);
+  if (spec.type == FRAME_STATUS)
+  {
+    writer.status(spec.status);
+  }
+  writer.payload(spec.payload, spec.payloadLength);
+  for (uint8_t i = 0; i < spec.extensionCount; i++)
+  {
+    writer.extension(spec.kinds[i], spec.values[i], spec.lengths[i]);
+  }
+  return writer.finish();
+}
+
+bool matchesSpec(const FrameView &frame, const FrameSpec &spec)
+{
+  if (frame.type != spec.type || frame.nodeId != spec.nodeId || frame.counter != spec.counter ||
+      frame.status != spec.status || frame.payloadLength != spec.payloadLength ||
+      (spec.payloadLength != 0 && memcmp(frame.payload, spec.payload, spec.payloadLength) != 0))
+  {
+    return false;
+  }
+  for (uint8_t i = 0; i < spec.extensionCount; i++)
+  {
+    FrameExtensionView extension;
+    if (!frame.find(spec.kinds[i], 0, extension) || extension.length != spec.lengths[i] ||
+        memcmp(extension.value, spec.values[i], spec.lengths[i]) != 0)
+    {
+      return false;
+    }
+  }
+  FrameExtensionView extension;
+  return !frame.find(spec.extensionCount + 1, 0, extension);
+}
+
+// walks the body and every extension of a decoded frame, the sanitizers catch
+// a read past it
+uint32_t touchExtensions(const FrameView &frame)
+{
+  uint32_t sum = 0;
+  for (uint8_t i = 0; i < frame.payloadLength; i++)
+  {
+    sum += frame.payload[i];
+  }
+  for (uint8_t kind = 0; kind < 16; kind++)
+  {
+    FrameExtensionView extension;
+    if (frame.find(kind, 0, extension))
+    {
+      for (uint8_t i = 0; i < extension.length; i++)
+      {
+        sum += extension.value[i];
+      }
+    }
+  }
+  return sum;
+}
+
+uint32_t g_failures = 0;
+
+void fail(const char *check, uint32_t iteration)
+{
+  if (g_failures++ < 10)
+  {
+    printf("FAIL %s at iteration %u\n", check, iteration);
+  }
+}
+
+void checkProperties(uint32_t iterations)
+{
+  Random random;
+  // one more than a frame, for the too long case
+  uint8_t buffer[FRAME_MAX_LENGTH + 1];
+  uint32_t encoded = 0;
+  uint32_t overflowed = 0;
+  uint32_t flipsCaught = 0;
+  uint32_t cuts = 0;
+  uint32_t cutsAccepted = 0;
+  for (uint32_t i = 0; i < iterations; i++)
+  {
+    FrameSpec spec;
+    randomSpec(random, spec);
+    const size_t length = encodeSpec(spec, buffer, FRAME_MAX_LENGTH);
+    if (length == 0)
+    {
+      // only when the frame does not fit
+      size_t needed = FRAME_HEADER_LENGTH + (spec.type == FRAME_STATUS) + FRAME_CHECK_LENGTH;
+      for (uint8_t j = 0; j < spec.extensionCount; j++)
+      {
+        needed += 1 + spec.lengths[j];
+      }
+      if (needed <= FRAME_MAX_LENGTH)
+      {
+        fail("encode overflow", i);
+      }
+      overflowed++;
+      continue;
+    }
+    encoded++;
+
+    FrameView frame;
+    if (decodeFrame(buffer, length, frame) != FRAME_OK || !matchesSpec(frame, spec))
+    {
+      fail("round trip", i);
+    }
+    // a frame that does not fit a smaller buffer is refused, not cut off
+    if (encodeSpec(spec, buffer, length - 1) != 0)
+    {
+      fail("short buffer", i);
+    }
+    encodeSpec(spec, buffer, FRAME_MAX_LENGTH);
+    // a truncated frame only gets through if its last byte happens to be
+    // the check of the rest, 1 in 256 for a CRC-8
+    for (size_t cut = FRAME_HEADER_LENGTH + FRAME_CHECK_LENGTH; cut < length; cut++)
+    {
+      cuts++;
+      cutsAccepted += decodeFrame(buffer, cut, frame) == FRAME_OK;
+    }
+    // the CRC catches every single bit flip, the version nibble some before it
+    const size_t bit = random.next() % (length * 8);
+    buffer[bit / 8] ^= (uint8_t)(1 << (bit % 8));
+    if (decodeFrame(buffer, length, frame) == FRAME_OK)
+    {
+      fail("bit flip", i);
+    }
+    else
+    {
+      flipsCaught++;
+    }
+  }
+
+  if (cutsAccepted * 128 > cuts)
+  {
+    fail("truncation", iterations);
+  }
+
+  // random bytes with a valid version and check: must decode or fail cleanly
+  uint32_t accepted = 0;
+  uint32_t errors[FRAME_BAD_EXTENSION + 1] = {};
+  volatile uint32_t sink = 0;
+  for (uint32_t i = 0; i < iterations; i++)
+  {
+    const size_t length = random.next() % (FRAME_MAX_LENGTH + 2);
+    for (size_t j = 0; j < length; j++)
+    {
+      buffer[j] = random.byte();
+    }
+    if (length > FRAME_CHECK_LENGTH && length <= FRAME_MAX_LENGTH)
+    {
+      buffer[0] = (uint8_t)(FRAME_VERSION << 4 | (buffer[0] & 0x0f));
+      buffer[length - 1] = frameCrc8(buffer, length - 1);
+    }
+    FrameView frame;
+    const FrameError error = decodeFrame(buffer, length, frame);
+    errors[error]++;
+    if (error == FRAME_OK)
+    {
+      accepted++;
+      sink = sink + touchExtensions(frame);
+    }
+  }
+
+  printf("round trips:  %u encoded, %u too long for a frame, %u bit flips caught\n", encoded, overflowed, flipsCaught);
+  printf("truncations:  %u of %u accepted\n", cutsAccepted, cuts);
+  printf("random input: %u accepted", accepted);
+  for (uint8_t error = FRAME_TOO_SHORT; error <= FRAME_BAD_EXTENSION; error++)
+  {
+    printf(", %u %s", errors[error], frameErrorName((FrameError)error));
+  }
+  printf("\n");
+}
+
+double nsPerCall(std::chrono::steady_clock::time_point start, uint32_t calls)
+{
+  const auto elapsed = std::chrono::steady_clock::now() - start;
+  return std::chrono::duration<double, std::nano>(elapsed).count() / calls;
+}
+
+// the sensor's status frame, the common case on both ends
+void benchmark(uint32_t iterations)
+{
+  uint8_t buffer[FRAME_MAX_LENGTH];
+  const uint8_t pulses[2] = {3, 1};
+  volatile uint32_t sink = 0;
+
+  auto start = std::chrono::steady_clock::now();
+  size_t length = 0;
+  for (uint32_t i = 0; i < iterations; i++)
+  {
+    FrameWriter writer(buffer, sizeof(buffer));
+    length = writer.begin(FRAME_STATUS, 0x12345678, (uint16_t)i)
+                 .status(0x05)
+                 .extension(EXT_PULSE_COUNTS, pulses, sizeof(pulses))
+                 .finish();
+    sink = sink + buffer[length - 1];
+  }
+  const double encodeNs = nsPerCall(start, iterations);
+
+  start = std::chrono::steady_clock::now();
+  for (uint32_t i = 0; i < iterations; i++)
+  {
+    FrameView frame;
+    FrameExtensionView extension;
+    if (decodeFrame(buffer, length, frame) == FRAME_OK && frame.find(EXT_PULSE_COUNTS, 2, extension))
+    {
+      sink = sink + extension.value[0];
+    }
+  }
+  const double decodeNs = nsPerCall(start, iterations);
+
+  printf("status frame: %zu bytes, encode %.1f ns, decode %.1f ns\n", length, encodeNs, decodeNs);
+}
+
+} // namespace
+
+int codecCheck(int argc, char **argv)
+{
+  const uint32_t iterations = argc > 0 ? (uint32_t)strtoul(argv[0], nullptr, 10) : 100000;
+  if (iterations == 0)
+  {
+    fprintf(stderr, "usage: program codec [iterations]\n");
+    return 2;
+  }
+  checkProperties(iterations);
+  benchmark(iterations * 10);
+  if (g_failures)
+  {
+    printf("%u check(s) failed\n", g_failures);
+    return 1;
+  }
+  printf("all checks passed\n");
+  return 0;
+}
+
+#ifdef LETTERMAN_FUZZ
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+  FrameView frame;
+  if (decodeFrame(data, size, frame) == FRAME_OK)
+  {
+    // whatever decodes has to encode back to the same bytes
+    uint8_t buffer[FRAME_MAX_LENGTH];
+    FrameWriter writer(buffer, sizeof(buffer));
+    writer.begin(frame.type, frame.nodeId, frame.counter);
+    if (frame.type == FRAME_STATUS)
+    {
+      writer.status(frame.status);
+    }
+    writer.payload(frame.payload, frame.payloadLength);
+    size_t offset = 0;
+    while (offset < frame.extensionsLength)
+    {
+      const uint8_t tag = frame.extensions[offset];
+      writer.extension((FrameExtension)(tag >> 4), &frame.extensions[offset + 1], tag & 0x0f);
+      offset += 1 + (tag & 0x0f);
+    }
+    if (writer.finish() != size || memcmp(buffer, data, size) != 0)
+    {
+      abort();
+    }
+  }
+  return 0;
+}
+#endif
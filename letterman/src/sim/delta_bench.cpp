@@ -0,0 +1,486 @@
+// Host checks for firmware updates over LoRa: Ed25519 (ed25519.h) against
+// the RFC 8032 test vectors, delta round trips between two builds
+// (delta_encoder.h, firmware_delta.h), their signatures and the recovery of a
+// lost fragment from its block's parity (fuota.h). Also makes
+// the update key and the signed deltas for the gateway.
+//
+//   program delta                         synthetic builds, as in the
+//                                         firmware-update scenario
+//   program delta <base.bin> <target.bin> [<key> <out>]
+//                                         two builds from pio, signed with the
+//                                         key's seed, writes the delta for
+//                                         the gateway
+//   program keygen <key>                  writes a new seed to <key> and
+//                                         prints LETTERMAN_UPDATE_KEY
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include "delta_encoder.h"
+#include "fuota.h"
+
+namespace
+{
+
+// xorshift32, the images are the same on every run
+struct Random
+{
+  uint32_t state = 0x4c6d;
+
+  uint32_t next()
+  {
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+  }
+
+  uint32_t below(uint32_t limit)
+  {
+    return next() % limit;
+  }
+};
+
+// a function of the synthetic image: code with the addresses of the ones it
+// calls in its literal pool, the linker fills them in
+struct SimFunction
+{
+  uint32_t id;
+  std::vector<uint8_t> code;
+  std::vector<uint16_t> poolOffsets;
+  std::vector<uint32_t> callees;
+};
+
+const uint32_t SIM_FUNCTIONS = 600;
+const uint32_t SIM_CODE_ADDRESS = 0x42000020;
+
+SimFunction simFunction(Random &random, uint32_t id, uint32_t functions)
+{
+  SimFunction function;
+  function.id = id;
+  function.code.resize(64 + random.below(144) * 4);
+  for (uint8_t &byte : function.code)
+  {
+    byte = (uint8_t)random.next();
+  }
+  const uint32_t calls = 1 + random.below(4);
+  for (uint32_t i = 0; i < calls; i++)
+  {
+    function.poolOffsets.push_back((uint16_t)(random.below((uint32_t)function.code.size() / 4) * 4));
+    function.callees.push_back(random.below(functions));
+  }
+  return function;
+}
+
+// image header, segment header and app description with the build id, then
+// the functions with their calls linked
+std::vector<uint8_t> simLink(const std::vector<SimFunction> &functions, uint32_t buildId)
+{
+  std::vector<uint8_t> image(FIRMWARE_BUILD_ID_OFFSET + 112, 0);
+  image[0] = 0xe9;
+  framePutLe32(&image[FIRMWARE_BUILD_ID_OFFSET], buildId);
+  std::vector<uint32_t> addresses(SIM_FUNCTIONS + functions.size());
+  uint32_t address = SIM_CODE_ADDRESS + (uint32_t)image.size();
+  for (const SimFunction &function : functions)
+  {
+    addresses[function.id] = address;
+    address += (uint32_t)function.code.size();
+  }
+  for (const SimFunction &function : functions)
+  {
+    const size_t start = image.size();
+    image.insert(image.end(), function.code.begin(), function.code.end());
+    for (size_t i = 0; i < function.poolOffsets.size(); i++)
+    {
+      framePutLe32(&image[start + function.poolOffsets[i]], addresses[function.callees[i]]);
+    }
+  }
+  return image;
+}
+
+// Io of DeltaDecoder over vectors
+struct VectorIo
+{
+  const std::vector<uint8_t> &delta;
+  const std::vector<uint8_t> &base;
+  std::vector<uint8_t> target;
+
+  static bool read(const std::vector<uint8_t> &from, uint32_t offset, uint8_t *data, size_t length)
+  {
+    if (offset > from.size() || length > from.size() - offset)
+    {
+      return false;
+    }
+    memcpy(data, &from[offset], length);
+    return true;
+  }
+
+  bool readDelta(uint32_t offset, uint8_t *data, size_t length)
+  {
+    return read(delta, offset, data, length);
+  }
+
+  bool readBase(uint32_t offset, uint8_t *data, size_t length)
+  {
+    return read(base, offset, data, length);
+  }
+
+  bool write(const uint8_t *data, size_t length)
+  {
+    target.insert(target.end(), data, data + length);
+    return true;
+  }
+};
+
+bool readFile(const char *path, std::vector<uint8_t> &data)
+{
+  FILE *file = fopen(path, "rb");
+  if (file == nullptr)
+  {
+    return false;
+  }
+  uint8_t chunk[4096];
+  size_t read;
+  while ((read = fread(chunk, 1, sizeof(chunk), file)) > 0)
+  {
+    data.insert(data.end(), chunk, chunk + read);
+  }
+  fclose(file);
+  return true;
+}
+
+bool writeFile(const char *path, const std::vector<uint8_t> &data)
+{
+  FILE *file = fopen(path, "wb");
+  const bool written = file != nullptr && fwrite(data.data(), 1, data.size(), file) == data.size();
+  if (file != nullptr)
+  {
+    fclose(file);
+  }
+  return written;
+}
+
+// RFC 8032 section 7.1, TEST 1, 2, 3 and SHA(abc): seed, public key, message, signature
+struct SignatureVector
+{
+  const char *seed;
+  const char *key;
+  const char *message;
+  const char *signature;
+};
+
+const SignatureVector RFC8032_VECTORS[] = {
+    {"9d61b19deffd5a60ba844af492ec2cc44449c5697b326919703bac031cae7f60",
+     "d75a980182b10ab7d54bfed3c964073a0ee172f3daa62325af021a68f707511a", "",
+     "e5564300c360ac729086e2cc806e828a84877f1eb8e5d974d873e065224901555fb8821590a33bacc61e39701cf9b46bd25bf5f0595bbe24655141438e7a100b"},
+    {"4ccd089b28ff96da9db6c346ec114e0f5b8a319f35aba624da8cf6ed4fb8a6fb",
+     "3d4017c3e843895a92b70aa74d1b7ebc9c982ccf2ec4968cc0cd55f12af4660c", "72",
+     "92a009a9f0d4cab8720e820b5f642540a2b27b5416503f8fb3762223ebdb69da085ac1e43e15996e458f3613d0f11d8c387b2eaeb4302aeeb00d291612bb0c00"},
+    {"c5aa8df43f9f837bedb7442f31dcb7b166d38535076f094b85ce3a2e0b4458f7",
+     "fc51cd8e6218a1a38da47ed00230f0580816ed13ba3303ac5deb911548908025", "af82",
+     "6291d657deec24024827e69c3abe01a30ce548a284743a445e3680d7db5ac3ac18ff9b538d16f290ae67f760984dc6594a7c15e9716ed28dc027beceea1ec40a"},
+    {"833fe62409237b9d62ec77587520911e9a759cec1d19755b7da901b96dca3d42",
+     "ec172b93ad5e563bf4932c70e1245034c35467ef2efd4d64ebf819683467e2bf",
+     "ddaf35a193617abacc417349ae20413112e6fa4e89a97ea20a9eeee64b55d39a"
+     "2192992a274fc1a836ba3c23a3feebbd454d4423643ce80e2a9ac94fa54ca49f",
+     "dc2a4459e7369633a52b1bf277839a00201009a3efbf3ecb69bea2186c26b58909351fc9ac90b3ecfdfbc7c66431e0303dca179c138ac17ad9bef1177331a704"},
+};
+
+// the group order L, little endian
+const uint8_t ED25519_ORDER[32] = {0xed, 0xd3, 0xf5, 0x5c, 0x1a, 0x63, 0x12, 0x58, 0xd6, 0x9c, 0xf7,
+                                   0xa2, 0xde, 0xf9, 0xde, 0x14, 0, 0, 0, 0, 0, 0,
+                                   0, 0, 0, 0, 0, 0, 0, 0, 0, 0x10};
+
+std::vector<uint8_t> fromHex(const char *hex)
+{
+  std::vector<uint8_t> data;
+  for (; hex[0] != 0 && hex[1] != 0; hex += 2)
+  {
+    unsigned byte;
+    sscanf(hex, "%2x", &byte);
+    data.push_back((uint8_t)byte);
+  }
+  return data;
+}
+
+bool verifySignature(const uint8_t *key, const std::vector<uint8_t> &message, const uint8_t *signature)
+{
+  Ed25519::Verifier verifier;
+  if (!verifier.begin(key, signature))
+  {
+    return false;
+  }
+  // in two pieces, the way a delta comes in
+  const size_t half = message.size() / 2;
+  verifier.update(message.data(), half);
+  verifier.update(message.data() + half, message.size() - half);
+  return verifier.finish();
+}
+
+// Ed25519 against the RFC 8032 vectors: key, signature and its check, and the
+// refusal of a changed signature or message and of the same S plus L
+bool checkSignatureVectors()
+{
+  bool passed = true;
+  for (size_t i = 0; i < sizeof(RFC8032_VECTORS) / sizeof(RFC8032_VECTORS[0]); i++)
+  {
+    const SignatureVector &vector = RFC8032_VECTORS[i];
+    const std::vector<uint8_t> seed = fromHex(vector.seed);
+    const std::vector<uint8_t> expectedKey = fromHex(vector.key);
+    std::vector<uint8_t> message = fromHex(vector.message);
+    const std::vector<uint8_t> expected = fromHex(vector.signature);
+
+    uint8_t key[Ed25519::KEY_LENGTH];
+    uint8_t signature[Ed25519::SIGNATURE_LENGTH];
+    Ed25519::publicKey(seed.data(), key);
+    Ed25519::sign(seed.data(), message.data(), message.size(), signature);
+    const char *failed = nullptr;
+    if (memcmp(key, expectedKey.data(), sizeof(key)) != 0)
+    {
+      failed = "public key";
+    }
+    else if (memcmp(signature, expected.data(), sizeof(signature)) != 0)
+    {
+      failed = "signature";
+    }
+    else if (!verifySignature(key, message, signature))
+    {
+      failed = "check of the signature";
+    }
+
+    uint8_t changed[Ed25519::SIGNATURE_LENGTH];
+    for (size_t at : {(size_t)0, (size_t)31, (size_t)32, (size_t)63})
+    {
+      memcpy(changed, signature, sizeof(changed));
+      changed[at] ^= 0x01;
+      if (failed == nullptr && verifySignature(key, message, changed))
+      {
+        failed = "changed signature accepted";
+      }
+    }
+    // S + L is the same point but has to be refused, or signatures are malleable
+    memcpy(changed, signature, sizeof(changed));
+    unsigned carry = 0;
+    for (size_t j = 0; j < 32; j++)
+    {
+      carry += changed[32 + j] + ED25519_ORDER[j];
+      changed[32 + j] = (uint8_t)carry;
+      carry >>= 8;
+    }
+    if (failed == nullptr && verifySignature(key, message, changed))
+    {
+      failed = "S + L accepted";
+    }
+    message.push_back(0);
+    if (failed == nullptr && verifySignature(key, message, signature))
+    {
+      failed = "changed message accepted";
+    }
+    if (failed != nullptr)
+    {
+      printf("FAIL RFC 8032 vector %zu: %s\n", i + 1, failed);
+      passed = false;
+    }
+  }
+  return passed;
+}
+
+// every fragment of the delta lost once, and got back from the rest of its block
+bool checkParityRecovery(const std::vector<uint8_t> &delta)
+{
+  const uint32_t length = (uint32_t)delta.size();
+  for (uint16_t lost = 0; lost < fuotaFragmentCount(length); lost++)
+  {
+    const uint16_t block = lost / FUOTA_BLOCK_FRAGMENTS;
+    auto read = [&](uint16_t fragment, uint8_t *data, uint8_t fragmentLength)
+    {
+      memcpy(data, &delta[(size_t)fragment * FUOTA_FRAGMENT_SIZE], fragmentLength);
+      return true;
+    };
+    auto readWithoutLost = [&](uint16_t fragment, uint8_t *data, uint8_t fragmentLength)
+    {
+      if (fragment == lost)
+      {
+        memset(data, 0, fragmentLength);
+        return true;
+      }
+      return read(fragment, data, fragmentLength);
+    };
+    uint8_t parity[FUOTA_FRAGMENT_SIZE];
+    uint8_t recovered[FUOTA_FRAGMENT_SIZE];
+    fuotaParity(read, length, block, parity);
+    fuotaParity(readWithoutLost, length, block, recovered);
+    for (uint8_t i = 0; i < FUOTA_FRAGMENT_SIZE; i++)
+    {
+      recovered[i] ^= parity[i];
+    }
+    if (memcmp(recovered, &delta[(size_t)lost * FUOTA_FRAGMENT_SIZE], fuotaFragmentLength(length, lost)) != 0)
+    {
+      printf("FAIL parity recovery of fragment %u\n", lost);
+      return false;
+    }
+  }
+  return true;
+}
+
+} // namespace
+
+// Two builds of about 200 KB for the firmware-update scenario: the target has
+// three functions added in the middle, which moves everything after them and
+// changes every call to it, one function rewritten, small edits in twenty
+// others and a new build id.
+void simFirmwareImages(std::vector<uint8_t> &base, std::vector<uint8_t> &target)
+{
+  Random random;
+  std::vector<SimFunction> functions;
+  for (uint32_t id = 0; id < SIM_FUNCTIONS; id++)
+  {
+    functions.push_back(simFunction(random, id, SIM_FUNCTIONS));
+  }
+  base = simLink(functions, 0x5eed0001);
+
+  for (uint32_t i = 0; i < 3; i++)
+  {
+    functions.insert(functions.begin() + SIM_FUNCTIONS / 3 + i, simFunction(random, SIM_FUNCTIONS + i, SIM_FUNCTIONS));
+  }
+  // the new ones get called
+  functions[SIM_FUNCTIONS / 3 - 1].callees[0] = SIM_FUNCTIONS;
+  functions[SIM_FUNCTIONS / 2] = simFunction(random, functions[SIM_FUNCTIONS / 2].id, SIM_FUNCTIONS);
+  for (uint32_t i = 0; i < 20; i++)
+  {
+    std::vector<uint8_t> &code = functions[random.below((uint32_t)functions.size())].code;
+    const uint32_t at = random.below((uint32_t)code.size() - 8);
+    const uint32_t length = 2 + random.below(6);
+    for (uint32_t j = 0; j < length; j++)
+    {
+      code[at + j] = (uint8_t)random.next();
+    }
+  }
+  target = simLink(functions, 0x5eed0002);
+}
+
+int deltaBench(int argc, char **argv)
+{
+  std::vector<uint8_t> base;
+  std::vector<uint8_t> target;
+  std::vector<uint8_t> seed(SIM_UPDATE_SEED, SIM_UPDATE_SEED + sizeof(SIM_UPDATE_SEED));
+  if (argc == 0)
+  {
+    simFirmwareImages(base, target);
+  }
+  else if ((argc != 2 && argc != 4) || !readFile(argv[0], base) || !readFile(argv[1], target) ||
+           (argc == 4 && (!readFile(argv[2], seed) || seed.size() != Ed25519::KEY_LENGTH)))
+  {
+    fprintf(stderr, "usage: program delta [<base.bin> <target.bin> [<key> <out>]]\n");
+    return 2;
+  }
+
+  const std::vector<uint8_t> delta = DeltaEncoder::encode(base, target, seed.data());
+  uint8_t key[Ed25519::KEY_LENGTH];
+  Ed25519::publicKey(seed.data(), key);
+  VectorIo io = {delta, base, {}};
+  DeltaDecoder decoder;
+  const DeltaError error =
+      decoder.apply(io, (uint32_t)delta.size(), firmwareImageBuildId(base.data(), base.size()), key);
+  const uint16_t fragments = fuotaFragmentCount((uint32_t)delta.size());
+  const uint16_t windows = (fragments + FUOTA_WINDOW_FRAGMENTS - 1) / FUOTA_WINDOW_FRAGMENTS;
+  printf("build %08x -> %08x: %zu -> %zu bytes, delta %zu bytes (%.1f %%)\n",
+         firmwareImageBuildId(base.data(), base.size()), firmwareImageBuildId(target.data(), target.size()),
+         base.size(), target.size(), delta.size(), 100.0 * delta.size() / target.size());
+  printf("fragments:    %u in %u windows, %u frames with parity\n", fragments, windows,
+         fragments + (fragments + FUOTA_BLOCK_FRAGMENTS - 1) / FUOTA_BLOCK_FRAGMENTS);
+
+  bool passed = checkSignatureVectors();
+  if (error != DELTA_OK || io.target != target)
+  {
+    printf("FAIL round trip: %s after %u bytes\n", deltaErrorName(error), decoder.written());
+    passed = false;
+  }
+  // a delta against another build is refused before anything is written
+  VectorIo wrongBase = {delta, base, {}};
+  if (decoder.apply(wrongBase, (uint32_t)delta.size(), firmwareImageBuildId(base.data(), base.size()) + 1, key) !=
+          DELTA_WRONG_BASE ||
+      !wrongBase.target.empty())
+  {
+    printf("FAIL wrong base\n");
+    passed = false;
+  }
+  // a truncated one ends in an error
+  VectorIo truncated = {delta, base, {}};
+  if (decoder.apply(truncated, (uint32_t)delta.size() - 1, firmwareImageBuildId(base.data(), base.size()), key) ==
+      DELTA_OK)
+  {
+    printf("FAIL truncated delta\n");
+    passed = false;
+  }
+  // and one changed anywhere, or checked with another key, is refused before
+  // anything is written
+  for (size_t at : {(size_t)0, (size_t)DELTA_HEADER_LENGTH + 1, delta.size() / 2, delta.size() - 1})
+  {
+    std::vector<uint8_t> forged = delta;
+    forged[at] ^= 0x10;
+    VectorIo forgedIo = {forged, base, {}};
+    const DeltaError forgedError =
+        decoder.apply(forgedIo, (uint32_t)forged.size(), firmwareImageBuildId(base.data(), base.size()), key);
+    if (forgedError == DELTA_OK || !forgedIo.target.empty())
+    {
+      printf("FAIL delta changed at %zu: %s\n", at, deltaErrorName(forgedError));
+      passed = false;
+    }
+  }
+  uint8_t otherKey[Ed25519::KEY_LENGTH];
+  const uint8_t otherSeed[Ed25519::KEY_LENGTH] = {1};
+  Ed25519::publicKey(otherSeed, otherKey);
+  VectorIo otherIo = {delta, base, {}};
+  if (decoder.apply(otherIo, (uint32_t)delta.size(), firmwareImageBuildId(base.data(), base.size()), otherKey) !=
+          DELTA_BAD_SIGNATURE ||
+      !otherIo.target.empty())
+  {
+    printf("FAIL delta checked with another key\n");
+    passed = false;
+  }
+  passed &= checkParityRecovery(delta);
+
+  if (argc == 4 && !writeFile(argv[3], delta))
+  {
+    fprintf(stderr, "writing %s failed\n", argv[3]);
+    return 1;
+  }
+  printf(passed ? "all checks passed\n" : "checks failed\n");
+  return passed ? 0 : 1;
+}
+
+int keygen(int argc, char **argv)
+{
+  if (argc != 1)
+  {
+    fprintf(stderr, "usage: program keygen <key>\n");
+    return 2;
+  }
+  std::vector<uint8_t> seed;
+  FILE *random = fopen("/dev/urandom", "rb");
+  if (random != nullptr)
+  {
+    seed.resize(Ed25519::KEY_LENGTH);
+    if (fread(seed.data(), 1, seed.size(), random) != seed.size())
+    {
+      seed.clear();
+    }
+    fclose(random);
+  }
+  if (seed.empty() || !writeFile(argv[0], seed))
+  {
+    fprintf(stderr, "writing a new key to %s failed\n", argv[0]);
+    return 1;
+  }
+  uint8_t key[Ed25519::KEY_LENGTH];
+  Ed25519::publicKey(seed.data(), key);
+  printf("keep %s secret, it signs the updates. The sensor builds need\n  -DLETTERMAN_UPDATE_KEY=\\\"", argv[0]);
+  for (uint8_t byte : key)
+  {
+    printf("%02x", byte);
+  }
+  printf("\\\"\n");
+  return 0;
+}
@@ -0,0 +1,244 @@
+#pragma once
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+#include "firmware_delta.h"
+
+// Host side of firmware_delta.h, used by `program delta` and the
+// firmware-update scenario. A greedy matcher over the base image and the
+// target written so far: a new build mostly moves code by whole functions and
+// changes the addresses in it, so next to the longest match it tries the base
+// right where the previous copy left off, and the changed words in between
+// become short literals.
+//
+// The delta is signed with the seed of the update key, the node's build has
+// its public half (LETTERMAN_UPDATE_KEY).
+
+// update key of the simulation and of the checks of `program delta`, never
+// the one of real sensors
+static const uint8_t SIM_UPDATE_SEED[Ed25519::KEY_LENGTH] = {
+    0x4c, 0x65, 0x74, 0x74, 0x65, 0x72, 0x6d, 0x61, 0x6e, 0x20, 0x73, 0x69, 0x6d, 0x75, 0x6c, 0x61,
+    0x74, 0x69, 0x6f, 0x6e, 0x20, 0x6b, 0x65, 0x79, 0x2c, 0x20, 0x6e, 0x6f, 0x74, 0x20, 0x69, 0x74};
+
+class DeltaEncoder
+{
+public:
+  static std::vector<uint8_t> encode(const std::vector<uint8_t> &base, const std::vector<uint8_t> &target,
+                                     const uint8_t *seed)
+  {
+    DeltaEncoder encoder(base, target);
+    std::vector<uint8_t> delta = encoder.run();
+    uint8_t signature[DELTA_SIGNATURE_LENGTH];
+    Ed25519::sign(seed, delta.data(), delta.size(), signature);
+    delta.insert(delta.end(), signature, signature + sizeof(signature));
+    return delta;
+  }
+
+private:
+  // matches are found by their first KEY_LENGTH bytes
+  static constexpr size_t KEY_LENGTH = 8;
+  // candidates looked at per key, the most recent ones
+  static constexpr size_t MAX_CANDIDATES = 32;
+
+  struct Match
+  {
+    DeltaOp op = DELTA_LITERAL;
+    uint32_t length = 0;
+    // base offset of a copy, distance of a repeat
+    uint32_t from = 0;
+    int32_t gain = 0;
+  };
+
+  DeltaEncoder(const std::vector<uint8_t> &base, const std::vector<uint8_t> &target) : m_base(base), m_target(target)
+  {
+  }
+
+  static uint64_t key(const std::vector<uint8_t> &data, size_t offset)
+  {
+    uint64_t value = 0;
+    for (size_t i = 0; i < KEY_LENGTH; i++)
+    {
+      value = value << 8 | data[offset + i];
+    }
+    return value;
+  }
+
+  static size_t varintLength(uint32_t value)
+  {
+    size_t length = 1;
+    for (; value >= 0x80; value >>= 7)
+    {
+      length++;
+    }
+    return length;
+  }
+
+  static void putVarint(std::vector<uint8_t> &out, uint32_t value)
+  {
+    for (; value >= 0x80; value >>= 7)
+    {
+      out.push_back((uint8_t)(value | 0x80));
+    }
+    out.push_back((uint8_t)value);
+  }
+
+  static uint32_t zigzag(int32_t value)
+  {
+    return (uint32_t)value << 1 ^ (uint32_t)(value >> 31);
+  }
+
+  static void putToken(std::vector<uint8_t> &out, DeltaOp op, uint32_t length)
+  {
+    out.push_back((uint8_t)(op << 6 | (length < 64 ? length : 0)));
+    if (length >= 64)
+    {
+      putVarint(out, length);
+    }
+  }
+
+  static size_t tokenLength(uint32_t length)
+  {
+    return 1 + (length < 64 ? 0 : varintLength(length));
+  }
+
+  uint32_t matchLength(const std::vector<uint8_t> &from, size_t fromOffset, size_t offset) const
+  {
+    uint32_t length = 0;
+    while (fromOffset + length < from.size() && offset + length < m_target.size() &&
+           from[fromOffset + length] == m_target[offset + length])
+    {
+      length++;
+    }
+    return length;
+  }
+
+  // bytes a match saves over sending them as a literal
+  void consider(Match &best, DeltaOp op, uint32_t length, uint32_t from, size_t argumentLength) const
+  {
+    const int32_t gain = (int32_t)length - (int32_t)(tokenLength(length) + argumentLength);
+    if (gain > best.gain)
+    {
+      best = {op, length, from, gain};
+    }
+  }
+
+  Match findMatch(size_t offset) const
+  {
+    Match best;
+    // where the previous copy left off, shifted by what was sent since
+    const uint32_t aligned = m_baseOffset + (uint32_t)(offset - m_copyEnd);
+    if (aligned < m_base.size())
+    {
+      consider(best, DELTA_COPY, matchLength(m_base, aligned, offset), aligned,
+               varintLength(zigzag((int32_t)(aligned - m_baseOffset))));
+    }
+    if (m_baseOffset < m_base.size())
+    {
+      consider(best, DELTA_COPY, matchLength(m_base, m_baseOffset, offset), m_baseOffset, 1);
+    }
+    if (offset + KEY_LENGTH > m_target.size())
+    {
+      return best;
+    }
+    const uint64_t k = key(m_target, offset);
+    auto base = m_baseIndex.find(k);
+    if (base != m_baseIndex.end())
+    {
+      const std::vector<uint32_t> &candidates = base->second;
+      for (size_t i = candidates.size(); i-- > 0 && candidates.size() - i <= MAX_CANDIDATES;)
+      {
+        const uint32_t from = candidates[i];
+        consider(best, DELTA_COPY, matchLength(m_base, from, offset), from,
+                 varintLength(zigzag((int32_t)(from - m_baseOffset))));
+      }
+    }
+    auto target = m_targetIndex.find(k);
+    if (target != m_targetIndex.end())
+    {
+      const std::vector<uint32_t> &candidates = target->second;
+      for (size_t i = candidates.size(); i-- > 0 && offset - candidates[i] <= DELTA_WINDOW;)
+      {
+        const uint32_t distance = (uint32_t)(offset - candidates[i]);
+        consider(best, DELTA_REPEAT, matchLength(m_target, candidates[i], offset), distance, varintLength(distance));
+      }
+    }
+    return best;
+  }
+
+  void index(size_t offset)
+  {
+    if (offset + KEY_LENGTH <= m_target.size())
+    {
+      m_targetIndex[key(m_target, offset)].push_back((uint32_t)offset);
+    }
+  }
+
+  void flushLiteral(size_t end)
+  {
+    if (end > m_literalStart)
+    {
+      putToken(m_out, DELTA_LITERAL, (uint32_t)(end - m_literalStart));
+      m_out.insert(m_out.end(), m_target.begin() + m_literalStart, m_target.begin() + end);
+    }
+  }
+
+  std::vector<uint8_t> run()
+  {
+    for (size_t offset = 0; offset + KEY_LENGTH <= m_base.size(); offset++)
+    {
+      m_baseIndex[key(m_base, offset)].push_back((uint32_t)offset);
+    }
+    const DeltaHeader header = {firmwareImageBuildId(m_base.data(), m_base.size()),
+                                firmwareImageBuildId(m_target.data(), m_target.size()), (uint32_t)m_target.size(),
+                                deltaCrc32(0, m_target.data(), m_target.size())};
+    m_out.resize(DELTA_HEADER_LENGTH);
+    writeDeltaHeader(header, m_out.data());
+
+    size_t offset = 0;
+    while (offset < m_target.size())
+    {
+      const Match match = findMatch(offset);
+      // a match has to pay for cutting the literal it interrupts
+      if (match.gain < 2)
+      {
+        index(offset++);
+        continue;
+      }
+      flushLiteral(offset);
+      putToken(m_out, match.op, match.length);
+      if (match.op == DELTA_COPY)
+      {
+        putVarint(m_out, zigzag((int32_t)(match.from - m_baseOffset)));
+        m_baseOffset = match.from + match.length;
+      }
+      else
+      {
+        putVarint(m_out, match.from);
+      }
+      for (uint32_t i = 0; i < match.length; i++)
+      {
+        index(offset + i);
+      }
+      offset += match.length;
+      m_literalStart = offset;
+      if (match.op == DELTA_COPY)
+      {
+        m_copyEnd = offset;
+      }
+    }
+    flushLiteral(offset);
+    return m_out;
+  }
+
+  const std::vector<uint8_t> &m_base;
+  const std::vector<uint8_t> &m_target;
+  std::unordered_map<uint64_t, std::vector<uint32_t>> m_baseIndex;
+  std::unordered_map<uint64_t, std::vector<uint32_t>> m_targetIndex;
+  std::vector<uint8_t> m_out;
+  // where the decoder's next copy starts from, and the target offset the
+  // previous copy ended at
+  uint32_t m_baseOffset = 0;
+  size_t m_copyEnd = 0;
+  size_t m_literalStart = 0;
+};
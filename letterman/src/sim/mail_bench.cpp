@@ -0,0 +1,341 @@
+// Host bench for the mail inference (mail_inference.h). Replays recorded
+// input traces, cuts them into bursts the way loop() does and compares what
+// classifyMailBurst() makes of every burst with the label of the trace.
+//
+//   program mail <trace|-> [sweep]
+//
+// trace: serial log of a sensor or the output of `program -v`, '-' reads stdin
+//          edge,<ms>,<channel id>,<level>,<pulses>   printEdge() in main.cpp
+//          label,<delivered|emptied|noise>           what the bursts after it are
+//        other lines are ignored, bursts before the first label are unlabelled
+// sweep: accuracy over a range of thresholds instead of the single bursts
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include "../event_window.h"
+#include "../mail_inference.h"
+
+namespace
+{
+
+struct LabelledBurst
+{
+  uint64_t startMs;
+  MailBurst burst;
+  MailEvent label;
+};
+
+int channelById(const char *id, size_t length)
+{
+  for (uint8_t channel = 0; channel < CHANNEL_COUNT; channel++)
+  {
+    if (strlen(CHANNELS[channel].id) == length && strncmp(CHANNELS[channel].id, id, length) == 0)
+    {
+      return channel;
+    }
+  }
+  return -1;
+}
+
+MailEvent eventByName(const char *name)
+{
+  for (uint8_t event = MAIL_DELIVERED; event <= MAIL_NOISE; event++)
+  {
+    if (strcmp(name, mailEventName((MailEvent)event)) == 0)
+    {
+      return (MailEvent)event;
+    }
+  }
+  return MAIL_NONE;
+}
+
+// Cuts the edges into bursts like loop(): an input still high when the window
+// would close holds it open, a door change closes it right away, with the
+// other edges of the same ms, the inputs of a wake are read all at once. The
+// door counts for every burst while it is open, the bench does not know a door
+// left open.
+class BurstCutter
+{
+public:
+  explicit BurstCutter(std::vector<LabelledBurst> &bursts) : m_bursts(bursts)
+  {
+  }
+
+  void label(MailEvent label)
+  {
+    m_label = label;
+  }
+
+  void edge(uint64_t atMs, uint8_t channel, bool level, uint16_t pulses)
+  {
+    if (m_doorClosing && atMs != m_nowMs)
+    {
+      m_doorClosing = false;
+      finish();
+    }
+    advance(atMs);
+    const bool changed = ((m_levels >> channel) & 1) != level;
+    m_levels = (uint8_t)((m_levels & ~channelBit(channel)) | (level ? channelBit(channel) : 0));
+    if (!changed && pulses == 0)
+    {
+      return;
+    }
+    if (!m_counting && pulses != 0)
+    {
+      m_counting = true;
+      m_current = LabelledBurst();
+      m_current.startMs = atMs;
+      m_current.label = m_label;
+    }
+    m_current.burst.door |= (m_levels & channelBit(CHANNEL_DOOR)) != 0;
+    if (channel == CHANNEL_DOOR)
+    {
+      m_current.burst.door |= changed;
+    }
+    else if (channel == CHANNEL_VIBRATION)
+    {
+      m_current.burst.flapPulses += pulses;
+    }
+    else if (channel == CHANNEL_MOTION)
+    {
+      m_current.burst.motionPulses += pulses;
+    }
+    if (changed)
+    {
+      m_window.edge((uint32_t)atMs, level ? channelBit(channel) : 0);
+    }
+    if (changed && channel == CHANNEL_DOOR)
+    {
+      m_window.close();
+      m_doorClosing = true;
+    }
+  }
+
+  // the trace ended, the last burst closes
+  void flush()
+  {
+    advance(UINT64_MAX);
+    finish();
+  }
+
+private:
+  // plays the window timeouts up to atMs
+  void advance(uint64_t atMs)
+  {
+    for (;;)
+    {
+      const uint32_t closesIn = m_window.closesInMs((uint32_t)m_nowMs);
+      if (closesIn == 0)
+      {
+        if (!m_doorClosing)
+        {
+          finish();
+        }
+        break;
+      }
+      if (m_nowMs + closesIn > atMs)
+      {
+        break;
+      }
+      m_nowMs += closesIn;
+      if ((m_levels & ~channelBit(CHANNEL_DOOR)) != 0)
+      {
+        m_window.hold((uint32_t)m_nowMs);
+      }
+    }
+    m_nowMs = atMs;
+  }
+
+  void finish()
+  {
+    if (m_counting)
+    {
+      m_bursts.push_back(m_current);
+      m_counting = false;
+    }
+    m_window.clear();
+  }
+
+  std::vector<LabelledBurst> &m_bursts;
+  EventWindow m_window{EVENT_WINDOW_QUIET_MS, EVENT_WINDOW_MAX_MS};
+  uint64_t m_nowMs = 0;
+  uint8_t m_levels = 0;
+  MailEvent m_label = MAIL_NONE;
+  bool m_counting = false;
+  // a door change ended the burst, it is finished by the next edge of another ms
+  bool m_doorClosing = false;
+  LabelledBurst m_current = {};
+};
+
+bool readTrace(FILE *trace, std::vector<LabelledBurst> &bursts)
+{
+  BurstCutter cutter(bursts);
+  uint32_t edges = 0;
+  char line[256];
+  while (fgets(line, sizeof(line), trace))
+  {
+    line[strcspn(line, "\r\n")] = '\0';
+    if (strncmp(line, "label,", 6) == 0)
+    {
+      const MailEvent label = eventByName(line + 6);
+      if (label == MAIL_NONE)
+      {
+        fprintf(stderr, "unknown label %s\n", line + 6);
+        return false;
+      }
+      cutter.label(label);
+      continue;
+    }
+    if (strncmp(line, "edge,", 5) != 0)
+    {
+      continue;
+    }
+    char *field;
+    const uint64_t atMs = strtoull(line + 5, &field, 10);
+    const char *id = field + 1;
+    const char *end = strchr(id, ',');
+    unsigned level;
+    unsigned pulses;
+    const int channel = end && *field == ',' ? channelById(id, end - id) : -1;
+    if (channel < 0 || sscanf(end, ",%u,%u", &level, &pulses) != 2)
+    {
+      fprintf(stderr, "bad edge line %s\n", line);
+      return false;
+    }
+    cutter.edge(atMs, (uint8_t)channel, level != 0, (uint16_t)pulses);
+    edges++;
+  }
+  cutter.flush();
+  if (edges == 0)
+  {
+    fprintf(stderr, "no edges in the trace\n");
+    return false;
+  }
+  return true;
+}
+
+// bursts per label and classification, [label][event]
+struct Confusion
+{
+  uint32_t counts[MAIL_NOISE + 1][MAIL_NOISE + 1] = {};
+
+  uint32_t labelled() const
+  {
+    uint32_t total = 0;
+    for (uint8_t label = MAIL_DELIVERED; label <= MAIL_NOISE; label++)
+    {
+      for (uint8_t event = MAIL_DELIVERED; event <= MAIL_NOISE; event++)
+      {
+        total += counts[label][event];
+      }
+    }
+    return total;
+  }
+
+  uint32_t correct() const
+  {
+    uint32_t total = 0;
+    for (uint8_t label = MAIL_DELIVERED; label <= MAIL_NOISE; label++)
+    {
+      total += counts[label][label];
+    }
+    return total;
+  }
+};
+
+Confusion evaluate(const std::vector<LabelledBurst> &bursts, const MailInferenceConfig &config, bool print)
+{
+  Confusion confusion;
+  for (const LabelledBurst &labelled : bursts)
+  {
+    const MailEvent event = classifyMailBurst(labelled.burst, config);
+    confusion.counts[labelled.label][event]++;
+    if (print)
+    {
+      printf("%10.1f %4d %5u %6u  %-9s %-9s%s\n", labelled.startMs / 1000.0, labelled.burst.door,
+             labelled.burst.flapPulses, labelled.burst.motionPulses, mailEventName(labelled.label),
+             mailEventName(event), labelled.label != MAIL_NONE && labelled.label != event ? "  <-" : "");
+    }
+  }
+  return confusion;
+}
+
+void printConfusion(const Confusion &confusion)
+{
+  printf("\n%-10s %9s %9s %9s\n", "label", "delivered", "emptied", "noise");
+  for (uint8_t label = MAIL_NONE; label <= MAIL_NOISE; label++)
+  {
+    printf("%-10s", mailEventName((MailEvent)label));
+    for (uint8_t event = MAIL_DELIVERED; event <= MAIL_NOISE; event++)
+    {
+      printf(" %9u", confusion.counts[label][event]);
+    }
+    printf("\n");
+  }
+  const uint32_t labelled = confusion.labelled();
+  if (labelled != 0)
+  {
+    printf("\n%u of %u labelled bursts right (%.1f %%)\n", confusion.correct(), labelled,
+           100.0 * confusion.correct() / labelled);
+  }
+}
+
+// deliveries missed are mail nobody hears about, noise sent is a message too many
+void sweep(const std::vector<LabelledBurst> &bursts)
+{
+  printf("%5s %6s %9s %7s %11s\n", "flap", "alone", "right", "missed", "false mail");
+  for (uint16_t flapMin = 1; flapMin <= 4; flapMin++)
+  {
+    for (uint16_t aloneMin = 2; aloneMin <= 8; aloneMin++)
+    {
+      const MailInferenceConfig config = {flapMin, aloneMin};
+      const Confusion confusion = evaluate(bursts, config, false);
+      const uint32_t labelled = confusion.labelled();
+      printf("%5u %6u %8.1f%% %7u %11u%s\n", flapMin, aloneMin,
+             labelled ? 100.0 * confusion.correct() / labelled : 0.0,
+             confusion.counts[MAIL_DELIVERED][MAIL_EMPTIED] + confusion.counts[MAIL_DELIVERED][MAIL_NOISE],
+             confusion.counts[MAIL_NOISE][MAIL_DELIVERED],
+             flapMin == MAIL_INFERENCE_DEFAULTS.flapMinPulses && aloneMin == MAIL_INFERENCE_DEFAULTS.flapAloneMinPulses
+                 ? "  (default)"
+                 : "");
+    }
+  }
+}
+
+} // namespace
+
+int mailBench(int argc, char **argv)
+{
+  if (argc < 1)
+  {
+    fprintf(stderr, "usage: program mail <trace|-> [sweep]\n");
+    return 2;
+  }
+  FILE *trace = strcmp(argv[0], "-") == 0 ? stdin : fopen(argv[0], "r");
+  if (trace == nullptr)
+  {
+    fprintf(stderr, "cannot open trace %s\n", argv[0]);
+    return 1;
+  }
+  std::vector<LabelledBurst> bursts;
+  const bool read = readTrace(trace, bursts);
+  if (trace != stdin)
+  {
+    fclose(trace);
+  }
+  if (!read)
+  {
+    return 1;
+  }
+
+  if (argc > 1 && strcmp(argv[1], "sweep") == 0)
+  {
+    sweep(bursts);
+    return 0;
+  }
+  printf("%10s %4s %5s %6s  %-9s %-9s\n", "start s", "door", "flap", "motion", "label", "inferred");
+  printConfusion(evaluate(bursts, MAIL_INFERENCE_DEFAULTS, true));
+  return 0;
+}
@@ -0,0 +1,142 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+
+#include "sim_hal.h"
+#include "../platform.h"
+
+// A scripted mailbox timeline replayed against the firmware.
+struct SimScenario
+{
+  const char *name;
+  const char *description;
+  uint32_t durationMs;
+  // real-world mailbox events in the timeline, used to normalise the results
+  uint32_t events;
+  std::vector<SimInputEdge> edges;
+  // chance of losing a frame in either direction, in percent
+  uint8_t lossPercent = 0;
+  // SNR at the gateway for 0 dBm TX power, the default needs the 10 dBm the
+  // node starts with to keep the gateway's margin
+  float linkGainDb = -12;
+  // from fadeAtMs on the link is fadeDb worse, 0 for never
+  uint32_t fadeAtMs = 0;
+  float fadeDb = 0;
+  // chance of a CAD finding someone else's frame, in percent
+  uint8_t channelBusyPercent = 0;
+  // the node runs a synthetic base build and the gateway offers an update
+  // to another one, see simFirmwareImages() in delta_bench.cpp
+  bool firmwareUpdate = false;
+};
+
+// the door opened for 3 s every intervalMs, count times from startMs on
+inline std::vector<SimInputEdge> simCollections(uint32_t startMs, uint32_t intervalMs, uint8_t count)
+{
+  std::vector<SimInputEdge> edges;
+  for (uint8_t i = 0; i < count; i++)
+  {
+    edges.push_back({startMs + i * intervalMs, INPUT_DOOR, true});
+    edges.push_back({startMs + i * intervalMs + 3000, INPUT_DOOR, false});
+  }
+  return edges;
+}
+
+// pin high for highMs every periodMs, count times from startMs on
+inline std::vector<SimInputEdge> simPulses(uint8_t pin, uint32_t startMs, uint32_t highMs, uint32_t periodMs, uint16_t count)
+{
+  std::vector<SimInputEdge> edges;
+  for (uint16_t i = 0; i < count; i++)
+  {
+    edges.push_back({startMs + i * periodMs, pin, true});
+    edges.push_back({startMs + i * periodMs + highMs, pin, false});
+  }
+  return edges;
+}
+
+// edges have to be sorted by time
+inline std::vector<SimScenario> simScenarios()
+{
+  return {
+      {"vibration-blip", "truck passing by, one short SW420 pulse", 60000, 1,
+       {
+           {10000, INPUT_VIBRATION, true},
+           {10150, INPUT_VIBRATION, false},
+       }},
+      {"delivery", "flap vibration, PIR hold time, second flap bounce", 60000, 1,
+       {
+           {10000, INPUT_VIBRATION, true},
+           {10100, INPUT_MOTION, true},
+           {10300, INPUT_VIBRATION, false},
+           {10800, INPUT_VIBRATION, true},
+           {10900, INPUT_VIBRATION, false},
+           {12600, INPUT_MOTION, false},
+       }},
+      {"delivery-lossy", "delivery over a link losing 30 % of the frames", 60000, 1,
+       {
+           {10000, INPUT_VIBRATION, true},
+           {10100, INPUT_MOTION, true},
+           {10300, INPUT_VIBRATION, false},
+           {10800, INPUT_VIBRATION, true},
+           {10900, INPUT_VIBRATION, false},
+           {12600, INPUT_MOTION, false},
+       },
+       30},
+      {"collect-mail", "door opened for 4 s while taking out the mail", 60000, 1,
+       {
+           {10000, INPUT_DOOR, true},
+           {10500, INPUT_MOTION, true},
+           {13000, INPUT_MOTION, false},
+           {14000, INPUT_DOOR, false},
+       }},
+      {"door-ajar", "door left open for two minutes", 180000, 1,
+       {
+           {10000, INPUT_DOOR, true},
+           {130000, INPUT_DOOR, false},
+       }},
+      {"door-left-open", "door left open for an hour, stuck input handling", 7200000, 1,
+       {
+           {60000, INPUT_DOOR, true},
+           {3660000, INPUT_DOOR, false},
+       }},
+      {"busy-hour", "two deliveries, one collection and three blips in an hour", 3600000, 6,
+       {
+           {120000, INPUT_VIBRATION, true},
+           {120150, INPUT_VIBRATION, false},
+           {600000, INPUT_VIBRATION, true},
+           {600100, INPUT_MOTION, true},
+           {600300, INPUT_VIBRATION, false},
+           {602600, INPUT_MOTION, false},
+           {900000, INPUT_VIBRATION, true},
+           {900200, INPUT_VIBRATION, false},
+           {1500000, INPUT_VIBRATION, true},
+           {1500100, INPUT_MOTION, true},
+           {1500300, INPUT_VIBRATION, false},
+           {1502600, INPUT_MOTION, false},
+           {2400000, INPUT_VIBRATION, true},
+           {2400150, INPUT_VIBRATION, false},
+           {3000000, INPUT_DOOR, true},
+           {3000500, INPUT_MOTION, true},
+           {3003000, INPUT_MOTION, false},
+           {3004000, INPUT_DOOR, false},
+       }},
+      {"idle-hour", "nothing happens, sleep floor only", 3600000, 0, {}},
+      {"near-gateway", "mailbox next to the gateway, 12 collections, link adaptation", 14400000, 12,
+       simCollections(600000, 1200000, 12), 0, 5},
+      {"link-fade", "like near-gateway, then the link gets 25 dB worse", 14400000, 12,
+       simCollections(600000, 1200000, 12), 0, 5, 7800000, 25},
+      {"crowded", "delivery with other nodes on the channel, a quarter of the CADs busy", 60000, 1,
+       {
+           {10000, INPUT_VIBRATION, true},
+           {10100, INPUT_MOTION, true},
+           {10300, INPUT_VIBRATION, false},
+           {10800, INPUT_VIBRATION, true},
+           {10900, INPUT_VIBRATION, false},
+           {12600, INPUT_MOTION, false},
+       },
+       0, -12, 0, 0, 25},
+      {"restless-pir", "PIR in the sun, triggering every 3 s for two hours", 7200000, 1,
+       simPulses(INPUT_MOTION, 60000, 1000, 3000, 2400)},
+      {"firmware-update", "delta update over a link losing 10 %, a collection every 2 h", 43200000, 6,
+       simCollections(3600000, 7200000, 6), 10, -12, 0, 0, 0, true},
+  };
+}
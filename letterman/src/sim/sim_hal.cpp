@@ -0,0 +1,563 @@
+#include "sim_hal.h"
+#include <cstring>
+#include "delta_encoder.h"
+
+SimSerial Serial;
+
+uint64_t SimHal::s_nowUs = 0;
+uint64_t SimHal::s_appStartUs = 0;
+uint64_t SimHal::s_endUs = UINT64_MAX;
+bool SimHal::s_cpuAwake = false;
+bool SimHal::s_cpuLightSleep = false;
+SimRadioState SimHal::s_radioState = SimRadioState::Off;
+bool SimHal::s_radioConfigured = false;
+int8_t SimHal::s_radioTxPowerDbm = 10;
+double SimHal::s_chargeNc = 0;
+SimPowerModel SimHal::s_model;
+const std::vector<SimInputEdge> *SimHal::s_edges = nullptr;
+
+esp_sleep_wakeup_cause_t SimHal::s_wakeupCause = ESP_SLEEP_WAKEUP_UNDEFINED;
+uint64_t SimHal::s_ext1Status = 0;
+uint64_t SimHal::s_ext1Mask = 0;
+esp_sleep_ext1_wakeup_mode_t SimHal::s_ext1Mode = ESP_EXT1_WAKEUP_ANY_HIGH;
+uint64_t SimHal::s_gpioWakeMask = 0;
+uint64_t SimHal::s_gpioWakeLevels = 0;
+uint64_t SimHal::s_timerWakeupUs = 0;
+uint64_t SimHal::s_sleepStartUs = 0;
+InputFilter SimHal::s_filter = {};
+bool SimHal::s_filterRunning = false;
+uint64_t SimHal::s_filterNextSampleUs = 0;
+uint8_t SimHal::s_filterWakeReason = 0;
+
+std::vector<uint64_t> SimHal::s_txStartsUs;
+std::vector<uint32_t> SimHal::s_txAirtimesUs;
+uint64_t SimHal::s_airtimeUs = 0;
+uint64_t SimHal::s_serialBytes = 0;
+
+uint64_t SimHal::s_rngState = 1;
+uint8_t SimHal::s_lossPercent = 0;
+uint8_t SimHal::s_channelBusyPercent = 0;
+float SimHal::s_linkGainDb = 0;
+uint64_t SimHal::s_linkFadeAtUs = UINT64_MAX;
+float SimHal::s_linkFadeDb = 0;
+LinkAdr SimHal::s_gatewayAdr = {};
+void (*SimHal::s_radioIrq)(void) = nullptr;
+bool SimHal::s_radioIrqArmed = false;
+uint64_t SimHal::s_radioIrqAtUs = 0;
+
+std::vector<uint8_t> SimHal::s_firmwareSlots[2];
+uint8_t SimHal::s_runningSlot = 0;
+uint8_t SimHal::s_bootSlot = 0;
+uint32_t SimHal::s_firmwareLength = 0;
+bool SimHal::s_firmwareConfirmed = false;
+std::vector<uint8_t> SimHal::s_updateStorage;
+SimDeltaStore SimHal::s_fuotaStore;
+// the gateway sends with RadioLib's defaults, like the ACKs
+FuotaServer<SimDeltaStore> SimHal::s_fuota(9, 125000, 7, 8);
+FuotaNode SimHal::s_fuotaNode = {};
+
+// the data partition of the default 4 MB partition table
+static const uint32_t UPDATE_STORAGE_SIZE = 0x160000;
+static const uint32_t FLASH_SECTOR_SIZE = 4096;
+static const uint32_t FLASH_PAGE_SIZE = 256;
+
+void SimHal::reset(const std::vector<SimInputEdge> *edges, const SimPowerModel &model)
+{
+  s_nowUs = 0;
+  s_appStartUs = 0;
+  s_endUs = UINT64_MAX;
+  s_cpuAwake = false;
+  s_cpuLightSleep = false;
+  s_radioState = SimRadioState::Off;
+  s_radioConfigured = false;
+  s_radioTxPowerDbm = 10;
+  s_chargeNc = 0;
+  s_model = model;
+  s_edges = edges;
+  s_wakeupCause = ESP_SLEEP_WAKEUP_UNDEFINED;
+  s_ext1Status = 0;
+  s_ext1Mask = 0;
+  s_ext1Mode = ESP_EXT1_WAKEUP_ANY_HIGH;
+  s_gpioWakeMask = 0;
+  s_gpioWakeLevels = 0;
+  s_timerWakeupUs = 0;
+  s_sleepStartUs = 0;
+  s_filter = InputFilter();
+  s_filterRunning = false;
+  s_filterWakeReason = 0;
+  s_txStartsUs.clear();
+  s_txAirtimesUs.clear();
+  s_airtimeUs = 0;
+  s_serialBytes = 0;
+  s_rngState = 1;
+  s_lossPercent = 0;
+  s_channelBusyPercent = 0;
+  s_linkGainDb = 0;
+  s_linkFadeAtUs = UINT64_MAX;
+  s_linkFadeDb = 0;
+  s_gatewayAdr = LinkAdr();
+  s_radioIrq = nullptr;
+  s_radioIrqArmed = false;
+  s_firmwareSlots[0].clear();
+  s_firmwareSlots[1].clear();
+  s_runningSlot = 0;
+  s_bootSlot = 0;
+  s_firmwareLength = 0;
+  s_firmwareConfirmed = false;
+  s_updateStorage.assign(UPDATE_STORAGE_SIZE, 0xff);
+  s_fuotaStore.delta.clear();
+  s_fuota = FuotaServer<SimDeltaStore>(9, 125000, 7, 8);
+  s_fuotaNode = FuotaNode();
+  Serial.begin(0);
+}
+
+static double radioCurrentMa(const SimPowerModel &model, SimRadioState state)
+{
+  switch (state)
+  {
+  case SimRadioState::Sleep:
+    return model.radioSleepMa;
+  case SimRadioState::Standby:
+    return model.radioStandbyMa;
+  case SimRadioState::Tx:
+    return model.radioTxMa(SimHal::s_radioTxPowerDbm);
+  case SimRadioState::Rx:
+    return model.radioRxMa;
+  default:
+    return model.radioOffMa;
+  }
+}
+
+void SimHal::advance(uint64_t us)
+{
+  // split the step where a radio interrupt fires, the firmware sees it right away
+  if (s_radioIrqArmed && s_radioIrqAtUs < s_nowUs + us)
+  {
+    uint64_t before = s_radioIrqAtUs > s_nowUs ? s_radioIrqAtUs - s_nowUs : 0;
+    s_radioIrqArmed = false;
+    advance(before);
+    if (s_radioIrq)
+    {
+      s_radioIrq();
+    }
+    advance(us - before);
+    return;
+  }
+
+  double currentMa = s_cpuAwake ? s_model.cpuActiveMa : s_cpuLightSleep ? s_model.cpuLightSleepMa : s_model.cpuDeepSleepMa;
+  if (!s_cpuAwake && !s_cpuLightSleep && s_filterRunning)
+  {
+    // averaged over the sample period, the runs are far shorter than any step
+    currentMa += s_model.rtcPeripheralsMa + s_model.ulpRunMa * s_model.ulpRunUs / s_filter.config.samplePeriodUs;
+  }
+  currentMa += radioCurrentMa(s_model, s_radioState);
+  // mA * us = nC
+  s_chargeNc += currentMa * (double)us;
+  s_nowUs += us;
+}
+
+bool SimHal::levelAt(uint8_t pin, uint64_t atUs)
+{
+  bool level = false;
+  if (s_edges == nullptr)
+  {
+    return level;
+  }
+  for (const SimInputEdge &edge : *s_edges)
+  {
+    if ((uint64_t)edge.atMs * 1000 > atUs)
+    {
+      break;
+    }
+    if (edge.pin == pin)
+    {
+      level = edge.level;
+    }
+  }
+  return level;
+}
+
+static bool ext1Fires(uint64_t atUs)
+{
+  bool anyHigh = false;
+  bool allLow = true;
+  for (uint8_t pin = 0; pin < 64; pin++)
+  {
+    if ((SimHal::s_ext1Mask & (1ULL << pin)) == 0)
+    {
+      continue;
+    }
+    bool level = SimHal::levelAt(pin, atUs);
+    anyHigh |= level;
+    allLow &= !level;
+  }
+  if (SimHal::s_ext1Mask == 0)
+  {
+    return false;
+  }
+  return SimHal::s_ext1Mode == ESP_EXT1_WAKEUP_ANY_HIGH ? anyHigh : allLow;
+}
+
+static bool gpioFires(uint64_t atUs)
+{
+  for (uint8_t pin = 0; pin < 64; pin++)
+  {
+    if ((SimHal::s_gpioWakeMask & (1ULL << pin)) &&
+        SimHal::levelAt(pin, atUs) == ((SimHal::s_gpioWakeLevels >> pin) & 1))
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+// earliest time in [s_nowUs, untilUs) at which a level triggered source fires;
+// the candidates are now and every later edge
+static bool nextLevelWakeup(bool (*fires)(uint64_t), uint64_t untilUs, uint64_t &wakeUs)
+{
+  if (fires(SimHal::s_nowUs))
+  {
+    wakeUs = SimHal::s_nowUs;
+    return true;
+  }
+  if (SimHal::s_edges == nullptr)
+  {
+    return false;
+  }
+  for (const SimInputEdge &edge : *SimHal::s_edges)
+  {
+    uint64_t atUs = (uint64_t)edge.atMs * 1000;
+    if (atUs <= SimHal::s_nowUs)
+    {
+      continue;
+    }
+    if (atUs >= untilUs)
+    {
+      break;
+    }
+    if (fires(atUs))
+    {
+      wakeUs = atUs;
+      return true;
+    }
+  }
+  return false;
+}
+
+bool SimHal::nextWakeup(uint64_t untilUs, uint64_t &wakeUs, esp_sleep_wakeup_cause_t &cause)
+{
+  bool found = false;
+  if (s_timerWakeupUs != 0 && s_sleepStartUs + s_timerWakeupUs < untilUs)
+  {
+    untilUs = s_sleepStartUs + s_timerWakeupUs;
+    wakeUs = untilUs;
+    cause = ESP_SLEEP_WAKEUP_TIMER;
+    found = true;
+  }
+  if (nextLevelWakeup(ext1Fires, untilUs, wakeUs))
+  {
+    untilUs = wakeUs;
+    cause = ESP_SLEEP_WAKEUP_EXT1;
+    found = true;
+  }
+
+  // the ULP samples until whichever wakeup comes first
+  const uint8_t vibrationPin = s_filter.config.vibrationPin;
+  const uint8_t motionPin = s_filter.config.motionPin;
+  while (s_filterRunning && s_filterNextSampleUs < untilUs)
+  {
+    const uint64_t sampleUs = s_filterNextSampleUs;
+    s_filterNextSampleUs += s_filter.config.samplePeriodUs;
+    uint8_t reason = s_filter.sample(levelAt(vibrationPin, sampleUs), levelAt(motionPin, sampleUs));
+    if (reason != 0)
+    {
+      s_filterRunning = false;
+      s_filterWakeReason = reason;
+      wakeUs = sampleUs;
+      cause = ESP_SLEEP_WAKEUP_ULP;
+      return true;
+    }
+  }
+  return found;
+}
+
+esp_sleep_wakeup_cause_t SimHal::lightSleepStart()
+{
+  uint64_t untilUs = s_endUs;
+  esp_sleep_wakeup_cause_t cause = ESP_SLEEP_WAKEUP_UNDEFINED;
+  if (s_timerWakeupUs != 0 && s_nowUs + s_timerWakeupUs < untilUs)
+  {
+    untilUs = s_nowUs + s_timerWakeupUs;
+    cause = ESP_SLEEP_WAKEUP_TIMER;
+  }
+  uint64_t wakeUs = untilUs;
+  if (nextLevelWakeup(gpioFires, untilUs, wakeUs))
+  {
+    cause = ESP_SLEEP_WAKEUP_GPIO;
+  }
+
+  s_cpuAwake = false;
+  s_cpuLightSleep = true;
+  advance(wakeUs - s_nowUs);
+  s_cpuLightSleep = false;
+  if (cause == ESP_SLEEP_WAKEUP_UNDEFINED)
+  {
+    throw SimScenarioEnd();
+  }
+  s_cpuAwake = true;
+  s_wakeupCause = cause;
+  advance(s_model.lightSleepWakeUs);
+  return cause;
+}
+
+void SimHal::wakeAt(uint64_t wakeUs, esp_sleep_wakeup_cause_t cause)
+{
+  if (wakeUs > s_nowUs)
+  {
+    advance(wakeUs - s_nowUs);
+  }
+  s_wakeupCause = cause;
+  s_ext1Status = 0;
+  if (cause == ESP_SLEEP_WAKEUP_EXT1)
+  {
+    for (uint8_t pin = 0; pin < 64; pin++)
+    {
+      if ((s_ext1Mask & (1ULL << pin)) && levelAt(pin, s_nowUs))
+      {
+        s_ext1Status |= 1ULL << pin;
+      }
+    }
+  }
+  // wakeup sources are cleared by the boot, the firmware has to re-arm them
+  s_ext1Mask = 0;
+  s_gpioWakeMask = 0;
+  s_timerWakeupUs = 0;
+  s_radioIrq = nullptr;
+  s_radioIrqArmed = false;
+  // the bootloader starts the slot the firmware chose
+  s_runningSlot = s_bootSlot;
+  s_cpuAwake = true;
+  Serial.begin(0);
+  advance(s_model.bootUs);
+  s_appStartUs = s_nowUs;
+}
+
+void SimHal::setRadioState(SimRadioState state)
+{
+  s_radioState = state;
+}
+
+void SimHal::armRadioIrq(uint64_t atUs)
+{
+  s_radioIrqArmed = true;
+  s_radioIrqAtUs = atUs;
+}
+
+void SimHal::disarmRadioIrq()
+{
+  s_radioIrqArmed = false;
+}
+
+bool SimHal::frameLost()
+{
+  return random(0, 100) < s_lossPercent;
+}
+
+bool SimHal::channelBusy()
+{
+  // no draw on a quiet channel, the other random numbers stay as they were
+  return s_channelBusyPercent != 0 && random(0, 100) < s_channelBusyPercent;
+}
+
+float SimHal::linkSnrDb(int8_t powerDbm)
+{
+  return s_linkGainDb + powerDbm - (s_nowUs >= s_linkFadeAtUs ? s_linkFadeDb : 0);
+}
+
+static uint32_t flashUnits(uint32_t length, uint32_t unit)
+{
+  return (length + unit - 1) / unit;
+}
+
+bool SimHal::updateStorageErase(uint32_t offset, uint32_t length)
+{
+  length = flashUnits(length, FLASH_SECTOR_SIZE) * FLASH_SECTOR_SIZE;
+  if (offset % FLASH_SECTOR_SIZE != 0 || offset > s_updateStorage.size() || length > s_updateStorage.size() - offset)
+  {
+    return false;
+  }
+  memset(&s_updateStorage[offset], 0xff, length);
+  advance((uint64_t)length / FLASH_SECTOR_SIZE * s_model.flashEraseSectorUs);
+  return true;
+}
+
+// NOR flash: programming only clears bits
+bool SimHal::updateStorageWrite(uint32_t offset, const void *data, size_t length)
+{
+  if (offset > s_updateStorage.size() || length > s_updateStorage.size() - offset)
+  {
+    return false;
+  }
+  const uint8_t *bytes = (const uint8_t *)data;
+  for (size_t i = 0; i < length; i++)
+  {
+    s_updateStorage[offset + i] &= bytes[i];
+  }
+  advance((uint64_t)flashUnits(length, FLASH_PAGE_SIZE) * s_model.flashWritePageUs);
+  return true;
+}
+
+bool SimHal::updateStorageRead(uint32_t offset, void *data, size_t length)
+{
+  if (offset > s_updateStorage.size() || length > s_updateStorage.size() - offset)
+  {
+    return false;
+  }
+  memcpy(data, &s_updateStorage[offset], length);
+  return true;
+}
+
+bool SimHal::firmwareRead(uint32_t offset, uint8_t *data, size_t length)
+{
+  const std::vector<uint8_t> &image = s_firmwareSlots[s_runningSlot];
+  if (offset > image.size() || length > image.size() - offset)
+  {
+    return false;
+  }
+  memcpy(data, &image[offset], length);
+  return true;
+}
+
+bool SimHal::updateKey(uint8_t *key)
+{
+  Ed25519::publicKey(SIM_UPDATE_SEED, key);
+  return true;
+}
+
+bool SimHal::firmwareBegin(uint32_t length)
+{
+  std::vector<uint8_t> &slot = s_firmwareSlots[1 - s_runningSlot];
+  slot.clear();
+  slot.reserve(length);
+  s_firmwareLength = length;
+  advance((uint64_t)flashUnits(length, FLASH_SECTOR_SIZE) * s_model.flashEraseSectorUs);
+  return true;
+}
+
+bool SimHal::firmwareWrite(const uint8_t *data, size_t length)
+{
+  std::vector<uint8_t> &slot = s_firmwareSlots[1 - s_runningSlot];
+  if (length > s_firmwareLength - slot.size())
+  {
+    return false;
+  }
+  slot.insert(slot.end(), data, data + length);
+  advance((uint64_t)flashUnits((uint32_t)length, FLASH_PAGE_SIZE) * s_model.flashWritePageUs);
+  return true;
+}
+
+// esp_ota_end() checks the image, here only its length
+bool SimHal::firmwareFinish()
+{
+  if (s_firmwareSlots[1 - s_runningSlot].size() != s_firmwareLength)
+  {
+    return false;
+  }
+  s_bootSlot = 1 - s_runningSlot;
+  s_firmwareConfirmed = false;
+  return true;
+}
+
+void SimHal::firmwareAbort()
+{
+  s_firmwareSlots[1 - s_runningSlot].clear();
+}
+
+size_t SimSerial::write(const char *data, size_t length)
+{
+  if (m_baud == 0)
+  {
+    // UART not started, output is discarded
+    return length;
+  }
+  if (echo)
+  {
+    fwrite(data, 1, length, stdout);
+  }
+  SimHal::s_serialBytes += length;
+  const uint64_t byteUs = 10ULL * 1000000 / m_baud;
+  if (m_drainedAtUs < SimHal::s_nowUs)
+  {
+    m_drainedAtUs = SimHal::s_nowUs;
+  }
+  m_drainedAtUs += length * byteUs;
+  // block until the tail of this write fits into the FIFO
+  const uint64_t fifoUs = FIFO_SIZE * byteUs;
+  if (m_drainedAtUs > SimHal::s_nowUs + fifoUs)
+  {
+    SimHal::advance(m_drainedAtUs - fifoUs - SimHal::s_nowUs);
+  }
+  return length;
+}
+
+void SimSerial::flush()
+{
+  if (m_baud != 0 && m_drainedAtUs > SimHal::s_nowUs)
+  {
+    SimHal::advance(m_drainedAtUs - SimHal::s_nowUs);
+  }
+}
+
+size_t SimSerial::print(const char *str)
+{
+  return write(str, strlen(str));
+}
+
+size_t SimSerial::print(char c)
+{
+  return write(&c, 1);
+}
+
+size_t SimSerial::print(int value)
+{
+  return printf("%d", value);
+}
+
+size_t SimSerial::print(unsigned int value)
+{
+  return printf("%u", value);
+}
+
+size_t SimSerial::print(long value)
+{
+  return printf("%ld", value);
+}
+
+size_t SimSerial::print(unsigned long value)
+{
+  return printf("%lu", value);
+}
+
+size_t SimSerial::print(double value, int digits)
+{
+  return printf("%.*f", digits, value);
+}
+
+size_t SimSerial::println()
+{
+  return write("\r\n", 2);
+}
+
+size_t SimSerial::printf(const char *format, ...)
+{
+  char buffer[256];
+  va_list args;
+  va_start(args, format);
+  int length = vsnprintf(buffer, sizeof(buffer), format, args);
+  va_end(args);
+  if (length < 0)
+  {
+    return 0;
+  }
+  return write(buffer, (size_t)length < sizeof(buffer) ? (size_t)length : sizeof(buffer) - 1);
+}
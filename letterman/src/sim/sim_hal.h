@@ -0,0 +1,760 @@
+#pragma once
+// Native (host) backend of the hardware layer. Pins are driven by a scripted
+// input timeline, time only moves when the firmware delays, transmits, logs or
+// sleeps, and every microsecond is charged against SimPowerModel.
+#include <cstdint>
+#include <cstddef>
+#include <cstdio>
+#include <cstdarg>
+#include <cmath>
+#include <cstring>
+#include <deque>
+#include <vector>
+
+#include "sim_power.h"
+#include "sim_lora.h"
+#include "../input_filter.h"
+// the gateway's link adaptation, run by the ACK model
+#include "frame_codec.h"
+#include "link_adr.h"
+// and its firmware update server
+#include "fuota_server.h"
+
+// Arduino / ESP-IDF / RadioLib names the firmware uses
+#define F(s) (s)
+#define RTC_DATA_ATTR
+#define IRAM_ATTR
+#define LOW 0x0
+#define HIGH 0x1
+#define INPUT 0x01
+#define OUTPUT 0x03
+
+#define RADIOLIB_ERR_NONE (0)
+#define RADIOLIB_ERR_PACKET_TOO_LONG (-4)
+#define RADIOLIB_ERR_TX_TIMEOUT (-5)
+#define RADIOLIB_ERR_RX_TIMEOUT (-6)
+#define RADIOLIB_LORA_DETECTED (-701)
+#define RADIOLIB_CHANNEL_FREE (-702)
+
+typedef int esp_err_t;
+#define ESP_OK 0
+
+typedef enum
+{
+  ESP_SLEEP_WAKEUP_UNDEFINED,
+  ESP_SLEEP_WAKEUP_ALL,
+  ESP_SLEEP_WAKEUP_EXT0,
+  ESP_SLEEP_WAKEUP_EXT1,
+  ESP_SLEEP_WAKEUP_TIMER,
+  ESP_SLEEP_WAKEUP_TOUCHPAD,
+  ESP_SLEEP_WAKEUP_ULP,
+  ESP_SLEEP_WAKEUP_GPIO,
+} esp_sleep_wakeup_cause_t;
+
+typedef enum
+{
+  ESP_EXT1_WAKEUP_ALL_LOW = 0,
+  ESP_EXT1_WAKEUP_ANY_HIGH = 1,
+} esp_sleep_ext1_wakeup_mode_t;
+
+// thrown by SimHal::deepSleepStart() to unwind out of loop() back to the harness
+struct SimDeepSleep
+{
+};
+
+// thrown when a light sleep reaches the end of the scenario
+struct SimScenarioEnd
+{
+};
+
+// thrown by SimHal::restart(), the harness boots the firmware again
+struct SimRestart
+{
+};
+
+// the update delta of the simulated gateway
+struct SimDeltaStore
+{
+  std::vector<uint8_t> delta;
+
+  bool read(uint32_t offset, uint8_t *data, size_t length) const
+  {
+    if (offset > delta.size() || length > delta.size() - offset)
+    {
+      return false;
+    }
+    memcpy(data, &delta[offset], length);
+    return true;
+  }
+};
+
+// one level change on an input pin, relative to the scenario start
+struct SimInputEdge
+{
+  uint32_t atMs;
+  uint8_t pin;
+  bool level;
+};
+
+enum class SimRadioState
+{
+  Off,
+  Sleep,
+  Standby,
+  Tx,
+  Rx,
+};
+
+class SimRadio;
+
+// RadioLib Module, only the part the warm start uses
+struct SimModule
+{
+  void init()
+  {
+  }
+};
+
+struct SimHal
+{
+  using Radio = SimRadio;
+
+  static void *radioModule()
+  {
+    return nullptr;
+  }
+
+  static uint32_t nodeId()
+  {
+    return 0x5e05e001;
+  }
+
+  // deterministic per scenario, so runs are comparable
+  static long random(long min, long max)
+  {
+    s_rngState = s_rngState * 6364136223846793005ULL + 1442695040888963407ULL;
+    return min + (long)((s_rngState >> 33) % (uint64_t)(max - min));
+  }
+
+  static void pinMode(uint8_t pin, uint8_t mode)
+  {
+    (void)pin;
+    (void)mode;
+  }
+
+  static int digitalRead(uint8_t pin)
+  {
+    return levelAt(pin, s_nowUs) ? HIGH : LOW;
+  }
+
+  static void digitalWrite(uint8_t pin, uint8_t value)
+  {
+    (void)pin;
+    (void)value;
+  }
+
+  static void delay(uint32_t ms)
+  {
+    advance((uint64_t)ms * 1000);
+  }
+
+  static uint32_t millis()
+  {
+    return (uint32_t)(s_nowUs / 1000);
+  }
+
+  // like on target counted from app start, not from the wakeup
+  static uint32_t micros()
+  {
+    return (uint32_t)(s_nowUs - s_appStartUs);
+  }
+
+  static uint64_t rtcMicros()
+  {
+    return s_nowUs;
+  }
+
+  static esp_sleep_wakeup_cause_t wakeupCause()
+  {
+    return s_wakeupCause;
+  }
+
+  static uint64_t ext1WakeupStatus()
+  {
+    return s_ext1Status;
+  }
+
+  static esp_err_t enableExt1Wakeup(uint64_t mask, esp_sleep_ext1_wakeup_mode_t mode)
+  {
+    s_ext1Mask = mask;
+    s_ext1Mode = mode;
+    return ESP_OK;
+  }
+
+  static void disableWakeupSources()
+  {
+    s_ext1Mask = 0;
+    s_gpioWakeMask = 0;
+    s_timerWakeupUs = 0;
+  }
+
+  static esp_err_t enableTimerWakeup(uint64_t us)
+  {
+    s_timerWakeupUs = us;
+    return ESP_OK;
+  }
+
+  static esp_err_t enableGpioWakeup(uint8_t pin, bool level)
+  {
+    s_gpioWakeMask |= 1ULL << pin;
+    if (level)
+    {
+      s_gpioWakeLevels |= 1ULL << pin;
+    }
+    else
+    {
+      s_gpioWakeLevels &= ~(1ULL << pin);
+    }
+    return ESP_OK;
+  }
+
+  static void disableGpioWakeup(uint8_t pin)
+  {
+    s_gpioWakeMask &= ~(1ULL << pin);
+  }
+
+  static esp_sleep_wakeup_cause_t lightSleepStart();
+
+  // the ULP program is InputFilter itself, run by nextWakeup() during deep sleep
+  static bool startInputFilter(const InputFilterConfig &config)
+  {
+    s_filter.begin(config);
+    s_filterRunning = true;
+    s_filterNextSampleUs = s_nowUs + config.samplePeriodUs;
+    s_filterWakeReason = 0;
+    return true;
+  }
+
+  static void stopInputFilter(const InputFilterConfig &config)
+  {
+    (void)config;
+    s_filterRunning = false;
+  }
+
+  static uint8_t inputFilterWakeReason()
+  {
+    return s_filterWakeReason;
+  }
+
+  static void takeInputFilterCounts(uint16_t &vibrationPulses, uint16_t &motionPulses)
+  {
+    vibrationPulses = s_filter.vibrationPulses;
+    motionPulses = s_filter.motionPulses;
+    s_filter.vibrationPulses = 0;
+    s_filter.motionPulses = 0;
+  }
+
+  [[noreturn]] static void deepSleepStart()
+  {
+    s_cpuAwake = false;
+    s_sleepStartUs = s_nowUs;
+    throw SimDeepSleep();
+  }
+
+  // firmware update: two OTA slots and the update storage partition as byte
+  // vectors, flash erases and writes take the time they take on target
+  static uint32_t firmwareBuildId()
+  {
+    const std::vector<uint8_t> &image = s_firmwareSlots[s_runningSlot];
+    return firmwareImageBuildId(image.data(), image.size());
+  }
+
+  static uint32_t updateStorageSize()
+  {
+    return (uint32_t)s_updateStorage.size();
+  }
+
+  static bool updateStorageErase(uint32_t offset, uint32_t length);
+  static bool updateStorageWrite(uint32_t offset, const void *data, size_t length);
+  static bool updateStorageRead(uint32_t offset, void *data, size_t length);
+  static bool firmwareRead(uint32_t offset, uint8_t *data, size_t length);
+  // public half of SIM_UPDATE_SEED, the key the scenarios sign updates with
+  static bool updateKey(uint8_t *key);
+  static bool firmwareBegin(uint32_t length);
+  static bool firmwareWrite(const uint8_t *data, size_t length);
+  static bool firmwareFinish();
+  static void firmwareAbort();
+
+  static void firmwareConfirm()
+  {
+    s_firmwareConfirmed = true;
+  }
+
+  static bool firmwareBootPrevious()
+  {
+    s_bootSlot = 1 - s_runningSlot;
+    return true;
+  }
+
+  [[noreturn]] static void restart()
+  {
+    s_cpuAwake = false;
+    throw SimRestart();
+  }
+
+  // --- simulation control, used by the harness only ---
+
+  // start a new scenario at t = 0 with all inputs low and the board unpowered
+  static void reset(const std::vector<SimInputEdge> *edges, const SimPowerModel &model);
+  // move the virtual clock forward, integrating the current drawn meanwhile
+  static void advance(uint64_t us);
+  // level of a pin at an absolute time according to the input timeline
+  static bool levelAt(uint8_t pin, uint64_t atUs);
+  // earliest time >= s_nowUs at which an armed deep sleep source (ext1, timer
+  // or the input filter) fires, false if none does before untilUs
+  static bool nextWakeup(uint64_t untilUs, uint64_t &wakeUs, esp_sleep_wakeup_cause_t &cause);
+  // sleep until wakeUs, then run the boot sequence and latch the wakeup cause
+  static void wakeAt(uint64_t wakeUs, esp_sleep_wakeup_cause_t cause);
+  static void setRadioState(SimRadioState state);
+  // fire the radio DIO1 callback once the clock reaches atUs
+  static void armRadioIrq(uint64_t atUs);
+  static void disarmRadioIrq();
+  // true with the configured loss probability of the current scenario
+  static bool frameLost();
+  // true with the configured chance of a CAD finding someone else's frame
+  static bool channelBusy();
+  // SNR of a frame sent with the given power, same in both directions
+  static float linkSnrDb(int8_t powerDbm);
+
+  static uint64_t s_nowUs;
+  static uint64_t s_appStartUs;
+  // scenario end, a light sleep does not run past it
+  static uint64_t s_endUs;
+  static bool s_cpuAwake;
+  static bool s_cpuLightSleep;
+  static SimRadioState s_radioState;
+  // SX1262 registers hold a configuration, survives warm sleep only
+  static bool s_radioConfigured;
+  // output power register, survives warm sleep like the rest
+  static int8_t s_radioTxPowerDbm;
+  static double s_chargeNc;
+  static SimPowerModel s_model;
+  static const std::vector<SimInputEdge> *s_edges;
+
+  static esp_sleep_wakeup_cause_t s_wakeupCause;
+  static uint64_t s_ext1Status;
+  static uint64_t s_ext1Mask;
+  static esp_sleep_ext1_wakeup_mode_t s_ext1Mode;
+  static uint64_t s_gpioWakeMask;
+  static uint64_t s_gpioWakeLevels;
+  // 0 if the timer wakeup is disabled
+  static uint64_t s_timerWakeupUs;
+  static uint64_t s_sleepStartUs;
+  static InputFilter s_filter;
+  static bool s_filterRunning;
+  static uint64_t s_filterNextSampleUs;
+  static uint8_t s_filterWakeReason;
+
+  // start and time on air of every transmission in this scenario
+  static std::vector<uint64_t> s_txStartsUs;
+  static std::vector<uint32_t> s_txAirtimesUs;
+  static uint64_t s_airtimeUs;
+  static uint64_t s_serialBytes;
+
+  static uint64_t s_rngState;
+  // chance of losing a frame in either direction, in percent
+  static uint8_t s_lossPercent;
+  // chance of a CAD finding the channel busy, in percent
+  static uint8_t s_channelBusyPercent;
+  // SNR at the other end for 0 dBm TX power, lower by s_linkFadeDb from
+  // s_linkFadeAtUs on
+  static float s_linkGainDb;
+  static uint64_t s_linkFadeAtUs;
+  static float s_linkFadeDb;
+  // link margin estimator of the simulated gateway
+  static LinkAdr s_gatewayAdr;
+  static void (*s_radioIrq)(void);
+  static bool s_radioIrqArmed;
+  static uint64_t s_radioIrqAtUs;
+
+  // OTA slots, a boot starts the firmware in s_bootSlot
+  static std::vector<uint8_t> s_firmwareSlots[2];
+  static uint8_t s_runningSlot;
+  static uint8_t s_bootSlot;
+  // length firmwareBegin() announced, the image written so far is in the other slot
+  static uint32_t s_firmwareLength;
+  static bool s_firmwareConfirmed;
+  static std::vector<uint8_t> s_updateStorage;
+  // update server of the simulated gateway, inactive unless the scenario loads a delta
+  static SimDeltaStore s_fuotaStore;
+  static FuotaServer<SimDeltaStore> s_fuota;
+  static FuotaNode s_fuotaNode;
+};
+
+// a frame the gateway sends to the node
+struct SimDownlink
+{
+  uint64_t startUs;
+  size_t length;
+  uint8_t data[FRAME_MAX_LENGTH];
+};
+
+// SX1262 stand-in. Besides the airtime it models a gateway that acknowledges
+// node frames: the ACK arrives after the gateway turnaround plus its own time on
+// air, if neither the uplink nor the downlink got lost. A frame is lost when
+// the link SNR is below the demodulation floor or by chance, the ACK carries
+// the SF and power the gateway's LinkAdr assigns and what its FuotaServer has
+// to say, the update fragments it grants follow the ACK.
+class SimRadio
+{
+public:
+  SimRadio(void *module)
+  {
+    (void)module;
+  }
+
+  int16_t begin(float freq = 434.0, float bw = 125.0, uint8_t sf = 9, uint8_t cr = 7, uint8_t syncWord = 0x12, int8_t power = 10, uint16_t preambleLength = 8)
+  {
+    (void)syncWord;
+    m_params = SimLoraParams();
+    m_params.freqMhz = freq;
+    m_params.bwKhz = bw;
+    m_params.sf = sf;
+    m_params.cr = cr;
+    m_params.powerDbm = power;
+    m_params.preambleLength = preambleLength;
+    SimHal::s_radioTxPowerDbm = power;
+    m_downlinks.clear();
+    SimHal::setRadioState(SimRadioState::Standby);
+    SimHal::advance(SimHal::s_model.radioBeginUs);
+    SimHal::s_radioConfigured = true;
+    return RADIOLIB_ERR_NONE;
+  }
+
+  SimModule *getMod()
+  {
+    return &m_module;
+  }
+
+  int16_t sleep(bool retainConfig = true)
+  {
+    command();
+    SimHal::disarmRadioIrq();
+    SimHal::setRadioState(SimRadioState::Sleep);
+    SimHal::s_radioConfigured &= retainConfig;
+    return RADIOLIB_ERR_NONE;
+  }
+
+  int16_t setBandwidth(float bw)
+  {
+    m_params.bwKhz = bw;
+    return command();
+  }
+
+  int16_t setSpreadingFactor(uint8_t sf)
+  {
+    m_params.sf = sf;
+    return command();
+  }
+
+  int16_t setOutputPower(int8_t power)
+  {
+    m_params.powerDbm = power;
+    SimHal::s_radioTxPowerDbm = power;
+    return command();
+  }
+
+  int16_t setCodingRate(uint8_t cr)
+  {
+    m_params.cr = cr;
+    return command();
+  }
+
+  int16_t setPreambleLength(uint16_t preambleLength)
+  {
+    m_params.preambleLength = preambleLength;
+    return command();
+  }
+
+  int16_t setCRC(uint8_t len)
+  {
+    m_params.crc = len > 0;
+    return command();
+  }
+
+  int16_t explicitHeader()
+  {
+    m_params.implicitHeader = false;
+    return command();
+  }
+
+  int16_t invertIQ(bool enable)
+  {
+    (void)enable;
+    return command();
+  }
+
+  int16_t transmit(const uint8_t *data, size_t length)
+  {
+    if (length > 255)
+    {
+      return RADIOLIB_ERR_PACKET_TOO_LONG;
+    }
+    // RadioLib goes through standby first, which wakes a sleeping chip
+    standby();
+    SimHal::advance(SimHal::s_model.radioTxOverheadUs / 2);
+    uint32_t toa = loraTimeOnAirUs(m_params, length);
+    SimHal::s_txStartsUs.push_back(SimHal::s_nowUs);
+    SimHal::s_txAirtimesUs.push_back(toa);
+    SimHal::s_airtimeUs += toa;
+    SimHal::setRadioState(SimRadioState::Tx);
+    SimHal::advance(toa);
+    SimHal::setRadioState(SimRadioState::Standby);
+    scheduleAck(data, length);
+    SimHal::advance(SimHal::s_model.radioTxOverheadUs / 2);
+    m_lastLength = length;
+    return RADIOLIB_ERR_NONE;
+  }
+
+  // blocking CAD like RadioLib's: standby, CAD_SYMBOLS symbols of listening
+  // and the detection after them
+  int16_t scanChannel()
+  {
+    standby();
+    SimHal::setRadioState(SimRadioState::Rx);
+    SimHal::advance(((uint64_t)CAD_SYMBOLS * 2 + 1) * symbolUs() / 2);
+    SimHal::setRadioState(SimRadioState::Standby);
+    return SimHal::channelBusy() ? RADIOLIB_LORA_DETECTED : RADIOLIB_CHANNEL_FREE;
+  }
+
+  void setDio1Action(void (*func)(void))
+  {
+    SimHal::s_radioIrq = func;
+  }
+
+  void clearDio1Action()
+  {
+    SimHal::s_radioIrq = nullptr;
+  }
+
+  int16_t startReceive()
+  {
+    SimHal::setRadioState(SimRadioState::Rx);
+    // the preamble has to start while we are listening
+    while (!m_downlinks.empty() && m_downlinks.front().startUs < SimHal::s_nowUs)
+    {
+      m_downlinks.pop_front();
+    }
+    if (!m_downlinks.empty())
+    {
+      SimHal::armRadioIrq(m_downlinks.front().startUs + loraTimeOnAirUs(m_params, m_downlinks.front().length));
+    }
+    return RADIOLIB_ERR_NONE;
+  }
+
+  size_t getPacketLength()
+  {
+    return m_downlinks.empty() ? 0 : m_downlinks.front().length;
+  }
+
+  int16_t readData(uint8_t *data, size_t length)
+  {
+    if (m_downlinks.empty() || m_downlinks.front().startUs + loraTimeOnAirUs(m_params, m_downlinks.front().length) > SimHal::s_nowUs)
+    {
+      return RADIOLIB_ERR_RX_TIMEOUT;
+    }
+    const SimDownlink &downlink = m_downlinks.front();
+    memcpy(data, downlink.data, length < downlink.length ? length : downlink.length);
+    m_downlinks.pop_front();
+    return RADIOLIB_ERR_NONE;
+  }
+
+  int16_t standby()
+  {
+    SimHal::disarmRadioIrq();
+    if (SimHal::s_radioState == SimRadioState::Sleep || SimHal::s_radioState == SimRadioState::Off)
+    {
+      SimHal::advance(SimHal::s_model.radioWakeUs);
+    }
+    SimHal::setRadioState(SimRadioState::Standby);
+    return RADIOLIB_ERR_NONE;
+  }
+
+  float getDataRate() const
+  {
+    if (m_lastLength == 0)
+    {
+      return 0;
+    }
+    return (float)(m_lastLength * 8) / (loraTimeOnAirUs(m_params, m_lastLength) / 1e6f);
+  }
+
+private:
+  // ISR latency, SPI read and the switch to TX on the gateway
+  static constexpr uint32_t GATEWAY_TURNAROUND_US = 5000;
+  // what the gateway listens on and sends its ACKs with, RadioLib defaults
+  static constexpr uint8_t GATEWAY_SF = 9;
+  static constexpr int8_t GATEWAY_POWER_DBM = 10;
+  // RadioLib's RADIOLIB_ERR_WRONG_MODEM, what a chip without configuration reports
+  static constexpr int16_t ERR_WRONG_MODEM = -20;
+  // RadioLib's CAD setting for SF9 and below
+  static constexpr uint32_t CAD_SYMBOLS = 2;
+
+  uint32_t symbolUs() const
+  {
+    return (uint32_t)((1UL << m_params.sf) * 1000.0 / m_params.bwKhz);
+  }
+
+  // a configuration command, rejected if the chip lost its registers
+  int16_t command()
+  {
+    SimHal::advance(SimHal::s_model.radioCommandUs);
+    return SimHal::s_radioConfigured ? RADIOLIB_ERR_NONE : ERR_WRONG_MODEM;
+  }
+
+  void scheduleAck(const uint8_t *data, size_t length)
+  {
+    m_downlinks.clear();
+    FrameView frame;
+    if (decodeFrame(data, length, frame) != FRAME_OK || frame.type != FRAME_STATUS)
+    {
+      return;
+    }
+    const float floor = LinkAdr::requiredSnr(m_params.sf);
+    const float snr = SimHal::linkSnrDb(SimHal::s_radioTxPowerDbm);
+    if (m_params.sf != GATEWAY_SF || snr < floor || SimHal::frameLost())
+    {
+      return;
+    }
+    // like sendAck() and assignLink() on the gateway
+    SimDownlink ack = {};
+    FrameWriter writer(ack.data, sizeof(ack.data));
+    writer.begin(FRAME_ACK, frame.nodeId, frame.counter);
+    LinkAdr &adr = SimHal::s_gatewayAdr;
+    FrameExtensionView reported;
+    if (frame.find(EXT_LINK_SETTINGS, 1, reported))
+    {
+      adr.report(frameLinkSf(reported.value[0]), frameLinkPower(reported.value[0]));
+    }
+    uint8_t sf;
+    int8_t power;
+    if (adr.addFrame(snr) && adr.assign(GATEWAY_SF, GATEWAY_SF, sf, power))
+    {
+      writer.extension(EXT_LINK_SETTINGS, frameLinkSettings(sf, power));
+    }
+    FuotaRequest grant;
+    SimHal::s_fuota.answer(frame, SimHal::s_fuotaNode, SimHal::s_nowUs, FUOTA_GRANT_MAX_FRAMES, writer, grant);
+    ack.length = writer.finish();
+    ack.startUs = SimHal::s_nowUs + GATEWAY_TURNAROUND_US;
+    // the gateway sends the fragments whether or not the node hears the ACK
+    uint64_t atUs = ack.startUs + loraTimeOnAirUs(m_params, ack.length);
+    const bool ackLost = SimHal::linkSnrDb(GATEWAY_POWER_DBM) < floor || SimHal::frameLost();
+    if (!ackLost)
+    {
+      m_downlinks.push_back(ack);
+    }
+    for (uint8_t i = 0; i < fuotaGrantFrames(grant.missing); i++)
+    {
+      SimDownlink downlink = {};
+      downlink.length = SimHal::s_fuota.grantFrame(frame.nodeId, grant, i, downlink.data, sizeof(downlink.data));
+      if (downlink.length == 0)
+      {
+        break;
+      }
+      downlink.startUs = atUs + FUOTA_FRAGMENT_GAP_MS * 1000;
+      atUs = downlink.startUs + loraTimeOnAirUs(m_params, downlink.length);
+      if (!ackLost && !SimHal::frameLost())
+      {
+        m_downlinks.push_back(downlink);
+      }
+    }
+  }
+
+  SimModule m_module;
+  SimLoraParams m_params;
+  size_t m_lastLength = 0;
+
+  // ACK and update fragments on their way, by start time
+  std::deque<SimDownlink> m_downlinks;
+};
+
+// Serial with the timing of the ESP32 UART: writes land in the 128 byte TX
+// FIFO for free and only block while the FIFO is full, draining at 10 bit
+// times per byte.
+class SimSerial
+{
+public:
+  static constexpr size_t FIFO_SIZE = 128;
+
+  void begin(unsigned long baud)
+  {
+    m_baud = baud;
+    m_drainedAtUs = 0;
+  }
+
+  size_t write(const char *data, size_t length);
+
+  size_t print(const char *str);
+  size_t print(char c);
+  size_t print(int value);
+  size_t print(unsigned int value);
+  size_t print(long value);
+  size_t print(unsigned long value);
+  size_t print(double value, int digits = 2);
+  size_t println();
+
+  template <typename T>
+  size_t println(T value)
+  {
+    return print(value) + println();
+  }
+
+  size_t println(double value, int digits)
+  {
+    return print(value, digits) + println();
+  }
+
+  size_t printf(const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+  // blocks until the FIFO is empty
+  void flush();
+
+  // echo everything the firmware prints to stdout
+  bool echo = false;
+
+private:
+  unsigned long m_baud = 0;
+  // when the last byte written so far leaves the FIFO
+  uint64_t m_drainedAtUs = 0;
+};
+
+extern SimSerial Serial;
+
+// esp32-hal-log equivalents, gated by CORE_DEBUG_LEVEL exactly like on target
+#ifndef CORE_DEBUG_LEVEL
+#define CORE_DEBUG_LEVEL 0
+#endif
+
+#define SIM_LOG(letter, format, ...) \
+  Serial.printf("[%6u][" letter "][%s:%u] %s(): " format "\r\n", (unsigned)SimHal::millis(), __FILE__, __LINE__, __func__, ##__VA_ARGS__)
+
+#if CORE_DEBUG_LEVEL >= 1
+#define log_e(format, ...) SIM_LOG("E", format, ##__VA_ARGS__)
+#else
+#define log_e(format, ...) do {} while (0)
+#endif
+#if CORE_DEBUG_LEVEL >= 2
+#define log_w(format, ...) SIM_LOG("W", format, ##__VA_ARGS__)
+#else
+#define log_w(format, ...) do {} while (0)
+#endif
+#if CORE_DEBUG_LEVEL >= 3
+#define log_i(format, ...) SIM_LOG("I", format, ##__VA_ARGS__)
+#else
+#define log_i(format, ...) do {} while (0)
+#endif
+#if CORE_DEBUG_LEVEL >= 4
+#define log_d(format, ...) SIM_LOG("D", format, ##__VA_ARGS__)
+#else
+#define log_d(format, ...) do {} while (0)
+#endif
@@ -0,0 +1,41 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <cmath>
+
+// LoRa modulation settings, defaults match RadioLib's SX126x begin() defaults.
+struct SimLoraParams
+{
+  float freqMhz = 434.0f;
+  float bwKhz = 125.0f;
+  uint8_t sf = 9;
+  // coding rate denominator, 5..8 for 4/5..4/8
+  uint8_t cr = 7;
+  uint16_t preambleLength = 8;
+  bool crc = true;
+  bool implicitHeader = false;
+  int8_t powerDbm = 10;
+};
+
+// Time on air as given in the SX1261/2 datasheet, section 6.1.4.
+inline uint32_t loraTimeOnAirUs(const SimLoraParams &p, size_t payloadLength)
+{
+  const double symbolUs = (double)(1UL << p.sf) * 1000.0 / p.bwKhz;
+  // low data rate optimisation is mandatory for symbols of 16 ms and more
+  const int ldro = symbolUs >= 16000.0 ? 1 : 0;
+  const int crc = p.crc ? 1 : 0;
+  const int ih = p.implicitHeader ? 1 : 0;
+
+  double preambleSymbols = p.preambleLength + 4.25;
+  double numerator = 8.0 * payloadLength - 4.0 * p.sf + 28 + 16 * crc - 20 * ih;
+  double denominator = 4.0 * (p.sf - 2 * ldro);
+  if (p.sf <= 6)
+  {
+    // SF5/SF6 carry two extra preamble symbols and drop the 8 bit header offset
+    preambleSymbols += 2;
+    numerator = 8.0 * payloadLength - 4.0 * p.sf + 20 + 16 * crc - 20 * ih;
+    denominator = 4.0 * p.sf;
+  }
+  double payloadSymbols = 8 + ceil(fmax(numerator, 0.0) / denominator) * p.cr;
+  return (uint32_t)lround((preambleSymbols + payloadSymbols) * symbolUs);
+}
@@ -0,0 +1,63 @@
+#pragma once
+#include <cstdint>
+
+// Current model of the Heltec WiFi LoRa 32 V3 (ESP32-S3 + SX1262) used by the
+// simulation to turn virtual time into charge. Values are datasheet typicals,
+// good enough to compare firmware builds against each other, not to replace a
+// current meter for absolute numbers.
+struct SimPowerModel
+{
+  // ESP32-S3 running at 240 MHz, WiFi/BT off
+  double cpuActiveMa = 40.0;
+  // ESP32-S3 deep sleep with RTC IO wakeup armed, plus board regulator quiescent
+  double cpuDeepSleepMa = 0.025;
+  // ESP32-S3 light sleep, CPU and RAM retained
+  double cpuLightSleepMa = 0.24;
+  // ULP FSM run of the input filter, and the RTC peripherals it keeps powered
+  double ulpRunMa = 0.15;
+  uint32_t ulpRunUs = 100;
+  double rtcPeripheralsMa = 0.001;
+
+  // SX1262
+  double radioOffMa = 0.0;
+  double radioSleepMa = 0.0006;
+  double radioStandbyMa = 0.6;
+  double radioRxMa = 4.6;
+  // TX by output power with RadioLib's PA settings, linear in between
+  static constexpr int TX_POINTS = 6;
+  int8_t radioTxDbm[TX_POINTS] = {2, 10, 14, 17, 20, 22};
+  double radioTxMaAt[TX_POINTS] = {18.0, 26.0, 45.0, 58.0, 84.0, 118.0};
+
+  // ROM + bootloader + app start after a deep sleep wakeup
+  uint32_t bootUs = 150000;
+  // light sleep wakeup until the CPU runs again
+  uint32_t lightSleepWakeUs = 1000;
+  // SX1262 reset, calibration and configuration in begin()
+  uint32_t radioBeginUs = 25000;
+  // SX1262 wake from warm sleep to standby
+  uint32_t radioWakeUs = 400;
+  // one SPI command including the busy wait
+  uint32_t radioCommandUs = 30;
+  // SPI + busy wait overhead around a blocking transmit()
+  uint32_t radioTxOverheadUs = 1500;
+  // SPI flash: erasing a 4 KB sector and programming a 256 byte page, the CPU
+  // waits for both
+  uint32_t flashEraseSectorUs = 45000;
+  uint32_t flashWritePageUs = 700;
+
+  double radioTxMa(int8_t powerDbm) const
+  {
+    if (powerDbm <= radioTxDbm[0])
+    {
+      return radioTxMaAt[0];
+    }
+    for (int i = 1; i < TX_POINTS; i++)
+    {
+      if (powerDbm <= radioTxDbm[i])
+      {
+        return radioTxMaAt[i - 1] + (radioTxMaAt[i] - radioTxMaAt[i - 1]) * (powerDbm - radioTxDbm[i - 1]) / (radioTxDbm[i] - radioTxDbm[i - 1]);
+      }
+    }
+    return radioTxMaAt[TX_POINTS - 1];
+  }
+};
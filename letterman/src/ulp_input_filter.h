@@ -0,0 +1,199 @@
+#pragma once
+#include <Arduino.h>
+#include "esp_sleep.h"
+#include "driver/rtc_io.h"
+#include "soc/rtc_cntl_reg.h"
+#include "soc/rtc_io_reg.h"
+#if __has_include("esp32s3/ulp.h")
+#include "esp32s3/ulp.h"
+#else
+#include "ulp.h"
+#endif
+
+#include "input_filter.h"
+
+// ULP (FSM) implementation of InputFilter. The program and its data live in
+// the ULP reserved part of RTC slow memory, which needs the FSM ULP enabled in
+// sdkconfig with at least 512 bytes reserved. Both pins have to be RTC GPIOs,
+// which GPIO 0-21 are on the ESP32-S3.
+class UlpInputFilter
+{
+public:
+  static bool start(const InputFilterConfig &config)
+  {
+    const uint32_t vibrationBit = RTC_GPIO_IN_NEXT_S + rtc_io_number_get((gpio_num_t)config.vibrationPin);
+    const uint32_t motionBit = RTC_GPIO_IN_NEXT_S + rtc_io_number_get((gpio_num_t)config.motionPin);
+
+    enum
+    {
+      L_MOTION,
+      L_VIBRATION_WINDOW,
+      L_MOTION_LOW,
+      L_DONE,
+      L_WAKE,
+    };
+
+    // R3 holds the base address of the data words throughout
+    const ulp_insn_t program[] = {
+        I_MOVI(R3, 0),
+
+        // vibration: rising edges within the window
+        I_LD(R0, R3, CFG_ENABLED),
+        I_ANDI(R0, R0, INPUT_FILTER_VIBRATION),
+        M_BL(L_MOTION, 1),
+        I_RD_REG(RTC_GPIO_IN_REG, vibrationBit, vibrationBit),
+        I_MOVR(R1, R0),
+        I_LD(R2, R3, VAR_VIBRATION_LEVEL),
+        I_ST(R1, R3, VAR_VIBRATION_LEVEL),
+        // no edge if it was high already or is low now
+        I_MOVR(R0, R2),
+        M_BGE(L_VIBRATION_WINDOW, 1),
+        I_MOVR(R0, R1),
+        M_BL(L_VIBRATION_WINDOW, 1),
+        I_LD(R0, R3, VAR_VIBRATION_PULSES),
+        I_ADDI(R0, R0, 1),
+        I_ST(R0, R3, VAR_VIBRATION_PULSES),
+        I_LD(R0, R3, VAR_VIBRATION_EDGES),
+        I_ADDI(R0, R0, 1),
+        I_ST(R0, R3, VAR_VIBRATION_EDGES),
+        // edges - min pulses overflows while below the threshold
+        I_LD(R2, R3, CFG_VIBRATION_MIN_PULSES),
+        I_SUBR(R0, R0, R2),
+        M_BXF(L_VIBRATION_WINDOW),
+        I_MOVI(R2, INPUT_FILTER_VIBRATION),
+        M_BX(L_WAKE),
+        M_LABEL(L_VIBRATION_WINDOW),
+        I_LD(R0, R3, VAR_WINDOW_LEFT),
+        I_SUBI(R0, R0, 1),
+        I_ST(R0, R3, VAR_WINDOW_LEFT),
+        M_BGE(L_MOTION, 1),
+        I_MOVI(R0, 0),
+        I_ST(R0, R3, VAR_VIBRATION_EDGES),
+        I_LD(R0, R3, CFG_VIBRATION_WINDOW_SAMPLES),
+        I_ST(R0, R3, VAR_WINDOW_LEFT),
+
+        // motion: high for long enough
+        M_LABEL(L_MOTION),
+        I_LD(R0, R3, CFG_ENABLED),
+        I_ANDI(R0, R0, INPUT_FILTER_MOTION),
+        M_BL(L_DONE, 1),
+        I_RD_REG(RTC_GPIO_IN_REG, motionBit, motionBit),
+        M_BL(L_MOTION_LOW, 1),
+        I_LD(R0, R3, VAR_MOTION_RUN),
+        I_ADDI(R0, R0, 1),
+        I_ST(R0, R3, VAR_MOTION_RUN),
+        I_LD(R2, R3, CFG_MOTION_MIN_SAMPLES),
+        I_SUBR(R0, R0, R2),
+        M_BXF(L_DONE),
+        I_LD(R0, R3, VAR_MOTION_PULSES),
+        I_ADDI(R0, R0, 1),
+        I_ST(R0, R3, VAR_MOTION_PULSES),
+        I_MOVI(R2, INPUT_FILTER_MOTION),
+        M_BX(L_WAKE),
+        M_LABEL(L_MOTION_LOW),
+        I_LD(R0, R3, VAR_MOTION_RUN),
+        M_BL(L_DONE, 1),
+        // pulse too short to wake for
+        I_LD(R0, R3, VAR_MOTION_PULSES),
+        I_ADDI(R0, R0, 1),
+        I_ST(R0, R3, VAR_MOTION_PULSES),
+        I_MOVI(R0, 0),
+        I_ST(R0, R3, VAR_MOTION_RUN),
+
+        M_LABEL(L_DONE),
+        I_HALT(),
+
+        // R2 holds the input that qualified
+        M_LABEL(L_WAKE),
+        I_ST(R2, R3, VAR_WAKE_REASON),
+        I_WAKE(),
+        // stop the ULP timer, the main CPU restarts the filter before it sleeps again
+        I_END(),
+        I_HALT(),
+    };
+
+    for (uint8_t pin : {config.vibrationPin, config.motionPin})
+    {
+      rtc_gpio_init((gpio_num_t)pin);
+      rtc_gpio_set_direction((gpio_num_t)pin, RTC_GPIO_MODE_INPUT_ONLY);
+    }
+    // the RTC IOs have to stay readable in deep sleep
+    esp_sleep_pd_config(ESP_PD_DOMAIN_RTC_PERIPH, ESP_PD_OPTION_ON);
+
+    // the counts survive, everything else starts over like InputFilter::begin()
+    write(VAR_VIBRATION_LEVEL, 1);
+    write(VAR_VIBRATION_EDGES, 0);
+    write(VAR_WINDOW_LEFT, config.vibrationWindowSamples);
+    write(VAR_MOTION_RUN, 0);
+    write(VAR_WAKE_REASON, 0);
+    write(CFG_ENABLED, config.enabled);
+    write(CFG_VIBRATION_MIN_PULSES, config.vibrationMinPulses);
+    write(CFG_VIBRATION_WINDOW_SAMPLES, config.vibrationWindowSamples);
+    write(CFG_MOTION_MIN_SAMPLES, config.motionMinSamples);
+
+    size_t size = sizeof(program) / sizeof(ulp_insn_t);
+    if (ulp_process_macros_and_load(PROGRAM_OFFSET, program, &size) != ESP_OK ||
+        ulp_set_wakeup_period(0, config.samplePeriodUs) != ESP_OK ||
+        esp_sleep_enable_ulp_wakeup() != ESP_OK ||
+        ulp_run(PROGRAM_OFFSET) != ESP_OK)
+    {
+      log_e("Starting the ULP input filter failed");
+      return false;
+    }
+    return true;
+  }
+
+  // stops sampling and hands the pins back to the digital GPIO matrix
+  static void stop(const InputFilterConfig &config)
+  {
+    CLEAR_PERI_REG_MASK(RTC_CNTL_ULP_CP_TIMER_REG, RTC_CNTL_ULP_CP_SLP_TIMER_EN);
+    for (uint8_t pin : {config.vibrationPin, config.motionPin})
+    {
+      rtc_gpio_deinit((gpio_num_t)pin);
+    }
+  }
+
+  // INPUT_FILTER_* bit of the input that woke us
+  static uint8_t wakeReason()
+  {
+    return read(VAR_WAKE_REASON);
+  }
+
+  // pulses counted since the last call
+  static void takeCounts(uint16_t &vibrationPulses, uint16_t &motionPulses)
+  {
+    vibrationPulses = read(VAR_VIBRATION_PULSES);
+    motionPulses = read(VAR_MOTION_PULSES);
+    write(VAR_VIBRATION_PULSES, 0);
+    write(VAR_MOTION_PULSES, 0);
+  }
+
+private:
+  // data words at the start of RTC slow memory, the program follows
+  enum
+  {
+    VAR_VIBRATION_LEVEL,
+    VAR_VIBRATION_EDGES,
+    VAR_WINDOW_LEFT,
+    VAR_MOTION_RUN,
+    VAR_VIBRATION_PULSES,
+    VAR_MOTION_PULSES,
+    VAR_WAKE_REASON,
+    CFG_ENABLED,
+    CFG_VIBRATION_MIN_PULSES,
+    CFG_VIBRATION_WINDOW_SAMPLES,
+    CFG_MOTION_MIN_SAMPLES,
+    PROGRAM_OFFSET = 16,
+  };
+
+  // the ULP only uses the lower 16 bits of a word
+  static uint16_t read(size_t offset)
+  {
+    return RTC_SLOW_MEM[offset] & 0xffff;
+  }
+
+  static void write(size_t offset, uint16_t value)
+  {
+    RTC_SLOW_MEM[offset] = value;
+  }
+};
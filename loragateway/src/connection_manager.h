@@ -0,0 +1,349 @@
+#pragma once
+#include <Arduino.h>
+#include <WiFi.h>
+#include <PubSubClient.h>
+#include "mqtt_socket.h"
+
+// Non-blocking WiFi/MQTT connection state machine. loop() does at most one
+// bounded step per call and never sleeps: failed attempts are retried after a
+// jittered exponential backoff instead of delay() loops.
+//
+// An MQTT attempt opens the TCP connection (MqttConnecting) and waits for the
+// CONNACK (MqttHandshake) by polling MqttSocket, each up to its timeout. The
+// only call that can block is the DNS lookup of the broker, made once and
+// again only after it failed.
+class ConnectionManager
+{
+public:
+  enum class State
+  {
+    WifiConnecting,
+    WifiBackoff,
+    MqttConnecting,
+    MqttHandshake,
+    MqttBackoff,
+    Connected,
+  };
+
+  struct Metrics
+  {
+    uint32_t wifiReconnects = 0;
+    uint32_t mqttReconnects = 0;
+    uint32_t mqttFailedAttempts = 0;
+    // duration of the last and the longest MQTT outage
+    uint32_t lastOutageMs = 0;
+    uint32_t maxOutageMs = 0;
+    uint64_t totalOutageMs = 0;
+  };
+
+  static constexpr uint32_t WIFI_CONNECT_TIMEOUT_MS = 20000;
+  static constexpr uint32_t MQTT_TCP_TIMEOUT_MS = 3000;
+  static constexpr uint32_t MQTT_CONNACK_TIMEOUT_MS = 3000;
+  static constexpr uint32_t BACKOFF_MIN_MS = 500;
+  static constexpr uint32_t BACKOFF_MAX_MS = 60000;
+
+  ConnectionManager(PubSubClient &client, MqttSocket &net)
+      : m_client(client), m_net(net)
+  {
+  }
+
+  void begin(const char *ssid, const char *pass, const char *host, uint16_t port, const char *clientId);
+
+  // drives the state machine, call as often as possible
+  void loop();
+
+  State state() const
+  {
+    return m_state;
+  }
+
+  bool connected() const
+  {
+    return m_state == State::Connected;
+  }
+
+  const Metrics &metrics() const
+  {
+    return m_metrics;
+  }
+
+  static const char *stateName(State state);
+
+  // called once whenever WiFi comes up
+  void (*onWifiConnected)() = nullptr;
+  // called once whenever the MQTT session is (re-)established
+  void (*onMqttConnected)() = nullptr;
+
+private:
+  void enter(State state);
+  void scheduleRetry(State backoffState, uint8_t &attempts);
+  void wifiUp();
+  void startMqtt();
+  void mqttUp();
+  void mqttFailed(const char *step);
+  void mqttDown();
+
+  PubSubClient &m_client;
+  MqttSocket &m_net;
+  const char *m_ssid = nullptr;
+  const char *m_pass = nullptr;
+  const char *m_host = nullptr;
+  uint16_t m_port = 0;
+  IPAddress m_address;
+  bool m_resolved = false;
+  char m_clientId[40] = {0};
+
+  State m_state = State::WifiConnecting;
+  uint32_t m_stateSince = 0;
+  uint32_t m_retryAt = 0;
+  uint8_t m_wifiAttempts = 0;
+  uint8_t m_mqttAttempts = 0;
+  bool m_wifiWasUp = false;
+  bool m_mqttWasUp = false;
+  uint32_t m_outageSince = 0;
+
+  Metrics m_metrics;
+};
+
+inline void ConnectionManager::begin(const char *ssid, const char *pass, const char *host, uint16_t port, const char *clientId)
+{
+  m_ssid = ssid;
+  m_pass = pass;
+  m_host = host;
+  m_port = port;
+  strncpy(m_clientId, clientId, sizeof(m_clientId) - 1);
+
+  m_client.setServer(host, port);
+  m_client.setSocketTimeout(1);
+  m_outageSince = millis();
+
+  log_i("Connecting to wifi...");
+  WiFi.begin(m_ssid, m_pass);
+  enter(State::WifiConnecting);
+}
+
+inline const char *ConnectionManager::stateName(State state)
+{
+  switch (state)
+  {
+  case State::WifiConnecting:
+    return "wifi-connecting";
+  case State::WifiBackoff:
+    return "wifi-backoff";
+  case State::MqttConnecting:
+    return "mqtt-connecting";
+  case State::MqttHandshake:
+    return "mqtt-handshake";
+  case State::MqttBackoff:
+    return "mqtt-backoff";
+  case State::Connected:
+    return "connected";
+  }
+  return "unknown";
+}
+
+inline void ConnectionManager::enter(State state)
+{
+  if (state != m_state)
+  {
+    log_d("Connection state %s -> %s", stateName(m_state), stateName(state));
+  }
+  m_state = state;
+  m_stateSince = millis();
+}
+
+inline void ConnectionManager::scheduleRetry(State backoffState, uint8_t &attempts)
+{
+  // exponential backoff with equal jitter: half fixed, half random
+  uint32_t backoff = BACKOFF_MIN_MS << min<uint8_t>(attempts, 7);
+  if (backoff > BACKOFF_MAX_MS)
+  {
+    backoff = BACKOFF_MAX_MS;
+  }
+  if (attempts < 255)
+  {
+    attempts++;
+  }
+  m_retryAt = millis() + backoff / 2 + esp_random() % (backoff / 2 + 1);
+  enter(backoffState);
+}
+
+inline void ConnectionManager::wifiUp()
+{
+  log_i("Wifi connected!");
+  m_wifiAttempts = 0;
+  if (m_wifiWasUp)
+  {
+    m_metrics.wifiReconnects++;
+  }
+  m_wifiWasUp = true;
+  if (onWifiConnected)
+  {
+    onWifiConnected();
+  }
+  startMqtt();
+}
+
+// starts an MQTT attempt, logged only for the first one of an outage
+inline void ConnectionManager::startMqtt()
+{
+  if (m_mqttAttempts == 0)
+  {
+    log_i("Connecting to MQTT at %s:%u...", m_host, m_port);
+  }
+  if (!m_resolved)
+  {
+    m_resolved = m_address.fromString(m_host) || WiFi.hostByName(m_host, m_address) == 1;
+  }
+  if (!m_resolved)
+  {
+    mqttFailed("resolving the host");
+  }
+  else if (!m_net.connectStart(m_address, m_port))
+  {
+    mqttFailed("opening a socket");
+  }
+  else
+  {
+    enter(State::MqttConnecting);
+  }
+}
+
+inline void ConnectionManager::mqttUp()
+{
+  const uint32_t outage = millis() - m_outageSince;
+  m_metrics.lastOutageMs = outage;
+  m_metrics.maxOutageMs = max(m_metrics.maxOutageMs, outage);
+  m_metrics.totalOutageMs += outage;
+  if (m_mqttWasUp)
+  {
+    m_metrics.mqttReconnects++;
+  }
+  m_mqttWasUp = true;
+  m_mqttAttempts = 0;
+  log_i("Mqtt connected after %u ms", outage);
+  enter(State::Connected);
+  if (onMqttConnected)
+  {
+    onMqttConnected();
+  }
+}
+
+inline void ConnectionManager::mqttFailed(const char *step)
+{
+  m_metrics.mqttFailedAttempts++;
+  log_w("Mqtt connect failed while %s, state: %d", step, m_client.state());
+  m_net.stop();
+  scheduleRetry(State::MqttBackoff, m_mqttAttempts);
+}
+
+inline void ConnectionManager::mqttDown()
+{
+  m_outageSince = millis();
+  m_net.stop();
+}
+
+inline void ConnectionManager::loop()
+{
+  const uint32_t now = millis();
+  const bool wifiConnected = WiFi.status() == WL_CONNECTED;
+
+  // losing WiFi drops everything back to the start
+  if (!wifiConnected && m_state != State::WifiConnecting && m_state != State::WifiBackoff)
+  {
+    log_w("WiFi lost, state: %d", WiFi.status());
+    if (m_state == State::Connected)
+    {
+      mqttDown();
+    }
+    else
+    {
+      m_net.stop();
+    }
+    WiFi.reconnect();
+    enter(State::WifiConnecting);
+    return;
+  }
+
+  switch (m_state)
+  {
+  case State::WifiConnecting:
+    if (wifiConnected)
+    {
+      wifiUp();
+    }
+    else if (now - m_stateSince >= WIFI_CONNECT_TIMEOUT_MS)
+    {
+      log_w("WiFi connect timed out, state: %d", WiFi.status());
+      WiFi.disconnect();
+      scheduleRetry(State::WifiBackoff, m_wifiAttempts);
+    }
+    break;
+
+  case State::WifiBackoff:
+    if (wifiConnected)
+    {
+      wifiUp();
+    }
+    else if ((int32_t)(now - m_retryAt) >= 0)
+    {
+      WiFi.begin(m_ssid, m_pass);
+      enter(State::WifiConnecting);
+    }
+    break;
+
+  case State::MqttConnecting:
+  {
+    const int connected = m_net.connectPoll();
+    // PubSubClient sends CONNECT on the open socket, the broker's answer is polled
+    // TODO: add security settings back to mqtt
+    if (connected > 0)
+    {
+      m_net.beginHandshake();
+      if (m_client.connect(m_clientId))
+      {
+        enter(State::MqttHandshake);
+      }
+      else
+      {
+        mqttFailed("sending CONNECT");
+      }
+    }
+    else if (connected < 0 || now - m_stateSince >= MQTT_TCP_TIMEOUT_MS)
+    {
+      mqttFailed("connecting TCP");
+    }
+    break;
+  }
+
+  case State::MqttHandshake:
+  {
+    const int accepted = m_net.connackPoll();
+    if (accepted > 0)
+    {
+      mqttUp();
+    }
+    else if (accepted < 0 || now - m_stateSince >= MQTT_CONNACK_TIMEOUT_MS)
+    {
+      mqttFailed("waiting for CONNACK");
+    }
+    break;
+  }
+
+  case State::MqttBackoff:
+    if ((int32_t)(now - m_retryAt) >= 0)
+    {
+      startMqtt();
+    }
+    break;
+
+  case State::Connected:
+    if (!m_client.connected())
+    {
+      log_w("Mqtt not connected, reconnecting");
+      mqttDown();
+      startMqtt();
+    }
+    break;
+  }
+}
@@ -0,0 +1,309 @@
+#pragma once
+#include <Arduino.h>
+#include <LittleFS.h>
+#include "node_table.h"
+
+// pacing of the configs, the host harness announces its thousand nodes at once
+#ifndef LETTERMAN_DISCOVERY_BURST
+#define LETTERMAN_DISCOVERY_BURST 2
+#endif
+#ifndef LETTERMAN_DISCOVERY_INTERVAL_MS
+#define LETTERMAN_DISCOVERY_INTERVAL_MS 100
+#endif
+
+// one discovery config as the render callback writes it, sized for the MQTT buffer
+struct DiscoveryConfig
+{
+  static constexpr size_t TOPIC_SIZE = 128;
+  static constexpr size_t PAYLOAD_SIZE = 512;
+
+  char topic[TOPIC_SIZE];
+  char altTopic[TOPIC_SIZE];
+  char payload[PAYLOAD_SIZE];
+};
+
+// Home Assistant discovery configs of the node entities.
+//
+// Configs are published retained: the broker hands them to Home Assistant
+// after a restart of either, so neither an MQTT reconnect nor a
+// homeassistant/status "online" needs them again. The cache keeps no payloads,
+// only an entry per node with a hash over all its configs and a bit per config
+// still to send. The caller's render function writes config i of a node; add()
+// runs it once for the hash, drain() again right before the publish. What
+// reached the broker is remembered as the node's hash, in RAM and in a small
+// LittleFS file, and only the configs of a node whose hash differs from that
+// are sent, after a firmware update that renamed an entity for instance.
+// drain() sends at most DISCOVERY_BURST configs per DISCOVERY_INTERVAL_MS so a
+// gateway with many nodes does not flood the broker.
+//
+// Slots is the size of the node table the entries live in. With twice the
+// slots of the gateway's node table every node it can hold fits, next to the
+// records of nodes from before the reboot that were not heard again yet.
+template <size_t Slots>
+class DiscoveryCache
+{
+public:
+  // configs per node, one bit each in Entry::pending
+  static constexpr uint8_t MAX_CONFIGS = 16;
+  static constexpr uint8_t DISCOVERY_BURST = LETTERMAN_DISCOVERY_BURST;
+  static constexpr uint32_t DISCOVERY_INTERVAL_MS = LETTERMAN_DISCOVERY_INTERVAL_MS;
+
+  // writes config `index` of the node, false if it has none to send
+  typedef bool (*RenderFn)(uint32_t nodeId, uint8_t index, DiscoveryConfig &config);
+  // publishes retained, false leaves the config pending
+  typedef bool (*PublishFn)(const char *topic, const char *payload);
+
+  void begin();
+  // hashes configs 0..count-1 of the node, false if the table is full
+  bool add(uint32_t nodeId, uint8_t count, RenderFn render);
+  // sends due configs while publish succeeds, call regularly while connected
+  void drain(RenderFn render, PublishFn publish);
+  // marks every cached config pending, for brokers that lose retained messages
+  void resendAll();
+
+  // a config of the node still has to go out, its states would be ignored
+  bool pending(uint32_t nodeId);
+
+  size_t pendingCount() const
+  {
+    return m_pending;
+  }
+
+  // nodes with configs since boot
+  size_t size() const
+  {
+    return m_nodes;
+  }
+
+  uint32_t sentTotal() const
+  {
+    return m_sentTotal;
+  }
+
+  uint32_t unchangedTotal() const
+  {
+    return m_unchangedTotal;
+  }
+
+private:
+  struct Entry
+  {
+    uint32_t id;
+    bool used;
+    // the broker has the configs that hash to publishedHash
+    bool published;
+    // configs of the node, 0 for a record of a node not heard since boot
+    uint8_t count;
+    uint16_t pending;
+    uint32_t hash;
+    uint32_t publishedHash;
+  };
+
+  struct PublishedRecord
+  {
+    uint32_t nodeId;
+    uint32_t hash;
+  };
+
+  static constexpr const char *PUBLISHED_PATH = "/discovery.bin";
+
+  // FNV-1a, over the topics and the payload
+  static uint32_t hash(uint32_t hash, const char *text)
+  {
+    while (*text)
+    {
+      hash = (hash ^ (uint8_t)*text++) * 16777619u;
+    }
+    return hash;
+  }
+
+  static uint8_t pendingConfigs(uint16_t pending)
+  {
+    uint8_t configs = 0;
+    for (; pending != 0; pending &= pending - 1)
+    {
+      configs++;
+    }
+    return configs;
+  }
+
+  void savePublished();
+
+  NodeTable<Entry, Slots> m_entries;
+  // render target of add() and drain(), too large for the network task's stack
+  DiscoveryConfig m_config;
+  size_t m_nodes = 0;
+  size_t m_pending = 0;
+  bool m_publishedDirty = false;
+
+  bool m_fsReady = false;
+  uint32_t m_sentTotal = 0;
+  uint32_t m_unchangedTotal = 0;
+  uint32_t m_lastDrain = 0;
+};
+
+template <size_t Slots>
+void DiscoveryCache<Slots>::begin()
+{
+  m_fsReady = LittleFS.begin(true);
+  if (!m_fsReady)
+  {
+    log_e("LittleFS not available, discovery configs are sent after every reboot");
+    return;
+  }
+  File file = LittleFS.open(PUBLISHED_PATH, "r");
+  if (!file)
+  {
+    return;
+  }
+  // records beyond half the table are dropped, their nodes just send again
+  size_t records = 0;
+  PublishedRecord record;
+  while (m_entries.size() < m_entries.Capacity / 2 &&
+         file.read((uint8_t *)&record, sizeof(record)) == sizeof(record))
+  {
+    Entry *entry = m_entries.findOrInsert(record.nodeId);
+    if (entry != nullptr)
+    {
+      entry->published = true;
+      entry->publishedHash = record.hash;
+      records++;
+    }
+  }
+  file.close();
+  log_i("Discovery: %u nodes with published configs on record", records);
+}
+
+template <size_t Slots>
+bool DiscoveryCache<Slots>::add(uint32_t nodeId, uint8_t count, RenderFn render)
+{
+  Entry *entry = m_entries.findOrInsert(nodeId);
+  if (entry == nullptr)
+  {
+    return false;
+  }
+  if (count > MAX_CONFIGS)
+  {
+    count = MAX_CONFIGS;
+  }
+  uint32_t configHash = 2166136261u;
+  uint16_t configs = 0;
+  for (uint8_t i = 0; i < count; i++)
+  {
+    if (render(nodeId, i, m_config))
+    {
+      configHash = hash(hash(hash(configHash, m_config.topic), m_config.altTopic), m_config.payload);
+      configs |= 1 << i;
+    }
+  }
+  if (entry->count == 0)
+  {
+    m_nodes++;
+  }
+  m_pending -= pendingConfigs(entry->pending);
+  entry->count = count;
+  entry->hash = configHash;
+  if (entry->published && entry->publishedHash == configHash)
+  {
+    entry->pending = 0;
+    m_unchangedTotal += pendingConfigs(configs);
+  }
+  else
+  {
+    entry->pending = configs;
+    m_pending += pendingConfigs(configs);
+  }
+  return true;
+}
+
+template <size_t Slots>
+bool DiscoveryCache<Slots>::pending(uint32_t nodeId)
+{
+  if (m_pending == 0)
+  {
+    return false;
+  }
+  const Entry *entry = m_entries.find(nodeId);
+  return entry != nullptr && entry->pending != 0;
+}
+
+template <size_t Slots>
+void DiscoveryCache<Slots>::resendAll()
+{
+  m_pending = 0;
+  m_entries.forEach([this](Entry &entry)
+                    {
+                      entry.pending = entry.count != 0 ? (uint16_t)((1u << entry.count) - 1) : 0;
+                      m_pending += pendingConfigs(entry.pending); });
+}
+
+template <size_t Slots>
+void DiscoveryCache<Slots>::savePublished()
+{
+  m_publishedDirty = false;
+  if (!m_fsReady)
+  {
+    return;
+  }
+  File file = LittleFS.open(PUBLISHED_PATH, "w");
+  if (!file)
+  {
+    log_w("Cannot write %s, configs are sent again after a reboot", PUBLISHED_PATH);
+    return;
+  }
+  m_entries.forEach([&file](Entry &entry)
+                    {
+                      if (entry.published)
+                      {
+                        const PublishedRecord record = {entry.id, entry.publishedHash};
+                        file.write((const uint8_t *)&record, sizeof(record));
+                      } });
+  file.close();
+}
+
+template <size_t Slots>
+void DiscoveryCache<Slots>::drain(RenderFn render, PublishFn publish)
+{
+  if (m_pending == 0 || millis() - m_lastDrain < DISCOVERY_INTERVAL_MS)
+  {
+    return;
+  }
+  m_lastDrain = millis();
+
+  uint8_t sent = 0;
+  for (size_t slot = 0; slot < m_entries.SlotCount && sent < DISCOVERY_BURST; slot++)
+  {
+    Entry *entry = m_entries.at(slot);
+    while (entry != nullptr && entry->pending != 0 && sent < DISCOVERY_BURST)
+    {
+      uint8_t index = 0;
+      while ((entry->pending & (1 << index)) == 0)
+      {
+        index++;
+      }
+      // a config that cannot be rendered any more is dropped, not retried
+      if (render(entry->id, index, m_config))
+      {
+        if (!publish(m_config.topic, m_config.payload) || !publish(m_config.altTopic, m_config.payload))
+        {
+          return;
+        }
+        m_sentTotal++;
+        sent++;
+      }
+      entry->pending &= ~(1 << index);
+      m_pending--;
+      if (entry->pending == 0 && (!entry->published || entry->publishedHash != entry->hash))
+      {
+        entry->published = true;
+        entry->publishedHash = entry->hash;
+        m_publishedDirty = true;
+      }
+    }
+  }
+  // one flash write per round of configs
+  if (m_pending == 0 && m_publishedDirty)
+  {
+    savePublished();
+  }
+}
@@ -0,0 +1,578 @@
+#pragma once
+#include <Arduino.h>
+#include <LittleFS.h>
+#include <time.h>
+
+// what a node's message was, by the new mail state it reported
+enum HistoryEvent : uint8_t
+{
+  // any other status message
+  HISTORY_MESSAGE,
+  // new mail set
+  HISTORY_DELIVERY,
+  // new mail cleared, the mailbox was emptied
+  HISTORY_EMPTIED,
+  HISTORY_EVENT_COUNT,
+};
+
+// names in history queries, by HistoryEvent
+static const char *const HISTORY_EVENT_NAMES[HISTORY_EVENT_COUNT] = {"messages", "deliveries", "emptied"};
+
+// one accepted status message of a node
+struct HistoryRecord
+{
+  // unix seconds, 0 if the gateway had no clock yet
+  uint32_t time;
+  uint32_t nodeId;
+  uint16_t counter;
+  uint8_t event;
+  // channel set (channels.h) of the message
+  uint8_t channels;
+  int16_t rssi;
+  // quarter dB
+  int8_t snr;
+  uint8_t reserved;
+};
+
+static_assert(sizeof(HistoryRecord) == 16, "records are read and written as they are");
+
+// messages per node found by a history query
+struct HistoryCounts
+{
+  static constexpr size_t MAX_NODES = 24;
+
+  struct Node
+  {
+    uint32_t nodeId;
+    uint32_t count;
+  };
+
+  Node nodes[MAX_NODES];
+  size_t nodeCount = 0;
+  // more nodes had messages than fit
+  bool truncated = false;
+  // segments answered from their index and read from flash
+  uint16_t indexed = 0;
+  uint16_t scanned = 0;
+
+  void add(uint32_t nodeId, uint32_t count)
+  {
+    for (size_t i = 0; i < nodeCount; i++)
+    {
+      if (nodes[i].nodeId == nodeId)
+      {
+        nodes[i].count += count;
+        return;
+      }
+    }
+    if (nodeCount == MAX_NODES)
+    {
+      truncated = true;
+      return;
+    }
+    nodes[nodeCount++] = {nodeId, count};
+  }
+};
+
+// Message history of the gateway, appended to LittleFS.
+//
+// Records are collected in a RAM batch and written BATCH_RECORDS at a time,
+// or once the oldest is BATCH_MAX_AGE_MS old: LittleFS rewrites the last
+// block of a file on every append, so one write per batch instead of per
+// message. The log is a run of segment files of SEGMENT_RECORDS each; when
+// MAX_SEGMENTS are full the oldest one is deleted. Each segment has an index
+// in RAM, saved next to it when it is full: the time range of its records, per
+// node how many messages of each HistoryEvent it holds for its first
+// INDEX_NODES nodes, and a Bloom filter of all its nodes. A query reads only
+// the segments its time range cuts through and, for a busier segment, those
+// the filter says can hold the node asked for; the others are answered from
+// their index or skipped.
+//
+// Records get the time of the clock NTP sets, messages received before it is
+// set are dated back from millis() when the batch is written. A batch that
+// fills before that keeps time 0, such records only count in queries over the
+// whole history. Up to one batch is lost with a power cut.
+class EventLog
+{
+public:
+  // 4 KB, one LittleFS block
+  static constexpr size_t SEGMENT_RECORDS = 256;
+  // 256 KB of the filesystem, 16384 messages
+  static constexpr size_t MAX_SEGMENTS = 64;
+  static constexpr size_t BATCH_RECORDS = 32;
+  static constexpr uint32_t BATCH_MAX_AGE_MS = 15 * 60 * 1000;
+  // nodes a segment index counts for, a segment with more is read by queries
+  // for all nodes and by those for a node its filter may hold
+  static constexpr uint8_t INDEX_NODES = 8;
+  // node filter of a segment, 3 bits per node: about 0.5 % false hits with
+  // 64 nodes in a segment, 15 % with a different one in every record
+  static constexpr size_t FILTER_BITS = 1024;
+  // a clock before this has not been set yet
+  static constexpr time_t CLOCK_VALID_FROM = 1600000000;
+
+  void begin();
+  void append(uint32_t nodeId, HistoryEvent event, uint8_t channels, uint16_t counter, int16_t rssi, float snr);
+  // writes the batch when it is due, call regularly
+  void service();
+  // messages of `event` per node since the unix time `since`, 0 for the whole
+  // history, of the node nodeId points to or of all for nullptr
+  void count(HistoryEvent event, uint32_t since, const uint32_t *nodeId, HistoryCounts &counts);
+
+  // unix seconds, 0 while the clock is not set
+  static uint32_t now()
+  {
+    const time_t seconds = time(nullptr);
+    return seconds >= CLOCK_VALID_FROM ? (uint32_t)seconds : 0;
+  }
+
+  size_t records() const;
+
+  size_t segments() const
+  {
+    return m_segmentCount;
+  }
+
+  uint32_t batchesWritten() const
+  {
+    return m_batchesWritten;
+  }
+
+  uint32_t segmentsEvicted() const
+  {
+    return m_segmentsEvicted;
+  }
+
+private:
+  struct NodeIndex
+  {
+    uint32_t nodeId;
+    uint16_t counts[HISTORY_EVENT_COUNT];
+  };
+
+  struct SegmentIndex
+  {
+    uint32_t sequence;
+    // of the records with a time, UINT32_MAX and 0 if there are none
+    uint32_t minTime;
+    uint32_t maxTime;
+    uint16_t records;
+    uint8_t nodeCount;
+    // more nodes than INDEX_NODES, the counts are not the whole segment
+    bool partial;
+    // records without a time, which no query since a time matches
+    bool untimed;
+    NodeIndex nodes[INDEX_NODES];
+    uint8_t filter[FILTER_BITS / 8];
+  };
+
+  struct Head
+  {
+    uint32_t magic;
+    uint32_t oldestSequence;
+  };
+
+  static constexpr uint32_t HEAD_MAGIC = 0x31484c4c;
+  static constexpr const char *HEAD_PATH = "/history.bin";
+  // records read from flash at a time
+  static constexpr size_t READ_RECORDS = 16;
+
+  static void segmentPath(char *path, size_t size, uint32_t sequence, const char *suffix)
+  {
+    snprintf(path, size, "/h%06u.%s", (unsigned)sequence, suffix);
+  }
+
+  static void startSegment(SegmentIndex &segment, uint32_t sequence)
+  {
+    segment = SegmentIndex();
+    segment.sequence = sequence;
+    segment.minTime = UINT32_MAX;
+  }
+
+  // murmur3 finaliser, node ids are MAC derived and poorly distributed
+  static uint32_t nodeHash(uint32_t nodeId)
+  {
+    nodeId ^= nodeId >> 16;
+    nodeId *= 0x85ebca6b;
+    nodeId ^= nodeId >> 13;
+    nodeId *= 0xc2b2ae35;
+    nodeId ^= nodeId >> 16;
+    return nodeId;
+  }
+
+  // the filter bits of a node are three 10 bit slices of its hash
+  static void addToFilter(SegmentIndex &segment, uint32_t nodeId)
+  {
+    const uint32_t hash = nodeHash(nodeId);
+    for (uint8_t i = 0; i < 3; i++)
+    {
+      const uint32_t bit = (hash >> (10 * i)) % FILTER_BITS;
+      segment.filter[bit / 8] |= 1 << (bit % 8);
+    }
+  }
+
+  static_assert(FILTER_BITS <= 1024, "filter bits are taken from 10 bit slices");
+
+  static bool mayHold(const SegmentIndex &segment, uint32_t nodeId)
+  {
+    const uint32_t hash = nodeHash(nodeId);
+    for (uint8_t i = 0; i < 3; i++)
+    {
+      const uint32_t bit = (hash >> (10 * i)) % FILTER_BITS;
+      if ((segment.filter[bit / 8] & (1 << (bit % 8))) == 0)
+      {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  static void indexRecord(SegmentIndex &segment, const HistoryRecord &record);
+  static bool matches(const HistoryRecord &record, HistoryEvent event, uint32_t since, const uint32_t *nodeId)
+  {
+    return record.event == event && (nodeId == nullptr || record.nodeId == *nodeId) &&
+           (since == 0 || record.time >= since);
+  }
+
+  SegmentIndex &segment(size_t i)
+  {
+    return m_segments[(m_oldestSlot + i) % MAX_SEGMENTS];
+  }
+
+  bool loadSegment(uint32_t sequence, SegmentIndex &segment);
+  void countSegment(const SegmentIndex &segment, HistoryEvent event, uint32_t since, const uint32_t *nodeId,
+                    HistoryCounts &counts);
+  void flush();
+  bool writeRecords(const HistoryRecord *records, size_t count);
+  void closeSegment();
+  void saveHead();
+
+  SegmentIndex m_segments[MAX_SEGMENTS];
+  size_t m_oldestSlot = 0;
+  // the newest one is open for appends
+  size_t m_segmentCount = 0;
+
+  HistoryRecord m_batch[BATCH_RECORDS];
+  // millis() each batched message was received at
+  uint32_t m_batchMillis[BATCH_RECORDS];
+  size_t m_batchCount = 0;
+
+  bool m_fsReady = false;
+  uint32_t m_batchesWritten = 0;
+  uint32_t m_segmentsEvicted = 0;
+};
+
+inline void EventLog::begin()
+{
+  m_fsReady = LittleFS.begin(true);
+  if (!m_fsReady)
+  {
+    log_e("LittleFS not available, the event history is not kept");
+    return;
+  }
+  Head head = {HEAD_MAGIC, 0};
+  File file = LittleFS.open(HEAD_PATH, "r");
+  if (file)
+  {
+    Head stored;
+    if (file.read((uint8_t *)&stored, sizeof(stored)) == sizeof(stored) && stored.magic == HEAD_MAGIC)
+    {
+      head = stored;
+    }
+    file.close();
+  }
+  m_oldestSlot = 0;
+  m_segmentCount = 0;
+  while (m_segmentCount < MAX_SEGMENTS && loadSegment(head.oldestSequence + m_segmentCount, segment(m_segmentCount)))
+  {
+    m_segmentCount++;
+  }
+  if (m_segmentCount == 0)
+  {
+    startSegment(segment(0), head.oldestSequence);
+    m_segmentCount = 1;
+  }
+  log_i("Event history: %u messages in %u segments", records(), m_segmentCount);
+}
+
+// the index file of a full segment, or the segment itself read again
+inline bool EventLog::loadSegment(uint32_t sequence, SegmentIndex &segment)
+{
+  char path[16];
+  segmentPath(path, sizeof(path), sequence, "log");
+  File log = LittleFS.open(path, "r");
+  if (!log)
+  {
+    return false;
+  }
+  const size_t records = log.size() / sizeof(HistoryRecord);
+  segmentPath(path, sizeof(path), sequence, "idx");
+  File index = LittleFS.open(path, "r");
+  if (index)
+  {
+    const bool loaded = index.read((uint8_t *)&segment, sizeof(segment)) == sizeof(segment) &&
+                        segment.sequence == sequence && segment.records == records;
+    index.close();
+    if (loaded)
+    {
+      log.close();
+      return true;
+    }
+  }
+  startSegment(segment, sequence);
+  HistoryRecord chunk[READ_RECORDS];
+  size_t read;
+  while (segment.records < records &&
+         (read = log.read((uint8_t *)chunk, sizeof(chunk)) / sizeof(HistoryRecord)) > 0)
+  {
+    for (size_t i = 0; i < read && segment.records < records; i++)
+    {
+      indexRecord(segment, chunk[i]);
+    }
+  }
+  log.close();
+  return true;
+}
+
+inline void EventLog::indexRecord(SegmentIndex &segment, const HistoryRecord &record)
+{
+  segment.records++;
+  if (record.time == 0)
+  {
+    segment.untimed = true;
+  }
+  else
+  {
+    segment.minTime = min(segment.minTime, record.time);
+    segment.maxTime = max(segment.maxTime, record.time);
+  }
+  if (record.event >= HISTORY_EVENT_COUNT)
+  {
+    return;
+  }
+  addToFilter(segment, record.nodeId);
+  for (uint8_t i = 0; i < segment.nodeCount; i++)
+  {
+    if (segment.nodes[i].nodeId == record.nodeId)
+    {
+      segment.nodes[i].counts[record.event]++;
+      return;
+    }
+  }
+  if (segment.nodeCount == INDEX_NODES)
+  {
+    segment.partial = true;
+    return;
+  }
+  NodeIndex &node = segment.nodes[segment.nodeCount++];
+  node = NodeIndex();
+  node.nodeId = record.nodeId;
+  node.counts[record.event] = 1;
+}
+
+inline size_t EventLog::records() const
+{
+  size_t records = m_batchCount;
+  for (size_t i = 0; i < m_segmentCount; i++)
+  {
+    records += m_segments[(m_oldestSlot + i) % MAX_SEGMENTS].records;
+  }
+  return records;
+}
+
+inline void EventLog::append(uint32_t nodeId, HistoryEvent event, uint8_t channels, uint16_t counter, int16_t rssi,
+                             float snr)
+{
+  if (m_batchCount == BATCH_RECORDS)
+  {
+    flush();
+  }
+  const float quarterDb = snr * 4;
+  HistoryRecord &record = m_batch[m_batchCount];
+  record = HistoryRecord();
+  record.time = now();
+  record.nodeId = nodeId;
+  record.counter = counter;
+  record.event = event;
+  record.channels = channels;
+  record.rssi = rssi;
+  record.snr = (int8_t)(quarterDb < -128 ? -128 : quarterDb > 127 ? 127 : quarterDb);
+  m_batchMillis[m_batchCount] = millis();
+  m_batchCount++;
+}
+
+inline void EventLog::service()
+{
+  // an old batch waits for the clock as long as it has room
+  if (m_batchCount == BATCH_RECORDS ||
+      (m_batchCount > 0 && millis() - m_batchMillis[0] >= BATCH_MAX_AGE_MS && now() != 0))
+  {
+    flush();
+  }
+}
+
+inline void EventLog::flush()
+{
+  const uint32_t seconds = now();
+  const uint32_t nowMs = millis();
+  for (size_t i = 0; i < m_batchCount; i++)
+  {
+    if (m_batch[i].time == 0 && seconds != 0)
+    {
+      m_batch[i].time = seconds - (nowMs - m_batchMillis[i]) / 1000;
+    }
+  }
+  if (m_fsReady && !writeRecords(m_batch, m_batchCount))
+  {
+    log_w("Writing the event history failed, %u messages dropped", m_batchCount);
+  }
+  m_batchCount = 0;
+}
+
+inline bool EventLog::writeRecords(const HistoryRecord *records, size_t count)
+{
+  m_batchesWritten++;
+  while (count > 0)
+  {
+    if (segment(m_segmentCount - 1).records == SEGMENT_RECORDS)
+    {
+      closeSegment();
+    }
+    SegmentIndex &open = segment(m_segmentCount - 1);
+    const size_t part = min(count, SEGMENT_RECORDS - open.records);
+    char path[16];
+    segmentPath(path, sizeof(path), open.sequence, "log");
+    File file = LittleFS.open(path, "a");
+    if (!file)
+    {
+      return false;
+    }
+    const size_t written = file.write((const uint8_t *)records, part * sizeof(HistoryRecord)) / sizeof(HistoryRecord);
+    file.close();
+    for (size_t i = 0; i < written; i++)
+    {
+      indexRecord(open, records[i]);
+    }
+    if (written != part)
+    {
+      return false;
+    }
+    records += part;
+    count -= part;
+  }
+  return true;
+}
+
+// saves the index of the full segment and opens the next one, the oldest
+// goes if there is no room for it
+inline void EventLog::closeSegment()
+{
+  const SegmentIndex &full = segment(m_segmentCount - 1);
+  char path[16];
+  segmentPath(path, sizeof(path), full.sequence, "idx");
+  File file = LittleFS.open(path, "w");
+  if (file)
+  {
+    file.write((const uint8_t *)&full, sizeof(full));
+    file.close();
+  }
+  const uint32_t next = full.sequence + 1;
+  if (m_segmentCount == MAX_SEGMENTS)
+  {
+    const SegmentIndex &oldest = segment(0);
+    segmentPath(path, sizeof(path), oldest.sequence, "log");
+    LittleFS.remove(path);
+    segmentPath(path, sizeof(path), oldest.sequence, "idx");
+    LittleFS.remove(path);
+    m_oldestSlot = (m_oldestSlot + 1) % MAX_SEGMENTS;
+    m_segmentCount--;
+    m_segmentsEvicted++;
+    saveHead();
+  }
+  startSegment(segment(m_segmentCount), next);
+  m_segmentCount++;
+}
+
+inline void EventLog::saveHead()
+{
+  const Head head = {HEAD_MAGIC, segment(0).sequence};
+  File file = LittleFS.open(HEAD_PATH, "w");
+  if (!file)
+  {
+    log_w("Cannot write %s, evicted history segments come back after a reboot", HEAD_PATH);
+    return;
+  }
+  file.write((const uint8_t *)&head, sizeof(head));
+  file.close();
+}
+
+inline void EventLog::count(HistoryEvent event, uint32_t since, const uint32_t *nodeId, HistoryCounts &counts)
+{
+  for (size_t i = 0; i < m_segmentCount; i++)
+  {
+    const SegmentIndex &indexed = segment(i);
+    if (indexed.records == 0 || (since != 0 && indexed.maxTime < since) ||
+        (nodeId != nullptr && !mayHold(indexed, *nodeId)))
+    {
+      continue;
+    }
+    const NodeIndex *node = nullptr;
+    for (uint8_t j = 0; j < indexed.nodeCount && nodeId != nullptr; j++)
+    {
+      if (indexed.nodes[j].nodeId == *nodeId)
+      {
+        node = &indexed.nodes[j];
+      }
+    }
+    // a node past INDEX_NODES, or every node of a busy segment, is only in the records
+    const bool counted = !indexed.partial || node != nullptr;
+    if ((since != 0 && (indexed.minTime < since || indexed.untimed)) || !counted)
+    {
+      countSegment(indexed, event, since, nodeId, counts);
+      continue;
+    }
+    counts.indexed++;
+    for (uint8_t j = 0; j < indexed.nodeCount; j++)
+    {
+      const NodeIndex &indexedNode = indexed.nodes[j];
+      if (indexedNode.counts[event] != 0 && (nodeId == nullptr || indexedNode.nodeId == *nodeId))
+      {
+        counts.add(indexedNode.nodeId, indexedNode.counts[event]);
+      }
+    }
+  }
+  for (size_t i = 0; i < m_batchCount; i++)
+  {
+    if (matches(m_batch[i], event, since, nodeId))
+    {
+      counts.add(m_batch[i].nodeId, 1);
+    }
+  }
+}
+
+// a segment the query's time range cuts through, or whose index does not
+// count the node asked for, record by record
+inline void EventLog::countSegment(const SegmentIndex &segment, HistoryEvent event, uint32_t since,
+                                   const uint32_t *nodeId, HistoryCounts &counts)
+{
+  char path[16];
+  segmentPath(path, sizeof(path), segment.sequence, "log");
+  File file = LittleFS.open(path, "r");
+  if (!file)
+  {
+    return;
+  }
+  counts.scanned++;
+  HistoryRecord chunk[READ_RECORDS];
+  size_t read;
+  while ((read = file.read((uint8_t *)chunk, sizeof(chunk)) / sizeof(HistoryRecord)) > 0)
+  {
+    for (size_t i = 0; i < read; i++)
+    {
+      if (matches(chunk[i], event, since, nodeId))
+      {
+        counts.add(chunk[i].nodeId, 1);
+      }
+    }
+  }
+  file.close();
+}
@@ -0,0 +1,36 @@
+#pragma once
+#include <LittleFS.h>
+
+// The sensor update the gateway hands out (fuota_server.h): a delta made with
+// `program delta` of the letterman simulation, uploaded as data/fuota.delta
+// with `pio run -t uploadfs`. The file stays open, the radio task reads the
+// fragments from it as the nodes ask for them.
+#define FIRMWARE_DELTA_PATH "/fuota.delta"
+
+class FirmwareStore
+{
+public:
+  // false if there is no update to offer
+  bool begin()
+  {
+    if (!LittleFS.begin(true))
+    {
+      return false;
+    }
+    m_file = LittleFS.open(FIRMWARE_DELTA_PATH, "r");
+    return (bool)m_file;
+  }
+
+  uint32_t length()
+  {
+    return m_file.size();
+  }
+
+  bool read(uint32_t offset, uint8_t *data, size_t length)
+  {
+    return m_file.seek(offset) && m_file.read(data, length) == length;
+  }
+
+private:
+  File m_file;
+};
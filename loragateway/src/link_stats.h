@@ -0,0 +1,140 @@
+#pragma once
+#include <Arduino.h>
+#include "frame_codec.h"
+
+// Link quality of one node over one reporting period, for finding badly
+// placed mailboxes: RSSI and SNR histograms with their averages, and what the
+// counter sequence says about messages that never arrived. Every frame taken
+// from the node counts towards the histograms, repeats included, they were on
+// air as well. Owned by the network task, cleared once published.
+struct LinkStats
+{
+  static constexpr uint8_t BUCKETS = 8;
+  // below -120 dBm, 10 dB steps, -60 dBm and above
+  static constexpr int16_t RSSI_FIRST_DBM = -120;
+  static constexpr int16_t RSSI_STEP_DB = 10;
+  // below -15 dB, 5 dB steps, 15 dB and above
+  static constexpr int16_t SNR_FIRST_DB = -15;
+  static constexpr int16_t SNR_STEP_DB = 5;
+
+  uint16_t frames;
+  // first copies of messages, repeats dropped
+  uint16_t messages;
+  uint16_t duplicates;
+  // skipped counters, less the ones that showed up late
+  int16_t lost;
+  // sums for the averages, in 1/4 dB
+  int32_t rssiSum;
+  int32_t snrSum;
+  // saturate at 255, a period is far shorter than that many frames
+  uint8_t rssiHistogram[BUCKETS];
+  uint8_t snrHistogram[BUCKETS];
+
+  void addFrame(float rssi, float snr)
+  {
+    frames++;
+    rssiSum += (int32_t)lroundf(rssi * 4);
+    snrSum += (int32_t)lroundf(snr * 4);
+    count(rssiHistogram[bucket(rssi, RSSI_FIRST_DBM, RSSI_STEP_DB)]);
+    count(snrHistogram[bucket(snr, SNR_FIRST_DB, SNR_STEP_DB)]);
+  }
+
+  // share of the messages sent in the period that never arrived, in percent
+  float lossPercent() const
+  {
+    return lost > 0 ? 100.0f * lost / (messages + lost) : 0;
+  }
+
+  // {"rssi":-97.5,"snr":6.25,"loss":0.0,"frames":12,"dup":1,"lost":0,"rssi_h":[...],"snr_h":[...]}
+  size_t json(char *buffer, size_t size) const
+  {
+    size_t length = snprintf(buffer, size, "{\"rssi\":%.1f,\"snr\":%.2f,\"loss\":%.1f,\"frames\":%u,\"dup\":%u,\"lost\":%d",
+                             frames ? rssiSum / 4.0f / frames : 0, frames ? snrSum / 4.0f / frames : 0, lossPercent(),
+                             frames, duplicates, lost);
+    length = histogramJson(buffer, size, length, "rssi_h", rssiHistogram);
+    length = histogramJson(buffer, size, length, "snr_h", snrHistogram);
+    if (length < size)
+    {
+      length += snprintf(buffer + length, size - length, "}");
+    }
+    return length;
+  }
+
+private:
+  static uint8_t bucket(float value, int16_t first, int16_t step)
+  {
+    if (value < first)
+    {
+      return 0;
+    }
+    const int32_t index = (int32_t)((value - first) / step) + 1;
+    return index < BUCKETS ? (uint8_t)index : BUCKETS - 1;
+  }
+
+  static void count(uint8_t &bucket)
+  {
+    if (bucket < 255)
+    {
+      bucket++;
+    }
+  }
+
+  static size_t histogramJson(char *buffer, size_t size, size_t length, const char *key, const uint8_t (&histogram)[BUCKETS])
+  {
+    if (length < size)
+    {
+      length += snprintf(buffer + length, size - length, ",\"%s\":[", key);
+    }
+    for (uint8_t i = 0; i < BUCKETS && length < size; i++)
+    {
+      length += snprintf(buffer + length, size - length, "%s%u", i ? "," : "", histogram[i]);
+    }
+    if (length < size)
+    {
+      length += snprintf(buffer + length, size - length, "]");
+    }
+    return length;
+  }
+};
+
+// Frames the gateway heard but could not take from any node, by what was
+// wrong with them. The node id is part of what failed the check, so these
+// are counted for the gateway as a whole.
+struct LinkErrors
+{
+  // LoRa payload CRC and the frame's own check
+  uint32_t crc;
+  // unknown frame version or type
+  uint32_t header;
+  // too short, too long or an extension running past the end
+  uint32_t length;
+  // any other receive error the radio reported
+  uint32_t other;
+
+  void addFrameError(FrameError error)
+  {
+    switch (error)
+    {
+    case FRAME_BAD_CHECK:
+      crc++;
+      break;
+    case FRAME_BAD_VERSION:
+    case FRAME_BAD_TYPE:
+      header++;
+      break;
+    case FRAME_TOO_SHORT:
+    case FRAME_TOO_LONG:
+    case FRAME_BAD_EXTENSION:
+      length++;
+      break;
+    default:
+      other++;
+      break;
+    }
+  }
+
+  uint32_t total() const
+  {
+    return crc + header + length + other;
+  }
+};
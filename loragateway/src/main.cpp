@@ -25,132 +25,953 @@
 #include <ArduinoOTA.h>
 #include <MqttDevice.h>
 #include "utils.h"
+#include "node_table.h"
+#include "spsc_ring.h"
+#include "stage_stats.h"
+#include "connection_manager.h"
+#include "outbound_queue.h"
+#include "sequence_window.h"
+#include "frame_codec.h"
+#include "link_adr.h"
+#include "channels.h"
+#include "discovery_cache.h"
+#include "link_stats.h"
+#include "fuota_server.h"
+#include "firmware_store.h"
+#include "event_log.h"
+#include "tile_display.h"
+#ifdef LETTERMAN_NATIVE
+#include "sim/sim_config.h"
+#else
 #include "config.h"
+#endif
 
 #define LORA_FREQ 868.0
+// RadioLib's default, what begin() sets up
+#define LORA_SF 9
+// SF range the link adaptation assigns from. A single SX1276 demodulates only
+// the SF it listens on, so nodes cannot go below or above it; TX power is what
+// actually adapts.
+#define ADR_MIN_SF LORA_SF
+#define ADR_MAX_SF LORA_SF
 
 U8G2_SSD1306_128X64_NONAME_F_HW_I2C *u8g2 = nullptr;
+// sends the changed part of each frame, owned by the display task
+TileDisplay g_tiles;
 
 SX1276 radio = new Module(LORA_CS, LORA_IRQ, LORA_RST);
 
-WiFiClient net;
+MqttSocket net;
 PubSubClient client(net);
+ConnectionManager g_connection(client, net);
+
+// states are published a moment after the discovery configs went out so Home
+// Assistant has created the entities by then
+#define STATE_PUBLISH_DELAY_MS 200
+// a state resync sends one node per interval
+#define STATE_RESYNC_INTERVAL_MS 20
+// PubSubClient buffer, a discovery config has to fit with its topic
+#define MQTT_BUFFER_SIZE 512
+// Discovery configs are retained and only sent again when they change. Set to
+// 1 for a broker without persistence, which forgets them when it restarts.
+#ifndef LETTERMAN_DISCOVERY_RESEND
+#define LETTERMAN_DISCOVERY_RESEND 0
+#endif
+// sets the clock the event history dates its messages with
+#ifndef NTP_SERVER
+#define NTP_SERVER "pool.ntp.org"
+#endif
+bool g_publishSensorsPending = false;
+// composeClientID() once, it names the legacy node's entities on every publish
+char g_clientId[32];
+uint32_t g_publishSensorsAt = 0;
 const char *HOMEASSISTANT_STATUS_TOPIC = "homeassistant/status";
 const char *HOMEASSISTANT_STATUS_TOPIC_ALT = "ha/status";
 
-MqttDevice mqttDevice(composeClientID().c_str(), "Letterman", "Letterman-Lora", "maker_pt");
+// hash table slots for sensor nodes, 3/4 of them can be used
+#ifndef LETTERMAN_NODE_SLOTS
+#define LETTERMAN_NODE_SLOTS 512
+#endif
+
+// frames without node address come from sensors with the old firmware
+#define LEGACY_NODE_ID 0
+
+struct NodeState
+{
+  uint32_t id;
+  bool used;
+  // discovery configs of this node's entities are in g_discovery
+  bool configCached;
+  // channel set (channels.h) of the last status
+  uint8_t channels;
+  // channel set last handed to the outbound queue
+  uint8_t reportedStates;
+  bool reportedValid;
+  SequenceWindow sequence;
+  // repeated copies dropped and messages missing from the counter sequence
+  uint32_t duplicates;
+  int32_t lostMessages;
+  // pulses the sensor's input filter counted in deep sleep, including the
+  // ones too short to wake it
+  uint32_t vibrationPulses;
+  uint32_t motionPulses;
+  // last reported battery voltage, 0 if the node does not measure it
+  uint16_t batteryMv;
+  // event summary (EXT_EVENTS) of the last message, for the events topic: the
+  // inputs that went high during the burst, how often and when first
+  uint8_t eventChannels;
+  uint8_t eventCounts[CHANNEL_COUNT];
+  uint16_t eventOffsetsMs[CHANNEL_COUNT];
+  bool eventsPending;
+  // noise summary (EXT_NOISE) of the last message: the bursts the sensor did
+  // not take for mail since its previous summary, for the noise topic
+  uint16_t noiseBursts;
+  uint16_t noiseFlapPulses;
+  uint16_t noiseMotionPulses;
+  bool noisePending;
+  // last daily energy summary of the node, since its power on
+  uint32_t energySeconds;
+  uint32_t energyChargeUah;
+  uint16_t energyWakes;
+  // link quality since the last link report
+  LinkStats link;
+  // build the node runs (EXT_FIRMWARE), 0 until it reported one
+  uint32_t build;
+  // boot the sequence window was restarted for (EXT_RESTART), copies of its
+  // frames after the first are duplicates
+  uint32_t bootId;
+};
+
+uint32_t g_duplicates = 0;
+int32_t g_lostMessages = 0;
+
+NodeTable<NodeState, LETTERMAN_NODE_SLOTS> g_nodes;
+
+// state changes waiting for the broker, owned by the network task
+OutboundQueue g_outbox;
+// retained discovery configs, owned by the network task as well. Twice the
+// slots of g_nodes, for every node it holds plus the gateway and the records
+// of nodes from before a reboot.
+typedef DiscoveryCache<2 * LETTERMAN_NODE_SLOTS> NodeDiscovery;
+NodeDiscovery g_discovery;
+// every accepted message, owned by the network task
+EventLog g_history;
+
+// The outbound queue stores a Channel as the entity, or this for the channel
+// set of a node on the packed state topic
+#define ENTITY_PACKED 0x80
+
+// channels taken from legacy frames. New mail stays off: the original sensor
+// sets its flag on every wake that is not the door, only the codec sensors
+// work it out from the burst (mail_inference.h).
+constexpr uint8_t LEGACY_CHANNELS = CHANNEL_ALL & ~channelBit(CHANNEL_NEW_MAIL);
+
+// publish a single packed state message per node change on letterman/<node>/state
+// in addition to the per-entity state topics
+#ifndef LETTERMAN_PACKED_STATE
+#define LETTERMAN_PACKED_STATE 0
+#endif
+
+// state publishes that reached the broker and edges that did not need one
+uint32_t g_publishSent = 0;
+uint32_t g_publishSuppressed = 0;
+
+// the legacy node keeps the ids of the single mailbox gateway so existing setups survive
+const char *nodeDeviceId(const NodeState &node, char *buffer, size_t size)
+{
+  if (node.id == LEGACY_NODE_ID)
+  {
+    strncpy(buffer, g_clientId, size - 1);
+    buffer[size - 1] = 0;
+  }
+  else
+  {
+    snprintf(buffer, size, "letterman-%08x", node.id);
+  }
+  return buffer;
+}
+
+const char *nodeObjectId(const NodeState &node, const char *entity, char (&buffer)[48])
+{
+  if (node.id == LEGACY_NODE_ID)
+  {
+    snprintf(buffer, sizeof(buffer), "letterman_%s", entity);
+  }
+  else
+  {
+    snprintf(buffer, sizeof(buffer), "letterman_%08x_%s", node.id, entity);
+  }
+  return buffer;
+}
+
+const char *nodeEntityName(const NodeState &node, const char *entity, char (&buffer)[48])
+{
+  if (node.id == LEGACY_NODE_ID)
+  {
+    snprintf(buffer, sizeof(buffer), "Mailbox %s", entity);
+  }
+  else
+  {
+    snprintf(buffer, sizeof(buffer), "Mailbox %08x %s", node.id, entity);
+  }
+  return buffer;
+}
+
+// Home Assistant entity of one channel of a node, for the topics mqttdisco
+// gives it; renderChannelConfig() writes its config from the row in CHANNELS.
+// Only built on the stack while publishing, the node table itself just keeps
+// the channel set.
+struct ChannelEntity
+{
+  ChannelEntity(const NodeState &node, uint8_t channel)
+      : m_device(nodeDeviceId(node, m_deviceId, sizeof(m_deviceId)), "Letterman", "Letterman-Lora", "maker_pt"),
+        sensor(&m_device, nodeObjectId(node, CHANNELS[channel].id, m_objectId), nodeEntityName(node, CHANNELS[channel].name, m_name))
+  {
+  }
+
+private:
+  char m_deviceId[32];
+  char m_objectId[48];
+  char m_name[48];
+  MqttDevice m_device;
+
+public:
+  MqttBinarySensor sensor;
+};
+
+// Link quality: every LINK_STATS_INTERVAL_MS each node heard in the period
+// publishes its LinkStats (link_stats.h) on letterman/<node>/link, the gateway
+// its receive errors on letterman/<client id>/link. Home Assistant shows them
+// as diagnostic sensors of the mailbox and of the gateway.
+#define LINK_STATS_INTERVAL_MS (15 * 60 * 1000UL)
+// link reports per network loop pass
+#define LINK_STATS_BURST 4
+// the gateway's own entities are cached under this node id
+#define GATEWAY_NODE_ID 0xffffffff
+
+// a diagnostic sensor reading `id` from the JSON on a link topic
+struct LinkMetric
+{
+  const char *id;
+  const char *name;
+  const char *unit;
+  const char *deviceClass;
+  const char *icon;
+  const char *stateClass;
+};
+
+const LinkMetric NODE_LINK_METRICS[] = {
+    {"rssi", "RSSI", "dBm", "signal_strength", nullptr, "measurement"},
+    {"snr", "SNR", "dB", "signal_strength", nullptr, "measurement"},
+    {"loss", "Packet Loss", "%", nullptr, "mdi:email-remove-outline", "measurement"},
+};
+constexpr uint8_t NODE_LINK_METRIC_COUNT = sizeof(NODE_LINK_METRICS) / sizeof(NODE_LINK_METRICS[0]);
+
+// counted since boot, Home Assistant takes care of the reset
+const LinkMetric GATEWAY_LINK_METRIC = {"errors", "LoRa Receive Errors", nullptr, nullptr, "mdi:alert-circle-outline", "total_increasing"};
 
-MqttBinarySensor mqttNewMailSensor(&mqttDevice, "letterman_new_mail", "Mailbox New Mail");
-MqttBinarySensor mqttDoorSensor(&mqttDevice, "letterman_door", "Mailbox Door");
-MqttBinarySensor mqttMotionSensor(&mqttDevice, "letterman_motion", "Mailbox Motion");
-MqttBinarySensor mqttVibrationSensor(&mqttDevice, "letterman_vibration", "Mailbox Vibration");
+// frames the gateway could not take from any node, since boot
+LinkErrors g_linkErrors;
+uint32_t g_linkReportsSent = 0;
+uint32_t g_linkStatsAt = 0;
+// next node table slot of the running link report round, SlotCount when idle
+size_t g_linkStatsSlot = LETTERMAN_NODE_SLOTS;
+
+// largest frame the gateway keeps, longer packets are truncated and rejected by the decoder
+#define RX_MAX_PAYLOAD FRAME_MAX_LENGTH
+
+// a received frame together with the link metrics read right after it
+struct RxPacket
+{
+  int16_t state;
+  uint16_t length;
+  float rssi;
+  float snr;
+  float frequencyError;
+  uint32_t receivedMillis;
+  uint8_t data[RX_MAX_PAYLOAD];
+};
+
+// frames travel from the radio to the decoder through this ring, the radio
+// task is the only producer and the network task the only consumer
+SpscRing<RxPacket, 16> g_rxRing;
+
+// what the display shows after a frame, handed to the display task by value
+struct DisplaySnapshot
+{
+  uint32_t nodeId;
+  uint8_t channels;
+  float rssi;
+  float snr;
+};
 
-bool g_newMail = false;
-bool g_sensorMotionDetected = false;
-bool g_sensorDoorOpen = false;
-bool g_sensorVibrationDetected = false;
+// Pipeline: the radio task (APP_CPU) only moves frames from the module into
+// g_rxRing, the network task (PRO_CPU, next to the WiFi stack) decodes and
+// talks MQTT, the display task redraws at the lowest priority. The queues are
+// bounded and never block the producing side, a full queue is counted instead.
+// The display only gets the latest snapshot: its queue holds one, a newer one
+// overwrites it, and frames are drawn at most every DISPLAY_FRAME_MS.
+#define RADIO_TASK_CORE 1
+#define NETWORK_TASK_CORE 0
+#define DISPLAY_TASK_CORE 1
+#define RADIO_TASK_PRIORITY 5
+#define NETWORK_TASK_PRIORITY 2
+#define DISPLAY_TASK_PRIORITY 1
+#define DISPLAY_FRAME_MS 100
+#define STATS_LOG_INTERVAL_MS 60000
+
+TaskHandle_t g_radioTask = nullptr;
+TaskHandle_t g_networkTask = nullptr;
+QueueHandle_t g_displayQueue = nullptr;
+
+StageStats g_statsRadio;
+StageStats g_statsDecode;
+StageStats g_statsPublish;
+StageStats g_statsDisplay;
+// snapshots replaced by a newer one before they were drawn
+uint32_t g_displayCoalesced = 0;
+
+// frames lost because the ring was full when the radio delivered them
+uint32_t g_rxDropped = 0;
+uint32_t g_rxReceived = 0;
 
 // flag to indicate that a packet was received
 volatile bool g_receivedFlag = false;
 
-// disable interrupt when it's not needed
-volatile bool g_enableInterrupt = true;
-
 // this function is called when a complete packet
 // is received by the module
 // IMPORTANT: this function MUST be 'void' type
 //            and MUST NOT have any arguments!
-void setFlag(void)
+void IRAM_ATTR setFlag(void)
+{
+  // we got a packet, set the flag
+  g_receivedFlag = true;
+
+  // wake the radio task
+  if (g_radioTask != nullptr)
+  {
+    BaseType_t higherPriorityTaskWoken = pdFALSE;
+    vTaskNotifyGiveFromISR(g_radioTask, &higherPriorityTaskWoken);
+    portYIELD_FROM_ISR(higherPriorityTaskWoken);
+  }
+}
+
+// ACKs sent for node frames, including repeats whose first ACK got lost
+uint32_t g_acksSent = 0;
+// ACKs that told a node to change its SF / TX power
+uint32_t g_linkChanges = 0;
+// firmware update fragments sent after ACKs, parity included
+uint32_t g_fragmentsSent = 0;
+
+// link margin of every node that reports its radio settings and where it is
+// with the firmware update, owned by the radio task like the ACKs that carry
+// the result
+struct NodeLink
 {
-  // check if the interrupt is enabled
-  if (!g_enableInterrupt)
+  uint32_t id;
+  bool used;
+  LinkAdr adr;
+  FuotaNode fuota;
+};
+
+// the sensor update in LittleFS, if there is one, with the radio settings of
+// begin() the fragments go out with
+FirmwareStore g_firmwareStore;
+FuotaServer<FirmwareStore> g_fuota(LORA_SF, 125000, 7, 8);
+
+// us since boot for the fragment budget, millis() wraps after 49 days. Radio
+// task only.
+uint64_t radioClockUs()
+{
+  static uint32_t lastMs = millis();
+  static uint64_t clockUs = 0;
+  const uint32_t nowMs = millis();
+  clockUs += (uint64_t)(nowMs - lastMs) * 1000;
+  lastMs = nowMs;
+  return clockUs;
+}
+
+NodeTable<NodeLink, LETTERMAN_NODE_SLOTS> g_links;
+
+// Feeds the frame's SNR into the node's estimator, returns true and the packed
+// settings if the node should change them.
+bool assignLink(const FrameView &frame, float snr, uint8_t &settings)
+{
+  NodeLink *link = g_links.findOrInsert(frame.nodeId);
+  if (link == nullptr)
+  {
+    return false;
+  }
+  FrameExtensionView reported;
+  if (frame.find(EXT_LINK_SETTINGS, 1, reported))
+  {
+    link->adr.report(frameLinkSf(reported.value[0]), frameLinkPower(reported.value[0]));
+  }
+  uint8_t sf;
+  int8_t power;
+  if (!link->adr.addFrame(snr) || !link->adr.assign(ADR_MIN_SF, ADR_MAX_SF, sf, power))
+  {
+    return false;
+  }
+  g_linkChanges++;
+  log_i("Node %08x link SF%u %d dBm -> SF%u %d dBm (SNR %.1f dB)", frame.nodeId, link->adr.sf, link->adr.power, sf, power, snr);
+  settings = frameLinkSettings(sf, power);
+  return true;
+}
+
+// Update fragments granted in the last ACK, the radio task sends one per pass
+// FUOTA_FRAGMENT_GAP_MS after the frame before and listens in between. Only
+// one grant goes out at a time, ACKs meanwhile grant nothing.
+struct FragmentJob
+{
+  uint32_t nodeId;
+  FuotaRequest grant;
+  uint8_t frames;
+  uint8_t next;
+  uint8_t sent;
+  uint32_t lastTxMillis;
+};
+FragmentJob g_fragmentJob = {};
+
+// Acknowledges a status frame right away, from the radio task: the sensor only
+// listens for a few hundred ms after its transmission. Deduplication happens
+// later, so a repeated message is acknowledged again. Update fragments the ACK
+// grants are queued in g_fragmentJob.
+void sendAck(const RxPacket &packet)
+{
+  FrameView frame;
+  if (decodeFrame(packet.data, packet.length, frame) != FRAME_OK || frame.type != FRAME_STATUS)
   {
     return;
   }
+  uint8_t ack[FRAME_HEADER_LENGTH + 2 + 1 + FUOTA_OFFER_LENGTH + FRAME_CHECK_LENGTH];
+  FrameWriter writer(ack, sizeof(ack));
+  writer.begin(FRAME_ACK, frame.nodeId, frame.counter);
+  // the settings only go out when they change, the short ACK is 7 symbols less on air
+  uint8_t settings;
+  if (assignLink(frame, packet.snr, settings))
+  {
+    writer.extension(EXT_LINK_SETTINGS, settings);
+  }
+  FuotaRequest grant = {};
+  NodeLink *link = g_links.find(frame.nodeId);
+  if (link != nullptr)
+  {
+    const uint8_t maxFrames = g_fragmentJob.next < g_fragmentJob.frames ? 0 : FUOTA_GRANT_MAX_FRAMES;
+    g_fuota.answer(frame, link->fuota, radioClockUs(), maxFrames, writer, grant);
+  }
+  const size_t length = writer.finish();
 
-  // we got a packet, set the flag
-  g_receivedFlag = true;
+  // DIO0 also signals TX done, which must not look like a received frame
+  radio.clearDio0Action();
+  int16_t state = radio.transmit(ack, length);
+  if (state == RADIOLIB_ERR_NONE && grant.missing != 0)
+  {
+    g_fragmentJob = {frame.nodeId, grant, fuotaGrantFrames(grant.missing), 0, 0, (uint32_t)millis()};
+  }
+  radio.setDio0Action(setFlag);
+  g_receivedFlag = false;
+  if (state == RADIOLIB_ERR_NONE)
+  {
+    g_acksSent++;
+  }
+  else
+  {
+    log_w("Sending ACK failed, code %d", state);
+  }
+}
+
+// Radio side of the receive path: copy the frame and its metrics out of the
+// module back to back and restart reception right away, decoding happens later
+// when the ring is drained. Only ever called from the radio task.
+void pollRadio()
+{
+  if (!g_receivedFlag)
+  {
+    return;
+  }
+  g_receivedFlag = false;
+  StageTimer timer(g_statsRadio);
+
+  RxPacket *packet = g_rxRing.reserve();
+  if (packet == nullptr)
+  {
+    // still have to empty the FIFO to get the module listening again
+    uint8_t scratch[RX_MAX_PAYLOAD];
+    radio.readData(scratch, min((size_t)radio.getPacketLength(), sizeof(scratch)));
+    radio.startReceive();
+    g_rxDropped++;
+    log_w("Receive ring full, dropped frame (%u dropped so far)", g_rxDropped);
+    return;
+  }
+
+  // the length stays the one reported by the module, oversized frames are
+  // truncated here and rejected by the decoder
+  packet->length = radio.getPacketLength();
+  packet->state = radio.readData(packet->data, min((size_t)packet->length, sizeof(packet->data)));
+  packet->rssi = radio.getRSSI();
+  packet->snr = radio.getSNR();
+  packet->frequencyError = radio.getFrequencyError();
+  packet->receivedMillis = millis();
+
+  if (packet->state == RADIOLIB_ERR_NONE)
+  {
+    sendAck(*packet);
+  }
+
+  // put module back to listen mode
+  radio.startReceive();
+
+  g_rxRing.commit();
+  g_rxReceived++;
+
+  // hand over to the decoder, which only exists once setup() is done
+  if (g_networkTask != nullptr)
+  {
+    xTaskNotifyGive(g_networkTask);
+  }
 }
 
-void publishConfig(MqttEntity *entity)
+// Sends the next frame of g_fragmentJob once its gap is over, the module is
+// back to listening right after it. Returns the ms until the one after is due,
+// 1000 if there is none. Only ever called from the radio task.
+uint32_t sendFragment()
 {
-  String payload = entity->getHomeAssistantConfigPayload();
-  char topic[255];
-  entity->getHomeAssistantConfigTopic(topic, sizeof(topic));
-  client.publish(topic, payload.c_str());
+  FragmentJob &job = g_fragmentJob;
+  if (job.next >= job.frames)
+  {
+    return 1000;
+  }
+  const uint32_t sinceMs = millis() - job.lastTxMillis;
+  // a frame that came in meanwhile is read and acknowledged first
+  if (sinceMs < FUOTA_FRAGMENT_GAP_MS || g_receivedFlag)
+  {
+    return sinceMs < FUOTA_FRAGMENT_GAP_MS ? FUOTA_FRAGMENT_GAP_MS - sinceMs : 0;
+  }
+  uint8_t frame[FUOTA_FRAGMENT_FRAME_LENGTH];
+  const size_t length = g_fuota.grantFrame(job.nodeId, job.grant, job.next++, frame, sizeof(frame));
+  if (length != 0)
+  {
+    radio.clearDio0Action();
+    if (radio.transmit(frame, length) == RADIOLIB_ERR_NONE)
+    {
+      job.sent++;
+      g_fragmentsSent++;
+    }
+    radio.setDio0Action(setFlag);
+    g_receivedFlag = false;
+    radio.startReceive();
+  }
+  job.lastTxMillis = millis();
+  if (length == 0 || job.next >= job.frames)
+  {
+    job.next = job.frames;
+    log_i("Node %08x: %u update fragments from %u", job.nodeId, job.sent, job.grant.first);
+    return 1000;
+  }
+  return FUOTA_FRAGMENT_GAP_MS;
+}
 
-  entity->getHomeAssistantConfigTopicAlt(topic, sizeof(topic));
-  client.publish(topic,
-                 payload.c_str());
+void radioTask(void *)
+{
+  uint32_t waitMs = 1000;
+  while (true)
+  {
+    // the timeout only guards against a lost notification, or is the gap
+    // before the next update fragment
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(waitMs));
+    pollRadio();
+    waitMs = sendFragment();
+  }
 }
 
-void publishConfig()
+bool publishRetained(const char *topic, const char *payload)
 {
-  publishConfig(&mqttNewMailSensor);
-  publishConfig(&mqttDoorSensor);
-  publishConfig(&mqttMotionSensor);
-  publishConfig(&mqttVibrationSensor);
+  return client.publish(topic, payload, true);
 }
 
+// PubSubClient's fixed header and topic length in front of topic and payload
+#define MQTT_PUBLISH_OVERHEAD 7
 
+// a node's configs in g_discovery: its channels, then its link metrics
+constexpr uint8_t NODE_CONFIG_COUNT = CHANNEL_COUNT + NODE_LINK_METRIC_COUNT;
+static_assert(NODE_CONFIG_COUNT <= NodeDiscovery::MAX_CONFIGS, "too many discovery configs per node");
 
-void publishNewMailSensor()
+// Discovery config of a diagnostic sensor on a link topic. MqttDevice only
+// knows binary sensors, so these are written out here, `device` is the JSON
+// of the device they belong to.
+void linkConfigPayload(char *payload, size_t size, const char *device, const char *objectId, const char *name,
+                       const LinkMetric &metric, const char *stateTopic, uint32_t expireAfterS)
 {
-  client.publish(mqttNewMailSensor.getStateTopic(), (g_newMail ? mqttNewMailSensor.getOnState() : mqttNewMailSensor.getOffState()));
+  size_t length = snprintf(payload, size,
+                           "{\"name\":\"%s\",\"uniq_id\":\"%s\",\"obj_id\":\"%s\",\"stat_t\":\"%s\",\"json_attr_t\":\"%s\","
+                           "\"val_tpl\":\"{{ value_json.%s }}\",\"stat_cla\":\"%s\",\"ent_cat\":\"diagnostic\"",
+                           name, objectId, objectId, stateTopic, stateTopic, metric.id, metric.stateClass);
+  if (metric.unit != nullptr && length < size)
+  {
+    length += snprintf(payload + length, size - length, ",\"unit_of_meas\":\"%s\"", metric.unit);
+  }
+  if (metric.deviceClass != nullptr && length < size)
+  {
+    length += snprintf(payload + length, size - length, ",\"dev_cla\":\"%s\"", metric.deviceClass);
+  }
+  if (metric.icon != nullptr && length < size)
+  {
+    length += snprintf(payload + length, size - length, ",\"ic\":\"%s\"", metric.icon);
+  }
+  // a mailbox gone quiet shows its link as unavailable rather than stale
+  if (expireAfterS != 0 && length < size)
+  {
+    length += snprintf(payload + length, size - length, ",\"exp_aft\":%u", expireAfterS);
+  }
+  if (length < size)
+  {
+    snprintf(payload + length, size - length, ",\"dev\":%s}", device);
+  }
 }
 
-void publishDoorSensor()
+void renderLinkConfig(DiscoveryConfig &config, const char *device, const char *objectId, const char *name,
+                      const LinkMetric &metric, const char *stateTopic, uint32_t expireAfterS)
 {
-  client.publish(mqttDoorSensor.getStateTopic(), (g_sensorDoorOpen ? mqttDoorSensor.getOnState() : mqttDoorSensor.getOffState()));
+  snprintf(config.topic, sizeof(config.topic), "homeassistant/sensor/%s/config", objectId);
+  snprintf(config.altTopic, sizeof(config.altTopic), "ha/sensor/%s/config", objectId);
+  linkConfigPayload(config.payload, sizeof(config.payload), device, objectId, name, metric, stateTopic, expireAfterS);
 }
 
-void publishMotionSensor()
+// Discovery config of a channel's binary sensor, written from its row in
+// CHANNELS. The topics are mqttdisco's, the ones publishState() sends on.
+bool renderChannelConfig(const NodeState &node, uint8_t channel, DiscoveryConfig &config)
 {
-  client.publish(mqttMotionSensor.getStateTopic(), (g_sensorMotionDetected ? mqttMotionSensor.getOnState() : mqttMotionSensor.getOffState()));
+  const ChannelSpec &spec = CHANNELS[channel];
+  ChannelEntity entity(node, channel);
+  entity.sensor.getHomeAssistantConfigTopic(config.topic, sizeof(config.topic));
+  entity.sensor.getHomeAssistantConfigTopicAlt(config.altTopic, sizeof(config.altTopic));
+  char deviceId[32];
+  char objectId[48];
+  char name[48];
+  const size_t size = sizeof(config.payload);
+  nodeObjectId(node, spec.id, objectId);
+  size_t length = snprintf(config.payload, size, "{\"name\":\"%s\",\"uniq_id\":\"%s\",\"obj_id\":\"%s\",\"stat_t\":\"%s\"",
+                           nodeEntityName(node, spec.name, name), objectId, objectId, entity.sensor.getStateTopic());
+  if (spec.deviceClass != nullptr && length < size)
+  {
+    length += snprintf(config.payload + length, size - length, ",\"dev_cla\":\"%s\"", spec.deviceClass);
+  }
+  if (spec.icon != nullptr && length < size)
+  {
+    length += snprintf(config.payload + length, size - length, ",\"ic\":\"%s\"", spec.icon);
+  }
+  if (length < size)
+  {
+    length += snprintf(config.payload + length, size - length,
+                       ",\"dev\":{\"ids\":[\"%s\"],\"name\":\"Letterman\",\"mdl\":\"Letterman-Lora\",\"mf\":\"maker_pt\"}}",
+                       nodeDeviceId(node, deviceId, sizeof(deviceId)));
+  }
+  return length < size;
 }
 
-void publishVibrationSensor()
+void renderNodeLinkConfig(const NodeState &node, uint8_t metric, DiscoveryConfig &config)
 {
-  client.publish(mqttVibrationSensor.getStateTopic(), (g_sensorVibrationDetected ? mqttVibrationSensor.getOnState() : mqttVibrationSensor.getOffState()));
+  char deviceId[32];
+  char device[48];
+  char stateTopic[32];
+  char objectId[48];
+  char name[48];
+  snprintf(device, sizeof(device), "{\"ids\":[\"%s\"]}", nodeDeviceId(node, deviceId, sizeof(deviceId)));
+  snprintf(stateTopic, sizeof(stateTopic), "letterman/%08x/link", node.id);
+  nodeObjectId(node, NODE_LINK_METRICS[metric].id, objectId);
+  nodeEntityName(node, NODE_LINK_METRICS[metric].name, name);
+  renderLinkConfig(config, device, objectId, name, NODE_LINK_METRICS[metric], stateTopic, 3 * LINK_STATS_INTERVAL_MS / 1000);
 }
 
-void publishSensors()
+// the gateway shows up as a device of its own with the receive error counter
+void renderGatewayConfig(DiscoveryConfig &config)
 {
-  publishNewMailSensor();
-  publishDoorSensor();
-  publishMotionSensor();
-  publishVibrationSensor();
+  char device[160];
+  char objectId[48];
+  char name[48];
+  char stateTopic[64];
+  snprintf(device, sizeof(device),
+           "{\"ids\":[\"%s-gateway\"],\"name\":\"Letterman Gateway\",\"mdl\":\"Letterman-Lora\",\"mf\":\"maker_pt\"}",
+           g_clientId);
+  snprintf(objectId, sizeof(objectId), "%s_gateway_%s", g_clientId, GATEWAY_LINK_METRIC.id);
+  snprintf(name, sizeof(name), "Letterman Gateway %s", GATEWAY_LINK_METRIC.name);
+  snprintf(stateTopic, sizeof(stateTopic), "letterman/%s/link", g_clientId);
+  renderLinkConfig(config, device, objectId, name, GATEWAY_LINK_METRIC, stateTopic, 0);
 }
 
-void connectToMqtt()
+// Render function of g_discovery, writes config `index` of a node from the
+// node table. It runs when the node is cached and again when the config is
+// sent, so the cache holds no payloads.
+bool renderConfig(uint32_t nodeId, uint8_t index, DiscoveryConfig &config)
 {
-  log_i("connecting to MQTT...");
-  // TODO: add security settings back to mqtt
-  // while (!client.connect(mqtt_client, mqtt_user, mqtt_pass))
-  for (int i = 0; i < 3 && !client.connect(composeClientID().c_str()); i++)
+  if (nodeId == GATEWAY_NODE_ID)
   {
-    Serial.print(".");
-    delay(3000);
+    renderGatewayConfig(config);
   }
-  client.subscribe(HOMEASSISTANT_STATUS_TOPIC);
-  client.subscribe(HOMEASSISTANT_STATUS_TOPIC_ALT);
+  else
+  {
+    const NodeState *node = g_nodes.find(nodeId);
+    if (node == nullptr)
+    {
+      return false;
+    }
+    if (index < CHANNEL_COUNT)
+    {
+      if (!renderChannelConfig(*node, index, config))
+      {
+        log_e("Discovery config of node %08x channel %u does not fit", nodeId, index);
+        return false;
+      }
+    }
+    else
+    {
+      renderNodeLinkConfig(*node, index - CHANNEL_COUNT, config);
+    }
+  }
+  if (MQTT_PUBLISH_OVERHEAD + strlen(config.topic) + strlen(config.payload) > MQTT_BUFFER_SIZE)
+  {
+    log_e("Discovery config of %s does not fit the MQTT buffer", config.topic);
+    return false;
+  }
+  return true;
+}
 
-  publishConfig();
-  delay(200);
-  publishSensors();
+// Hands the discovery configs of a node to g_discovery, which sends them
+// unless the broker has them already. False if the cache is full.
+bool cacheConfig(NodeState &node)
+{
+  node.configCached = g_discovery.add(node.id, NODE_CONFIG_COUNT, renderConfig);
+  if (!node.configCached)
+  {
+    log_e("Discovery cache full, node %08x has no entities yet", node.id);
+  }
+  return node.configCached;
 }
 
-void connectToWifi()
+void cacheConfigs()
 {
-  log_i("Connecting to wifi...");
-  WiFi.begin(wifi_ssid, wifi_pass);
-  // TODO: really forever? What if we want to go back to autoconnect?
-  while (WiFi.status() != WL_CONNECTED)
+  g_discovery.add(GATEWAY_NODE_ID, 1, renderConfig);
+  g_nodes.forEach([](NodeState &node)
+                  {
+                    if (!node.configCached)
+                    {
+                      cacheConfig(node);
+                    } });
+  if (LETTERMAN_DISCOVERY_RESEND)
   {
-    Serial.print(".");
-    delay(1000);
+    g_discovery.resendAll();
   }
-  log_i("\n Wifi connected!");
+}
+
+bool publishChannel(const NodeState &node, uint8_t channel, bool state)
+{
+  ChannelEntity entity(node, channel);
+  return client.publish(entity.sensor.getStateTopic(), (state ? entity.sensor.getOnState() : entity.sensor.getOffState()));
+}
+
+void publishSensors(const NodeState &node)
+{
+  for (uint8_t channel = 0; channel < CHANNEL_COUNT; channel++)
+  {
+    if (publishChannel(node, channel, node.channels & channelBit(channel)))
+    {
+      g_publishSent++;
+    }
+  }
+}
+
+// {"nm":0,"d":1,...}, one key per channel
+void packedStatePayload(uint8_t channels, char *payload, size_t size)
+{
+  size_t length = snprintf(payload, size, "{");
+  for (uint8_t channel = 0; channel < CHANNEL_COUNT && length < size; channel++)
+  {
+    length += snprintf(payload + length, size - length, "%s\"%s\":%d", channel ? "," : "",
+                       CHANNELS[channel].key, (channels >> channel) & 1);
+  }
+  if (length < size)
+  {
+    snprintf(payload + length, size - length, "}");
+  }
+}
+
+// outbound queue callback, false leaves the event queued
+bool publishEvent(const OutboundEvent &event)
+{
+  // spilled events may belong to a node not heard since reboot
+  NodeState *node = g_nodes.findOrInsert(event.nodeId);
+  if (node == nullptr)
+  {
+    // table full, nothing to publish to
+    return true;
+  }
+  bool sent;
+  if (event.entity == ENTITY_PACKED)
+  {
+    char topic[32];
+    char payload[8 * CHANNEL_COUNT + 2];
+    snprintf(topic, sizeof(topic), "letterman/%08x/state", node->id);
+    packedStatePayload(event.state, payload, sizeof(payload));
+    sent = client.publish(topic, payload);
+  }
+  else if (event.entity >= CHANNEL_COUNT)
+  {
+    // spilled by a firmware with more channels
+    return true;
+  }
+  else
+  {
+    if (!node->configCached && !cacheConfig(*node))
+    {
+      return false;
+    }
+    // the state of an entity Home Assistant does not know yet is lost
+    if (g_discovery.pending(node->id))
+    {
+      return false;
+    }
+    sent = publishChannel(*node, event.entity, event.state);
+  }
+  if (sent)
+  {
+    g_publishSent++;
+  }
+  return sent;
+}
+
+// The event summary of a node's last message on letterman/<node>/events as
+// {"m":{"n":2,"ms":0},"v":{"n":3,"ms":400}}, one key per input that went high.
+// The entity states only show the inputs as they were when the sensor's
+// window closed, a PIR that went high and low again within it is only here.
+// Not retained and not queued, an event while disconnected is only logged.
+void publishNodeEvents(NodeState &node)
+{
+  node.eventsPending = false;
+  if (!g_connection.connected())
+  {
+    return;
+  }
+  char topic[32];
+  char payload[28 * CHANNEL_COUNT + 2];
+  snprintf(topic, sizeof(topic), "letterman/%08x/events", node.id);
+  size_t length = snprintf(payload, sizeof(payload), "{");
+  for (uint8_t channel = 0; channel < CHANNEL_COUNT && length < sizeof(payload); channel++)
+  {
+    if (node.eventChannels & channelBit(channel))
+    {
+      length += snprintf(payload + length, sizeof(payload) - length, "%s\"%s\":{\"n\":%u,\"ms\":%u}",
+                         length > 1 ? "," : "", CHANNELS[channel].key, node.eventCounts[channel],
+                         node.eventOffsetsMs[channel]);
+    }
+  }
+  if (length < sizeof(payload))
+  {
+    snprintf(payload + length, sizeof(payload) - length, "}");
+  }
+  if (client.publish(topic, payload))
+  {
+    g_publishSent++;
+  }
+}
+
+// The noise summary of a node's last message on letterman/<node>/noise as
+// {"bursts":3,"v":4,"m":2}: bursts of input activity the sensor did not take
+// for mail and sent no message for, with their flap and PIR pulses. Not
+// retained and not queued like the events.
+void publishNodeNoise(NodeState &node)
+{
+  node.noisePending = false;
+  if (!g_connection.connected())
+  {
+    return;
+  }
+  char topic[32];
+  char payload[48];
+  snprintf(topic, sizeof(topic), "letterman/%08x/noise", node.id);
+  snprintf(payload, sizeof(payload), "{\"bursts\":%u,\"%s\":%u,\"%s\":%u}", node.noiseBursts,
+           CHANNELS[CHANNEL_VIBRATION].key, node.noiseFlapPulses, CHANNELS[CHANNEL_MOTION].key,
+           node.noiseMotionPulses);
+  if (client.publish(topic, payload))
+  {
+    g_publishSent++;
+  }
+}
+
+// hand the entity states of a node that just reported to the outbound queue,
+// only the ones that changed since the last report
+void queueSensors(NodeState &node)
+{
+  const uint8_t states = node.channels;
+  const uint8_t changed = node.reportedValid ? (states ^ node.reportedStates) : 0xff;
+  for (uint8_t channel = 0; channel < CHANNEL_COUNT; channel++)
+  {
+    if (changed & channelBit(channel))
+    {
+      g_outbox.push(node.id, channel, (states >> channel) & 1);
+    }
+    else
+    {
+      g_publishSuppressed++;
+    }
+  }
+  if (LETTERMAN_PACKED_STATE && (changed & CHANNEL_ALL))
+  {
+    g_outbox.push(node.id, ENTITY_PACKED, states);
+  }
+  node.reportedStates = states;
+  node.reportedValid = true;
+}
+
+// next node table slot of the running state resync, SlotCount when idle
+size_t g_resyncSlot = LETTERMAN_NODE_SLOTS;
+uint32_t g_resyncAt = 0;
+
+// Full state resync of all nodes, one node per STATE_RESYNC_INTERVAL_MS from
+// the network loop while connected. Nodes only known from spilled events
+// have no state of their own and are left out.
+void publishSensors()
+{
+  if (g_resyncSlot >= g_nodes.SlotCount || millis() - g_resyncAt < STATE_RESYNC_INTERVAL_MS)
+  {
+    return;
+  }
+  g_resyncAt = millis();
+  while (g_resyncSlot < g_nodes.SlotCount)
+  {
+    const NodeState *node = g_nodes.at(g_resyncSlot++);
+    if (node != nullptr && node->reportedValid && node->configCached && !g_discovery.pending(node->id))
+    {
+      publishSensors(*node);
+      return;
+    }
+  }
+}
+
+void schedulePublishSensors()
+{
+  g_publishSensorsPending = true;
+  g_publishSensorsAt = millis() + STATE_PUBLISH_DELAY_MS;
+}
+
+void onWifiConnected()
+{
+  log_i("Connected to SSID: %s", wifi_ssid);
+  // no-op after the first call
+  ArduinoOTA.begin();
+  configTime(0, 0, NTP_SERVER);
+}
+
+void onMqttConnected()
+{
+  client.subscribe(HOMEASSISTANT_STATUS_TOPIC);
+  client.subscribe(HOMEASSISTANT_STATUS_TOPIC_ALT);
+  char topic[64];
+  snprintf(topic, sizeof(topic), "letterman/%s/history/get", g_clientId);
+  client.subscribe(topic);
+
+  cacheConfigs();
+  schedulePublishSensors();
 }
 
 void initBoard()
@@ -213,30 +1034,95 @@ void initBoard()
   Serial.println("Initboard done");
 }
 
+// Answers "<deliveries|emptied|messages> [days] [node id]" from
+// letterman/<client id>/history/get on letterman/<client id>/history: the
+// messages per node of the last days, 0 or none for the whole history, of one
+// node, 00000000 for the legacy sensors, or of all of them without one
+void answerHistoryQuery(const byte *payload, unsigned int length)
+{
+  char request[48];
+  length = min(length, (unsigned int)sizeof(request) - 1);
+  memcpy(request, payload, length);
+  request[length] = '\0';
+  char name[16] = "";
+  unsigned days = 0;
+  unsigned nodeId = 0;
+  const bool oneNode = sscanf(request, "%15s %u %x", name, &days, &nodeId) == 3;
+
+  char topic[64];
+  snprintf(topic, sizeof(topic), "letterman/%s/history", g_clientId);
+  char response[MQTT_BUFFER_SIZE - 64];
+  int event = 0;
+  while (event < HISTORY_EVENT_COUNT && strcmp(name, HISTORY_EVENT_NAMES[event]) != 0)
+  {
+    event++;
+  }
+  const uint32_t now = EventLog::now();
+  if (event == HISTORY_EVENT_COUNT || (days != 0 && now == 0))
+  {
+    snprintf(response, sizeof(response), "{\"error\":\"%s\"}",
+             event == HISTORY_EVENT_COUNT ? "expected deliveries, emptied or messages" : "clock not set");
+    client.publish(topic, response);
+    return;
+  }
+  // a longer range than the clock has is the whole history with a time
+  const uint32_t since = days == 0 ? 0 : days < now / 86400 ? now - days * 86400 : 1;
+  HistoryCounts counts;
+  const uint32_t node = nodeId;
+  g_history.count((HistoryEvent)event, since, oneNode ? &node : nullptr, counts);
+
+  int used = snprintf(response, sizeof(response), "{\"event\":\"%s\",\"days\":%u,\"since\":%u,\"nodes\":{",
+                      HISTORY_EVENT_NAMES[event], days, since);
+  for (size_t i = 0; i < counts.nodeCount && used < (int)sizeof(response); i++)
+  {
+    used += snprintf(response + used, sizeof(response) - used, "%s\"%08x\":%u", i == 0 ? "" : ",",
+                     counts.nodes[i].nodeId, counts.nodes[i].count);
+  }
+  if (used < (int)sizeof(response))
+  {
+    used += snprintf(response + used, sizeof(response) - used, "},\"truncated\":%s,\"indexed\":%u,\"scanned\":%u}",
+                     counts.truncated ? "true" : "false", counts.indexed, counts.scanned);
+  }
+  if (used >= (int)sizeof(response))
+  {
+    snprintf(response, sizeof(response), "{\"error\":\"too many nodes, ask for one\"}");
+  }
+  client.publish(topic, response);
+  log_i("History query \"%s\": %u nodes, %u segments from the index, %u read", request, counts.nodeCount,
+        counts.indexed, counts.scanned);
+}
+
 void callback(char *topic, byte *payload, unsigned int length)
 {
   log_d("Mqtt msg arrived [%s]", topic);
-  
 
-  // publish config when homeassistant comes online and needs the configuration again
+  char historyTopic[64];
+  snprintf(historyTopic, sizeof(historyTopic), "letterman/%s/history/get", g_clientId);
+  if (strcmp(topic, historyTopic) == 0)
+  {
+    answerHistoryQuery(payload, length);
+    return;
+  }
+
+  // Home Assistant came back: the broker hands it the retained configs, the
+  // states are not retained and have to be sent again
   if (strcmp(topic, HOMEASSISTANT_STATUS_TOPIC) == 0 ||
            strcmp(topic, HOMEASSISTANT_STATUS_TOPIC_ALT) == 0)
   {
     if (strncmp((char *)payload, "online", length) == 0)
     {
-      publishConfig();
-      delay(200);
-      publishSensors();
+      cacheConfigs();
+      schedulePublishSensors();
     }
   }
 }
 
+void radioTask(void *);
+void networkTask(void *);
+void displayTask(void *);
+
 void setup()
 {
-  mqttNewMailSensor.setIcon("mdi:mail");
-  mqttDoorSensor.setDeviceClass("door");
-  mqttMotionSensor.setDeviceClass("motion");
-  mqttVibrationSensor.setDeviceClass("vibration");
   initBoard();
   // When the power is turned on, a delay is required.
   delay(1500);
@@ -281,6 +1167,16 @@ void setup()
       ;
   }
 
+  // the radio task answers update requests, the delta has to be set up first
+  if (g_firmwareStore.begin() && g_fuota.begin(&g_firmwareStore, g_firmwareStore.length()))
+  {
+    log_i("Offering sensor update %08x -> %08x, %u bytes", g_fuota.offer().baseBuild, g_fuota.offer().targetBuild,
+          g_fuota.offer().length);
+  }
+
+  // receive from here on, even while WiFi is still connecting
+  xTaskCreatePinnedToCore(radioTask, "radio", 4096, nullptr, RADIO_TASK_PRIORITY, &g_radioTask, RADIO_TASK_CORE);
+
   // if needed, 'listen' mode can be disabled by calling
   // any of the following methods:
   //
@@ -292,11 +1188,10 @@ void setup()
   // radio.scanChannel();
 
   WiFi.mode(WIFI_STA);
-  WiFi.hostname(composeClientID().c_str());
+  strncpy(g_clientId, composeClientID().c_str(), sizeof(g_clientId) - 1);
+  WiFi.hostname(g_clientId);
   WiFi.setAutoConnect(true);
-  WiFi.begin(wifi_ssid, wifi_pass);
 
-  connectToWifi();
   ArduinoOTA.onStart([]()
                      {
     String type;
@@ -330,35 +1225,127 @@ void setup()
       log_e("Arduino OTA: End Failed");
     } });
 
-  ArduinoOTA.begin();
+  client.setBufferSize(MQTT_BUFFER_SIZE);
+  client.setCallback(callback);
 
-  log_i("Connected to SSID: %s", wifi_ssid);
-  //log_i("IP address: %s", WiFi.localIP());
+  g_outbox.begin();
+  g_discovery.begin();
+  g_history.begin();
 
-  client.setBufferSize(512);
-  client.setServer(mqtt_server, mqtt_port);
-  client.setCallback(callback);
+  // WiFi, OTA and MQTT come up in the background, driven by the network task
+  g_connection.onWifiConnected = onWifiConnected;
+  g_connection.onMqttConnected = onMqttConnected;
+  g_connection.begin(wifi_ssid, wifi_pass, mqtt_server, mqtt_port, g_clientId);
+
+  if (u8g2)
+  {
+    g_displayQueue = xQueueCreate(1, sizeof(DisplaySnapshot));
+    xTaskCreatePinnedToCore(displayTask, "display", 4096, nullptr, DISPLAY_TASK_PRIORITY, nullptr, DISPLAY_TASK_CORE);
+  }
+  xTaskCreatePinnedToCore(networkTask, "network", 12288, nullptr, NETWORK_TASK_PRIORITY, &g_networkTask, NETWORK_TASK_CORE);
 }
 
-bool processIncomingLora()
+// runs the message counter through the node's sequence window, false for
+// duplicates and stale copies
+bool acceptCounter(NodeState &node, const FrameView &frame)
 {
-  if (!g_receivedFlag)
+  // the node lost its RTC memory, a low counter is a new message and not a
+  // late copy of an old one
+  FrameExtensionView restart;
+  if (frame.find(EXT_RESTART, 4, restart) && frameGetLe32(restart.value) != node.bootId)
   {
+    node.bootId = frameGetLe32(restart.value);
+    node.sequence.restart();
+  }
+  const uint16_t counter = frame.counter;
+  int32_t lost = 0;
+  SequenceWindow::Result result = node.sequence.check(counter, lost);
+  node.lostMessages += lost;
+  node.link.lost += lost;
+  g_lostMessages += lost;
+  if (result == SequenceWindow::Duplicate || result == SequenceWindow::Stale)
+  {
+    node.duplicates++;
+    node.link.duplicates++;
+    g_duplicates++;
     return false;
   }
-  uint8_t buffer[1000];
-  // disable the interrupt service routine while
-  // processing the data
-  g_enableInterrupt = false;
+  node.link.messages++;
+  if (result == SequenceWindow::Resynced && node.reportedValid)
+  {
+    log_i("Node %08x counter restarted at %u", node.id, counter);
+  }
+  return true;
+}
 
-  // reset flag
-  g_receivedFlag = false;
+// daily summary of a sensor's energy ledger, it changes no entity state and is
+// not acknowledged, a lost one is simply replaced by the next
+void processEnergyReport(const FrameView &frame)
+{
+  static const char *const phases[] = {"deep-sleep", "boot", "radio-init", "tx", "rx", "wait", "log", "light-sleep", "active"};
+  FrameExtensionView totals;
+  if (!frame.find(EXT_ENERGY_TOTALS, 10, totals))
+  {
+    log_w("Energy report of node %08x without totals", frame.nodeId);
+    return;
+  }
+  NodeState *node = g_nodes.findOrInsert(frame.nodeId);
+  if (node == nullptr)
+  {
+    log_e("Node table full, dropping energy report from node %08x", frame.nodeId);
+    return;
+  }
+  node->energyWakes = frameGetLe16(&totals.value[0]);
+  node->energySeconds = frameGetLe32(&totals.value[2]);
+  node->energyChargeUah = frameGetLe32(&totals.value[6]);
+  // the average is only worked out for the log, it compiles out with it
+  log_i("Node %08x energy: %u uAh in %u s over %u wakes, average %u uA",
+        frame.nodeId, node->energyChargeUah, node->energySeconds, node->energyWakes,
+        node->energySeconds ? (uint32_t)((uint64_t)node->energyChargeUah * 3600 / node->energySeconds) : 0);
+  FrameExtensionView shares;
+  if (frame.find(EXT_ENERGY_PHASES, 1, shares))
+  {
+    for (uint8_t phase = 0; phase < shares.length && phase < sizeof(phases) / sizeof(phases[0]); phase++)
+    {
+      log_d("Node %08x energy %s: %u %%", frame.nodeId, phases[phase], shares.value[phase]);
+    }
+  }
+}
 
-  // you can read received data as an Arduino String
-  uint16_t length = radio.getPacketLength();
-  int16_t state = radio.readData(buffer, sizeof(buffer));
+// EXT_EVENTS of a status frame, channels of a newer firmware are skipped
+void decodeEvents(NodeState &node, const FrameExtensionView &extension)
+{
+  const uint8_t channels = extension.value[0];
+  size_t offset = 1;
+  node.eventChannels = 0;
+  for (uint8_t channel = 0; channel < 8 && offset + 2 <= extension.length; channel++)
+  {
+    if ((channels & channelBit(channel)) == 0)
+    {
+      continue;
+    }
+    if (channel < CHANNEL_COUNT)
+    {
+      node.eventChannels |= channelBit(channel);
+      node.eventCounts[channel] = extension.value[offset];
+      node.eventOffsetsMs[channel] = extension.value[offset + 1] * FRAME_EVENT_TICK_MS;
+      log_i("Node %08x %s %u time(s), first after %u ms", node.id, CHANNELS[channel].name,
+            node.eventCounts[channel], node.eventOffsetsMs[channel]);
+    }
+    offset += 2;
+  }
+  node.eventsPending = node.eventChannels != 0;
+}
 
-  bool success = false;
+// decodes one frame taken from the receive ring,
+// returns the node whose state was updated by it, nullptr otherwise
+NodeState *processIncomingLora(const RxPacket &packet)
+{
+  const uint8_t *buffer = packet.data;
+  uint16_t length = packet.length;
+  int16_t state = packet.state;
+
+  NodeState *node = nullptr;
 
   if (state == RADIOLIB_ERR_NONE)
   {
@@ -372,50 +1359,124 @@ bool processIncomingLora()
     //Serial.println(str);
 
     //g_newMail = strcmp(doc["newmail"], "on") == 0;
-    if (length != 4)
+    // legacy frame of the original sensor firmware: 'l', 'm', status, counter,
+    // everything else goes through the codec (frame_codec.h)
+    const bool legacy = length == 4 && buffer[0] == 'l' && buffer[1] == 'm';
+    FrameView frame;
+    FrameError error = legacy ? FRAME_OK : decodeFrame(buffer, length, frame);
+    if (error != FRAME_OK)
     {
-      Serial.println(F("[SX1278] Length error!"));
+      Serial.print(F("[SX1278] Frame error: "));
+      Serial.println(frameErrorName(error));
+      g_linkErrors.addFrameError(error);
     }
-    else if (buffer[0] != 'l' || buffer[1] != 'm')
+    else if (!legacy && frame.type == FRAME_ENERGY)
     {
-      Serial.println(F("[SX1278] Header error!"));
+      processEnergyReport(frame);
+    }
+    else if (!legacy && frame.type != FRAME_STATUS)
+    {
+      // an ACK, ours or another gateway's
     }
     else
     {
+      uint32_t nodeId = LEGACY_NODE_ID;
       uint8_t status = buffer[2];
+      uint16_t counter = 0;
+      if (!legacy)
+      {
+        nodeId = frame.nodeId;
+        status = frame.status;
+        counter = frame.counter;
+      }
 
-      g_sensorDoorOpen = (status >> 0) & 1;
-      g_sensorMotionDetected = (status >> 1) & 1;
-      g_sensorVibrationDetected = (status >> 2) & 1;
-      success = true;
+      node = g_nodes.findOrInsert(nodeId);
+      if (node != nullptr)
+      {
+        // repeats count towards the link quality too, they were on air as well
+        node->link.addFrame(packet.rssi, packet.snr);
+      }
+      if (node == nullptr)
+      {
+        log_e("Node table full, dropping frame from node %08x", nodeId);
+      }
+      // legacy sensors count transmissions, not messages, so only node frames can be deduplicated
+      else if (!legacy && !acceptCounter(*node, frame))
+      {
+        log_d("Duplicate message %u from node %08x", counter, nodeId);
+        node = nullptr;
+      }
+      else
+      {
+        const uint8_t decoded = legacy ? LEGACY_CHANNELS : CHANNEL_ALL;
+        node->channels = (node->channels & ~decoded) | (unpackStatus(status) & decoded);
+        FrameExtensionView extension;
+        if (!legacy && frame.find(EXT_PULSE_COUNTS, 2, extension))
+        {
+          node->vibrationPulses += extension.value[0];
+          node->motionPulses += extension.value[1];
+          log_d("Node %08x filtered %u vibration and %u motion pulses", nodeId, extension.value[0], extension.value[1]);
+        }
+        if (!legacy && frame.find(EXT_BATTERY, 2, extension))
+        {
+          node->batteryMv = frameGetLe16(extension.value);
+        }
+        if (!legacy && frame.find(EXT_EVENTS, 1, extension))
+        {
+          decodeEvents(*node, extension);
+        }
+        if (!legacy && frame.find(EXT_FIRMWARE, 4, extension) && frameGetLe32(extension.value) != node->build)
+        {
+          log_i("Node %08x runs build %08x, was %08x", nodeId, frameGetLe32(extension.value), node->build);
+          node->build = frameGetLe32(extension.value);
+        }
+        if (!legacy && frame.find(EXT_NOISE, 6, extension))
+        {
+          node->noiseBursts = frameGetLe16(&extension.value[0]);
+          node->noiseFlapPulses = frameGetLe16(&extension.value[2]);
+          node->noiseMotionPulses = frameGetLe16(&extension.value[4]);
+          node->noisePending = true;
+          log_i("Node %08x noise: %u bursts, %u flap and %u motion pulses", nodeId, node->noiseBursts,
+                node->noiseFlapPulses, node->noiseMotionPulses);
+        }
+        // the sensor tells which burst was a delivery or the mailbox being emptied
+        HistoryEvent event = HISTORY_MESSAGE;
+        if (!legacy && frame.find(EXT_MAIL, 1, extension))
+        {
+          event = extension.value[0] == FRAME_MAIL_DELIVERED ? HISTORY_DELIVERY
+                  : extension.value[0] == FRAME_MAIL_EMPTIED ? HISTORY_EMPTIED
+                                                             : HISTORY_MESSAGE;
+        }
+        g_history.append(nodeId, event, node->channels, counter, packet.rssi, packet.snr);
+      }
+    }
 
+    if (node != nullptr)
+    {
       // print RSSI (Received Signal Strength Indicator)
       Serial.print(F("[SX1278] RSSI:\t\t"));
-      Serial.print(radio.getRSSI());
+      Serial.print(packet.rssi);
       Serial.println(F(" dBm"));
 
       // print SNR (Signal-to-Noise Ratio)
       Serial.print(F("[SX1278] SNR:\t\t"));
-      Serial.print(radio.getSNR());
+      Serial.print(packet.snr);
       Serial.println(F(" dB"));
 
       // print frequency error
       Serial.print(F("[SX1278] Frequency error:\t"));
-      Serial.print(radio.getFrequencyError());
+      Serial.print(packet.frequencyError);
       Serial.println(F(" Hz"));
 
-      if (u8g2)
+      if (g_displayQueue != nullptr)
       {
-        u8g2->clearBuffer();
-        char buf[256];
-        u8g2->drawStr(0, 12, "Received OK!");
-        snprintf(buf, sizeof(buf), "d:%d m:%d v:%d", g_sensorDoorOpen, g_sensorMotionDetected, g_sensorVibrationDetected);
-        u8g2->drawStr(5, 26, buf);
-        snprintf(buf, sizeof(buf), "RSSI:%.2f", radio.getRSSI());
-        u8g2->drawStr(0, 40, buf);
-        snprintf(buf, sizeof(buf), "SNR:%.2f", radio.getSNR());
-        u8g2->drawStr(0, 54, buf);
-        u8g2->sendBuffer();
+        DisplaySnapshot snapshot = {node->id, node->channels, packet.rssi, packet.snr};
+        // the display is the least important consumer, never wait for it
+        if (uxQueueMessagesWaiting(g_displayQueue) != 0)
+        {
+          g_displayCoalesced++;
+        }
+        xQueueOverwrite(g_displayQueue, &snapshot);
       }
     }
   }
@@ -423,40 +1484,233 @@ bool processIncomingLora()
   {
     // packet was received, but is malformed
     Serial.println(F("[SX1278] CRC error!"));
+    g_linkErrors.crc++;
   }
   else
   {
     // some other error occurred
     Serial.print(F("[SX1278] Failed, code "));
     Serial.println(state);
+    g_linkErrors.other++;
   }
 
-  // put module back to listen mode
-  radio.startReceive();
+  return node;
+}
 
-  // we're ready to receive more packets,
-  // enable interrupt service routine
-  g_enableInterrupt = true;
-  return success;
+void drawSnapshot(const DisplaySnapshot &snapshot)
+{
+  u8g2->clearBuffer();
+  char buf[256];
+  snprintf(buf, sizeof(buf), "Node %08x OK", snapshot.nodeId);
+  u8g2->drawStr(0, 12, buf);
+  // the inputs as "d:1 m:0 v:0"
+  size_t length = 0;
+  buf[0] = 0;
+  for (uint8_t channel = 0; channel < CHANNEL_COUNT; channel++)
+  {
+    if (CHANNEL_INPUTS & channelBit(channel))
+    {
+      length += snprintf(buf + length, sizeof(buf) - length, "%s%s:%d", length ? " " : "", CHANNELS[channel].key,
+                         (snapshot.channels >> channel) & 1);
+    }
+  }
+  u8g2->drawStr(5, 26, buf);
+  snprintf(buf, sizeof(buf), "RSSI:%.2f", snapshot.rssi);
+  u8g2->drawStr(0, 40, buf);
+  snprintf(buf, sizeof(buf), "SNR:%.2f", snapshot.snr);
+  u8g2->drawStr(0, 54, buf);
+  g_tiles.flush();
 }
 
-void loop()
+void displayTask(void *)
 {
-  if (WiFi.status() != WL_CONNECTED)
+  // whatever initBoard() left on the panel is replaced as a whole
+  g_tiles.begin(u8g2);
+  DisplaySnapshot snapshot;
+  uint32_t lastFrame = millis() - DISPLAY_FRAME_MS;
+  while (true)
   {
-    log_w("WiFi not connected, trying to reconnect, state: %d", WiFi.status());
-    WiFi.reconnect();
+    if (xQueueReceive(g_displayQueue, &snapshot, portMAX_DELAY) != pdTRUE)
+    {
+      continue;
+    }
+    const uint32_t since = millis() - lastFrame;
+    if (since < DISPLAY_FRAME_MS)
+    {
+      vTaskDelay(pdMS_TO_TICKS(DISPLAY_FRAME_MS - since));
+      // a newer snapshot may have come in meanwhile
+      xQueueReceive(g_displayQueue, &snapshot, 0);
+    }
+    lastFrame = millis();
+    StageTimer timer(g_statsDisplay);
+    drawSnapshot(snapshot);
   }
+}
 
-  if (!client.connected())
+// {"errors":3,"crc":2,"header":0,"length":1,"other":0,"frames":1234,"dropped":0}
+bool publishGatewayLink()
+{
+  char topic[64];
+  char payload[160];
+  snprintf(topic, sizeof(topic), "letterman/%s/link", g_clientId);
+  snprintf(payload, sizeof(payload), "{\"errors\":%u,\"crc\":%u,\"header\":%u,\"length\":%u,\"other\":%u,\"frames\":%u,\"dropped\":%u}",
+           g_linkErrors.total(), g_linkErrors.crc, g_linkErrors.header, g_linkErrors.length, g_linkErrors.other,
+           g_rxReceived, g_rxDropped);
+  return client.publish(topic, payload);
+}
+
+// Sends the link report of every node heard since the last round, a few per
+// call, then starts over with fresh stats. A node whose discovery configs are
+// not out yet keeps counting into the next round.
+void publishLinkStats()
+{
+  if (g_linkStatsSlot >= g_nodes.SlotCount)
   {
-    log_w("Mqtt not connected, trying to reconnect");
-    connectToMqtt();
+    if (millis() - g_linkStatsAt < LINK_STATS_INTERVAL_MS)
+    {
+      return;
+    }
+    g_linkStatsAt = millis();
+    g_linkStatsSlot = 0;
+    if (!g_discovery.pending(GATEWAY_NODE_ID))
+    {
+      publishGatewayLink();
+    }
   }
-  client.loop();
-  ArduinoOTA.handle();
-  if(processIncomingLora())
+  uint8_t sent = 0;
+  while (g_linkStatsSlot < g_nodes.SlotCount && sent < LINK_STATS_BURST)
   {
-    publishSensors();
+    NodeState *node = g_nodes.at(g_linkStatsSlot);
+    if (node != nullptr && node->link.frames > 0 && node->configCached && !g_discovery.pending(node->id))
+    {
+      char topic[32];
+      char payload[256];
+      snprintf(topic, sizeof(topic), "letterman/%08x/link", node->id);
+      node->link.json(payload, sizeof(payload));
+      if (!client.publish(topic, payload))
+      {
+        // the same node again on the next pass
+        return;
+      }
+      node->link = LinkStats();
+      g_linkReportsSent++;
+      sent++;
+    }
+    g_linkStatsSlot++;
   }
-}
\ No newline at end of file
+}
+
+void logStageStats()
+{
+  log_i("radio: %u frames avg %u us max %u us, ring dropped %u, acks sent %u, link changes %u, update fragments %u",
+        g_statsRadio.count, g_statsRadio.avgUs(), g_statsRadio.maxUs, g_rxDropped, g_acksSent, g_linkChanges,
+        g_fragmentsSent);
+  log_i("decode: %u frames avg %u us max %u us",
+        g_statsDecode.count, g_statsDecode.avgUs(), g_statsDecode.maxUs);
+  log_i("publish: %u frames avg %u us max %u us",
+        g_statsPublish.count, g_statsPublish.avgUs(), g_statsPublish.maxUs);
+  log_i("display: %u frames avg %u us max %u us, %u tiles sent (%u per frame), %u snapshots coalesced",
+        g_statsDisplay.count, g_statsDisplay.avgUs(), g_statsDisplay.maxUs, g_tiles.tilesSent(),
+        g_tiles.frames() ? g_tiles.tilesSent() / g_tiles.frames() : 0, g_displayCoalesced);
+  log_i("messages: %u duplicates dropped, %d lost", g_duplicates, g_lostMessages);
+  log_i("link: %u receive errors (crc %u, header %u, length %u, other %u), %u node reports sent",
+        g_linkErrors.total(), g_linkErrors.crc, g_linkErrors.header, g_linkErrors.length, g_linkErrors.other,
+        g_linkReportsSent);
+  log_i("publish: %u sent, %u suppressed unchanged", g_publishSent, g_publishSuppressed);
+  log_i("outbox: %u queued, %u spilled to flash, %u collapsed",
+        g_outbox.size(), g_outbox.spilledTotal(), g_outbox.collapsedTotal());
+  log_i("discovery: configs of %u nodes cached, %u sent, %u unchanged, %u pending",
+        g_discovery.size(), g_discovery.sentTotal(), g_discovery.unchangedTotal(),
+        g_discovery.pendingCount());
+  log_i("history: %u messages in %u segments, %u batches written, %u segments evicted",
+        g_history.records(), g_history.segments(), g_history.batchesWritten(), g_history.segmentsEvicted());
+  // the metrics are read inside the log call, which compiles out with the log level
+  log_i("connection: %s, wifi reconnects %u, mqtt reconnects %u, failed attempts %u, last outage %u ms, max outage %u ms",
+        ConnectionManager::stateName(g_connection.state()), g_connection.metrics().wifiReconnects,
+        g_connection.metrics().mqttReconnects, g_connection.metrics().mqttFailedAttempts,
+        g_connection.metrics().lastOutageMs, g_connection.metrics().maxOutageMs);
+}
+
+void networkTask(void *)
+{
+  uint32_t lastStatsLog = millis();
+  while (true)
+  {
+    g_connection.loop();
+    if (g_connection.connected())
+    {
+      client.loop();
+    }
+    if (WiFi.status() == WL_CONNECTED)
+    {
+      ArduinoOTA.handle();
+    }
+    if (g_connection.connected())
+    {
+      g_discovery.drain(renderConfig, publishRetained);
+    }
+    if (g_discovery.pendingCount() > 0)
+    {
+      // the delay counts from the last config
+      g_publishSensorsAt = millis() + STATE_PUBLISH_DELAY_MS;
+    }
+    // the resync waits for the outbound queue, what it holds is older than
+    // the node states and would overwrite them in Home Assistant afterwards
+    if (g_publishSensorsPending && g_connection.connected() && g_outbox.size() == 0 &&
+        (int32_t)(millis() - g_publishSensorsAt) >= 0)
+    {
+      g_publishSensorsPending = false;
+      g_resyncSlot = 0;
+    }
+    if (g_connection.connected())
+    {
+      g_outbox.drain(publishEvent);
+      publishSensors();
+      publishLinkStats();
+    }
+    g_history.service();
+
+    RxPacket packet;
+    while (g_rxRing.pop(packet))
+    {
+      NodeState *node;
+      {
+        StageTimer timer(g_statsDecode);
+        node = processIncomingLora(packet);
+      }
+      if (node != nullptr)
+      {
+        StageTimer timer(g_statsPublish);
+        // entities of a node are announced the first time it is heard
+        if (!node->configCached)
+        {
+          cacheConfig(*node);
+        }
+        queueSensors(*node);
+        if (node->eventsPending)
+        {
+          publishNodeEvents(*node);
+        }
+        if (node->noisePending)
+        {
+          publishNodeNoise(*node);
+        }
+      }
+    }
+
+    if (millis() - lastStatsLog >= STATS_LOG_INTERVAL_MS)
+    {
+      lastStatsLog = millis();
+      logStageStats();
+    }
+
+    // woken early by the radio task when a frame is waiting
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(10));
+  }
+}
+
+void loop()
+{
+  // all work happens in the pipeline tasks started by setup()
+  vTaskDelete(nullptr);
+}
@@ -0,0 +1,165 @@
+#pragma once
+#include <Arduino.h>
+#include <WiFi.h>
+#include <errno.h>
+#include <lwip/sockets.h>
+
+#define CONNACK_LENGTH 4
+// CONNACK, remaining length 2, no session present, accepted
+constexpr uint8_t CONNACK_ACCEPTED[CONNACK_LENGTH] = {0x20, 0x02, 0x00, 0x00};
+
+// The broker connection under PubSubClient, opened without waiting:
+// connectStart() starts the TCP connect and connectPoll() tells when it is up.
+//
+// PubSubClient's connect() writes CONNECT and then waits for the CONNACK. So
+// that it does not, beginHandshake() has the socket hand it an accepted CONNACK
+// right away and keep the broker's own back until connackPoll() took it. The
+// session only counts as up once connackPoll() says the broker accepted it.
+class MqttSocket : public WiFiClient
+{
+public:
+  // false if no connect could be started
+  bool connectStart(const IPAddress &address, uint16_t port);
+  // 1 once the connection is up, 0 while it is still being made, -1 if it failed
+  int connectPoll();
+
+  void beginHandshake()
+  {
+    m_handshake = true;
+    m_connackServed = 0;
+  }
+
+  // 1 once the broker accepted the session, 0 while its CONNACK is still
+  // out, -1 if it refused or closed the connection
+  int connackPoll();
+
+  int available() override;
+  int read() override;
+  int read(uint8_t *buffer, size_t size) override;
+  int peek() override;
+  void stop() override;
+
+private:
+  int m_pendingFd = -1;
+  bool m_handshake = false;
+  uint8_t m_connackServed = 0;
+};
+
+inline bool MqttSocket::connectStart(const IPAddress &address, uint16_t port)
+{
+  stop();
+  const int fd = lwip_socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  if (fd < 0)
+  {
+    return false;
+  }
+  lwip_fcntl(fd, F_SETFL, lwip_fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+  struct sockaddr_in server = {};
+  server.sin_family = AF_INET;
+  server.sin_port = htons(port);
+  server.sin_addr.s_addr = (uint32_t)address;
+  if (lwip_connect(fd, (struct sockaddr *)&server, sizeof(server)) < 0 && errno != EINPROGRESS)
+  {
+    lwip_close(fd);
+    return false;
+  }
+  m_pendingFd = fd;
+  return true;
+}
+
+inline int MqttSocket::connectPoll()
+{
+  if (m_pendingFd < 0)
+  {
+    return -1;
+  }
+  fd_set writable;
+  FD_ZERO(&writable);
+  FD_SET(m_pendingFd, &writable);
+  struct timeval noWait = {0, 0};
+  const int ready = lwip_select(m_pendingFd + 1, nullptr, &writable, nullptr, &noWait);
+  if (ready == 0)
+  {
+    return 0;
+  }
+  int error = 0;
+  socklen_t length = sizeof(error);
+  if (ready < 0 || lwip_getsockopt(m_pendingFd, SOL_SOCKET, SO_ERROR, &error, &length) < 0 || error != 0)
+  {
+    lwip_close(m_pendingFd);
+    m_pendingFd = -1;
+    return -1;
+  }
+  // blocking again, the way WiFiClient::connect() leaves its sockets
+  lwip_fcntl(m_pendingFd, F_SETFL, lwip_fcntl(m_pendingFd, F_GETFL, 0) & ~O_NONBLOCK);
+  WiFiClient::operator=(WiFiClient(m_pendingFd));
+  m_pendingFd = -1;
+  return 1;
+}
+
+inline int MqttSocket::connackPoll()
+{
+  if (WiFiClient::available() < CONNACK_LENGTH)
+  {
+    return WiFiClient::connected() ? 0 : -1;
+  }
+  uint8_t connack[CONNACK_LENGTH];
+  const int length = WiFiClient::read(connack, sizeof(connack));
+  m_handshake = false;
+  // the session present flag does not matter, PubSubClient asks for a clean one
+  const bool accepted = length == CONNACK_LENGTH && connack[0] == CONNACK_ACCEPTED[0] &&
+                        connack[1] == CONNACK_ACCEPTED[1] && connack[3] == CONNACK_ACCEPTED[3];
+  return accepted ? 1 : -1;
+}
+
+inline int MqttSocket::available()
+{
+  if (m_handshake)
+  {
+    return CONNACK_LENGTH - m_connackServed;
+  }
+  return WiFiClient::available();
+}
+
+inline int MqttSocket::read()
+{
+  if (m_handshake)
+  {
+    return m_connackServed < CONNACK_LENGTH ? CONNACK_ACCEPTED[m_connackServed++] : -1;
+  }
+  return WiFiClient::read();
+}
+
+inline int MqttSocket::read(uint8_t *buffer, size_t size)
+{
+  if (m_handshake)
+  {
+    size_t length = 0;
+    while (length < size && m_connackServed < CONNACK_LENGTH)
+    {
+      buffer[length++] = CONNACK_ACCEPTED[m_connackServed++];
+    }
+    return length;
+  }
+  return WiFiClient::read(buffer, size);
+}
+
+inline int MqttSocket::peek()
+{
+  if (m_handshake)
+  {
+    return m_connackServed < CONNACK_LENGTH ? CONNACK_ACCEPTED[m_connackServed] : -1;
+  }
+  return WiFiClient::peek();
+}
+
+inline void MqttSocket::stop()
+{
+  if (m_pendingFd >= 0)
+  {
+    lwip_close(m_pendingFd);
+    m_pendingFd = -1;
+  }
+  m_handshake = false;
+  WiFiClient::stop();
+}
@@ -0,0 +1,105 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+// Fixed-capacity, open-addressed hash table of sensor nodes keyed by node id.
+// Storage is a static array sized at compile time, lookups probe linearly from
+// the hashed slot, so the frame path never touches the heap. Nodes are never
+// removed: a mailbox that was seen once keeps its slot until reboot.
+//
+// T needs a `uint32_t id` and a `bool used` member.
+template <typename T, size_t Slots>
+class NodeTable
+{
+  static_assert((Slots & (Slots - 1)) == 0, "NodeTable slot count must be a power of two");
+
+public:
+  // refuse inserts beyond 3/4 load so probe chains stay short
+  static constexpr size_t Capacity = Slots - Slots / 4;
+  static constexpr size_t SlotCount = Slots;
+
+  T *find(uint32_t id)
+  {
+    size_t slot = hash(id) & (Slots - 1);
+    for (size_t probe = 0; probe < Slots; probe++)
+    {
+      T &node = m_nodes[slot];
+      if (!node.used)
+      {
+        return nullptr;
+      }
+      if (node.id == id)
+      {
+        return &node;
+      }
+      slot = (slot + 1) & (Slots - 1);
+    }
+    return nullptr;
+  }
+
+  // returns the existing or a freshly initialised node, nullptr if the table is full
+  T *findOrInsert(uint32_t id)
+  {
+    size_t slot = hash(id) & (Slots - 1);
+    for (size_t probe = 0; probe < Slots; probe++)
+    {
+      T &node = m_nodes[slot];
+      if (node.used && node.id == id)
+      {
+        return &node;
+      }
+      if (!node.used)
+      {
+        if (m_size >= Capacity)
+        {
+          return nullptr;
+        }
+        node = T();
+        node.id = id;
+        node.used = true;
+        m_size++;
+        return &node;
+      }
+      slot = (slot + 1) & (Slots - 1);
+    }
+    return nullptr;
+  }
+
+  template <typename F>
+  void forEach(F fn)
+  {
+    for (size_t slot = 0; slot < Slots; slot++)
+    {
+      if (m_nodes[slot].used)
+      {
+        fn(m_nodes[slot]);
+      }
+    }
+  }
+
+  // the node in a slot, nullptr if it is free, for walking the table a few slots at a time
+  T *at(size_t slot)
+  {
+    return m_nodes[slot].used ? &m_nodes[slot] : nullptr;
+  }
+
+  size_t size() const
+  {
+    return m_size;
+  }
+
+private:
+  // murmur3 finaliser, node ids are MAC derived and poorly distributed in the low bits
+  static uint32_t hash(uint32_t id)
+  {
+    id ^= id >> 16;
+    id *= 0x85ebca6b;
+    id ^= id >> 13;
+    id *= 0xc2b2ae35;
+    id ^= id >> 16;
+    return id;
+  }
+
+  T m_nodes[Slots] = {};
+  size_t m_size = 0;
+};
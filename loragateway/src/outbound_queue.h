@@ -0,0 +1,397 @@
+#pragma once
+#include <Arduino.h>
+#include <LittleFS.h>
+
+// one state change of one Home Assistant entity of a node
+struct OutboundEvent
+{
+  uint32_t nodeId;
+  uint8_t entity;
+  uint8_t state;
+  // false once superseded by a newer event for the same entity
+  bool live;
+};
+
+// Store-and-forward queue for state changes that have to reach the broker.
+//
+// Events are kept in a RAM ring. A newer event for the same node and entity
+// supersedes the queued one, so a long outage replays the final state of each
+// entity instead of every flap. When the ring is full the oldest events go to
+// a LittleFS spill file, which survives a reboot and is replayed before the
+// ring. The file holds one record per entity, a spilled event takes the place
+// of the one of its entity not replayed yet, and its header the offset the
+// replay got to, saved after every drain() that took records from it, so a
+// reboot does not send delivered states again. A RAM index, built from the
+// file once in begin(), tells where the record of each entity is, so spilling
+// does not read the file. drain() sends at most OUTBOX_BURST events per
+// OUTBOX_INTERVAL_MS so reconnecting does not turn into a publish storm.
+class OutboundQueue
+{
+public:
+  static constexpr size_t RAM_SLOTS = 64;
+  static constexpr uint8_t OUTBOX_BURST = 4;
+  static constexpr uint32_t OUTBOX_INTERVAL_MS = 50;
+  // spill index slots, a power of two, 8 bytes each
+  static constexpr size_t SPILL_INDEX_SLOTS = 2048;
+  // events are dropped once the file holds this many records, replayed ones
+  // included, so the index stays 3/4 full at most
+  static constexpr size_t SPILL_MAX_RECORDS = SPILL_INDEX_SLOTS - SPILL_INDEX_SLOTS / 4;
+
+  typedef bool (*PublishFn)(const OutboundEvent &event);
+
+  void begin();
+  void push(uint32_t nodeId, uint8_t entity, bool state);
+  // sends due events while publish succeeds, call regularly while connected
+  void drain(PublishFn publish);
+
+  size_t size() const
+  {
+    return m_live + m_spilled;
+  }
+
+  uint32_t spilledTotal() const
+  {
+    return m_spilledTotal;
+  }
+
+  uint32_t collapsedTotal() const
+  {
+    return m_collapsedTotal;
+  }
+
+private:
+  struct SpillRecord
+  {
+    uint32_t nodeId;
+    uint8_t entity;
+    uint8_t state;
+    uint8_t reserved[2];
+  };
+
+  struct SpillHeader
+  {
+    uint32_t magic;
+    // the records in front of this were replayed
+    uint32_t readOffset;
+  };
+
+  // where the spilled record of an entity is, a record before the read offset
+  // was replayed and no longer counts
+  struct SpillIndexEntry
+  {
+    uint32_t nodeId;
+    uint16_t record;
+    uint8_t entity;
+    bool used;
+  };
+
+  static constexpr const char *SPILL_PATH = "/outbox.bin";
+  static constexpr uint32_t SPILL_MAGIC = 0x3258424f;
+  // records read from flash at a time
+  static constexpr size_t READ_RECORDS = 16;
+
+  void spillOldest();
+  bool spill(const OutboundEvent &event);
+  SpillIndexEntry &indexSlot(uint32_t nodeId, uint8_t entity);
+  void dropSpillFile();
+  void saveSpillOffset();
+  bool peekSpilled(OutboundEvent &event);
+  bool supersededInRam(const OutboundEvent &event) const;
+
+  OutboundEvent m_ring[RAM_SLOTS] = {};
+  size_t m_head = 0;
+  size_t m_count = 0;
+  size_t m_live = 0;
+
+  bool m_fsReady = false;
+  size_t m_spillReadOffset = sizeof(SpillHeader);
+  // whole records in the file, replayed ones included
+  size_t m_spillRecords = 0;
+  size_t m_spilled = 0;
+  SpillIndexEntry m_index[SPILL_INDEX_SLOTS] = {};
+  uint32_t m_spilledTotal = 0;
+  uint32_t m_collapsedTotal = 0;
+  uint32_t m_lastDrain = 0;
+};
+
+inline void OutboundQueue::begin()
+{
+  // format on first use, the partition is ours
+  m_fsReady = LittleFS.begin(true);
+  if (!m_fsReady)
+  {
+    log_e("LittleFS not available, outbound queue is RAM only");
+    return;
+  }
+  File file = LittleFS.open(SPILL_PATH, "r");
+  if (!file)
+  {
+    return;
+  }
+  SpillHeader header;
+  const size_t size = file.size();
+  const bool valid = file.read((uint8_t *)&header, sizeof(header)) == sizeof(header) && header.magic == SPILL_MAGIC &&
+                     header.readOffset >= sizeof(header) && header.readOffset <= size &&
+                     (size - sizeof(header)) / sizeof(SpillRecord) <= SPILL_MAX_RECORDS;
+  if (!valid)
+  {
+    file.close();
+    LittleFS.remove(SPILL_PATH);
+    log_w("Outbound queue: dropped an invalid spill file");
+    return;
+  }
+  m_spillReadOffset = header.readOffset;
+  // a torn record from a power cut is overwritten by the next spill
+  m_spillRecords = (size - sizeof(header)) / sizeof(SpillRecord);
+
+  // index the records not replayed yet, the only time the file is scanned
+  size_t record = (m_spillReadOffset - sizeof(header)) / sizeof(SpillRecord);
+  m_spilled = m_spillRecords - record;
+  SpillRecord chunk[READ_RECORDS];
+  size_t read;
+  while (record < m_spillRecords && file.seek(sizeof(header) + record * sizeof(SpillRecord)) &&
+         (read = file.read((uint8_t *)chunk, sizeof(chunk)) / sizeof(SpillRecord)) > 0)
+  {
+    for (size_t i = 0; i < read && record < m_spillRecords; i++, record++)
+    {
+      indexSlot(chunk[i].nodeId, chunk[i].entity) = {chunk[i].nodeId, (uint16_t)record, chunk[i].entity, true};
+    }
+  }
+  file.close();
+  log_i("Outbound queue: %u events left over from before reboot", m_spilled);
+}
+
+inline void OutboundQueue::push(uint32_t nodeId, uint8_t entity, bool state)
+{
+  // collapse: the queued state of this entity is now stale
+  for (size_t i = 0; i < m_count; i++)
+  {
+    OutboundEvent &queued = m_ring[(m_head + i) % RAM_SLOTS];
+    if (queued.live && queued.nodeId == nodeId && queued.entity == entity)
+    {
+      queued.live = false;
+      m_live--;
+      m_collapsedTotal++;
+    }
+  }
+
+  if (m_count == RAM_SLOTS)
+  {
+    spillOldest();
+  }
+  OutboundEvent &event = m_ring[(m_head + m_count) % RAM_SLOTS];
+  event.nodeId = nodeId;
+  event.entity = entity;
+  event.state = state;
+  event.live = true;
+  m_count++;
+  m_live++;
+}
+
+inline void OutboundQueue::spillOldest()
+{
+  OutboundEvent &oldest = m_ring[m_head];
+  m_head = (m_head + 1) % RAM_SLOTS;
+  m_count--;
+  if (!oldest.live)
+  {
+    return;
+  }
+  m_live--;
+
+  if (!m_fsReady)
+  {
+    log_w("Outbound queue full, dropping state of node %08x", oldest.nodeId);
+    return;
+  }
+  if (!spill(oldest))
+  {
+    log_w("Spill file full, dropping state of node %08x", oldest.nodeId);
+  }
+}
+
+// the index entry of an entity, or the free one it would take
+inline OutboundQueue::SpillIndexEntry &OutboundQueue::indexSlot(uint32_t nodeId, uint8_t entity)
+{
+  // murmur3 finaliser, node ids are MAC derived and poorly distributed in the low bits
+  uint32_t hash = nodeId ^ ((uint32_t)entity << 24);
+  hash ^= hash >> 16;
+  hash *= 0x85ebca6b;
+  hash ^= hash >> 13;
+  hash *= 0xc2b2ae35;
+  hash ^= hash >> 16;
+  // never full, it has an entry per record at most
+  size_t slot = hash & (SPILL_INDEX_SLOTS - 1);
+  while (m_index[slot].used && (m_index[slot].nodeId != nodeId || m_index[slot].entity != entity))
+  {
+    slot = (slot + 1) & (SPILL_INDEX_SLOTS - 1);
+  }
+  return m_index[slot];
+}
+
+inline void OutboundQueue::dropSpillFile()
+{
+  LittleFS.remove(SPILL_PATH);
+  m_spillReadOffset = sizeof(SpillHeader);
+  m_spillRecords = 0;
+  m_spilled = 0;
+  memset(m_index, 0, sizeof(m_index));
+}
+
+// writes the event over the spilled record of its entity that was not
+// replayed yet, or appends it, false if that did not work out
+inline bool OutboundQueue::spill(const OutboundEvent &event)
+{
+  File file;
+  if (m_spillRecords > 0)
+  {
+    file = LittleFS.open(SPILL_PATH, "r+");
+  }
+  if (!file)
+  {
+    dropSpillFile();
+    file = LittleFS.open(SPILL_PATH, "w+");
+    if (!file)
+    {
+      return false;
+    }
+    const SpillHeader header = {SPILL_MAGIC, (uint32_t)m_spillReadOffset};
+    file.write((const uint8_t *)&header, sizeof(header));
+  }
+  SpillIndexEntry &entry = indexSlot(event.nodeId, event.entity);
+  const size_t replayed = (m_spillReadOffset - sizeof(SpillHeader)) / sizeof(SpillRecord);
+  const bool collapsed = entry.used && entry.record >= replayed;
+  const size_t record = collapsed ? entry.record : m_spillRecords;
+  if (record >= SPILL_MAX_RECORDS)
+  {
+    file.close();
+    return false;
+  }
+  const SpillRecord spilled = {event.nodeId, event.entity, event.state, {0, 0}};
+  const bool written = file.seek(sizeof(SpillHeader) + record * sizeof(SpillRecord)) &&
+                       file.write((const uint8_t *)&spilled, sizeof(spilled)) == sizeof(spilled);
+  file.close();
+  if (!written)
+  {
+    return false;
+  }
+  entry = {event.nodeId, (uint16_t)record, event.entity, true};
+  if (collapsed)
+  {
+    m_collapsedTotal++;
+  }
+  else
+  {
+    m_spillRecords++;
+    m_spilled++;
+    m_spilledTotal++;
+  }
+  return true;
+}
+
+inline void OutboundQueue::saveSpillOffset()
+{
+  File file = LittleFS.open(SPILL_PATH, "r+");
+  if (!file)
+  {
+    return;
+  }
+  const SpillHeader header = {SPILL_MAGIC, (uint32_t)m_spillReadOffset};
+  file.write((const uint8_t *)&header, sizeof(header));
+  file.close();
+}
+
+inline bool OutboundQueue::peekSpilled(OutboundEvent &event)
+{
+  File file = LittleFS.open(SPILL_PATH, "r");
+  if (!file)
+  {
+    dropSpillFile();
+    return false;
+  }
+  SpillRecord record;
+  bool ok = file.seek(m_spillReadOffset) && file.read((uint8_t *)&record, sizeof(record)) == sizeof(record);
+  file.close();
+  if (!ok)
+  {
+    // everything replayed
+    dropSpillFile();
+    return false;
+  }
+  event.nodeId = record.nodeId;
+  event.entity = record.entity;
+  event.state = record.state;
+  event.live = true;
+  return true;
+}
+
+inline bool OutboundQueue::supersededInRam(const OutboundEvent &event) const
+{
+  for (size_t i = 0; i < m_count; i++)
+  {
+    const OutboundEvent &queued = m_ring[(m_head + i) % RAM_SLOTS];
+    if (queued.live && queued.nodeId == event.nodeId && queued.entity == event.entity)
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+inline void OutboundQueue::drain(PublishFn publish)
+{
+  if (millis() - m_lastDrain < OUTBOX_INTERVAL_MS)
+  {
+    return;
+  }
+  m_lastDrain = millis();
+
+  uint8_t sent = 0;
+  bool blocked = false;
+  const size_t spillReadOffset = m_spillReadOffset;
+  // spilled events are older than anything in RAM, replay them first
+  OutboundEvent event;
+  while (sent < OUTBOX_BURST && m_spilled > 0 && peekSpilled(event))
+  {
+    if (!supersededInRam(event))
+    {
+      if (!publish(event))
+      {
+        blocked = true;
+        break;
+      }
+      sent++;
+    }
+    m_spillReadOffset += sizeof(SpillRecord);
+    m_spilled--;
+  }
+  // one header write per pass that took records from the file
+  if (m_spilled == 0 && m_spillReadOffset != sizeof(SpillHeader))
+  {
+    dropSpillFile();
+  }
+  else if (m_spillReadOffset != spillReadOffset)
+  {
+    saveSpillOffset();
+  }
+  if (blocked)
+  {
+    return;
+  }
+
+  while (sent < OUTBOX_BURST && m_count > 0)
+  {
+    OutboundEvent &oldest = m_ring[m_head];
+    if (oldest.live)
+    {
+      if (!publish(oldest))
+      {
+        return;
+      }
+      m_live--;
+      sent++;
+    }
+    m_head = (m_head + 1) % RAM_SLOTS;
+    m_count--;
+  }
+}
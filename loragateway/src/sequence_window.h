@@ -0,0 +1,98 @@
+#pragma once
+#include <stdint.h>
+
+// Sliding window over the 16 bit message counter of one node. Remembers the
+// highest counter seen and which of the 32 counters below it arrived, so
+// retries after a lost ACK and late copies are recognised as duplicates while
+// skipped counters are reported as lost. A copy from before the window cannot
+// be told apart from one that was processed and is dropped as stale; a node
+// whose counter started over says so (restart()).
+struct SequenceWindow
+{
+  enum Result
+  {
+    // first copy of a message
+    Accepted,
+    // repeat of a message that was already processed
+    Duplicate,
+    // from before the window, too old to tell whether it was processed
+    Stale,
+    // counter far ahead of the window or the node restarted (restart()), the
+    // sensor lost its RTC memory
+    Resynced,
+  };
+
+  static const uint16_t WINDOW = 32;
+  // larger forward jumps are treated as a counter reset, not as loss
+  static const uint16_t MAX_GAP = 1024;
+
+  uint16_t last;
+  uint32_t seen;
+  // counters below last that were skipped over and counted as lost, the ones
+  // before a resync were not
+  uint32_t missed;
+  bool valid;
+
+  // lost is increased by messages skipped over and decreased again when one
+  // of them shows up late
+  Result check(uint16_t counter, int32_t &lost)
+  {
+    if (!valid)
+    {
+      resync(counter);
+      return Resynced;
+    }
+
+    const int16_t diff = (int16_t)(counter - last);
+    if (diff > 0 && diff <= MAX_GAP)
+    {
+      lost += diff - 1;
+      seen = diff >= 32 ? 0 : seen << diff;
+      seen |= 1;
+      missed = diff >= 32 ? 0 : missed << diff;
+      // the skipped ones still in the window, bits 1 to diff - 1
+      missed |= (diff >= 32 ? 0xffffffffUL : (1UL << diff) - 1) & ~1UL;
+      last = counter;
+      return Accepted;
+    }
+    if (diff <= 0 && -diff < WINDOW)
+    {
+      const uint32_t bit = 1UL << -diff;
+      if (seen & bit)
+      {
+        return Duplicate;
+      }
+      seen |= bit;
+      // arrived late but within the window, counted as lost before unless it
+      // is from before a resync
+      if (missed & bit)
+      {
+        missed &= ~bit;
+        lost--;
+      }
+      return Accepted;
+    }
+    // going back is never a reset, a sensor that starts over sends EXT_RESTART
+    if (diff < 0)
+    {
+      return Stale;
+    }
+    resync(counter);
+    return Resynced;
+  }
+
+  // the node signalled its counter started over, the next one resyncs
+  void restart()
+  {
+    valid = false;
+  }
+
+private:
+  void resync(uint16_t counter)
+  {
+    last = counter;
+    seen = 1;
+    missed = 0;
+    valid = true;
+  }
+};
@@ -0,0 +1,168 @@
+#pragma once
+// Host stand-in for the ESP32 Arduino core, only what the gateway firmware
+// uses. The native env puts this directory on the include path, so main.cpp
+// and its headers build unchanged. FreeRTOS tasks run as host threads
+// (sim_rtos.cpp), the clock is the host's steady clock.
+#include <cstdint>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <cstdarg>
+#include <cstring>
+#include <cmath>
+#include <string>
+#include <algorithm>
+
+using std::max;
+using std::min;
+
+typedef uint8_t byte;
+
+#define F(s) (s)
+#define IRAM_ATTR
+
+// TTGO LoRa32 v2.1 pins, from the board variant on target
+#define LORA_SCK 5
+#define LORA_MISO 19
+#define LORA_MOSI 27
+#define LORA_CS 18
+#define LORA_RST 23
+#define LORA_IRQ 26
+#define OLED_SDA 21
+#define OLED_SCL 22
+
+// time since start, plus whatever delay() skipped
+unsigned long millis();
+unsigned long micros();
+// does not sleep: setup() waits for the hardware to power up, the host moves
+// its clock on instead
+void delay(unsigned long ms);
+uint32_t esp_random();
+// the host clock is set already
+inline void configTime(long, int, const char *) {}
+
+class String
+{
+public:
+  String() = default;
+  String(const char *text) : m_text(text) {}
+  String(int value, unsigned char base = 10)
+  {
+    char buffer[16];
+    snprintf(buffer, sizeof(buffer), base == 16 ? "%x" : "%d", value);
+    m_text = buffer;
+  }
+  String(unsigned char value, unsigned char base = 10) : String((int)value, base) {}
+
+  String &operator+=(const String &other)
+  {
+    m_text += other.m_text;
+    return *this;
+  }
+
+  const char *c_str() const
+  {
+    return m_text.c_str();
+  }
+
+  size_t length() const
+  {
+    return m_text.size();
+  }
+
+private:
+  std::string m_text;
+};
+
+// prints to stdout while echo is on, -v in the harness
+class HardwareSerial
+{
+public:
+  void begin(unsigned long baud)
+  {
+    (void)baud;
+  }
+
+  size_t print(const char *text);
+  size_t print(int value);
+  size_t print(unsigned int value);
+  size_t print(long value);
+  size_t print(unsigned long value);
+  size_t print(double value, int digits = 2);
+  size_t println();
+
+  template <typename T>
+  size_t println(T value)
+  {
+    return print(value) + println();
+  }
+
+  size_t printf(const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+  bool echo = false;
+};
+
+extern HardwareSerial Serial;
+
+// esp32-hal-log equivalents, gated by CORE_DEBUG_LEVEL like on target
+#ifndef CORE_DEBUG_LEVEL
+#define CORE_DEBUG_LEVEL 0
+#endif
+
+#define SIM_LOG(letter, format, ...) \
+  Serial.printf("[%6lu][" letter "][%s:%u] %s(): " format "\r\n", millis(), __FILE__, __LINE__, __func__, ##__VA_ARGS__)
+
+#if CORE_DEBUG_LEVEL >= 1
+#define log_e(format, ...) SIM_LOG("E", format, ##__VA_ARGS__)
+#else
+#define log_e(format, ...) do {} while (0)
+#endif
+#if CORE_DEBUG_LEVEL >= 2
+#define log_w(format, ...) SIM_LOG("W", format, ##__VA_ARGS__)
+#else
+#define log_w(format, ...) do {} while (0)
+#endif
+#if CORE_DEBUG_LEVEL >= 3
+#define log_i(format, ...) SIM_LOG("I", format, ##__VA_ARGS__)
+#else
+#define log_i(format, ...) do {} while (0)
+#endif
+#if CORE_DEBUG_LEVEL >= 4
+#define log_d(format, ...) SIM_LOG("D", format, ##__VA_ARGS__)
+#else
+#define log_d(format, ...) do {} while (0)
+#endif
+
+// FreeRTOS, 1 ms ticks
+typedef struct SimTask *TaskHandle_t;
+typedef struct SimQueue *QueueHandle_t;
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+typedef uint32_t TickType_t;
+
+#define pdFALSE 0
+#define pdTRUE 1
+#define pdPASS 1
+#define portMAX_DELAY 0xffffffffUL
+#define pdMS_TO_TICKS(ms) ((TickType_t)(ms))
+#define portYIELD_FROM_ISR(woken) (void)(woken)
+
+// the stack size, priority and core are ignored, the host schedules the threads
+BaseType_t xTaskCreatePinnedToCore(void (*task)(void *), const char *name, uint32_t stackDepth, void *parameter,
+                                   UBaseType_t priority, TaskHandle_t *handle, BaseType_t core);
+void vTaskDelete(TaskHandle_t task);
+void vTaskDelay(TickType_t ticks);
+BaseType_t xTaskNotifyGive(TaskHandle_t task);
+void vTaskNotifyGiveFromISR(TaskHandle_t task, BaseType_t *higherPriorityTaskWoken);
+uint32_t ulTaskNotifyTake(BaseType_t clearOnExit, TickType_t ticks);
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t itemSize);
+BaseType_t xQueueSend(QueueHandle_t queue, const void *item, TickType_t ticks);
+BaseType_t xQueueOverwrite(QueueHandle_t queue, const void *item);
+BaseType_t xQueueReceive(QueueHandle_t queue, void *item, TickType_t ticks);
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t queue);
+
+// --- harness only ---
+
+// ends every task at its next blocking call and waits for their threads
+void simStopTasks();
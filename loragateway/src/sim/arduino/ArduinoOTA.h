@@ -0,0 +1,59 @@
+#pragma once
+// Host stand-in for ArduinoOTA, never receives an update.
+#include <Arduino.h>
+#include <functional>
+
+typedef int ota_error_t;
+enum
+{
+  OTA_AUTH_ERROR,
+  OTA_BEGIN_ERROR,
+  OTA_CONNECT_ERROR,
+  OTA_RECEIVE_ERROR,
+  OTA_END_ERROR,
+};
+#define U_FLASH 0
+#define U_SPIFFS 100
+
+class ArduinoOTAClass
+{
+public:
+  ArduinoOTAClass &onStart(std::function<void()> callback)
+  {
+    (void)callback;
+    return *this;
+  }
+
+  ArduinoOTAClass &onEnd(std::function<void()> callback)
+  {
+    (void)callback;
+    return *this;
+  }
+
+  ArduinoOTAClass &onProgress(std::function<void(unsigned int, unsigned int)> callback)
+  {
+    (void)callback;
+    return *this;
+  }
+
+  ArduinoOTAClass &onError(std::function<void(ota_error_t)> callback)
+  {
+    (void)callback;
+    return *this;
+  }
+
+  void begin()
+  {
+  }
+
+  void handle()
+  {
+  }
+
+  int getCommand()
+  {
+    return U_FLASH;
+  }
+};
+
+extern ArduinoOTAClass ArduinoOTA;
@@ -0,0 +1,67 @@
+#pragma once
+// Host stand-in for LittleFS: there is no flash, begin() fails and the
+// firmware keeps its queues and caches in RAM only.
+#include <Arduino.h>
+
+class File
+{
+public:
+  explicit operator bool() const
+  {
+    return false;
+  }
+
+  size_t size()
+  {
+    return 0;
+  }
+
+  bool seek(uint32_t position)
+  {
+    (void)position;
+    return false;
+  }
+
+  size_t read(uint8_t *buffer, size_t size)
+  {
+    (void)buffer;
+    (void)size;
+    return 0;
+  }
+
+  size_t write(const uint8_t *buffer, size_t size)
+  {
+    (void)buffer;
+    (void)size;
+    return 0;
+  }
+
+  void close()
+  {
+  }
+};
+
+class LittleFSFS
+{
+public:
+  bool begin(bool formatOnFail = false)
+  {
+    (void)formatOnFail;
+    return false;
+  }
+
+  File open(const char *path, const char *mode = "r")
+  {
+    (void)path;
+    (void)mode;
+    return File();
+  }
+
+  bool remove(const char *path)
+  {
+    (void)path;
+    return false;
+  }
+};
+
+extern LittleFSFS LittleFS;
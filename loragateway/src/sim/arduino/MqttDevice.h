@@ -0,0 +1,84 @@
+#pragma once
+// Host stand-in for mqttdisco, with its topic layout
+// homeassistant/<component>/<device id>/<object id>/{config,state}. The
+// gateway writes the config payloads itself.
+#include <Arduino.h>
+
+class MqttDevice
+{
+public:
+  MqttDevice(const char *identifier, const char *name, const char *model, const char *manufacturer)
+      : m_identifier(identifier), m_name(name), m_model(model), m_manufacturer(manufacturer)
+  {
+  }
+
+  const char *getIdentifier() const
+  {
+    return m_identifier;
+  }
+
+  // {"ids":["..."],"name":"...","mdl":"...","mf":"..."}
+  int getJson(char *buffer, size_t size) const
+  {
+    return snprintf(buffer, size, "{\"ids\":[\"%s\"],\"name\":\"%s\",\"mdl\":\"%s\",\"mf\":\"%s\"}", m_identifier, m_name,
+                    m_model, m_manufacturer);
+  }
+
+private:
+  const char *m_identifier;
+  const char *m_name;
+  const char *m_model;
+  const char *m_manufacturer;
+};
+
+class MqttEntity
+{
+public:
+  MqttEntity(MqttDevice *device, const char *objectId, const char *component, const char *name)
+      : m_device(device), m_objectId(objectId), m_component(component), m_name(name)
+  {
+    snprintf(m_stateTopic, sizeof(m_stateTopic), "homeassistant/%s/%s/%s/state", component, device->getIdentifier(),
+             objectId);
+  }
+
+  const char *getStateTopic() const
+  {
+    return m_stateTopic;
+  }
+
+  void getHomeAssistantConfigTopic(char *buffer, size_t size) const
+  {
+    snprintf(buffer, size, "homeassistant/%s/%s/%s/config", m_component, m_device->getIdentifier(), m_objectId);
+  }
+
+  void getHomeAssistantConfigTopicAlt(char *buffer, size_t size) const
+  {
+    snprintf(buffer, size, "ha/%s/%s/%s/config", m_component, m_device->getIdentifier(), m_objectId);
+  }
+
+private:
+  MqttDevice *m_device;
+  const char *m_objectId;
+  const char *m_component;
+  const char *m_name;
+  char m_stateTopic[128];
+};
+
+class MqttBinarySensor : public MqttEntity
+{
+public:
+  MqttBinarySensor(MqttDevice *device, const char *objectId, const char *name)
+      : MqttEntity(device, objectId, "binary_sensor", name)
+  {
+  }
+
+  const char *getOnState() const
+  {
+    return "ON";
+  }
+
+  const char *getOffState() const
+  {
+    return "OFF";
+  }
+};
@@ -0,0 +1,204 @@
+#pragma once
+// Host stand-in for RadioLib's SX1276, fed by the traffic generator of the
+// harness instead of an antenna. It keeps what limits a real gateway: one
+// frame in the FIFO, overwritten by the next one unless the radio task read it
+// in time, and no reception while an ACK is on air or before startReceive().
+#include <Arduino.h>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include "lora_airtime.h"
+
+#define RADIOLIB_ERR_NONE (0)
+#define RADIOLIB_ERR_PACKET_TOO_LONG (-4)
+#define RADIOLIB_ERR_TX_TIMEOUT (-5)
+#define RADIOLIB_ERR_RX_TIMEOUT (-6)
+#define RADIOLIB_ERR_CRC_MISMATCH (-7)
+
+// a frame as it arrives at the antenna, times in host us (micros())
+struct SimAirFrame
+{
+  uint32_t startUs;
+  uint8_t length;
+  uint8_t data[255];
+  float rssi;
+  float snr;
+  // the LoRa payload CRC failed, the data is what the radio made of it
+  bool crcError;
+};
+
+class Module
+{
+public:
+  Module(int cs, int irq, int rst, int gpio = -1)
+  {
+    (void)cs;
+    (void)irq;
+    (void)rst;
+    (void)gpio;
+  }
+};
+
+class SX1276
+{
+public:
+  enum class Delivery
+  {
+    // in the FIFO, DIO0 raised
+    Received,
+    // in the FIFO, the previous frame was not read yet and is gone
+    Overrun,
+    // not listening when the preamble came in
+    Missed,
+  };
+
+  SX1276(Module *module)
+  {
+    (void)module;
+  }
+
+  int16_t begin(float freq = 434.0, float bw = 125.0, uint8_t sf = 9, uint8_t cr = 7, uint8_t syncWord = 0x12,
+                int8_t power = 10, uint16_t preambleLength = 8, uint8_t gain = 0)
+  {
+    (void)freq;
+    (void)syncWord;
+    (void)power;
+    (void)gain;
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_bwHz = (uint32_t)(bw * 1000);
+    m_sf = sf;
+    m_cr = cr;
+    m_preambleLength = preambleLength;
+    m_listening = false;
+    return RADIOLIB_ERR_NONE;
+  }
+
+  int16_t startReceive()
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (!m_listening)
+    {
+      m_listening = true;
+      m_listeningSinceUs = micros();
+    }
+    return RADIOLIB_ERR_NONE;
+  }
+
+  void setDio0Action(void (*action)(void))
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_dio0 = action;
+  }
+
+  void clearDio0Action()
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_dio0 = nullptr;
+  }
+
+  size_t getPacketLength(bool update = true)
+  {
+    (void)update;
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_fifo.length;
+  }
+
+  int16_t readData(uint8_t *data, size_t length)
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    memcpy(data, m_fifo.data, min(length, (size_t)m_fifo.length));
+    m_unread = false;
+    return m_fifo.crcError ? RADIOLIB_ERR_CRC_MISMATCH : RADIOLIB_ERR_NONE;
+  }
+
+  float getRSSI()
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_fifo.rssi;
+  }
+
+  float getSNR()
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_fifo.snr;
+  }
+
+  float getFrequencyError(bool autoCorrect = false)
+  {
+    (void)autoCorrect;
+    return 0;
+  }
+
+  // blocks for the time on air divided by s_timeScale, the radio is in
+  // standby afterwards like with RadioLib
+  int16_t transmit(const uint8_t *data, size_t length, uint8_t addr = 0)
+  {
+    (void)data;
+    (void)addr;
+    uint32_t airtimeUs;
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_listening = false;
+      airtimeUs = loraAirtimeUs(m_sf, m_bwHz, m_cr, m_preambleLength, length);
+      s_txFrames++;
+      s_txAirtimeUs += airtimeUs;
+    }
+    std::this_thread::sleep_for(std::chrono::microseconds((uint64_t)(airtimeUs / s_timeScale)));
+    return RADIOLIB_ERR_NONE;
+  }
+
+  // --- harness only ---
+
+  // the frame ended at the antenna just now, called from the injecting thread
+  // which then is the ISR context of DIO0
+  Delivery deliver(const SimAirFrame &frame)
+  {
+    Delivery delivery;
+    void (*dio0)(void);
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      if (!m_listening || (int32_t)(frame.startUs - m_listeningSinceUs) < 0)
+      {
+        return Delivery::Missed;
+      }
+      delivery = m_unread ? Delivery::Overrun : Delivery::Received;
+      m_fifo = frame;
+      m_unread = true;
+      dio0 = m_dio0;
+    }
+    if (dio0 != nullptr)
+    {
+      dio0();
+    }
+    return delivery;
+  }
+
+  // a frame is in the FIFO the radio task has not read yet
+  bool unread()
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_unread;
+  }
+
+  uint32_t airtimeUs(size_t length) const
+  {
+    return loraAirtimeUs(m_sf, m_bwHz, m_cr, m_preambleLength, length);
+  }
+
+  // air time per host time, > 1 plays traffic faster than real time
+  static inline double s_timeScale = 1;
+  static inline uint32_t s_txFrames = 0;
+  static inline uint64_t s_txAirtimeUs = 0;
+
+private:
+  std::mutex m_mutex;
+  void (*m_dio0)(void) = nullptr;
+  uint32_t m_bwHz = 125000;
+  uint8_t m_sf = 9;
+  uint8_t m_cr = 7;
+  uint16_t m_preambleLength = 8;
+  bool m_listening = false;
+  uint32_t m_listeningSinceUs = 0;
+  bool m_unread = false;
+  SimAirFrame m_fifo = {};
+};
@@ -0,0 +1,16 @@
+#pragma once
+#include <Arduino.h>
+
+class SPIClass
+{
+public:
+  void begin(int8_t sck, int8_t miso, int8_t mosi, int8_t ss)
+  {
+    (void)sck;
+    (void)miso;
+    (void)mosi;
+    (void)ss;
+  }
+};
+
+extern SPIClass SPI;
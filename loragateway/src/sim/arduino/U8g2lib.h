@@ -0,0 +1,142 @@
+#pragma once
+// Host stand-in for U8g2. No panel answers on the host (Wire.h), so none of
+// this runs, it only has to build.
+#include <Arduino.h>
+
+#define U8G2_R0 0
+#define U8X8_PIN_NONE 255
+
+struct u8x8_t
+{
+};
+
+inline void u8x8_DrawTile(u8x8_t *u8x8, uint8_t x, uint8_t y, uint8_t count, uint8_t *tiles)
+{
+  (void)u8x8;
+  (void)x;
+  (void)y;
+  (void)count;
+  (void)tiles;
+}
+
+static const uint8_t u8g2_font_inb19_mr[1] = {0};
+static const uint8_t u8g2_font_inb19_mf[1] = {0};
+static const uint8_t u8g2_font_fur11_tf[1] = {0};
+
+class U8G2
+{
+public:
+  bool begin()
+  {
+    return true;
+  }
+
+  void clearBuffer()
+  {
+    memset(m_buffer, 0, sizeof(m_buffer));
+  }
+
+  void sendBuffer()
+  {
+  }
+
+  void firstPage()
+  {
+  }
+
+  uint8_t nextPage()
+  {
+    return 0;
+  }
+
+  void setFlipMode(uint8_t mode)
+  {
+    (void)mode;
+  }
+
+  void setFontMode(uint8_t mode)
+  {
+    (void)mode;
+  }
+
+  void setDrawColor(uint8_t color)
+  {
+    (void)color;
+  }
+
+  void setFontDirection(uint8_t direction)
+  {
+    (void)direction;
+  }
+
+  void setFont(const uint8_t *font)
+  {
+    (void)font;
+  }
+
+  void setCursor(int x, int y)
+  {
+    (void)x;
+    (void)y;
+  }
+
+  void drawStr(int x, int y, const char *text)
+  {
+    (void)x;
+    (void)y;
+    (void)text;
+  }
+
+  void drawHLine(int x, int y, int width)
+  {
+    (void)x;
+    (void)y;
+    (void)width;
+  }
+
+  void drawVLine(int x, int y, int height)
+  {
+    (void)x;
+    (void)y;
+    (void)height;
+  }
+
+  void println(const char *text)
+  {
+    (void)text;
+  }
+
+  uint8_t *getBufferPtr()
+  {
+    return m_buffer;
+  }
+
+  uint8_t getBufferTileWidth()
+  {
+    return 16;
+  }
+
+  uint8_t getBufferTileHeight()
+  {
+    return 8;
+  }
+
+  u8x8_t *getU8x8()
+  {
+    return &m_u8x8;
+  }
+
+private:
+  uint8_t m_buffer[128 * 64 / 8];
+  u8x8_t m_u8x8;
+};
+
+class U8G2_SSD1306_128X64_NONAME_F_HW_I2C : public U8G2
+{
+public:
+  U8G2_SSD1306_128X64_NONAME_F_HW_I2C(int rotation, uint8_t reset)
+  {
+    (void)rotation;
+    (void)reset;
+  }
+};
@@ -0,0 +1,152 @@
+#pragma once
+// Host stand-in for the ESP32 WiFi library: the station is up from the start.
+#include <Arduino.h>
+
+#define WL_CONNECTED 3
+#define WIFI_STA 1
+
+class IPAddress
+{
+public:
+  IPAddress() = default;
+  IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d)
+      : m_address((uint32_t)a | (uint32_t)b << 8 | (uint32_t)c << 16 | (uint32_t)d << 24)
+  {
+  }
+
+  bool fromString(const char *address)
+  {
+    unsigned a, b, c, d;
+    char rest;
+    if (sscanf(address, "%u.%u.%u.%u%c", &a, &b, &c, &d, &rest) != 4 || a > 255 || b > 255 || c > 255 || d > 255)
+    {
+      return false;
+    }
+    *this = IPAddress(a, b, c, d);
+    return true;
+  }
+
+  operator uint32_t() const
+  {
+    return m_address;
+  }
+
+private:
+  uint32_t m_address = 0;
+};
+
+class WiFiClass
+{
+public:
+  void mode(int mode)
+  {
+    (void)mode;
+  }
+
+  void begin(const char *ssid, const char *pass)
+  {
+    (void)ssid;
+    (void)pass;
+  }
+
+  void reconnect()
+  {
+  }
+
+  void disconnect()
+  {
+  }
+
+  int status()
+  {
+    return WL_CONNECTED;
+  }
+
+  void hostname(const char *name)
+  {
+    (void)name;
+  }
+
+  void setAutoConnect(bool autoConnect)
+  {
+    (void)autoConnect;
+  }
+
+  // every host name is the local broker
+  int hostByName(const char *host, IPAddress &address)
+  {
+    (void)host;
+    address = IPAddress(127, 0, 0, 1);
+    return 1;
+  }
+
+  void macAddress(uint8_t *mac)
+  {
+    static const uint8_t address[6] = {0x02, 0x00, 0x00, 0x5e, 0x0a, 0x7e};
+    memcpy(mac, address, sizeof(address));
+  }
+};
+
+extern WiFiClass WiFi;
+
+// A socket handed over from the lwIP stand-in is a broker that accepts the
+// session: its CONNACK is there to read right away.
+class WiFiClient
+{
+public:
+  WiFiClient() = default;
+  explicit WiFiClient(int fd) : m_fd(fd), m_connack(4)
+  {
+  }
+  virtual ~WiFiClient() = default;
+
+  int connect(const char *host, uint16_t port, int32_t timeoutMs = 0)
+  {
+    (void)host;
+    (void)port;
+    (void)timeoutMs;
+    m_fd = 3;
+    return 1;
+  }
+
+  virtual int available()
+  {
+    return m_connack;
+  }
+
+  virtual int read()
+  {
+    static const uint8_t connack[4] = {0x20, 0x02, 0x00, 0x00};
+    return m_connack > 0 ? connack[4 - m_connack--] : -1;
+  }
+
+  virtual int read(uint8_t *buffer, size_t size)
+  {
+    size_t length = 0;
+    while (length < size && m_connack > 0)
+    {
+      buffer[length++] = (uint8_t)read();
+    }
+    return length;
+  }
+
+  virtual int peek()
+  {
+    return -1;
+  }
+
+  virtual uint8_t connected()
+  {
+    return m_fd >= 0;
+  }
+
+  virtual void stop()
+  {
+    m_fd = -1;
+    m_connack = 0;
+  }
+
+private:
+  int m_fd = -1;
+  int m_connack = 0;
+};
@@ -0,0 +1,28 @@
+#pragma once
+// Host stand-in for the I2C bus: nothing answers, so the gateway runs without
+// its OLED and the display task.
+#include <Arduino.h>
+
+class TwoWire
+{
+public:
+  bool begin(int sda, int scl)
+  {
+    (void)sda;
+    (void)scl;
+    return true;
+  }
+
+  void beginTransmission(uint8_t address)
+  {
+    (void)address;
+  }
+
+  // 2: address sent, NACK received
+  uint8_t endTransmission()
+  {
+    return 2;
+  }
+};
+
+extern TwoWire Wire;
@@ -0,0 +1,58 @@
+#pragma once
+// Host stand-in for the lwIP sockets of the ESP32: a connect is done at once
+// and nothing goes on the wire, the host's headers only lend the types.
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+
+inline int lwip_socket(int domain, int type, int protocol)
+{
+  (void)domain;
+  (void)type;
+  (void)protocol;
+  return 3;
+}
+
+inline int lwip_fcntl(int fd, int command, int value)
+{
+  (void)fd;
+  (void)command;
+  (void)value;
+  return 0;
+}
+
+inline int lwip_connect(int fd, const struct sockaddr *address, socklen_t length)
+{
+  (void)fd;
+  (void)address;
+  (void)length;
+  return 0;
+}
+
+inline int lwip_select(int fds, fd_set *readable, fd_set *writable, fd_set *failed, struct timeval *timeout)
+{
+  (void)fds;
+  (void)readable;
+  (void)writable;
+  (void)failed;
+  (void)timeout;
+  return 1;
+}
+
+inline int lwip_getsockopt(int fd, int level, int option, void *value, socklen_t *length)
+{
+  (void)fd;
+  (void)level;
+  (void)option;
+  *(int *)value = 0;
+  *length = sizeof(int);
+  return 0;
+}
+
+inline int lwip_close(int fd)
+{
+  (void)fd;
+  return 0;
+}
@@ -0,0 +1,294 @@
+// Host harness for the gateway's receive path: boots the firmware with the
+// stand-ins of sim/arduino, plays the traffic of traffic.h into the SX1276
+// stand-in at the scenario's speed and reports what came through and how
+// fast, from the DIO0 interrupt to the state publish on MQTT.
+//
+//   pio run -e native && .pio/build/native/program [-v] [scenario]
+//
+// The gateway boots once, the scenarios run one after the other with node ids
+// of their own. Every node is heard once before the measurement starts, so
+// discovery does not count towards the latency.
+#include <Arduino.h>
+#include <RadioLib.h>
+#include <PubSubClient.h>
+
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "../stage_stats.h"
+#include "../connection_manager.h"
+#include "../outbound_queue.h"
+#include "../discovery_cache.h"
+#include "../link_stats.h"
+#include "traffic.h"
+
+// firmware entry point and state from main.cpp
+void setup();
+extern SX1276 radio;
+extern ConnectionManager g_connection;
+extern OutboundQueue g_outbox;
+extern DiscoveryCache<2 * LETTERMAN_NODE_SLOTS> g_discovery;
+extern StageStats g_statsDecode;
+extern uint32_t g_rxReceived;
+extern uint32_t g_rxDropped;
+extern uint32_t g_duplicates;
+extern LinkErrors g_linkErrors;
+
+// a fresh message the gateway got, waiting for its state on MQTT
+struct PendingState
+{
+  uint64_t interruptNs;
+  bool door;
+};
+
+static std::mutex s_pendingMutex;
+static std::unordered_map<uint32_t, std::deque<PendingState>> s_pending;
+static std::vector<uint32_t> s_latenciesUs;
+
+static uint64_t nowNs()
+{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// PubSubClient stand-in hook, on the network task. A door state ends the wait
+// of the oldest message carrying it, older ones were superseded on the way.
+static void onPublish(const char *topic, const char *payload, bool retained)
+{
+  const uint64_t now = nowNs();
+  uint32_t nodeId;
+  char entity[32];
+  const char *object = strstr(topic, "/letterman_");
+  if (retained || object == nullptr || sscanf(object, "/letterman_%8x_%31[^/]", &nodeId, entity) != 2 ||
+      strcmp(entity, CHANNELS[CHANNEL_DOOR].id) != 0)
+  {
+    return;
+  }
+  const bool door = strcmp(payload, "ON") == 0;
+  std::lock_guard<std::mutex> lock(s_pendingMutex);
+  std::deque<PendingState> &pending = s_pending[nodeId];
+  while (!pending.empty())
+  {
+    const PendingState state = pending.front();
+    pending.pop_front();
+    if (state.door == door)
+    {
+      s_latenciesUs.push_back((uint32_t)((now - state.interruptNs) / 1000));
+      return;
+    }
+  }
+}
+
+struct ScenarioResult
+{
+  uint32_t sent = 0;
+  // first transmissions, whatever the air did to them
+  uint32_t messages = 0;
+  // never reached the radio or arrived broken because of another frame
+  uint32_t collided = 0;
+  // started while the radio was sending an ACK
+  uint32_t deaf = 0;
+  uint32_t overrun = 0;
+  uint32_t ringDropped = 0;
+  uint32_t delivered = 0;
+  uint32_t handled = 0;
+  uint32_t accepted = 0;
+  double hostSeconds = 0;
+  std::vector<uint32_t> latenciesUs;
+};
+
+// waits until the radio task took the frame and the network task decoded
+// everything and published what it queued, false on timeout
+static bool waitIdle(uint32_t timeoutMs)
+{
+  const uint32_t start = millis();
+  while (millis() - start < timeoutMs)
+  {
+    // counters of other tasks, racy reads like the stats log does
+    if (!radio.unread() && g_rxReceived == g_statsDecode.count && g_outbox.size() == 0 &&
+        g_discovery.pendingCount() == 0)
+    {
+      return true;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  return false;
+}
+
+static SimAirFrame airFrame(const AirTransmission &transmission, uint64_t hostStartUs, uint16_t speed)
+{
+  SimAirFrame frame = {};
+  frame.startUs = (uint32_t)(hostStartUs + transmission.startUs / speed);
+  frame.length = transmission.length;
+  memcpy(frame.data, transmission.data, transmission.length);
+  frame.rssi = transmission.rssi;
+  frame.snr = transmission.snr;
+  frame.crcError = transmission.crcError;
+  return frame;
+}
+
+// one frame at a time, each after the previous one was handled
+static void introduce(const std::vector<AirTransmission> &hello)
+{
+  SX1276::s_timeScale = 1e9;
+  for (const AirTransmission &transmission : hello)
+  {
+    radio.deliver(airFrame(transmission, micros(), 1));
+    waitIdle(100);
+  }
+  waitIdle(30000);
+}
+
+static ScenarioResult runScenario(const GatewayScenario &scenario, uint32_t firstNodeId, uint64_t seed)
+{
+  ScenarioResult result;
+  TrafficGenerator generator(seed);
+  introduce(generator.hello(firstNodeId, scenario.nodes));
+  const std::vector<AirTransmission> transmissions = generator.generate(scenario, firstNodeId);
+
+  const uint32_t droppedBefore = g_rxDropped;
+  const uint32_t handledBefore = g_statsDecode.count;
+  const uint32_t duplicatesBefore = g_duplicates;
+  const uint32_t errorsBefore = g_linkErrors.total();
+  {
+    std::lock_guard<std::mutex> lock(s_pendingMutex);
+    s_pending.clear();
+    s_latenciesUs.clear();
+  }
+
+  SX1276::s_timeScale = scenario.idealAir ? 1e9 : scenario.speed;
+  const uint64_t hostStartUs = micros();
+  const uint64_t hostStartNs = nowNs();
+  for (const AirTransmission &transmission : transmissions)
+  {
+    result.sent++;
+    result.messages += !transmission.duplicate;
+    result.collided += transmission.lost || transmission.collided;
+    if (transmission.lost)
+    {
+      continue;
+    }
+    // DIO0 fires at the end of the frame
+    const uint64_t dueUs = hostStartUs + transmission.endUs() / scenario.speed;
+    while (micros() < dueUs)
+    {
+      if (dueUs - micros() > 200)
+      {
+        std::this_thread::sleep_for(std::chrono::microseconds(dueUs - micros() - 100));
+      }
+    }
+    // registered before the interrupt, the publish may come before deliver() returns
+    if (transmission.fresh())
+    {
+      std::lock_guard<std::mutex> lock(s_pendingMutex);
+      s_pending[transmission.nodeId].push_back({nowNs(), transmission.door});
+    }
+    SimAirFrame frame = airFrame(transmission, hostStartUs, scenario.speed);
+    if (scenario.idealAir)
+    {
+      // no air to share, the radio hears every frame whole
+      frame.startUs = micros();
+    }
+    switch (radio.deliver(frame))
+    {
+    case SX1276::Delivery::Received:
+      result.delivered++;
+      break;
+    case SX1276::Delivery::Overrun:
+      result.delivered++;
+      result.overrun++;
+      break;
+    case SX1276::Delivery::Missed:
+      result.deaf++;
+      if (transmission.fresh())
+      {
+        std::lock_guard<std::mutex> lock(s_pendingMutex);
+        s_pending[transmission.nodeId].pop_back();
+      }
+      break;
+    }
+  }
+  if (!waitIdle(60000))
+  {
+    printf("%s: gateway did not go idle\n", scenario.name);
+  }
+  result.hostSeconds = (nowNs() - hostStartNs) / 1e9;
+  result.ringDropped = g_rxDropped - droppedBefore;
+  result.handled = g_statsDecode.count - handledBefore;
+  result.accepted = result.handled - (g_duplicates - duplicatesBefore) - (g_linkErrors.total() - errorsBefore);
+  std::lock_guard<std::mutex> lock(s_pendingMutex);
+  result.latenciesUs = s_latenciesUs;
+  return result;
+}
+
+static uint32_t percentile(const std::vector<uint32_t> &sorted, double share)
+{
+  return sorted.empty() ? 0 : sorted[std::min(sorted.size() - 1, (size_t)(share * sorted.size()))];
+}
+
+static void printResult(const GatewayScenario &scenario, ScenarioResult &result)
+{
+  std::sort(result.latenciesUs.begin(), result.latenciesUs.end());
+  const uint32_t dropped = result.overrun + result.ringDropped;
+  printf("%-10s %6u %6u %5u %6u %5u %7u %8.0f %6.1f %6.1f %7u %7u %7u %7u\n",
+         scenario.name,
+         result.sent,
+         result.collided,
+         result.deaf,
+         result.overrun,
+         result.ringDropped,
+         result.handled,
+         result.handled / result.hostSeconds,
+         result.delivered ? 100.0 * dropped / result.delivered : 0.0,
+         result.messages ? 100.0 * result.accepted / result.messages : 0.0,
+         percentile(result.latenciesUs, 0.5),
+         percentile(result.latenciesUs, 0.9),
+         percentile(result.latenciesUs, 0.99),
+         result.latenciesUs.empty() ? 0 : result.latenciesUs.back());
+}
+
+int main(int argc, char **argv)
+{
+  const char *only = nullptr;
+  for (int i = 1; i < argc; i++)
+  {
+    if (strcmp(argv[i], "-v") == 0)
+    {
+      Serial.echo = true;
+    }
+    else
+    {
+      only = argv[i];
+    }
+  }
+
+  PubSubClient::s_onPublish = onPublish;
+  setup();
+  // MQTT comes up on the network task, the gateway's own discovery config goes out
+  while (!g_connection.connected())
+  {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  waitIdle(10000);
+
+  printf("%-10s %6s %6s %5s %6s %5s %7s %8s %6s %6s %7s %7s %7s %7s\n",
+         "scenario", "sent", "coll", "deaf", "ovrrun", "ring", "handled", "rx/s", "drop", "msgs", "p50", "p90", "p99", "max");
+  printf("%-10s %6s %6s %5s %6s %5s %7s %8s %6s %6s %7s %7s %7s %7s\n",
+         "", "", "", "", "", "", "", "", "%", "%", "us", "us", "us", "us");
+  const std::vector<GatewayScenario> scenarios = gatewayScenarios();
+  for (size_t i = 0; i < scenarios.size(); i++)
+  {
+    if (only && strcmp(only, scenarios[i].name) != 0)
+    {
+      continue;
+    }
+    // node ids of their own, the gateway remembers the earlier scenarios' nodes
+    ScenarioResult result = runScenario(scenarios[i], (uint32_t)(i + 1) << 24, i + 1);
+    printResult(scenarios[i], result);
+  }
+  simStopTasks();
+  return 0;
+}
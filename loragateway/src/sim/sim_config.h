@@ -0,0 +1,10 @@
+#pragma once
+// config.h of the host harness, the stand-ins connect to anything
+#include <Arduino.h>
+char wifi_ssid[] = "sim";
+char wifi_pass[] = "";
+
+char mqtt_server[255] = "localhost";
+uint16_t mqtt_port = 1883;
+char mqtt_user[60] = "";
+char mqtt_pass[60] = "";
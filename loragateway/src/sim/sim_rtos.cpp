@@ -0,0 +1,338 @@
+// Host side of the Arduino core stand-in (arduino/Arduino.h): clock, Serial,
+// the library singletons, and FreeRTOS tasks and queues on host threads.
+// Blocking calls end the calling task with SimTaskStop once simStopTasks()
+// runs, which unwinds it out of its endless loop.
+#include <Arduino.h>
+#include <ArduinoOTA.h>
+#include <LittleFS.h>
+#include <SPI.h>
+#include <WiFi.h>
+#include <Wire.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+HardwareSerial Serial;
+WiFiClass WiFi;
+SPIClass SPI;
+TwoWire Wire;
+ArduinoOTAClass ArduinoOTA;
+LittleFSFS LittleFS;
+
+static const std::chrono::steady_clock::time_point s_start = std::chrono::steady_clock::now();
+static std::atomic<unsigned long> s_skippedMs{0};
+
+unsigned long micros()
+{
+  const auto elapsed = std::chrono::steady_clock::now() - s_start;
+  return (unsigned long)std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count() + s_skippedMs * 1000;
+}
+
+unsigned long millis()
+{
+  return micros() / 1000;
+}
+
+void delay(unsigned long ms)
+{
+  s_skippedMs += ms;
+}
+
+uint32_t esp_random()
+{
+  static std::atomic<uint64_t> state{1};
+  uint64_t next = state.load() * 6364136223846793005ULL + 1442695040888963407ULL;
+  state = next;
+  return (uint32_t)(next >> 32);
+}
+
+// --- Serial ---
+
+static std::mutex s_serialMutex;
+
+size_t HardwareSerial::print(const char *text)
+{
+  if (!echo)
+  {
+    return strlen(text);
+  }
+  std::lock_guard<std::mutex> lock(s_serialMutex);
+  return fwrite(text, 1, strlen(text), stdout);
+}
+
+size_t HardwareSerial::print(int value)
+{
+  return printf("%d", value);
+}
+
+size_t HardwareSerial::print(unsigned int value)
+{
+  return printf("%u", value);
+}
+
+size_t HardwareSerial::print(long value)
+{
+  return printf("%ld", value);
+}
+
+size_t HardwareSerial::print(unsigned long value)
+{
+  return printf("%lu", value);
+}
+
+size_t HardwareSerial::print(double value, int digits)
+{
+  return printf("%.*f", digits, value);
+}
+
+size_t HardwareSerial::println()
+{
+  return print("\r\n");
+}
+
+size_t HardwareSerial::printf(const char *format, ...)
+{
+  if (!echo)
+  {
+    return 0;
+  }
+  va_list args;
+  va_start(args, format);
+  std::lock_guard<std::mutex> lock(s_serialMutex);
+  const int length = vprintf(format, args);
+  va_end(args);
+  return length > 0 ? (size_t)length : 0;
+}
+
+// --- tasks ---
+
+struct SimTaskStop
+{
+};
+
+struct SimTask
+{
+  std::thread thread;
+  std::mutex mutex;
+  std::condition_variable wake;
+  uint32_t notifications = 0;
+};
+
+struct SimQueue
+{
+  std::mutex mutex;
+  std::condition_variable wake;
+  std::deque<std::vector<uint8_t>> items;
+  size_t length;
+  size_t itemSize;
+};
+
+static std::mutex s_tasksMutex;
+static std::vector<SimTask *> s_tasks;
+static std::vector<SimQueue *> s_queues;
+static std::atomic<bool> s_stopping{false};
+static thread_local SimTask *s_currentTask = nullptr;
+
+static void checkStop()
+{
+  if (s_stopping)
+  {
+    throw SimTaskStop();
+  }
+}
+
+// waits on the condition until ready() or the timeout, stop-aware
+template <typename Ready>
+static bool waitFor(std::unique_lock<std::mutex> &lock, std::condition_variable &wake, TickType_t ticks, Ready ready)
+{
+  auto done = [&]()
+  { return s_stopping || ready(); };
+  if (ticks == portMAX_DELAY)
+  {
+    wake.wait(lock, done);
+  }
+  else
+  {
+    wake.wait_for(lock, std::chrono::milliseconds(ticks), done);
+  }
+  checkStop();
+  return ready();
+}
+
+BaseType_t xTaskCreatePinnedToCore(void (*task)(void *), const char *name, uint32_t stackDepth, void *parameter,
+                                   UBaseType_t priority, TaskHandle_t *handle, BaseType_t core)
+{
+  (void)name;
+  (void)stackDepth;
+  (void)priority;
+  (void)core;
+  SimTask *created = new SimTask();
+  {
+    std::lock_guard<std::mutex> lock(s_tasksMutex);
+    s_tasks.push_back(created);
+  }
+  // the handle is there before the task runs, like on target
+  if (handle != nullptr)
+  {
+    *handle = created;
+  }
+  created->thread = std::thread([created, task, parameter]()
+                                {
+                                  s_currentTask = created;
+                                  try
+                                  {
+                                    task(parameter);
+                                  }
+                                  catch (const SimTaskStop &)
+                                  {
+                                  } });
+  return pdPASS;
+}
+
+void vTaskDelete(TaskHandle_t task)
+{
+  // only ever used by a task on itself
+  if (task == nullptr && s_currentTask != nullptr)
+  {
+    throw SimTaskStop();
+  }
+}
+
+void vTaskDelay(TickType_t ticks)
+{
+  checkStop();
+  std::this_thread::sleep_for(std::chrono::milliseconds(ticks));
+  checkStop();
+}
+
+BaseType_t xTaskNotifyGive(TaskHandle_t task)
+{
+  {
+    std::lock_guard<std::mutex> lock(task->mutex);
+    task->notifications++;
+  }
+  task->wake.notify_one();
+  return pdPASS;
+}
+
+void vTaskNotifyGiveFromISR(TaskHandle_t task, BaseType_t *higherPriorityTaskWoken)
+{
+  xTaskNotifyGive(task);
+  if (higherPriorityTaskWoken != nullptr)
+  {
+    *higherPriorityTaskWoken = pdTRUE;
+  }
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t clearOnExit, TickType_t ticks)
+{
+  SimTask *task = s_currentTask;
+  std::unique_lock<std::mutex> lock(task->mutex);
+  waitFor(lock, task->wake, ticks, [task]()
+          { return task->notifications > 0; });
+  const uint32_t notifications = task->notifications;
+  if (notifications > 0)
+  {
+    task->notifications = clearOnExit ? 0 : notifications - 1;
+  }
+  return notifications;
+}
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t itemSize)
+{
+  SimQueue *queue = new SimQueue();
+  queue->length = length;
+  queue->itemSize = itemSize;
+  std::lock_guard<std::mutex> lock(s_tasksMutex);
+  s_queues.push_back(queue);
+  return queue;
+}
+
+BaseType_t xQueueSend(QueueHandle_t queue, const void *item, TickType_t ticks)
+{
+  {
+    std::unique_lock<std::mutex> lock(queue->mutex);
+    if (!waitFor(lock, queue->wake, ticks, [queue]()
+                 { return queue->items.size() < queue->length; }))
+    {
+      return pdFALSE;
+    }
+    const uint8_t *bytes = (const uint8_t *)item;
+    queue->items.emplace_back(bytes, bytes + queue->itemSize);
+  }
+  queue->wake.notify_all();
+  return pdPASS;
+}
+
+BaseType_t xQueueOverwrite(QueueHandle_t queue, const void *item)
+{
+  {
+    std::lock_guard<std::mutex> lock(queue->mutex);
+    const uint8_t *bytes = (const uint8_t *)item;
+    queue->items.clear();
+    queue->items.emplace_back(bytes, bytes + queue->itemSize);
+  }
+  queue->wake.notify_all();
+  return pdPASS;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t queue, void *item, TickType_t ticks)
+{
+  {
+    std::unique_lock<std::mutex> lock(queue->mutex);
+    if (!waitFor(lock, queue->wake, ticks, [queue]()
+                 { return !queue->items.empty(); }))
+    {
+      return pdFALSE;
+    }
+    memcpy(item, queue->items.front().data(), queue->itemSize);
+    queue->items.pop_front();
+  }
+  queue->wake.notify_all();
+  return pdTRUE;
+}
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t queue)
+{
+  std::lock_guard<std::mutex> lock(queue->mutex);
+  return (UBaseType_t)queue->items.size();
+}
+
+void simStopTasks()
+{
+  std::vector<SimTask *> tasks;
+  {
+    std::lock_guard<std::mutex> lock(s_tasksMutex);
+    tasks.swap(s_tasks);
+  }
+  s_stopping = true;
+  for (SimTask *task : tasks)
+  {
+    // under the mutex, so a task between its check and its wait cannot miss it
+    {
+      std::lock_guard<std::mutex> lock(task->mutex);
+    }
+    task->wake.notify_all();
+  }
+  {
+    std::lock_guard<std::mutex> lock(s_tasksMutex);
+    for (SimQueue *queue : s_queues)
+    {
+      {
+        std::lock_guard<std::mutex> queueLock(queue->mutex);
+      }
+      queue->wake.notify_all();
+    }
+  }
+  for (SimTask *task : tasks)
+  {
+    task->thread.join();
+    delete task;
+  }
+  s_stopping = false;
+}
@@ -0,0 +1,255 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+
+#include "frame_codec.h"
+#include "channels.h"
+#include "lora_airtime.h"
+
+// Synthetic uplink traffic for the gateway harness: mailboxes sending status
+// frames at random times, some repeated because the ACK got lost, some
+// damaged on air, some garbled beyond the LoRa CRC, and whatever overlaps on
+// the single channel the gateway listens on.
+struct GatewayScenario
+{
+  const char *name;
+  const char *description;
+  uint16_t nodes;
+  // mean message rate of every node, the times are exponentially distributed
+  uint32_t messagesPerNodeHour;
+  // air time the scenario covers
+  uint32_t durationS;
+  // air time per host time, the traffic is played this much faster
+  uint16_t speed;
+  // chance of a message being sent twice, its first ACK got lost
+  uint8_t duplicatePercent = 0;
+  // chance of a frame failing the LoRa CRC
+  uint8_t crcErrorPercent = 0;
+  // chance of a frame passing the LoRa CRC but failing the frame checks
+  uint8_t badFramePercent = 0;
+  // no collisions and ACKs take no air time, for loading the CPU path beyond
+  // what one channel carries
+  bool idealAir = false;
+};
+
+inline std::vector<GatewayScenario> gatewayScenarios()
+{
+  return {
+      {"street", "20 mailboxes, a message every 5 min each", 20, 12, 3600, 600},
+      {"village", "200 mailboxes, a message every 10 min each", 200, 6, 3600, 600},
+      {"town", "1000 mailboxes, a message every 10 min each, the channel is full", 1000, 6, 1800, 300},
+      {"dirty-air", "100 mailboxes with repeats, CRC errors and garbled frames", 100, 12, 3600, 600, 10, 10, 5},
+      {"storm", "100 mailboxes woken within 10 s by the same thunderstorm", 100, 360, 10, 5},
+      {"flood", "50 nodes sending every second on ideal air, CPU path only", 50, 3600, 30, 20, 0, 0, 0, true},
+  };
+}
+
+// the gateway listens with RadioLib's SX127x defaults, the sensors send with them
+#define TRAFFIC_SF 9
+#define TRAFFIC_BW_HZ 125000
+#define TRAFFIC_CR 7
+#define TRAFFIC_PREAMBLE 8
+// a weaker frame overlapping the one being received is captured below it
+#define TRAFFIC_CAPTURE_DB 6
+// SX1276 noise floor at 125 kHz, SNR is RSSI above it up to where it saturates
+#define TRAFFIC_NOISE_FLOOR_DBM -117
+#define TRAFFIC_MAX_SNR_DB 10
+// a sensor repeats its message after the ACK window and a random backoff
+#define TRAFFIC_REPEAT_MIN_MS 2000
+#define TRAFFIC_REPEAT_JITTER_MS 1000
+
+struct AirTransmission
+{
+  // in air us from the start of the scenario
+  uint64_t startUs;
+  uint32_t airtimeUs;
+  uint32_t nodeId;
+  // a repeat of the node's previous message
+  bool duplicate;
+  // fails the LoRa CRC, damaged on air or by a collision
+  bool crcError;
+  // passes the LoRa CRC but fails the frame checks
+  bool badFrame;
+  // lost in a collision, the radio was receiving another frame
+  bool lost;
+  // received, but broken by a weaker frame overlapping it
+  bool collided;
+  // door state the message carries, it alternates from message to message
+  bool door;
+  float rssi;
+  float snr;
+  uint8_t length;
+  uint8_t data[FRAME_MAX_LENGTH];
+
+  // a message the gateway should publish
+  bool fresh() const
+  {
+    return !duplicate && !crcError && !badFrame;
+  }
+
+  uint64_t endUs() const
+  {
+    return startUs + airtimeUs;
+  }
+};
+
+class TrafficGenerator
+{
+public:
+  explicit TrafficGenerator(uint64_t seed) : m_state(seed)
+  {
+  }
+
+  // the first message of every node, so the gateway knows them all
+  std::vector<AirTransmission> hello(uint32_t firstNodeId, uint16_t nodes)
+  {
+    std::vector<AirTransmission> transmissions;
+    for (uint16_t node = 0; node < nodes; node++)
+    {
+      AirTransmission transmission = {};
+      transmission.nodeId = firstNodeId + node;
+      transmission.rssi = -100;
+      transmission.snr = 10;
+      build(transmission, 0);
+      transmissions.push_back(transmission);
+    }
+    return transmissions;
+  }
+
+  // the scenario's transmissions by start time, counters continue after hello()
+  std::vector<AirTransmission> generate(const GatewayScenario &scenario, uint32_t firstNodeId)
+  {
+    std::vector<AirTransmission> transmissions;
+    const double meanGapUs = 3600.0e6 / scenario.messagesPerNodeHour;
+    const uint64_t endUs = (uint64_t)scenario.durationS * 1000000;
+    for (uint16_t node = 0; node < scenario.nodes; node++)
+    {
+      // placement decides the link, the frames of a node vary around it
+      const float rssi = -122 + uniform() * 42;
+      uint16_t counter = 0;
+      bool door = false;
+      for (uint64_t atUs = exponential(meanGapUs); atUs < endUs; atUs += exponential(meanGapUs))
+      {
+        AirTransmission transmission = {};
+        transmission.startUs = atUs;
+        transmission.nodeId = firstNodeId + node;
+        transmission.door = door = !door;
+        transmission.rssi = rssi + (uniform() - 0.5f) * 3;
+        transmission.snr = std::min<float>(transmission.rssi - TRAFFIC_NOISE_FLOOR_DBM, TRAFFIC_MAX_SNR_DB) + (uniform() - 0.5f);
+        build(transmission, ++counter);
+        damage(scenario, transmission);
+        transmissions.push_back(transmission);
+
+        if (percent(scenario.duplicatePercent))
+        {
+          AirTransmission repeat = transmission;
+          repeat.duplicate = true;
+          repeat.startUs += (TRAFFIC_REPEAT_MIN_MS + (uint64_t)(uniform() * TRAFFIC_REPEAT_JITTER_MS)) * 1000;
+          if (repeat.startUs < endUs)
+          {
+            transmissions.push_back(repeat);
+          }
+        }
+      }
+    }
+    std::sort(transmissions.begin(), transmissions.end(), [](const AirTransmission &a, const AirTransmission &b)
+              { return a.startUs < b.startUs; });
+    if (!scenario.idealAir)
+    {
+      collide(transmissions);
+    }
+    return transmissions;
+  }
+
+private:
+  // a status frame with the battery extension, the door bit as the state
+  static void build(AirTransmission &transmission, uint16_t counter)
+  {
+    uint8_t battery[2];
+    framePutLe16(battery, 3700);
+    FrameWriter writer(transmission.data, sizeof(transmission.data));
+    writer.begin(FRAME_STATUS, transmission.nodeId, counter)
+        .status(packStatus(transmission.door ? channelBit(CHANNEL_DOOR) : 0))
+        .extension(EXT_BATTERY, battery, sizeof(battery));
+    transmission.length = (uint8_t)writer.finish();
+    transmission.airtimeUs = loraAirtimeUs(TRAFFIC_SF, TRAFFIC_BW_HZ, TRAFFIC_CR, TRAFFIC_PREAMBLE, transmission.length);
+  }
+
+  void damage(const GatewayScenario &scenario, AirTransmission &transmission)
+  {
+    if (percent(scenario.crcErrorPercent))
+    {
+      transmission.crcError = true;
+      transmission.data[next() % transmission.length] ^= (uint8_t)(1 << (next() % 8));
+    }
+    else if (percent(scenario.badFramePercent))
+    {
+      // one of each error class the gateway counts
+      transmission.badFrame = true;
+      uint8_t *data = transmission.data;
+      switch (next() % 4)
+      {
+      case 0:
+        data[0] = (uint8_t)((FRAME_VERSION + 1) << 4 | (data[0] & 0x0f));
+        break;
+      case 1:
+        data[0] = (uint8_t)(FRAME_VERSION << 4 | 0x0f);
+        data[transmission.length - 1] = frameCrc8(data, transmission.length - FRAME_CHECK_LENGTH);
+        break;
+      case 2:
+        transmission.length = FRAME_HEADER_LENGTH - 2;
+        break;
+      default:
+        data[transmission.length - 1] ^= 0x5a;
+        break;
+      }
+    }
+  }
+
+  // One demodulator: the radio locks onto the first preamble and misses
+  // whatever starts before that frame is over. The frame it is receiving
+  // survives an overlap only if it is TRAFFIC_CAPTURE_DB stronger.
+  static void collide(std::vector<AirTransmission> &transmissions)
+  {
+    AirTransmission *receiving = nullptr;
+    for (AirTransmission &transmission : transmissions)
+    {
+      if (receiving != nullptr && transmission.startUs < receiving->endUs())
+      {
+        transmission.lost = true;
+        if (receiving->rssi - transmission.rssi < TRAFFIC_CAPTURE_DB)
+        {
+          receiving->crcError = true;
+          receiving->collided = true;
+        }
+        continue;
+      }
+      receiving = &transmission;
+    }
+  }
+
+  uint64_t next()
+  {
+    m_state = m_state * 6364136223846793005ULL + 1442695040888963407ULL;
+    return m_state >> 33;
+  }
+
+  float uniform()
+  {
+    return (float)(next() & 0xffffff) / 0x1000000;
+  }
+
+  bool percent(uint8_t chance)
+  {
+    return chance != 0 && next() % 100 < chance;
+  }
+
+  uint64_t exponential(double meanUs)
+  {
+    return (uint64_t)(-log(1.0 - uniform()) * meanUs);
+  }
+
+  uint64_t m_state;
+};
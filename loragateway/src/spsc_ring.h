@@ -0,0 +1,76 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+
+// Lock-free single-producer/single-consumer ring buffer. The producer only
+// writes m_head, the consumer only writes m_tail, so one side may run in a
+// different task or core than the other without any locking. One slot is kept
+// free to tell a full ring from an empty one.
+template <typename T, size_t Size>
+class SpscRing
+{
+  static_assert((Size & (Size - 1)) == 0, "SpscRing size must be a power of two");
+
+public:
+  // producer side, returns false and leaves the ring untouched if it is full
+  bool push(const T &item)
+  {
+    const size_t head = m_head.load(std::memory_order_relaxed);
+    const size_t next = (head + 1) & (Size - 1);
+    if (next == m_tail.load(std::memory_order_acquire))
+    {
+      return false;
+    }
+    m_items[head] = item;
+    m_head.store(next, std::memory_order_release);
+    return true;
+  }
+
+  // producer side, slot to fill in place before commit(), nullptr if full
+  T *reserve()
+  {
+    const size_t head = m_head.load(std::memory_order_relaxed);
+    const size_t next = (head + 1) & (Size - 1);
+    if (next == m_tail.load(std::memory_order_acquire))
+    {
+      return nullptr;
+    }
+    return &m_items[head];
+  }
+
+  // producer side, publishes the slot handed out by reserve()
+  void commit()
+  {
+    const size_t head = m_head.load(std::memory_order_relaxed);
+    m_head.store((head + 1) & (Size - 1), std::memory_order_release);
+  }
+
+  // consumer side, returns false if the ring is empty
+  bool pop(T &item)
+  {
+    const size_t tail = m_tail.load(std::memory_order_relaxed);
+    if (tail == m_head.load(std::memory_order_acquire))
+    {
+      return false;
+    }
+    item = m_items[tail];
+    m_tail.store((tail + 1) & (Size - 1), std::memory_order_release);
+    return true;
+  }
+
+  bool empty() const
+  {
+    return m_tail.load(std::memory_order_acquire) == m_head.load(std::memory_order_acquire);
+  }
+
+  static constexpr size_t capacity()
+  {
+    return Size - 1;
+  }
+
+private:
+  T m_items[Size];
+  std::atomic<size_t> m_head{0};
+  std::atomic<size_t> m_tail{0};
+};
@@ -0,0 +1,45 @@
+#pragma once
+#include <Arduino.h>
+
+// Timing counters of one pipeline stage. Written by the task that owns the
+// stage only, read (racy but harmless) by the periodic stats log.
+struct StageStats
+{
+  uint32_t count = 0;
+  uint64_t totalUs = 0;
+  uint32_t maxUs = 0;
+
+  void add(uint32_t us)
+  {
+    count++;
+    totalUs += us;
+    if (us > maxUs)
+    {
+      maxUs = us;
+    }
+  }
+
+  uint32_t avgUs() const
+  {
+    return count ? (uint32_t)(totalUs / count) : 0;
+  }
+};
+
+// measures the enclosing scope into a StageStats
+class StageTimer
+{
+public:
+  explicit StageTimer(StageStats &stats)
+      : m_stats(stats), m_start(micros())
+  {
+  }
+
+  ~StageTimer()
+  {
+    m_stats.add(micros() - m_start);
+  }
+
+private:
+  StageStats &m_stats;
+  uint32_t m_start;
+};
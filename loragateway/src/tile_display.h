@@ -0,0 +1,105 @@
+#pragma once
+#include <U8g2lib.h>
+
+// Dirty tile updates for a full frame buffer u8g2 display.
+//
+// Frames are still drawn into the u8g2 buffer with the usual calls, but
+// flush() replaces sendBuffer(): it compares the buffer tile by tile (8x8
+// pixels, 8 bytes) with a shadow copy of what the panel shows and only sends
+// the runs of changed tiles through u8x8_DrawTile(). A new node id or RSSI
+// changes a handful of the 128 tiles of a 128x64 SSD1306, so most of the 1 KB
+// I2C transfer of a full update goes away.
+class TileDisplay
+{
+public:
+  static constexpr uint8_t MAX_TILE_COLUMNS = 16;
+  static constexpr uint8_t MAX_TILE_ROWS = 8;
+
+  void begin(U8G2 *u8g2)
+  {
+    m_u8g2 = u8g2;
+    // a larger panel keeps being drawn in its top left corner only
+    m_columns = u8g2->getBufferTileWidth() < MAX_TILE_COLUMNS ? u8g2->getBufferTileWidth() : (uint8_t)MAX_TILE_COLUMNS;
+    m_rows = u8g2->getBufferTileHeight() < MAX_TILE_ROWS ? u8g2->getBufferTileHeight() : (uint8_t)MAX_TILE_ROWS;
+    invalidate();
+  }
+
+  // the panel was drawn behind our back, the next flush sends every tile
+  void invalidate()
+  {
+    m_valid = false;
+  }
+
+  // sends the tiles that changed since the last flush, returns how many
+  uint16_t flush()
+  {
+    const uint8_t *buffer = m_u8g2->getBufferPtr();
+    u8x8_t *u8x8 = m_u8g2->getU8x8();
+    uint16_t sent = 0;
+    for (uint8_t row = 0; row < m_rows; row++)
+    {
+      uint8_t column = 0;
+      while (column < m_columns)
+      {
+        if (!dirty(buffer, row, column))
+        {
+          column++;
+          continue;
+        }
+        const uint8_t first = column;
+        while (column < m_columns && dirty(buffer, row, column))
+        {
+          memcpy(shadowTile(row, column), bufferTile(buffer, row, column), 8);
+          column++;
+        }
+        // the tiles of a row are contiguous in the buffer
+        u8x8_DrawTile(u8x8, first, row, column - first, (uint8_t *)bufferTile(buffer, row, first));
+        sent += column - first;
+      }
+    }
+    m_valid = true;
+    m_frames++;
+    m_tilesSent += sent;
+    return sent;
+  }
+
+  uint32_t frames() const
+  {
+    return m_frames;
+  }
+
+  uint32_t tilesSent() const
+  {
+    return m_tilesSent;
+  }
+
+  uint16_t tileCount() const
+  {
+    return m_columns * m_rows;
+  }
+
+private:
+  // u8g2 full buffers are tile rows of 8 byte columns, 8 pixels each
+  const uint8_t *bufferTile(const uint8_t *buffer, uint8_t row, uint8_t column) const
+  {
+    return &buffer[((size_t)row * m_u8g2->getBufferTileWidth() + column) * 8];
+  }
+
+  uint8_t *shadowTile(uint8_t row, uint8_t column)
+  {
+    return &m_shadow[((size_t)row * MAX_TILE_COLUMNS + column) * 8];
+  }
+
+  bool dirty(const uint8_t *buffer, uint8_t row, uint8_t column)
+  {
+    return !m_valid || memcmp(shadowTile(row, column), bufferTile(buffer, row, column), 8) != 0;
+  }
+
+  U8G2 *m_u8g2 = nullptr;
+  uint8_t m_columns = 0;
+  uint8_t m_rows = 0;
+  bool m_valid = false;
+  uint8_t m_shadow[MAX_TILE_ROWS * MAX_TILE_COLUMNS * 8];
+  uint32_t m_frames = 0;
+  uint32_t m_tilesSent = 0;
+};